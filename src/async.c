@@ -8,58 +8,65 @@
    \file
 
    Asynchronous notifications
+
+   Other threads return their results to the main thread by pushing notifications onto a lock-free queue. The main
+   loop is woken up by an eventfd (or a pipe on systems without eventfd) when the queue becomes non-empty, and handles
+   all queued notifications at once.
 */
 
 
 #include "async.h"
 #include "fastd.h"
 
-#include <sys/uio.h>
+#ifdef USE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 
-/** The packet header used on the async notification sockets */
-typedef struct fastd_async_hdr {
+/** A queued notification */
+struct fastd_async_msg {
+	fastd_async_msg_t *next; /**< The next notification (in the queue, this is the previously enqueued one) */
 	fastd_async_type_t type; /**< The type of the notification */
 	size_t len;              /**< The length of the notification payload */
-} fastd_async_hdr_t;
 
+	uint8_t data[] __attribute__((aligned(8))); /**< The notification payload */
+};
 
-/** Initializes the async notification sockets */
+
+/** Initializes the async notification queue and its wakeup file descriptor */
 void fastd_async_init(void) {
+	ctx.async_queue = NULL;
+
+#ifdef USE_EVENTFD
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		exit_errno("eventfd");
+
+	ctx.async_rfd = FASTD_POLL_FD(POLL_TYPE_ASYNC, fd);
+	ctx.async_wfd = fd;
+#else
 	int fds[2];
 
-	/* use socketpair with SOCK_DGRAM instead of pipe2 with O_DIRECT to keep this portable */
-	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, fds))
-		exit_errno("socketpair");
+	if (pipe(fds))
+		exit_errno("pipe");
 
-#ifdef NO_HAVE_SOCK_NONBLOCK
 	fastd_setnonblock(fds[0]);
 	fastd_setnonblock(fds[1]);
-#endif
 
 	ctx.async_rfd = FASTD_POLL_FD(POLL_TYPE_ASYNC, fds[0]);
 	ctx.async_wfd = fds[1];
+#endif
 
 	fastd_poll_fd_register(&ctx.async_rfd);
 }
 
-/** Handles a DNS resolver response */
-static void handle_resolve_return(const fastd_async_resolve_return_t *resolve_return) {
-	fastd_peer_t *peer = fastd_peer_find_by_id(resolve_return->peer_id);
-	if (!peer || !fastd_peer_is_enabled(peer))
-		return;
-
-	if (fastd_peer_is_dynamic(peer))
-		exit_bug("resolve return for dynamic peer");
-
-	fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, resolve_return->remote);
-	fastd_peer_handle_resolve(peer, remote, resolve_return->n_addr, resolve_return->addr);
-}
-
 #ifdef WITH_DYNAMIC_PEERS
 
 /** Handles a on-verify response */
 static void handle_verify_return(const fastd_async_verify_return_t *verify_return) {
+	/* The result is cached even if the peer has been removed in the meantime */
+	fastd_verify_cache_add(verify_return->key, verify_return->ok);
+
 	fastd_peer_t *peer = fastd_peer_find_by_id(verify_return->peer_id);
 	if (!peer)
 		return;
@@ -77,64 +84,125 @@ static void handle_verify_return(const fastd_async_verify_return_t *verify_retur
 #endif
 
 
-/** Reads and handles a single notification from the async notification socket */
-void fastd_async_handle(void) {
-	fastd_async_hdr_t header;
-	struct iovec vec[2] = {
-		{ .iov_base = &header, .iov_len = sizeof(header) },
-	};
-	struct msghdr msg = {
-		.msg_iov = vec,
-		.msg_iovlen = 1,
-	};
-
-	if (recvmsg(ctx.async_rfd.fd, &msg, MSG_PEEK) < 0)
-		exit_errno("fastd_async_handle: recvmsg");
-
-	uint8_t buf[header.len] __attribute__((aligned(8)));
-	vec[1].iov_base = buf;
-	vec[1].iov_len = sizeof(buf);
-	msg.msg_iovlen = 2;
-
-	if (recvmsg(ctx.async_rfd.fd, &msg, 0) < 0)
-		exit_errno("fastd_async_handle: recvmsg");
-
-	switch (header.type) {
-	case ASYNC_TYPE_NOP:
-		break;
-
+/** Handles a single notification */
+static void handle_msg(const fastd_async_msg_t *msg) {
+	switch (msg->type) {
 	case ASYNC_TYPE_RESOLVE_RETURN:
-		handle_resolve_return((const fastd_async_resolve_return_t *)buf);
+		fastd_resolve_handle_return((const fastd_async_resolve_return_t *)msg->data);
 		break;
 
 #ifdef WITH_DYNAMIC_PEERS
 	case ASYNC_TYPE_VERIFY_RETURN:
-		handle_verify_return((const fastd_async_verify_return_t *)buf);
+		handle_verify_return((const fastd_async_verify_return_t *)msg->data);
 		break;
 #endif
 
+	case ASYNC_TYPE_PROTOCOL_RETURN:
+		conf.protocol->handle_async_return(msg->data, msg->len);
+		break;
+
 	default:
 		exit_bug("fastd_async_handle: unknown type");
 	}
 }
 
-/** Enqueues a new async notification */
+/** Clears the wakeup file descriptor */
+static void clear_wakeup(void) {
+#ifdef USE_EVENTFD
+	uint64_t value;
+	if (read(ctx.async_rfd.fd, &value, sizeof(value)) < 0 && errno != EAGAIN && errno != EINTR)
+		exit_errno("fastd_async_handle: read");
+#else
+	uint8_t buf[64];
+	ssize_t ret;
+
+	while ((ret = read(ctx.async_rfd.fd, buf, sizeof(buf))) > 0) {}
+
+	if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		exit_errno("fastd_async_handle: read");
+#endif
+}
+
+/**
+   Handles all queued notifications
+
+   The wakeup file descriptor is cleared before the queue is taken over, so notifications enqueued while the
+   current ones are handled cause another wakeup.
+*/
+void fastd_async_handle(void) {
+	clear_wakeup();
+
+	fastd_async_msg_t *msg = __atomic_exchange_n(&ctx.async_queue, NULL, __ATOMIC_ACQUIRE), *prev = NULL;
+
+	/* The queue is a LIFO stack, reverse it to handle the notifications in order */
+	while (msg) {
+		fastd_async_msg_t *next = msg->next;
+		msg->next = prev;
+		prev = msg;
+		msg = next;
+	}
+
+	for (msg = prev; msg; msg = prev) {
+		prev = msg->next;
+		handle_msg(msg);
+		free(msg);
+	}
+}
+
+/**
+   Wakes up the main loop
+
+   This function is async-signal-safe.
+*/
+void fastd_async_wakeup(void) {
+	int saved_errno = errno;
+
+#ifdef USE_EVENTFD
+	const uint64_t value = 1;
+#else
+	const uint8_t value = 0;
+#endif
+
+	/* If the write fails because the counter or pipe is full, a wakeup is pending anyways. Other errors can't
+	 * be logged, as logging isn't async-signal-safe. */
+	UNUSED ssize_t ret = write(ctx.async_wfd, &value, sizeof(value));
+
+	errno = saved_errno;
+}
+
+/**
+   Enqueues a new async notification
+
+   May be called from any thread. The notification is pushed onto the queue without taking any locks; only the
+   thread that finds the queue empty needs to wake up the main loop.
+*/
 void fastd_async_enqueue(fastd_async_type_t type, const void *data, size_t len) {
-	fastd_async_hdr_t header;
-	/* use memset to zero the holes in the struct to make valgrind happy */
-	memset(&header, 0, sizeof(header));
-	header.type = type;
-	header.len = len;
-
-	struct iovec vec[2] = {
-		{ .iov_base = &header, .iov_len = sizeof(header) },
-		{ .iov_base = (void *)data, .iov_len = len },
-	};
-	struct msghdr msg = {
-		.msg_iov = vec,
-		.msg_iovlen = len ? 2 : 1,
-	};
-
-	if (sendmsg(ctx.async_wfd, &msg, 0) < 0)
-		pr_warn_errno("fastd_async_enqueue: sendmsg");
+	fastd_async_msg_t *msg = fastd_alloc(sizeof(fastd_async_msg_t) + len);
+	msg->type = type;
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	fastd_async_msg_t *head = __atomic_load_n(&ctx.async_queue, __ATOMIC_RELAXED);
+
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&ctx.async_queue, &head, msg, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (!head)
+		fastd_async_wakeup();
+}
+
+/**
+   Frees all notifications that haven't been handled yet
+
+   The wakeup file descriptors are kept open, as detached threads may still try to enqueue notifications.
+*/
+void fastd_async_cleanup(void) {
+	fastd_async_msg_t *msg = __atomic_exchange_n(&ctx.async_queue, NULL, __ATOMIC_ACQUIRE);
+
+	while (msg) {
+		fastd_async_msg_t *next = msg->next;
+		free(msg);
+		msg = next;
+	}
 }
@@ -15,20 +15,21 @@
 
 #include "peer.h"
 #include "types.h"
+#include "verify.h"
 
 
 /** A type of asynchronous notification */
 typedef enum fastd_async_type {
-	ASYNC_TYPE_NOP, /**< Does nothing (is used to ensure poll returns quickly after a signal has occurred) */
-	ASYNC_TYPE_RESOLVE_RETURN, /**< A DNS resolver response */
-	ASYNC_TYPE_VERIFY_RETURN,  /**< A on-verify return */
+	ASYNC_TYPE_RESOLVE_RETURN,  /**< A DNS resolver response */
+	ASYNC_TYPE_VERIFY_RETURN,   /**< A on-verify return */
+	ASYNC_TYPE_PROTOCOL_RETURN, /**< The result of a protocol-specific job run on a worker thread */
 } fastd_async_type_t;
 
 
 /** A DNS resolver response */
 typedef struct fastd_async_resolve_return {
-	uint64_t peer_id; /**< The ID of the peer the resolved remote belongs to */
-	size_t remote;    /**< The index of the resolved remote */
+	uint64_t entry_id; /**< The ID of the resolve cache entry of the resolved hostname */
+	bool cached;       /**< If true, the cached result of the entry is delivered and addr is empty */
 
 	size_t n_addr;               /**< The number of addresses returned */
 	fastd_peer_address_t addr[]; /**< The resolved addresses */
@@ -38,7 +39,8 @@ typedef struct fastd_async_resolve_return {
 typedef struct fastd_async_verify_return {
 	bool ok; /**< true if the verification was successful */
 
-	uint64_t peer_id; /**< The ID of the verified peer */
+	uint64_t peer_id;                   /**< The ID of the verified peer */
+	uint8_t key[FASTD_VERIFY_KEY_SIZE]; /**< The public key of the verified peer */
 
 	fastd_socket_t *sock; /**< The socket the handshake causing the verification was received on */
 
@@ -50,5 +52,9 @@ typedef struct fastd_async_verify_return {
 
 
 void fastd_async_init(void);
+void fastd_async_cleanup(void);
 void fastd_async_handle(void);
+void fastd_async_wakeup(void);
 void fastd_async_enqueue(fastd_async_type_t type, const void *data, size_t len);
+
+void fastd_resolve_handle_return(const fastd_async_resolve_return_t *resolve_return);
@@ -104,6 +104,11 @@ void fastd_cap_acquire(void) {
 	/* device binds */
 	try_cap(CAP_NET_RAW);
 
+#if defined(WITH_XDP) && defined(CAP_BPF)
+	/* loading the XDP program */
+	try_cap(CAP_BPF);
+#endif
+
 	if (prctl(PR_SET_KEEPCAPS, 1) < 0)
 		pr_warn_errno("prctl(PR_SET_KEEPCAPS)");
 }
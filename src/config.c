@@ -23,7 +23,9 @@
 #include "lex.h"
 #include "method.h"
 #include "peer.h"
+#include "peer_db.h"
 #include "peer_group.h"
+#include "uring.h"
 
 #include <dirent.h>
 #include <grp.h>
@@ -52,6 +54,18 @@ static void default_config(void) {
 	conf.mode = MODE_TAP;
 	conf.iface_persist = true;
 
+	conf.replay_window = DEFAULT_REPLAY_WINDOW;
+	conf.worker_threads = DEFAULT_WORKER_THREADS;
+	conf.handshake_rate = DEFAULT_HANDSHAKE_RATE;
+	conf.cookie_threshold = DEFAULT_COOKIE_THRESHOLD;
+	conf.key_cache_size = DEFAULT_KEY_CACHE_SIZE;
+
+#ifdef WITH_DYNAMIC_PEERS
+	conf.verify_cache_size = DEFAULT_VERIFY_CACHE_SIZE;
+	conf.verify_cache_ttl = DEFAULT_VERIFY_CACHE_TTL;
+	conf.verify_cache_negative_ttl = DEFAULT_VERIFY_CACHE_NEGATIVE_TTL;
+#endif
+
 	conf.drop_caps = DROP_CAPS_ON;
 
 	conf.protocol = &fastd_protocol_ec25519_fhmqvc;
@@ -209,8 +223,55 @@ static bool has_peer_group_peer_dirs(const fastd_peer_group_t *group) {
 	return false;
 }
 
-/** Reads and processes all peer definitions in the current directory (which must also be supplied as the argument) */
+/**
+   Checks if a file in the current directory is a peer configuration file
+
+   Hidden files, backup files and files that aren't regular files are ignored.
+*/
+bool fastd_config_is_peer_file(const char *name, struct stat *statbuf) {
+	if (name[0] == '.')
+		return false;
+
+	if (name[strlen(name) - 1] == '~') {
+		pr_verbose("ignoring file `%s' as it seems to be a backup file", name);
+		return false;
+	}
+
+	if (stat(name, statbuf)) {
+		pr_warn("ignoring file `%s': stat failed: %s", name, strerror(errno));
+		return false;
+	}
+	if ((statbuf->st_mode & S_IFMT) != S_IFREG) {
+		pr_info("ignoring file `%s': no regular file", name);
+		return false;
+	}
+
+	return true;
+}
+
+/** Reads a peer configuration file from the current directory, returning NULL if it is invalid */
+fastd_peer_t *fastd_config_read_peer(fastd_peer_group_t *group, const char *dir, const char *name) {
+	fastd_peer_t *peer = fastd_new0(fastd_peer_t);
+	peer->name = fastd_strdup(name);
+	peer->config_source_dir = dir;
+
+	if (!fastd_config_read(name, group, peer, 0)) {
+		fastd_peer_free(peer);
+		return NULL;
+	}
+
+	return peer;
+}
+
+/**
+   Reads and processes all peer definitions in the current directory (which must also be supplied as the argument)
+
+   If the directory contains an up-to-date compiled peer database, the peers are loaded from it instead.
+*/
 static void read_peer_dir(fastd_peer_group_t *group, const char *dir) {
+	if (fastd_peer_db_load(group, dir))
+		return;
+
 	DIR *dirh = opendir(".");
 
 	if (dirh) {
@@ -224,34 +285,13 @@ static void read_peer_dir(fastd_peer_group_t *group, const char *dir) {
 				break;
 			}
 
-			if (result->d_name[0] == '.')
-				continue;
-
-			if (result->d_name[strlen(result->d_name) - 1] == '~') {
-				pr_verbose("ignoring file `%s' as it seems to be a backup file", result->d_name);
-				continue;
-			}
-
 			struct stat statbuf;
-			if (stat(result->d_name, &statbuf)) {
-				pr_warn("ignoring file `%s': stat failed: %s", result->d_name, strerror(errno));
-				continue;
-			}
-			if ((statbuf.st_mode & S_IFMT) != S_IFREG) {
-				pr_info("ignoring file `%s': no regular file", result->d_name);
-				continue;
-			}
-
-			fastd_peer_t *peer = fastd_new0(fastd_peer_t);
-			peer->name = fastd_strdup(result->d_name);
-			peer->config_source_dir = dir;
-
-			if (!fastd_config_read(result->d_name, group, peer, 0)) {
-				fastd_peer_free(peer);
+			if (!fastd_config_is_peer_file(result->d_name, &statbuf))
 				continue;
-			}
 
-			fastd_peer_add(peer);
+			fastd_peer_t *peer = fastd_config_read_peer(group, dir, result->d_name);
+			if (peer)
+				fastd_peer_add(peer);
 		}
 
 		if (closedir(dirh) < 0)
@@ -620,8 +660,13 @@ static void peer_dirs_read_peer_group(fastd_peer_group_t *group) {
 		peer_dirs_read_peer_group(child);
 }
 
-/** Initializes the configured peers */
-static void configure_peers(bool dirs_only) {
+/**
+   Initializes the configured peers
+
+   In incremental mode, peers that haven't been touched since the last run are kept unchanged instead of being
+   deleted.
+*/
+static void configure_peers(bool dirs_only, bool incremental) {
 	ctx.has_floating = false;
 	ctx.max_mtu = conf.mtu;
 
@@ -630,9 +675,19 @@ static void configure_peers(bool dirs_only) {
 		fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
 
 		if (peer->config_state == CONFIG_STATIC) {
-			/* The peer hasn't been touched since the last run of configure_peers(), so its definition must
-			 * have disappeared */
-			fastd_peer_delete(peer);
+			if (!incremental) {
+				/* The peer hasn't been touched since the last run of configure_peers(), so its
+				 * definition must have disappeared */
+				fastd_peer_delete(peer);
+				continue;
+			}
+
+			if (fastd_peer_is_floating(peer))
+				ctx.has_floating = true;
+
+			if (conf.mode != MODE_TAP && peer->mtu > ctx.max_mtu)
+				ctx.max_mtu = peer->mtu;
+
 			continue;
 		}
 
@@ -665,11 +720,13 @@ static void configure_peers(bool dirs_only) {
 	ctx.max_buffer =
 		alignto(max_size_t(headroom + fastd_max_payload(ctx.max_mtu) + conf.tailroom, MAX_HANDSHAKE_SIZE),
 			sizeof(fastd_block128_t));
+
+	fastd_uring_check_mtu();
 }
 
 /** Initialized the peers not configured through peer directories */
 void fastd_configure_peers(void) {
-	configure_peers(false);
+	configure_peers(false, false);
 }
 
 /** Refreshes the peer configurations from the configured peer dirs */
@@ -689,7 +746,83 @@ void fastd_config_load_peer_dirs(bool dirs_only) {
 	}
 
 	peer_dirs_read_peer_group(conf.peer_group);
-	configure_peers(dirs_only);
+	configure_peers(dirs_only, false);
+}
+
+/** Finds the peer configured by a file in a peer directory */
+static fastd_peer_t *find_dir_peer(const char *dir, const char *name) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+
+		if (peer->config_source_dir && !strcmp(peer->config_source_dir, dir) && strequal(peer->name, name))
+			return peer;
+	}
+
+	return NULL;
+}
+
+/**
+   Re-reads a single file of a peer directory after it has been created, modified or deleted
+
+   The peer defined by the file before is kept if its key and configuration are unchanged, and deleted
+   otherwise. A key that is also used by another peer disables both peers, just like when all peer directories
+   are reloaded; such peers are re-enabled by the next full reload only.
+
+   The changes take effect when fastd_config_apply_peer_changes() is called.
+*/
+void fastd_config_reload_peer_file(fastd_peer_group_t *group, const char *dir, const char *name) {
+	char *oldcwd = get_current_dir_name();
+
+	if (chdir(dir)) {
+		pr_error("change from directory `%s' to `%s' failed: %s", oldcwd, dir, strerror(errno));
+		free(oldcwd);
+		return;
+	}
+
+	fastd_peer_t *old = find_dir_peer(dir, name), *peer = NULL;
+	struct stat statbuf;
+
+	/* A deleted file only removes its peer */
+	if (stat(name, &statbuf) == 0 || errno != ENOENT) {
+		if (fastd_config_is_peer_file(name, &statbuf))
+			peer = fastd_config_read_peer(group, dir, name);
+	}
+
+	if (chdir(oldcwd))
+		pr_error("can't chdir to `%s': %s", oldcwd, strerror(errno));
+
+	free(oldcwd);
+
+	fastd_peer_t *other = (peer && peer->key) ? conf.protocol->find_peer(peer->key) : NULL;
+
+	if (old && (old != other || old->config_state == CONFIG_DISABLED)) {
+		if (old == other)
+			other = NULL;
+
+		fastd_peer_delete(old);
+	}
+
+	if (!peer)
+		return;
+
+	if (other && other != old && other->config_state == CONFIG_STATIC) {
+		pr_warn("duplicate key used by peers %P and %P, disabling both", peer, other);
+		other->config_state = CONFIG_DISABLED;
+		fastd_peer_free(peer);
+		return;
+	}
+
+	/* The file may have been changed more than once since the changes were last applied */
+	if (old == other && old && old->config_state == CONFIG_NEW)
+		old->config_state = CONFIG_STATIC;
+
+	fastd_peer_add(peer);
+}
+
+/** Applies the changes made by fastd_config_reload_peer_file() */
+void fastd_config_apply_peer_changes(void) {
+	configure_peers(true, true);
 }
 
 /** Frees all resources used by the global configuration */
@@ -710,12 +843,21 @@ void fastd_config_release(void) {
 	fastd_shell_command_unset(&conf.on_post_down);
 #ifdef WITH_DYNAMIC_PEERS
 	fastd_shell_command_unset(&conf.on_verify);
+	free(conf.verify_cache_file);
 #endif
 
 #ifdef WITH_STATUS_SOCKET
 	free(conf.status_socket);
 #endif
 
+#ifdef WITH_STATS_FILE
+	free(conf.stats_file);
+#endif
+
+#ifdef WITH_METRICS_SOCKET
+	free(conf.metrics_socket);
+#endif
+
 #ifdef USE_USER
 	free(conf.user);
 	free(conf.group);
@@ -15,6 +15,8 @@
 
 #include "fastd.h"
 
+#include <sys/stat.h>
+
 
 /** State of the config parser */
 struct fastd_parser_state {
@@ -37,6 +39,8 @@ void fastd_config_handle_options(int argc, char *const argv[]);
 void fastd_config_verify(void);
 
 bool fastd_config_read(const char *filename, fastd_peer_group_t *peer_group, fastd_peer_t *peer, int depth);
+bool fastd_config_is_peer_file(const char *name, struct stat *statbuf);
+fastd_peer_t *fastd_config_read_peer(fastd_peer_group_t *group, const char *dir, const char *name);
 void fastd_config_peer_group_push(fastd_parser_state_t *state, const char *name);
 void fastd_config_peer_group_pop(fastd_parser_state_t *state);
 void fastd_config_add_peer_dir(fastd_peer_group_t *group, const char *dir);
@@ -45,5 +49,7 @@ void fastd_configure(int argc, char *const argv[]);
 void fastd_configure_peers(void);
 void fastd_config_check(void);
 void fastd_config_load_peer_dirs(bool dirs_only);
+void fastd_config_reload_peer_file(fastd_peer_group_t *group, const char *dir, const char *name);
+void fastd_config_apply_peer_changes(void);
 bool fastd_config_single_iface(void);
 bool fastd_config_persistent_ifaces(void);
@@ -51,12 +51,16 @@
 %token TOK_ASYNC
 %token TOK_AUTO
 %token TOK_BIND
+%token TOK_CACHE
 %token TOK_CAPABILITIES
 %token TOK_CIPHER
 %token TOK_CONNECT
+%token TOK_COOKIE
+%token TOK_CPU
 %token TOK_DEBUG
 %token TOK_DEBUG2
 %token TOK_DEFAULT
+%token TOK_DIRS
 %token TOK_DISESTABLISH
 %token TOK_DOWN
 %token TOK_DROP
@@ -64,29 +68,36 @@
 %token TOK_ERROR
 %token TOK_ESTABLISH
 %token TOK_FATAL
+%token TOK_FILE
 %token TOK_FLOAT
 %token TOK_FORCE
 %token TOK_FORWARD
 %token TOK_FROM
 %token TOK_GROUP
+%token TOK_HANDSHAKE
 %token TOK_HANDSHAKES
+%token TOK_HELPER
 %token TOK_HIDE
 %token TOK_INCLUDE
 %token TOK_INFO
 %token TOK_INTERFACE
+%token TOK_IO_URING
 %token TOK_IP
 %token TOK_IPV4
 %token TOK_IPV6
 %token TOK_KEY
+%token TOK_LATENCY
 %token TOK_LEVEL
 %token TOK_LIMIT
 %token TOK_LOG
 %token TOK_MAC
 %token TOK_MARK
 %token TOK_METHOD
+%token TOK_METRICS
 %token TOK_MODE
 %token TOK_MTU
 %token TOK_MULTITAP
+%token TOK_NEGATIVE
 %token TOK_NO
 %token TOK_ON
 %token TOK_PACKET
@@ -98,16 +109,23 @@
 %token TOK_POST_DOWN
 %token TOK_PRE_UP
 %token TOK_PROTOCOL
+%token TOK_RATE
 %token TOK_REMOTE
+%token TOK_REPLAY
 %token TOK_SECRET
 %token TOK_SECURE
+%token TOK_SIZE
 %token TOK_SOCKET
+%token TOK_STATS
 %token TOK_STATUS
 %token TOK_STDERR
 %token TOK_SYNC
 %token TOK_SYSLOG
 %token TOK_TAP
+%token TOK_THREADS
+%token TOK_THRESHOLD
 %token TOK_TO
+%token TOK_TTL
 %token TOK_TUN
 %token TOK_UP
 %token TOK_USE
@@ -115,6 +133,10 @@
 %token TOK_VERBOSE
 %token TOK_VERIFY
 %token TOK_WARN
+%token TOK_WATCH
+%token TOK_WINDOW
+%token TOK_WORKER
+%token TOK_XDP
 %token TOK_YES
 
 
@@ -142,6 +164,7 @@
 %type <uint64> maybe_af
 %type <addr> bind_address
 %type <str> maybe_bind_interface
+%type <uint64> maybe_bind_xdp
 %type <uint64> maybe_bind_default
 %type <uint64> bind_default
 %type <uint64> drop_capabilities_enabled
@@ -184,7 +207,22 @@ statement:	peer_group_statement
 	|	TOK_ON TOK_PRE_UP on_pre_up ';'
 	|	TOK_ON TOK_POST_DOWN on_post_down ';'
 	|	TOK_STATUS TOK_SOCKET status_socket ';'
+	|	TOK_STATS TOK_FILE stats_file ';'
+	|	TOK_METRICS TOK_SOCKET metrics_socket ';'
+	|	TOK_LATENCY TOK_STATS latency_stats ';'
+	|	TOK_CPU TOK_STATS cpu_stats ';'
+	|	TOK_IO_URING io_uring ';'
 	|	TOK_FORWARD forward ';'
+	|	TOK_REPLAY TOK_WINDOW replay_window ';'
+	|	TOK_WORKER TOK_THREADS worker_threads ';'
+	|	TOK_HANDSHAKE TOK_RATE handshake_rate ';'
+	|	TOK_COOKIE TOK_THRESHOLD cookie_threshold ';'
+	|	TOK_KEY TOK_CACHE TOK_SIZE key_cache_size ';'
+	|	TOK_VERIFY TOK_CACHE TOK_SIZE verify_cache_size ';'
+	|	TOK_VERIFY TOK_CACHE TOK_TTL verify_cache_ttl ';'
+	|	TOK_VERIFY TOK_CACHE TOK_NEGATIVE TOK_TTL verify_cache_negative_ttl ';'
+	|	TOK_VERIFY TOK_CACHE TOK_FILE verify_cache_file ';'
+	|	TOK_WATCH TOK_PEER TOK_DIRS watch_peer_dirs ';'
 	;
 
 peer_group_statement:
@@ -269,6 +307,20 @@ log:		TOK_LEVEL log_level {
 
 			conf.log_syslog_level = $5;
 		}
+	|	TOK_ASYNC boolean {
+			conf.log_async = $2;
+		}
+	|	TOK_RATE TOK_LIMIT log_rate_limit
+	;
+
+log_rate_limit:	TOK_UINT {
+			if ($1 > UINT_MAX) {
+				fastd_config_error(&@$, state, "invalid log rate limit");
+				YYERROR;
+			}
+
+			conf.log_rate_limit = $1;
+		}
 	;
 
 persist:	TOK_INTERFACE boolean {
@@ -306,8 +358,25 @@ interface:	TOK_STRING	{
 		}
 	;
 
-bind:		bind_address maybe_bind_port maybe_bind_interface maybe_bind_default {
-			fastd_config_handle_bind_address($1, $2, $3 ? $3->str : NULL, $4);
+bind:		bind_address maybe_bind_port maybe_bind_interface maybe_bind_xdp maybe_bind_default {
+			if ($4) {
+				if ($1.sa.sa_family == AF_UNSPEC) {
+					fastd_config_error(&@$, state, "XDP requires a specific bind address");
+					YYERROR;
+				}
+
+				if ($2 < 0) {
+					fastd_config_error(&@$, state, "XDP requires a fixed port");
+					YYERROR;
+				}
+
+				if (!$3) {
+					fastd_config_error(&@$, state, "XDP requires a bind interface");
+					YYERROR;
+				}
+			}
+
+			fastd_config_handle_bind_address($1, $2, $3 ? $3->str : NULL, $4 | $5);
 		}
 	|	TOK_ADDR6_SCOPED maybe_bind_port maybe_bind_default {
 			fastd_peer_address_t addr = { .in6 = { .sin6_family = AF_INET6, .sin6_addr = $1.addr } };
@@ -336,6 +405,20 @@ maybe_bind_interface:
 		}
 	;
 
+maybe_bind_xdp:
+		TOK_XDP {
+#ifdef WITH_XDP
+			$$ = FASTD_BIND_XDP;
+#else
+			fastd_config_error(&@$, state, "XDP isn't supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	|	{
+			$$ = 0;
+		}
+	;
+
 maybe_bind_default:
 		TOK_DEFAULT bind_default {
 			$$ = $2;
@@ -376,6 +459,112 @@ mtu:		TOK_UINT {
 		}
 	;
 
+replay_window:	TOK_UINT {
+			if ($1 < MIN_REPLAY_WINDOW || $1 > MAX_REPLAY_WINDOW) {
+				fastd_config_error(&@$, state, "invalid replay window");
+				YYERROR;
+			}
+
+			conf.replay_window = $1;
+		}
+	;
+
+worker_threads:	TOK_UINT {
+			if ($1 > MAX_WORKER_THREADS) {
+				fastd_config_error(&@$, state, "invalid number of worker threads");
+				YYERROR;
+			}
+
+			conf.worker_threads = $1;
+		}
+	;
+
+handshake_rate:	TOK_UINT {
+			if ($1 > MAX_HANDSHAKE_RATE) {
+				fastd_config_error(&@$, state, "invalid handshake rate");
+				YYERROR;
+			}
+
+			conf.handshake_rate = $1;
+		}
+	;
+
+cookie_threshold: TOK_UINT {
+			if ($1 > UINT_MAX) {
+				fastd_config_error(&@$, state, "invalid cookie threshold");
+				YYERROR;
+			}
+
+			conf.cookie_threshold = $1;
+		}
+	;
+
+key_cache_size:	TOK_UINT {
+			if ($1 > MAX_KEY_CACHE_SIZE) {
+				fastd_config_error(&@$, state, "invalid key cache size");
+				YYERROR;
+			}
+
+			conf.key_cache_size = $1;
+		}
+	;
+
+verify_cache_size: TOK_UINT {
+#ifdef WITH_DYNAMIC_PEERS
+			if ($1 > MAX_VERIFY_CACHE_SIZE) {
+				fastd_config_error(&@$, state, "invalid verify cache size");
+				YYERROR;
+			}
+
+			conf.verify_cache_size = $1;
+#else
+			fastd_config_error(&@$, state, "`verify cache' is not supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
+verify_cache_ttl: TOK_UINT {
+#ifdef WITH_DYNAMIC_PEERS
+			if ($1 > UINT_MAX) {
+				fastd_config_error(&@$, state, "invalid verify cache TTL");
+				YYERROR;
+			}
+
+			conf.verify_cache_ttl = $1;
+#else
+			fastd_config_error(&@$, state, "`verify cache' is not supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
+verify_cache_negative_ttl: TOK_UINT {
+#ifdef WITH_DYNAMIC_PEERS
+			if ($1 > UINT_MAX) {
+				fastd_config_error(&@$, state, "invalid verify cache TTL");
+				YYERROR;
+			}
+
+			conf.verify_cache_negative_ttl = $1;
+#else
+			fastd_config_error(&@$, state, "`verify cache' is not supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
+verify_cache_file: TOK_STRING {
+#ifdef WITH_DYNAMIC_PEERS
+			free(conf.verify_cache_file);
+			conf.verify_cache_file = fastd_strdup($1->str);
+#else
+			fastd_config_error(&@$, state, "`verify cache' is not supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
 pmtu:		autobool
 	;
 
@@ -412,6 +601,75 @@ status_socket:	TOK_STRING {
 		}
 	;
 
+metrics_socket:	TOK_STRING {
+#ifdef WITH_METRICS_SOCKET
+			free(conf.metrics_socket); conf.metrics_socket = fastd_strdup($1->str);
+#else
+			fastd_config_error(&@$, state, "metrics sockets aren't supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
+latency_stats:	boolean {
+#ifdef WITH_STATISTICS
+			conf.latency_stats = $1;
+#else
+			if ($1) {
+				fastd_config_error(
+					&@$, state, "latency stats aren't supported by this version of fastd");
+				YYERROR;
+			}
+#endif
+		}
+	;
+
+cpu_stats:	boolean {
+#ifdef WITH_STATISTICS
+			conf.cpu_stats = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "CPU stats aren't supported by this version of fastd");
+				YYERROR;
+			}
+#endif
+		}
+	;
+
+io_uring:	boolean {
+#ifdef USE_IO_URING
+			conf.io_uring = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "io_uring isn't supported by this version of fastd");
+				YYERROR;
+			}
+#endif
+		}
+	;
+
+stats_file:	TOK_STRING {
+#ifdef WITH_STATS_FILE
+			free(conf.stats_file); conf.stats_file = fastd_strdup($1->str);
+#else
+			fastd_config_error(&@$, state, "stats files aren't supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
+watch_peer_dirs: boolean {
+#ifdef USE_INOTIFY
+			conf.watch_peer_dirs = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "`watch peer dirs' is not supported on this platform");
+				YYERROR;
+			}
+#endif
+		}
+	;
+
 peer:		TOK_STRING {
 			state->peer = fastd_new0(fastd_peer_t);
 			state->peer->name = fastd_strdup($1->str);
@@ -578,6 +836,17 @@ on_verify:	sync TOK_STRING {
 #ifdef WITH_DYNAMIC_PEERS
 			fastd_shell_command_set(&conf.on_verify, $2->str, $1);
 			conf.on_verify_group = state->peer_group;
+			conf.on_verify_helper = false;
+#else
+			fastd_config_error(&@$, state, "`on verify' is not supported by this version of fastd");
+			YYERROR;
+#endif
+		}
+	|	TOK_HELPER TOK_STRING {
+#ifdef WITH_DYNAMIC_PEERS
+			fastd_shell_command_set(&conf.on_verify, $2->str, false);
+			conf.on_verify_group = state->peer_group;
+			conf.on_verify_helper = true;
 #else
 			fastd_config_error(&@$, state, "`on verify' is not supported by this version of fastd");
 			YYERROR;
@@ -26,6 +26,13 @@
 /** The SSSE3 bit in the CPUID return value */
 #define CPUID_SSSE3 ((uint64_t)1 << 41)
 
+/** The SSE4.1 bit in the CPUID return value */
+#define CPUID_SSE41 ((uint64_t)1 << 51)
+
+
+/** The SHA extensions bit in the fastd_cpuid7() return value */
+#define CPUID7_SHA ((uint32_t)1 << 29)
+
 
 /** Returns the ECX and EDX return values of CPUID function 1 as a single uint64 */
 static inline uint64_t fastd_cpuid(void) {
@@ -48,4 +55,31 @@ static inline uint64_t fastd_cpuid(void) {
 	return ((uint64_t)cx) << 32 | (uint32_t)dx;
 }
 
+/** Returns the EBX return value of CPUID function 7 (subfunction 0), or 0 if function 7 isn't supported */
+static inline uint32_t fastd_cpuid7(void) {
+	unsigned long ax, bx;
+
+	__asm__ __volatile__("mov $0, %%eax \n\t"
+			     "mov %%" REG_PFX "bx, %%" REG_PFX "di \n\t"
+			     "cpuid \n\t"
+			     "mov %%" REG_PFX "di, %%" REG_PFX "bx \n\t"
+			     : "=a"(ax)
+			     :
+			     : REG_PFX "cx", REG_PFX "dx", REG_PFX "di");
+
+	if ((uint32_t)ax < 7)
+		return 0;
+
+	__asm__ __volatile__("mov $7, %%eax \n\t"
+			     "xor %%ecx, %%ecx \n\t"
+			     "mov %%" REG_PFX "bx, %%" REG_PFX "di \n\t"
+			     "cpuid \n\t"
+			     "xchg %%" REG_PFX "di, %%" REG_PFX "bx \n\t"
+			     : "=D"(bx)
+			     :
+			     : REG_PFX "ax", REG_PFX "cx", REG_PFX "dx");
+
+	return bx;
+}
+
 #undef REG_PFX
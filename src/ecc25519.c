@@ -0,0 +1,666 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Built-in Curve25519 arithmetic
+
+   Field elements are represented as five 51bit limbs, so products can be computed with 64x64->128bit
+   multiplications (which compilers translate to \c mulx when BMI2 is available) without intermediate carry
+   handling. The curve is used in the twisted Edwards form with a = 486664 and d = 486660 that \e libuecc calls
+   "legacy"; as a is a square and d is a non-square, the unified addition formulas are complete, so no special
+   cases are needed.
+
+   All operations on secret data are constant-time: there are no branches or array accesses depending
+   on secret values.
+*/
+
+
+#include "ecc25519.h"
+
+#include <string.h>
+
+
+/** An unsigned 128bit integer */
+typedef unsigned __int128 uint128_t;
+
+/** A field element modulo 2^255-19 */
+typedef uint64_t fe_t[5];
+
+
+/** Mask for a single 51bit limb */
+#define MASK51 ((UINT64_C(1) << 51) - 1)
+
+
+/** The curve parameter a */
+#define CURVE_A 486664
+
+/** The curve parameter d */
+#define CURVE_D 486660
+
+
+/** The identity element */
+const fastd_ecc_25519_work_t fastd_ecc_25519_work_identity = {
+	.X = { 0 },
+	.Y = { 1 },
+	.Z = { 1 },
+	.T = { 0 },
+};
+
+/** The base point in the legacy coordinate system */
+const fastd_ecc_25519_work_t fastd_ecc_25519_work_base_legacy = {
+	.X = { 0x4fa397ffe6bd4, 0x4dd6472dc2451, 0x22dd0d1aa3adc, 0x70cee9351eb33, 0x547c4350219f5 },
+	.Y = { 0x6666666666658, 0x4cccccccccccc, 0x1999999999999, 0x3333333333333, 0x6666666666666 },
+	.Z = { 1 },
+	.T = { 0x261c799985647, 0x3e4505be35041, 0x024a70e21c8b0, 0x5a3f20f74bc29, 0x29fd02a6814c4 },
+};
+
+/** A square root of -1 modulo 2^255-19 */
+static const fe_t fe_sqrt_m1 = { 0x61b274a0ea0b0, 0x0d5a5fc8f189d, 0x7ef5e9cbd0c60, 0x78595a6804c9e, 0x2b8324804fc1d };
+
+/** The order of the prime-order subgroup, 2^252 + 27742317777372353535851937790883648493 */
+static const uint64_t gf_order[4] = { 0x5812631a5cf5d3ed, 0x14def9dea2f79cd6, 0, 0x1000000000000000 };
+
+
+/** Reads a little-endian 64bit value */
+static inline uint64_t load64(const uint8_t in[8]) {
+	uint64_t ret = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		ret = (ret << 8) | in[i];
+
+	return ret;
+}
+
+/** Writes a little-endian 64bit value */
+static inline void store64(uint8_t out[8], uint64_t v) {
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		out[i] = v;
+		v >>= 8;
+	}
+}
+
+
+/** Propagates carries, so every limb is smaller than 2^52 afterwards */
+static inline void fe_carry(fe_t h) {
+	uint64_t c;
+
+	c = h[0] >> 51;
+	h[0] &= MASK51;
+	h[1] += c;
+	c = h[1] >> 51;
+	h[1] &= MASK51;
+	h[2] += c;
+	c = h[2] >> 51;
+	h[2] &= MASK51;
+	h[3] += c;
+	c = h[3] >> 51;
+	h[3] &= MASK51;
+	h[4] += c;
+	c = h[4] >> 51;
+	h[4] &= MASK51;
+	h[0] += 19 * c;
+}
+
+/** Computes out = a + b */
+static inline void fe_add(fe_t out, const fe_t a, const fe_t b) {
+	size_t i;
+	for (i = 0; i < 5; i++)
+		out[i] = a[i] + b[i];
+
+	fe_carry(out);
+}
+
+/** Computes out = a - b (4p is added to a first, so no limb can underflow) */
+static inline void fe_sub(fe_t out, const fe_t a, const fe_t b) {
+	out[0] = (a[0] + 0x1fffffffffffb4) - b[0];
+	out[1] = (a[1] + 0x1ffffffffffffc) - b[1];
+	out[2] = (a[2] + 0x1ffffffffffffc) - b[2];
+	out[3] = (a[3] + 0x1ffffffffffffc) - b[3];
+	out[4] = (a[4] + 0x1ffffffffffffc) - b[4];
+
+	fe_carry(out);
+}
+
+/** Computes out = -a */
+static inline void fe_neg(fe_t out, const fe_t a) {
+	static const fe_t zero = { 0 };
+	fe_sub(out, zero, a);
+}
+
+/** Reduces the 128bit limbs of a product */
+static inline void fe_reduce_wide(fe_t out, uint128_t t[5]) {
+	uint64_t c;
+
+	t[1] += (uint64_t)(t[0] >> 51);
+	out[0] = (uint64_t)t[0] & MASK51;
+	t[2] += (uint64_t)(t[1] >> 51);
+	out[1] = (uint64_t)t[1] & MASK51;
+	t[3] += (uint64_t)(t[2] >> 51);
+	out[2] = (uint64_t)t[2] & MASK51;
+	t[4] += (uint64_t)(t[3] >> 51);
+	out[3] = (uint64_t)t[3] & MASK51;
+	c = t[4] >> 51;
+	out[4] = (uint64_t)t[4] & MASK51;
+
+	out[0] += 19 * c;
+	out[1] += out[0] >> 51;
+	out[0] &= MASK51;
+}
+
+/** Computes out = a * b */
+static void fe_mul(fe_t out, const fe_t a, const fe_t b) {
+	const uint64_t b1_19 = 19 * b[1], b2_19 = 19 * b[2], b3_19 = 19 * b[3], b4_19 = 19 * b[4];
+	uint128_t t[5];
+
+	t[0] = (uint128_t)a[0] * b[0] + (uint128_t)a[1] * b4_19 + (uint128_t)a[2] * b3_19 + (uint128_t)a[3] * b2_19 +
+	       (uint128_t)a[4] * b1_19;
+	t[1] = (uint128_t)a[0] * b[1] + (uint128_t)a[1] * b[0] + (uint128_t)a[2] * b4_19 + (uint128_t)a[3] * b3_19 +
+	       (uint128_t)a[4] * b2_19;
+	t[2] = (uint128_t)a[0] * b[2] + (uint128_t)a[1] * b[1] + (uint128_t)a[2] * b[0] + (uint128_t)a[3] * b4_19 +
+	       (uint128_t)a[4] * b3_19;
+	t[3] = (uint128_t)a[0] * b[3] + (uint128_t)a[1] * b[2] + (uint128_t)a[2] * b[1] + (uint128_t)a[3] * b[0] +
+	       (uint128_t)a[4] * b4_19;
+	t[4] = (uint128_t)a[0] * b[4] + (uint128_t)a[1] * b[3] + (uint128_t)a[2] * b[2] + (uint128_t)a[3] * b[1] +
+	       (uint128_t)a[4] * b[0];
+
+	fe_reduce_wide(out, t);
+}
+
+/** Computes out = a^2 */
+static void fe_sq(fe_t out, const fe_t a) {
+	const uint64_t a0_2 = 2 * a[0], a1_2 = 2 * a[1], a2_38 = 38 * a[2], a3_19 = 19 * a[3], a4_19 = 19 * a[4],
+		       a4_38 = 38 * a[4];
+	uint128_t t[5];
+
+	t[0] = (uint128_t)a[0] * a[0] + (uint128_t)a4_38 * a[1] + (uint128_t)a2_38 * a[3];
+	t[1] = (uint128_t)a0_2 * a[1] + (uint128_t)a4_38 * a[2] + (uint128_t)a3_19 * a[3];
+	t[2] = (uint128_t)a0_2 * a[2] + (uint128_t)a[1] * a[1] + (uint128_t)a4_38 * a[3];
+	t[3] = (uint128_t)a0_2 * a[3] + (uint128_t)a1_2 * a[2] + (uint128_t)a4_19 * a[4];
+	t[4] = (uint128_t)a0_2 * a[4] + (uint128_t)a1_2 * a[3] + (uint128_t)a[2] * a[2];
+
+	fe_reduce_wide(out, t);
+}
+
+/** Computes out = a^(2^n) */
+static void fe_sq_n(fe_t out, const fe_t a, unsigned n) {
+	fe_sq(out, a);
+
+	while (--n)
+		fe_sq(out, out);
+}
+
+/** Computes out = a * b for a small constant b */
+static inline void fe_mul_small(fe_t out, const fe_t a, uint32_t b) {
+	uint128_t t[5];
+	size_t i;
+
+	for (i = 0; i < 5; i++)
+		t[i] = (uint128_t)a[i] * b;
+
+	fe_reduce_wide(out, t);
+}
+
+/** Computes z^(2^250-1) and z^11, which are needed for inversion and square roots */
+static void fe_pow_2_250_1(fe_t out, fe_t z11, const fe_t z) {
+	fe_t z2, z9, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+
+	fe_sq(z2, z);
+	fe_sq_n(t, z2, 2);
+	fe_mul(z9, t, z);
+	fe_mul(z11, z9, z2);
+	fe_sq(t, z11);
+	fe_mul(z2_5_0, t, z9);
+
+	fe_sq_n(t, z2_5_0, 5);
+	fe_mul(z2_10_0, t, z2_5_0);
+	fe_sq_n(t, z2_10_0, 10);
+	fe_mul(z2_20_0, t, z2_10_0);
+	fe_sq_n(t, z2_20_0, 20);
+	fe_mul(t, t, z2_20_0);
+	fe_sq_n(t, t, 10);
+	fe_mul(z2_50_0, t, z2_10_0);
+	fe_sq_n(t, z2_50_0, 50);
+	fe_mul(z2_100_0, t, z2_50_0);
+	fe_sq_n(t, z2_100_0, 100);
+	fe_mul(t, t, z2_100_0);
+	fe_sq_n(t, t, 50);
+	fe_mul(out, t, z2_50_0);
+}
+
+/** Computes out = z^-1 = z^(2^255-21) */
+static void fe_invert(fe_t out, const fe_t z) {
+	fe_t t, z11;
+
+	fe_pow_2_250_1(t, z11, z);
+	fe_sq_n(t, t, 5);
+	fe_mul(out, t, z11);
+}
+
+/** Computes out = z^((p-5)/8) = z^(2^252-3) */
+static void fe_pow22523(fe_t out, const fe_t z) {
+	fe_t t, z11;
+
+	fe_pow_2_250_1(t, z11, z);
+	fe_sq_n(t, t, 2);
+	fe_mul(out, t, z);
+}
+
+/** Converts a field element to its canonical 32-byte representation */
+static void fe_store(uint8_t out[32], const fe_t a) {
+	fe_t h;
+	uint64_t q;
+
+	memcpy(h, a, sizeof(h));
+	fe_carry(h);
+	fe_carry(h);
+
+	/* q is 1 iff h >= p */
+	q = (h[0] + 19) >> 51;
+	q = (h[1] + q) >> 51;
+	q = (h[2] + q) >> 51;
+	q = (h[3] + q) >> 51;
+	q = (h[4] + q) >> 51;
+
+	h[0] += 19 * q;
+	h[1] += h[0] >> 51;
+	h[0] &= MASK51;
+	h[2] += h[1] >> 51;
+	h[1] &= MASK51;
+	h[3] += h[2] >> 51;
+	h[2] &= MASK51;
+	h[4] += h[3] >> 51;
+	h[3] &= MASK51;
+	h[4] &= MASK51;
+
+	store64(out, h[0] | (h[1] << 51));
+	store64(out + 8, (h[1] >> 13) | (h[2] << 38));
+	store64(out + 16, (h[2] >> 26) | (h[3] << 25));
+	store64(out + 24, (h[3] >> 39) | (h[4] << 12));
+}
+
+/** Loads a field element from the lowest 255 bits of a 32-byte value */
+static void fe_load(fe_t out, const uint8_t in[32]) {
+	uint64_t w0 = load64(in), w1 = load64(in + 8), w2 = load64(in + 16), w3 = load64(in + 24);
+
+	out[0] = w0 & MASK51;
+	out[1] = ((w0 >> 51) | (w1 << 13)) & MASK51;
+	out[2] = ((w1 >> 38) | (w2 << 26)) & MASK51;
+	out[3] = ((w2 >> 25) | (w3 << 39)) & MASK51;
+	out[4] = (w3 >> 12) & MASK51;
+}
+
+/** Returns 1 if a is zero modulo p, 0 otherwise */
+static int fe_is_zero(const fe_t a) {
+	uint8_t s[32], c = 0;
+	size_t i;
+
+	fe_store(s, a);
+	for (i = 0; i < 32; i++)
+		c |= s[i];
+
+	return ((unsigned)c - 1) >> 31;
+}
+
+/** Returns 1 if a equals b modulo p, 0 otherwise */
+static inline int fe_equal(const fe_t a, const fe_t b) {
+	fe_t t;
+	fe_sub(t, a, b);
+	return fe_is_zero(t);
+}
+
+/** Sets out to a if \e mask is all-ones and leaves it unchanged if \e mask is zero */
+static inline void fe_cmov(fe_t out, const fe_t a, uint64_t mask) {
+	size_t i;
+	for (i = 0; i < 5; i++)
+		out[i] ^= mask & (out[i] ^ a[i]);
+}
+
+
+/** Sets \e out to \e in if \e mask is all-ones and leaves it unchanged if \e mask is zero */
+static inline void point_cmov(fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in, uint64_t mask) {
+	fe_cmov(out->X, in->X, mask);
+	fe_cmov(out->Y, in->Y, mask);
+	fe_cmov(out->Z, in->Z, mask);
+	fe_cmov(out->T, in->T, mask);
+}
+
+
+/**
+   Loads a packed point
+
+   The lowest 255 bits of the input are the X coordinate; the highest bit is the lowest bit of the Y
+   coordinate. Returns 0 if the input isn't the canonical encoding of a point on the curve.
+*/
+int fastd_ecc_25519_load_packed_legacy(fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *in) {
+	fe_t X2, u, v, v3, r, check, t;
+	uint8_t s[32];
+
+	fe_load(out->X, in->p);
+
+	/* Reject non-canonical X coordinates */
+	fe_store(s, out->X);
+	s[31] |= in->p[31] & 0x80;
+	if (memcmp(s, in->p, 32) != 0)
+		return 0;
+
+	/* Y^2 = u/v = (1 - a*X^2) / (1 - d*X^2) */
+	static const fe_t one = { 1 };
+	fe_sq(X2, out->X);
+	fe_mul_small(t, X2, CURVE_A);
+	fe_sub(u, one, t);
+	fe_mul_small(t, X2, CURVE_D);
+	fe_sub(v, one, t);
+
+	/* r = u * v^3 * (u * v^7)^((p-5)/8) */
+	fe_sq(t, v);
+	fe_mul(v3, t, v);
+	fe_sq(t, v3);
+	fe_mul(t, t, v);
+	fe_mul(t, t, u);
+	fe_pow22523(t, t);
+	fe_mul(t, t, v3);
+	fe_mul(r, t, u);
+
+	fe_sq(t, r);
+	fe_mul(check, t, v);
+
+	if (!fe_equal(check, u)) {
+		fe_neg(t, u);
+		if (!fe_equal(check, t))
+			return 0;
+
+		fe_mul(r, r, fe_sqrt_m1);
+	}
+
+	fe_store(s, r);
+	if ((s[0] ^ (in->p[31] >> 7)) & 1)
+		fe_neg(r, r);
+
+	memcpy(out->Y, r, sizeof(fe_t));
+	memcpy(out->Z, one, sizeof(fe_t));
+	fe_mul(out->T, out->X, out->Y);
+
+	return 1;
+}
+
+/** Stores a point in packed form, given the inverse of its Z coordinate */
+static void store_packed_inverted(fastd_ecc_int256_t *out, const fastd_ecc_25519_work_t *in, const fe_t Zi) {
+	fe_t x, y;
+	uint8_t s[32];
+
+	fe_mul(x, in->X, Zi);
+	fe_mul(y, in->Y, Zi);
+
+	fe_store(out->p, x);
+	fe_store(s, y);
+	out->p[31] |= s[0] << 7;
+}
+
+/** Stores a point in packed form */
+void fastd_ecc_25519_store_packed_legacy(fastd_ecc_int256_t *out, const fastd_ecc_25519_work_t *in) {
+	fe_t Zi;
+
+	fe_invert(Zi, in->Z);
+	store_packed_inverted(out, in, Zi);
+}
+
+/**
+   Stores multiple points in packed form
+
+   The inversions of the Z coordinates are shared using Montgomery's trick, so a single field inversion
+   and three multiplications per point are needed instead of one inversion per point. The Z coordinates
+   of points resulting from the curve operations are never zero.
+*/
+void fastd_ecc_25519_store_packed_legacy_batch(
+	fastd_ecc_int256_t *const out[], const fastd_ecc_25519_work_t in[], size_t n) {
+	if (!n)
+		return;
+
+	fe_t prod[n], inv, Zi;
+	size_t i;
+
+	/* prod[i] is the product of the Z coordinates of the points 0 to i */
+	memcpy(prod[0], in[0].Z, sizeof(fe_t));
+	for (i = 1; i < n; i++)
+		fe_mul(prod[i], prod[i - 1], in[i].Z);
+
+	fe_invert(inv, prod[n - 1]);
+
+	for (i = n - 1; i > 0; i--) {
+		fe_mul(Zi, inv, prod[i - 1]);
+		fe_mul(inv, inv, in[i].Z);
+
+		store_packed_inverted(out[i], &in[i], Zi);
+	}
+
+	store_packed_inverted(out[0], &in[0], inv);
+}
+
+/** Checks if a point is the identity element */
+int fastd_ecc_25519_is_identity(const fastd_ecc_25519_work_t *in) {
+	return fe_is_zero(in->X) & fe_equal(in->Y, in->Z);
+}
+
+/** Doubles a point */
+void fastd_ecc_25519_double(fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in) {
+	fe_t A, B, C, D, E, F, G, H;
+
+	fe_sq(A, in->X);
+	fe_sq(B, in->Y);
+	fe_sq(C, in->Z);
+	fe_add(C, C, C);
+	fe_mul_small(D, A, CURVE_A);
+	fe_add(E, in->X, in->Y);
+	fe_sq(E, E);
+	fe_sub(E, E, A);
+	fe_sub(E, E, B);
+	fe_add(G, D, B);
+	fe_sub(F, G, C);
+	fe_sub(H, D, B);
+
+	fe_mul(out->X, E, F);
+	fe_mul(out->Y, G, H);
+	fe_mul(out->T, E, H);
+	fe_mul(out->Z, F, G);
+}
+
+/** Adds two points */
+void fastd_ecc_25519_add(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in1, const fastd_ecc_25519_work_t *in2) {
+	fe_t A, B, C, D, E, F, G, H, t;
+
+	fe_mul(A, in1->X, in2->X);
+	fe_mul(B, in1->Y, in2->Y);
+	fe_mul(C, in1->T, in2->T);
+	fe_mul_small(C, C, CURVE_D);
+	fe_mul(D, in1->Z, in2->Z);
+	fe_add(E, in1->X, in1->Y);
+	fe_add(t, in2->X, in2->Y);
+	fe_mul(E, E, t);
+	fe_sub(E, E, A);
+	fe_sub(E, E, B);
+	fe_sub(F, D, C);
+	fe_add(G, D, C);
+	fe_mul_small(t, A, CURVE_A);
+	fe_sub(H, B, t);
+
+	fe_mul(out->X, E, F);
+	fe_mul(out->Y, G, H);
+	fe_mul(out->T, E, H);
+	fe_mul(out->Z, F, G);
+}
+
+/** Subtracts a point from another */
+void fastd_ecc_25519_sub(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in1, const fastd_ecc_25519_work_t *in2) {
+	fastd_ecc_25519_work_t neg = *in2;
+	fe_neg(neg.X, in2->X);
+	fe_neg(neg.T, in2->T);
+
+	fastd_ecc_25519_add(out, in1, &neg);
+}
+
+/**
+   Multiplies a point with the lowest \e bits bits of a scalar
+
+   A fixed window of 4 bits is used; the table entries are selected in constant time.
+*/
+void fastd_ecc_25519_scalarmult_bits(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *n, const fastd_ecc_25519_work_t *base, unsigned bits) {
+	fastd_ecc_25519_work_t table[16], Q, S;
+	size_t i;
+
+	if (bits > 256)
+		bits = 256;
+
+	table[0] = fastd_ecc_25519_work_identity;
+	table[1] = *base;
+	for (i = 2; i < 16; i += 2) {
+		fastd_ecc_25519_double(&table[i], &table[i / 2]);
+		fastd_ecc_25519_add(&table[i + 1], &table[i], base);
+	}
+
+	Q = fastd_ecc_25519_work_identity;
+
+	const size_t windows = (bits + 3) / 4;
+	size_t w = windows;
+	while (w--) {
+		if (w + 1 < windows) {
+			fastd_ecc_25519_double(&Q, &Q);
+			fastd_ecc_25519_double(&Q, &Q);
+			fastd_ecc_25519_double(&Q, &Q);
+			fastd_ecc_25519_double(&Q, &Q);
+		}
+
+		uint64_t digit = (n->p[w / 2] >> (4 * (w & 1))) & 0xf;
+		if (4 * w + 4 > bits)
+			digit &= (1 << (bits - 4 * w)) - 1;
+
+		S = fastd_ecc_25519_work_identity;
+		for (i = 1; i < 16; i++)
+			point_cmov(&S, &table[i], -(((i ^ digit) - 1) >> 63));
+
+		fastd_ecc_25519_add(&Q, &Q, &S);
+	}
+
+	*out = Q;
+}
+
+/** Multiplies a point with a scalar */
+void fastd_ecc_25519_scalarmult(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *n, const fastd_ecc_25519_work_t *base) {
+	fastd_ecc_25519_scalarmult_bits(out, n, base, 256);
+}
+
+/** Multiplies the base point with a scalar */
+void fastd_ecc_25519_scalarmult_base(fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *n) {
+	fastd_ecc_25519_scalarmult_bits(out, n, &fastd_ecc_25519_work_base_legacy, 256);
+}
+
+
+/**
+   Reduces a little-endian integer of \e len bytes modulo the group order
+
+   The reduction is done bit by bit (shifting in one bit and conditionally subtracting the group order
+   in each step). This is slow compared to the curve operations, but the scalar operations are only needed
+   once per handshake.
+*/
+static void gf_reduce_bytes(fastd_ecc_int256_t *out, const uint8_t *in, size_t len) {
+	uint64_t r[4] = { 0 }, t[4];
+	size_t i, j;
+
+	for (i = 8 * len; i--;) {
+		r[3] = (r[3] << 1) | (r[2] >> 63);
+		r[2] = (r[2] << 1) | (r[1] >> 63);
+		r[1] = (r[1] << 1) | (r[0] >> 63);
+		r[0] = (r[0] << 1) | ((in[i / 8] >> (i % 8)) & 1);
+
+		uint64_t borrow = 0;
+		for (j = 0; j < 4; j++) {
+			uint128_t d = (uint128_t)r[j] - gf_order[j] - borrow;
+			t[j] = d;
+			borrow = (d >> 64) & 1;
+		}
+
+		/* Keep r if the subtraction underflowed */
+		uint64_t mask = borrow - 1;
+		for (j = 0; j < 4; j++)
+			r[j] ^= mask & (r[j] ^ t[j]);
+	}
+
+	for (j = 0; j < 4; j++)
+		store64(out->p + 8 * j, r[j]);
+}
+
+/** Adds two integers modulo the group order */
+void fastd_ecc_25519_gf_add(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in1, const fastd_ecc_int256_t *in2) {
+	uint8_t sum[33];
+	unsigned c = 0;
+	size_t i;
+
+	for (i = 0; i < 32; i++) {
+		c += in1->p[i] + in2->p[i];
+		sum[i] = c;
+		c >>= 8;
+	}
+	sum[32] = c;
+
+	gf_reduce_bytes(out, sum, sizeof(sum));
+}
+
+/** Multiplies two integers modulo the group order */
+void fastd_ecc_25519_gf_mult(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in1, const fastd_ecc_int256_t *in2) {
+	uint64_t a[4], b[4], r[8] = { 0 };
+	uint8_t prod[64];
+	size_t i, j;
+
+	for (i = 0; i < 4; i++) {
+		a[i] = load64(in1->p + 8 * i);
+		b[i] = load64(in2->p + 8 * i);
+	}
+
+	for (i = 0; i < 4; i++) {
+		uint64_t c = 0;
+
+		for (j = 0; j < 4; j++) {
+			uint128_t t = (uint128_t)a[i] * b[j] + r[i + j] + c;
+			r[i + j] = t;
+			c = t >> 64;
+		}
+
+		r[i + 4] = c;
+	}
+
+	for (i = 0; i < 8; i++)
+		store64(prod + 8 * i, r[i]);
+
+	gf_reduce_bytes(out, prod, sizeof(prod));
+}
+
+/** Reduces an integer modulo the group order */
+void fastd_ecc_25519_gf_reduce(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in) {
+	fastd_ecc_int256_t tmp = *in;
+	gf_reduce_bytes(out, tmp.p, sizeof(tmp.p));
+}
+
+/**
+   Ensures that a random value is usable as a secret key by clearing and setting the appropriate bits
+
+   Like with libuecc, the result is not reduced modulo the group order: secret keys must stay divisible by the
+   cofactor 8.
+*/
+void fastd_ecc_25519_gf_sanitize_secret(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in) {
+	*out = *in;
+
+	out->p[0] &= 0xf8;
+	out->p[31] &= 0x7f;
+	out->p[31] |= 0x40;
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Built-in Curve25519 arithmetic
+
+   This implements the subset of the \e libuecc API used by the ec25519-fhmqvc protocol, using 64bit limbs in
+   radix 2^51. All functions have the same semantics as their \e libuecc counterparts (without the \c fastd_
+   prefix), so packed keys and results are interchangeable. fastd_ecc_25519_store_packed_legacy_batch() has
+   no \e libuecc counterpart.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** A 256bit integer (little endian), compatible with \e libuecc's ecc_int256_t */
+typedef union fastd_ecc_int256 {
+	uint8_t p[32]; /**< Byte-wise access */
+} fastd_ecc_int256_t;
+
+/**
+   A point on the curve in extended projective coordinates
+
+   The limbs of the field elements are not necessarily fully reduced.
+*/
+typedef struct fastd_ecc_25519_work {
+	uint64_t X[5]; /**< The projective X coordinate */
+	uint64_t Y[5]; /**< The projective Y coordinate */
+	uint64_t Z[5]; /**< The projective Z coordinate */
+	uint64_t T[5]; /**< The extended T coordinate (X*Y/Z) */
+} fastd_ecc_25519_work_t;
+
+
+/** The identity element */
+extern const fastd_ecc_25519_work_t fastd_ecc_25519_work_identity;
+
+/** The base point in the legacy coordinate system */
+extern const fastd_ecc_25519_work_t fastd_ecc_25519_work_base_legacy;
+
+
+int fastd_ecc_25519_load_packed_legacy(fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *in);
+void fastd_ecc_25519_store_packed_legacy(fastd_ecc_int256_t *out, const fastd_ecc_25519_work_t *in);
+void fastd_ecc_25519_store_packed_legacy_batch(
+	fastd_ecc_int256_t *const out[], const fastd_ecc_25519_work_t in[], size_t n);
+
+int fastd_ecc_25519_is_identity(const fastd_ecc_25519_work_t *in);
+void fastd_ecc_25519_double(fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in);
+void fastd_ecc_25519_add(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in1, const fastd_ecc_25519_work_t *in2);
+void fastd_ecc_25519_sub(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_25519_work_t *in1, const fastd_ecc_25519_work_t *in2);
+
+void fastd_ecc_25519_scalarmult_bits(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *n, const fastd_ecc_25519_work_t *base, unsigned bits);
+void fastd_ecc_25519_scalarmult(
+	fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *n, const fastd_ecc_25519_work_t *base);
+void fastd_ecc_25519_scalarmult_base(fastd_ecc_25519_work_t *out, const fastd_ecc_int256_t *n);
+
+void fastd_ecc_25519_gf_add(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in1, const fastd_ecc_int256_t *in2);
+void fastd_ecc_25519_gf_mult(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in1, const fastd_ecc_int256_t *in2);
+void fastd_ecc_25519_gf_reduce(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in);
+void fastd_ecc_25519_gf_sanitize_secret(fastd_ecc_int256_t *out, const fastd_ecc_int256_t *in);
@@ -19,11 +19,20 @@
 #include "async.h"
 #include "config.h"
 #include "crypto.h"
+#include "latency.h"
+#include "metrics.h"
 #include "peer.h"
+#include "peer_db.h"
 #include "peer_group.h"
 #include "peer_hashtable.h"
+#include "peer_watch.h"
 #include "polling.h"
+#include "spawn_server.h"
+#include "stats_file.h"
+#include "verify.h"
 #include "version.h"
+#include "worker.h"
+#include "xdp.h"
 
 #include <grp.h>
 #include <signal.h>
@@ -77,7 +86,7 @@ static void on_signal(int signo) {
 
 #ifndef USE_EPOLL
 	/* Avoids a race condition between pthread_sigmask() and poll() (FreeBSD doesn't have ppoll() ...) */
-	fastd_async_enqueue(ASYNC_TYPE_NOP, NULL, 0);
+	fastd_async_wakeup();
 #endif
 }
 
@@ -165,6 +174,9 @@ static void init_sockets(void) {
 /** Closes fastd's sockets */
 static void close_sockets(void) {
 	size_t i;
+
+	fastd_xdp_free();
+
 	for (i = 0; i < ctx.n_socks; i++)
 		fastd_socket_close(&ctx.socks[i]);
 
@@ -201,8 +213,8 @@ static inline void on_post_down(void) {
 }
 
 
-/** Closes all open FDs except stdin, stdout and stderr */
-void fastd_close_all_fds(void) {
+/** Closes all open FDs except stdin, stdout, stderr and \e keep (if it is not negative) */
+void fastd_close_all_fds_except(int keep) {
 	struct rlimit rl;
 	int fd, maxfd;
 
@@ -212,6 +224,9 @@ void fastd_close_all_fds(void) {
 		maxfd = sysconf(_SC_OPEN_MAX);
 
 	for (fd = 3; fd < maxfd; fd++) {
+		if (fd == keep)
+			continue;
+
 		if (close(fd) < 0) {
 			if (errno != EBADF)
 				pr_error_errno("close");
@@ -264,8 +279,12 @@ static inline void write_pid(void) {
 #endif
 }
 
-/** Switches to the configured user */
-static void set_user(void) {
+/**
+   Switches the real, effective and saved user and group IDs to the configured user
+
+   This is also used by the spawn server process.
+*/
+void fastd_set_user_ids(void) {
 #ifdef USE_USER
 	if (conf.user || conf.group) {
 
@@ -284,14 +303,28 @@ static void set_user(void) {
 		if (setreuid(conf.uid, conf.uid) < 0)
 			exit_errno("setreuid");
 #endif
+	}
+#endif
+}
+
+/** Switches fastd and the spawn server to the configured user */
+static void set_user(void) {
+#ifdef USE_USER
+	if (conf.user || conf.group) {
+		fastd_spawn_server_set_user();
+		fastd_set_user_ids();
 
 		pr_info("changed to UID %u, GID %u", (unsigned)conf.uid, (unsigned)conf.gid);
 	}
 #endif
 }
 
-/** Sets the configured user's supplementary groups */
-static void set_groups(void) {
+/**
+   Sets the configured user's supplementary groups
+
+   This is also used by the spawn server process.
+*/
+void fastd_set_supplementary_groups(void) {
 #ifdef USE_USER
 	if (conf.groups) {
 		if (setgroups(conf.n_groups, conf.groups) < 0) {
@@ -307,6 +340,12 @@ static void set_groups(void) {
 #endif
 }
 
+/** Sets the configured user's supplementary groups for fastd and the spawn server */
+static void set_groups(void) {
+	fastd_spawn_server_set_groups();
+	fastd_set_supplementary_groups();
+}
+
 /** Switches the user and drops all capabilities */
 static void drop_caps(void) {
 	set_user();
@@ -406,12 +445,13 @@ static inline void init_early(void) {
 
 	fastd_cipher_init();
 	fastd_mac_init();
+	fastd_sha256_init();
 }
 
 /**
    Performs further initialization after the config has been loaded
 
-   This also handles special run modes like \em generate-key and \em verify-config.
+   This also handles special run modes like \em generate-key, \em verify-config and \em compile-peers.
 */
 static inline void init_config(int *status_fd) {
 	if (conf.verify_config) {
@@ -419,6 +459,9 @@ static inline void init_config(int *status_fd) {
 		exit(0);
 	}
 
+	if (conf.compile_peers)
+		exit(fastd_peer_db_compile() ? 0 : 1);
+
 	if (conf.generate_key) {
 		conf.protocol->generate_key();
 		exit(0);
@@ -463,6 +506,12 @@ static inline void init(int argc, char *argv[]) {
 	fastd_configure(argc, argv);
 	init_config(&status_fd);
 
+	/* Fork the spawn server before the heap grows */
+	fastd_spawn_server_start();
+
+	/* Start the logging thread after forking the spawn server, which doesn't share it */
+	fastd_log_async_start();
+
 	fastd_update_time();
 	fastd_task_schedule(&ctx.next_maintenance, TASK_TYPE_MAINTENANCE, ctx.now + MAINTENANCE_INTERVAL);
 
@@ -470,8 +519,11 @@ static inline void init(int argc, char *argv[]) {
 
 #ifdef WITH_DYNAMIC_PEERS
 	fastd_sem_init(&ctx.verify_limit, VERIFY_LIMIT);
+	fastd_verify_cache_init();
 #endif
 
+	fastd_latency_init();
+
 	if (pthread_attr_init(&ctx.detached_thread))
 		exit_errno("pthread_attr_init");
 	if (pthread_attr_setdetachstate(&ctx.detached_thread, PTHREAD_CREATE_DETACHED))
@@ -482,14 +534,21 @@ static inline void init(int argc, char *argv[]) {
 	fastd_update_time();
 	ctx.started = ctx.now;
 
+	/* Peer IDs start at 1, so 0 never refers to a peer */
+	ctx.next_peer_id = 1;
+
 	fastd_cap_acquire();
 
 	fastd_poll_init();
+	fastd_spawn_server_register();
 
 	init_sockets();
 
 	fastd_status_init();
+	fastd_stats_file_init();
+	fastd_metrics_init();
 	fastd_async_init();
+	fastd_worker_init();
 
 	fastd_socket_bind_all();
 
@@ -530,6 +589,7 @@ static inline void init(int argc, char *argv[]) {
 	else if (conf.drop_caps == DROP_CAPS_OFF)
 		set_user();
 
+	fastd_peer_watch_init();
 	fastd_config_load_peer_dirs(true);
 }
 
@@ -585,6 +645,10 @@ static inline void handle_signals(void) {
 /** A single iteration of fastd's main loop */
 static inline void run(void) {
 	fastd_task_handle();
+
+	/* Packets queued for AF_XDP are sent before waiting for new events */
+	fastd_xdp_flush();
+
 	fastd_poll_handle();
 
 	handle_signals();
@@ -606,6 +670,15 @@ static void delete_peers(void) {
 static inline void cleanup(void) {
 	pr_info("terminating fastd");
 
+	fastd_worker_cleanup();
+	fastd_resolve_cleanup();
+	fastd_async_cleanup();
+
+#ifdef WITH_DYNAMIC_PEERS
+	fastd_verify_helper_cleanup();
+	fastd_verify_cache_free();
+#endif
+
 	delete_peers();
 
 	if (ctx.iface) {
@@ -613,11 +686,16 @@ static inline void cleanup(void) {
 		fastd_iface_close(ctx.iface);
 	}
 
+	fastd_peer_watch_close();
+	fastd_metrics_close();
+	fastd_stats_file_close();
 	fastd_status_close();
+	fastd_latency_free();
 	close_sockets();
 	fastd_poll_free();
 
 	on_post_down();
+	fastd_spawn_server_stop();
 
 	fastd_peer_hashtable_free();
 
@@ -631,6 +709,7 @@ static inline void cleanup(void) {
 
 	fastd_receive_unknown_free();
 
+	fastd_log_async_stop();
 	close_log();
 	fastd_config_release();
 }
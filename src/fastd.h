@@ -21,6 +21,7 @@
 #include "log.h"
 #include "polling.h"
 #include "sem.h"
+#include "sha256.h"
 #include "shell.h"
 #include "task.h"
 #include "util.h"
@@ -80,6 +81,9 @@ struct fastd_protocol {
 		const fastd_peer_address_t *remote_addr, const void *protocol_data, bool ok);
 #endif
 
+	/** Handles the result of a protocol-specific job run on a worker thread */
+	void (*handle_async_return)(const void *data, size_t len);
+
 
 	/** Handles a received payload packet (performs decryption and validity check, etc.) */
 	void (*handle_recv)(fastd_peer_t *peer, fastd_buffer_t buffer);
@@ -98,6 +102,13 @@ struct fastd_protocol {
 	void (*free_peer_state)(fastd_peer_t *peer);
 
 
+	/**
+	   The size of a fastd_protocol_key_t
+
+	   Keys must not contain pointers, so they can be stored in compiled peer databases.
+	*/
+	size_t key_size;
+
 	/** Initializes protocol-specific parts of a peer configuration */
 	fastd_protocol_key_t *(*read_key)(const char *key);
 
@@ -137,6 +148,7 @@ union fastd_peer_address {
 #define FASTD_BIND_DEFAULT_IPV4 (1U << 1)
 #define FASTD_BIND_DEFAULT_IPV6 (1U << 2)
 #define FASTD_BIND_DYNAMIC (1U << 3)
+#define FASTD_BIND_XDP (1U << 4)
 
 /** A linked list of addresses to bind to */
 struct fastd_bind_address {
@@ -154,7 +166,20 @@ struct fastd_socket {
 					     a random port) */
 	fastd_peer_t *peer; /**< If the socket belongs to a single peer (as it was create dynamically when sending a
 			       handshake), contains that peer */
+#ifdef WITH_XDP
+	fastd_xdp_t *xdp; /**< The AF_XDP state of the interface the socket is bound to (NULL if XDP isn't used) */
+#endif
+};
+
+#ifdef WITH_XDP
+/** The link-layer destination of a peer that can be reached through AF_XDP */
+struct fastd_xdp_dest {
+	fastd_xdp_t *xdp;          /**< The AF_XDP state the peer's packets were received on (NULL if unknown) */
+	fastd_peer_address_t addr; /**< The peer address the destination was learned for */
+	fastd_eth_addr_t mac;      /**< The MAC address of the peer or the next router */
+	uint16_t queue;            /**< The index of the queue the peer's packets were received on */
 };
+#endif
 
 /** A TUN/TAP interface */
 struct fastd_iface {
@@ -170,6 +195,8 @@ struct fastd_iface {
 typedef enum fastd_stat_type {
 	STAT_RX = 0,       /**< Reception statistics (total) */
 	STAT_RX_REORDERED, /**< Reception statistics (reordered) */
+	STAT_RX_TOO_OLD,   /**< Reception statistics (dropped because of being outside of the replay window) */
+	STAT_RX_DUPLICATE, /**< Reception statistics (dropped because of being duplicates) */
 	STAT_TX,           /**< Transmission statistics (OK) */
 	STAT_TX_DROPPED,   /**< Transmission statistics (dropped because of full queues) */
 	STAT_TX_ERROR,     /**< Transmission statistics (other errors) */
@@ -178,12 +205,29 @@ typedef enum fastd_stat_type {
 
 /** Some kind of network transfer statistics */
 struct fastd_stats {
-#ifdef WITH_STATUS_SOCKET
+#ifdef WITH_STATISTICS
 	uint64_t packets[STAT_MAX]; /**< The number of packets transferred */
 	uint64_t bytes[STAT_MAX];   /**< The number of bytes transferred */
 #endif
 };
 
+/** Type of a per-peer CPU cost counter */
+typedef enum fastd_cpu_type {
+	CPU_DECRYPT = 0, /**< Decryption of payload packets */
+	CPU_ENCRYPT,     /**< Encryption of payload packets */
+	CPU_HANDSHAKE,   /**< Handling of received handshakes (including work done by worker threads) */
+	CPU_HOOK,        /**< Execution of peer-specific shell commands */
+	CPU_MAX,         /**< (Number of defined CPU cost types) */
+} fastd_cpu_type_t;
+
+/** The CPU time spent on behalf of a peer */
+struct fastd_cpu_stats {
+#ifdef WITH_STATISTICS
+	uint64_t time[CPU_MAX];  /**< The time spent (in nanoseconds) */
+	uint64_t count[CPU_MAX]; /**< The number of measured operations */
+#endif
+};
+
 
 /** A data structure keeping track of an unknown addresses that a handshakes was received from recently */
 struct fastd_handshake_timeout {
@@ -199,6 +243,9 @@ struct fastd_config {
 	fastd_loglevel_t log_syslog_level; /**< The minimum loglevel of messages to print to syslog (or -1 to not print
 					      any messages on syslog) */
 	char *log_syslog_ident; /**< The identification string for messages sent to syslog (default: "fastd") */
+	bool log_async;          /**< Writes log messages from a separate thread instead of the main loop */
+	unsigned log_rate_limit; /**< The maximum number of messages per second logged by a single call site (0 for no
+				    limit) */
 
 	char *ifname;       /**< The configured interface name */
 	bool iface_persist; /**< Configures if peer-specific interfaces should exist always, or only when there's an
@@ -220,6 +267,18 @@ struct fastd_config {
 #endif
 	bool forward; /**< Specifies if packet forwarding is enable */
 
+	size_t replay_window; /**< The number of packets a received packet may be older than the newest one to be
+				 accepted */
+
+	size_t worker_threads; /**< The number of worker threads to use for CPU-intensive tasks (0 to disable) */
+
+	unsigned handshake_rate; /**< The maximum number of handshakes per second to initiate (0 for no limit) */
+
+	size_t key_cache_size; /**< The maximum number of peer public keys to keep precomputed tables for */
+
+	unsigned cookie_threshold; /**< The number of initial handshakes per second above which handshakes are only
+				      answered after a cookie exchange (0 to disable) */
+
 	fastd_drop_caps_t drop_caps; /**< Specifies if and when to drop capabilities */
 
 #ifdef USE_USER
@@ -257,12 +316,40 @@ struct fastd_config {
 	fastd_shell_command_t on_verify;     /**< The command to execute to check if a connection from an unknown peer
 						should be allowed */
 	fastd_peer_group_t *on_verify_group; /**< The peer group to put dynamic peers into */
+	bool on_verify_helper;               /**< If true, on_verify is a long-running helper process instead of a command
+						that is run for every verification */
+
+	size_t verify_cache_size;           /**< The maximum number of cached verification results (0 to disable) */
+	unsigned verify_cache_ttl;          /**< The number of seconds positive verification results are cached */
+	unsigned verify_cache_negative_ttl; /**< The number of seconds negative verification results are cached */
+	char *verify_cache_file;            /**< The file to keep the cached verification results in across restarts */
 #endif
 
 #ifdef WITH_STATUS_SOCKET
 	char *status_socket; /**< The path of the status socket */
 #endif
 
+#ifdef WITH_STATS_FILE
+	char *stats_file; /**< The path of the shared-memory statistics file */
+#endif
+
+#ifdef WITH_METRICS_SOCKET
+	char *metrics_socket; /**< The path of the OpenMetrics socket */
+#endif
+
+#ifdef WITH_STATISTICS
+	bool latency_stats; /**< Enables the latency histograms of the packet path */
+	bool cpu_stats;     /**< Enables the accounting of the CPU time spent on behalf of each peer */
+#endif
+
+#ifdef USE_IO_URING
+	bool io_uring; /**< Uses io_uring instead of epoll for the main loop */
+#endif
+
+#ifdef USE_INOTIFY
+	bool watch_peer_dirs; /**< Makes fastd reload changed peer files automatically */
+#endif
+
 #ifdef __ANDROID__
 	bool android_integration; /**< Enable Android GUI integration features */
 #endif
@@ -277,12 +364,16 @@ struct fastd_config {
 	bool generate_key;     /**< Makes fastd generate a new keypair and exit */
 	bool show_key;         /**< Makes fastd output the public key for the configured secret and exit */
 	bool verify_config;    /**< Does basic verification of the configuration and exits */
+	bool compile_peers;    /**< Makes fastd compile the peer directories into peer databases and exit */
 };
 
 
 /** The dynamic state of \em fastd */
 struct fastd_context {
-	bool log_initialized; /**< true if the logging facilities have been properly initialized */
+	bool log_initialized;       /**< true if the logging facilities have been properly initialized */
+	fastd_log_ring_t *log_ring; /**< The queue of the asynchronous logging thread (NULL if disabled) */
+	uint64_t log_dropped;       /**< The number of log messages dropped because the logging queue was full */
+	uint64_t log_suppressed;    /**< The number of log messages suppressed by the rate limit */
 
 	int64_t started; /**< The timestamp when fastd was started */
 
@@ -290,15 +381,21 @@ struct fastd_context {
 
 	fastd_iface_t *iface; /**< The default tunnel interface */
 
-	uint64_t next_peer_id;        /**< An monotonously increasing ID peers are identified with in some components */
+	uint64_t next_peer_id;        /**< An monotonously increasing ID peers are identified with in some components
+					   (starting at 1) */
 	VECTOR(fastd_peer_t *) peers; /**< The currectly active peers */
 
 #ifdef WITH_DYNAMIC_PEERS
-	fastd_sem_t verify_limit; /**< Keeps track of the number of verifier threads */
+	fastd_sem_t verify_limit;             /**< Keeps track of the number of verifier threads */
+	fastd_verify_helper_t *verify_helper; /**< The state of the verify helper process */
+	fastd_verify_cache_t *verify_cache;   /**< The cache of verification results */
 #endif
 
 #ifdef USE_EPOLL
 	int epoll_fd; /**< The file descriptor for the epoll facility */
+#ifdef USE_IO_URING
+	fastd_uring_t *uring; /**< The io_uring state (NULL if epoll is used) */
+#endif
 #else
 	VECTOR(fastd_poll_fd_t *) fds; /**< Vector of file descriptors to poll on, indexed by the FD itself */
 	VECTOR(struct pollfd) pollfds; /**< The vector of pollfds for all file descriptors */
@@ -308,6 +405,14 @@ struct fastd_context {
 	fastd_poll_fd_t status_fd; /**< The file descriptor of the status socket */
 #endif
 
+#ifdef WITH_METRICS_SOCKET
+	fastd_poll_fd_t metrics_fd; /**< The file descriptor of the metrics socket */
+#endif
+
+#ifdef WITH_STATISTICS
+	fastd_latency_t *latency; /**< The latency histograms (NULL if latency statistics are disabled) */
+#endif
+
 	bool has_floating; /**< Specifies if any of the configured peers have floating remotes */
 	uint16_t max_mtu;  /**< The maximum MTU of all peer-specific interfaces */
 	size_t max_buffer; /**< Maximum buffer size needed for any combination of peer MTU, method, or handshake */
@@ -320,13 +425,37 @@ struct fastd_context {
 	fastd_pqueue_t *task_queue;    /**< Priority queue of scheduled tasks */
 	fastd_task_t next_maintenance; /**< Schedules the next maintenance call */
 
+	int64_t handshake_tat;           /**< The time (in microseconds) the budget allows the next handshake at */
+	fastd_pqueue_t *handshake_queue; /**< Queue of handshakes waiting for the handshake budget */
+	fastd_pqueue_t *handshake_queue_established; /**< Queue of handshakes with established peers waiting for the
+							handshake budget (served first) */
+	fastd_task_t next_queued_handshake;          /**< Schedules sending the next queued handshakes */
+
 	VECTOR(pid_t) async_pids; /**< PIDs of asynchronously executed commands which still have to be reaped */
-	fastd_poll_fd_t
-		async_rfd; /**< The read side of the pipe used to send data from other threads to the main thread */
-	int async_wfd;     /**< The write side of the pipe used to send data from other threads to the main thread */
+	fastd_async_msg_t *async_queue; /**< Notifications from other threads to the main thread (a lock-free stack) */
+	fastd_poll_fd_t async_rfd;      /**< The read side of the eventfd or pipe used to wake up the main thread */
+	int async_wfd;                  /**< The write side of the eventfd or pipe used to wake up the main thread */
+
+#ifdef USE_SPAWN_SERVER
+	fastd_poll_fd_t spawn_fd;    /**< The socket connected to the spawn server */
+	pthread_mutex_t spawn_mutex; /**< Serializes requests to the spawn server */
+#endif
+
+#ifdef USE_INOTIFY
+	fastd_poll_fd_t peer_watch_fd; /**< The inotify instance watching the peer directories */
+#endif
 
 	pthread_attr_t detached_thread; /**< pthread_attr_t for creating detached threads */
 
+	size_t n_workers;                      /**< The number of running worker threads */
+	pthread_t *workers;                    /**< The worker threads used for CPU-intensive tasks */
+	pthread_mutex_t worker_mutex;          /**< Protects the worker job queue */
+	pthread_cond_t worker_cond;            /**< Signals the worker threads that jobs are available */
+	fastd_worker_job_t *worker_jobs;       /**< The head of the worker job queue */
+	fastd_worker_job_t **worker_jobs_tail; /**< The \e next pointer of the last job in the worker job queue */
+	size_t n_worker_jobs;                  /**< The number of jobs in the worker job queue */
+	bool workers_stop;                     /**< Tells the worker threads to exit */
+
 #ifdef __ANDROID__
 	int android_ctrl_sock_fd; /**< The unix domain socket for communicating with Android GUI */
 #endif
@@ -339,6 +468,12 @@ struct fastd_context {
 	fastd_socket_t *sock_default_v4; /**< Points to the socket that is used for new outgoing IPv4 connections */
 	fastd_socket_t *sock_default_v6; /**< Points to the socket that is used for new outgoing IPv6 connections */
 
+#ifdef WITH_XDP
+	fastd_xdp_t *xdp;                /**< The list of interfaces packets are received from through AF_XDP */
+	const fastd_xdp_dest_t *xdp_src; /**< The link-layer source of the packet that is currently being handled if
+					    it was received through AF_XDP */
+#endif
+
 	fastd_stats_t stats; /**< Traffic statistics */
 
 	VECTOR(fastd_peer_eth_addr_t)
@@ -348,6 +483,15 @@ struct fastd_context {
 	fastd_handshake_timeout_t
 		*unknown_handshakes[UNKNOWN_TABLES]; /**< Hash tables unknown addresses handshakes have been sent to */
 
+	int64_t handshake_rate_second; /**< The second (in ctx.now / 1000) handshake_rate_count refers to */
+	unsigned handshake_rate_count; /**< The number of initial handshakes received in the current second */
+	unsigned handshake_rate;       /**< The number of initial handshakes received in the last second */
+	uint64_t cookie_replies;       /**< The number of cookie replies sent */
+
+	fastd_timeout_t cookie_secret_timeout;                   /**< When the cookie secret is replaced */
+	uint32_t cookie_secret[FASTD_HMACSHA256_KEY_WORDS];      /**< The secret used to create cookies */
+	uint32_t prev_cookie_secret[FASTD_HMACSHA256_KEY_WORDS]; /**< The previous cookie secret */
+
 	fastd_protocol_state_t *protocol_state; /**< Protocol-specific state */
 };
 
@@ -368,29 +512,43 @@ void fastd_main(int argc, char *argv[]);
 void fastd_send(
 	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
 	fastd_peer_t *peer, fastd_buffer_t buffer, size_t stat_size);
+void fastd_send_complete(fastd_peer_t *peer, size_t stat_size, int error);
 void fastd_send_data(fastd_buffer_t buffer, fastd_peer_t *source, fastd_peer_t *dest);
 
 void fastd_receive_unknown_init(void);
 void fastd_receive_unknown_free(void);
 void fastd_receive(fastd_socket_t *sock);
+void fastd_receive_packet(
+	fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *remote_addr, fastd_buffer_t buffer,
+	int64_t start);
+void fastd_receive_from(
+	fastd_socket_t *sock, fastd_peer_address_t *local_addr, fastd_peer_address_t *remote_addr,
+	fastd_buffer_t buffer, int64_t start);
 void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t buffer, bool reordered);
 
-void fastd_close_all_fds(void);
+void fastd_close_all_fds_except(int keep);
+void fastd_set_user_ids(void);
+void fastd_set_supplementary_groups(void);
 
 void fastd_socket_bind_all(void);
 fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af);
+void fastd_socket_listen_unix(
+	fastd_poll_fd_t *fd, const char *path, const char *name, bool lock, void (*unlink_socket)(void));
 void fastd_socket_close(fastd_socket_t *sock);
 void fastd_socket_error(fastd_socket_t *sock);
 
 void fastd_resolve_peer(fastd_peer_t *peer, fastd_remote_t *remote);
+void fastd_resolve_cache_cleanup(void);
+void fastd_resolve_cleanup(void);
 
 fastd_iface_t *fastd_iface_open(fastd_peer_t *peer);
 void fastd_iface_handle(fastd_iface_t *iface);
-void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t buffer);
+void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t buffer, bool keep);
 void fastd_iface_close(fastd_iface_t *iface);
 
 void fastd_random_bytes(void *buffer, size_t len, bool secure);
 int64_t fastd_get_time(void);
+int64_t fastd_get_time_ns(void);
 
 
 #ifdef __ANDROID__
@@ -420,6 +578,15 @@ static inline void fastd_cap_reacquire_drop(void) {}
 void fastd_status_init(void);
 void fastd_status_close(void);
 void fastd_status_handle(void);
+void fastd_status_handle_conn(fastd_poll_fd_t *fd);
+void fastd_status_handle_task(fastd_task_t *task);
+void fastd_status_handle_flush(fastd_task_t *task);
+
+void fastd_status_event_established(const fastd_peer_t *peer, bool established);
+void fastd_status_event_roamed(const fastd_peer_t *peer, const fastd_peer_address_t *old_address);
+void fastd_status_event_handshake_failed(
+	const fastd_peer_t *peer, const fastd_peer_address_t *remote_addr, const char *direction, unsigned reply_code,
+	const char *field);
 
 #else /* WITH_STATUS_SOCKET */
 
@@ -427,9 +594,21 @@ static inline void fastd_status_init(void) {}
 static inline void fastd_status_close(void) {}
 static inline void fastd_status_handle(void) {}
 
+static inline void fastd_status_event_established(UNUSED const fastd_peer_t *peer, UNUSED bool established) {}
+static inline void fastd_status_event_roamed(
+	UNUSED const fastd_peer_t *peer, UNUSED const fastd_peer_address_t *old_address) {}
+static inline void fastd_status_event_handshake_failed(
+	UNUSED const fastd_peer_t *peer, UNUSED const fastd_peer_address_t *remote_addr, UNUSED const char *direction,
+	UNUSED unsigned reply_code, UNUSED const char *field) {}
+
 #endif /* WITH_STATUS_SOCKET */
 
 
+/** Closes all open FDs except stdin, stdout and stderr */
+static inline void fastd_close_all_fds(void) {
+	fastd_close_all_fds_except(-1);
+}
+
 /** Returns a random number between \a min (inclusively) and \a max (exclusively) */
 static inline int fastd_rand(int min, int max) {
 	unsigned int r = (unsigned int)random();
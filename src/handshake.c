@@ -12,6 +12,7 @@
 
 
 #include "handshake.h"
+#include "crypto.h"
 #include "method.h"
 #include "peer.h"
 #include "peer_group.h"
@@ -36,6 +37,7 @@ static const char *const RECORD_TYPES[RECORD_MAX] = {
 	"version name",
 	"method list",
 	"TLV message authentication code",
+	"cookie",
 };
 
 
@@ -216,6 +218,154 @@ fastd_buffer_t fastd_handshake_new_reply(
 	return buffer;
 }
 
+/** Rolls the handshake rate counters over when a new second has started */
+static void update_handshake_rate(void) {
+	int64_t second = ctx.now / 1000;
+
+	if (second == ctx.handshake_rate_second)
+		return;
+
+	ctx.handshake_rate = (second == ctx.handshake_rate_second + 1) ? ctx.handshake_rate_count : 0;
+	ctx.handshake_rate_second = second;
+	ctx.handshake_rate_count = 0;
+}
+
+/**
+   Checks if initial handshakes must carry a valid cookie
+
+   Cookie mode is active while the number of initial handshakes received in the current or the last second
+   exceeds the configured cookie threshold.
+*/
+bool fastd_handshake_cookie_mode(void) {
+	update_handshake_rate();
+
+	if (!conf.cookie_threshold)
+		return false;
+
+	return ctx.handshake_rate > conf.cookie_threshold || ctx.handshake_rate_count > conf.cookie_threshold;
+}
+
+/** Replaces the cookie secret when it has expired, keeping the last one to validate older cookies */
+static void update_cookie_secret(void) {
+	if (!fastd_timed_out(ctx.cookie_secret_timeout))
+		return;
+
+	if (ctx.cookie_secret_timeout && ctx.now - ctx.cookie_secret_timeout < COOKIE_SECRET_LIFETIME)
+		memcpy(ctx.prev_cookie_secret, ctx.cookie_secret, sizeof(ctx.cookie_secret));
+	else
+		fastd_random_bytes(ctx.prev_cookie_secret, sizeof(ctx.prev_cookie_secret), false);
+
+	fastd_random_bytes(ctx.cookie_secret, sizeof(ctx.cookie_secret), false);
+	ctx.cookie_secret_timeout = ctx.now + COOKIE_SECRET_LIFETIME;
+}
+
+/** Appends a length-prefixed TLV record value to the cookie input */
+static inline uint8_t *add_cookie_record(uint8_t *ptr, const fastd_handshake_record_t *record) {
+	ptr[0] = record->length;
+	ptr[1] = record->length >> 8;
+
+	if (record->length)
+		memcpy(ptr + 2, record->data, record->length);
+
+	return ptr + 2 + record->length;
+}
+
+/** Calculates the cookie for a remote address and the sender keys of an initial handshake */
+static void make_cookie(
+	uint8_t cookie[COOKIE_BYTES], const uint32_t secret[FASTD_HMACSHA256_KEY_WORDS],
+	const fastd_peer_address_t *remote_addr, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *sender_key = &handshake->records[RECORD_SENDER_KEY];
+	const fastd_handshake_record_t *sender_handshake_key = &handshake->records[RECORD_SENDER_HANDSHAKE_KEY];
+
+	/* address family, port, address and the two length-prefixed sender key records */
+	size_t len = 2 + 2 + 16 + 2 + sender_key->length + 2 + sender_handshake_key->length;
+	uint32_t data[block_count(len, sizeof(uint32_t))];
+	uint8_t *ptr = (uint8_t *)data;
+
+	memset(data, 0, sizeof(data));
+
+	ptr[0] = remote_addr->sa.sa_family;
+	ptr[1] = remote_addr->sa.sa_family >> 8;
+
+	switch (remote_addr->sa.sa_family) {
+	case AF_INET:
+		memcpy(ptr + 2, &remote_addr->in.sin_port, 2);
+		memcpy(ptr + 4, &remote_addr->in.sin_addr, 4);
+		break;
+
+	case AF_INET6:
+		memcpy(ptr + 2, &remote_addr->in6.sin6_port, 2);
+		memcpy(ptr + 4, &remote_addr->in6.sin6_addr, 16);
+		break;
+	}
+
+	ptr = add_cookie_record(ptr + 20, sender_key);
+	add_cookie_record(ptr, sender_handshake_key);
+
+	fastd_sha256_t hash;
+	fastd_hmacsha256(&hash, secret, data, len);
+	memcpy(cookie, hash.b, COOKIE_BYTES);
+}
+
+/** Checks if an initial handshake carries a valid cookie for the address it was received from */
+bool fastd_handshake_check_cookie(const fastd_peer_address_t *remote_addr, const fastd_handshake_t *handshake) {
+	if (handshake->records[RECORD_COOKIE].length != COOKIE_BYTES)
+		return false;
+
+	update_cookie_secret();
+
+	uint8_t cookie[COOKIE_BYTES];
+
+	make_cookie(cookie, ctx.cookie_secret, remote_addr, handshake);
+	if (secure_memequal(cookie, handshake->records[RECORD_COOKIE].data, COOKIE_BYTES))
+		return true;
+
+	make_cookie(cookie, ctx.prev_cookie_secret, remote_addr, handshake);
+	return secure_memequal(cookie, handshake->records[RECORD_COOKIE].data, COOKIE_BYTES);
+}
+
+/** Returns the space needed for the TLV records of a cookie reply with \e tail_space bytes of additional records */
+static inline size_t cookie_space(size_t tail_space) {
+	return 2 * RECORD_LEN(1) + RECORD_LEN(COOKIE_BYTES) /* handshake type, reply code, cookie */ + tail_space;
+}
+
+/**
+   Checks if an initial handshake may be answered with a cookie reply
+
+   A cookie reply must not be larger than the handshake it answers, or it could be used for amplification towards
+   spoofed source addresses. The initial handshakes sent by fastd are always large enough; shorter ones are ignored.
+*/
+bool fastd_handshake_cookie_allowed(const fastd_handshake_t *handshake, size_t tail_space) {
+	return cookie_space(tail_space) <= handshake->tlv_len;
+}
+
+/**
+   Allocates and initializes a cookie reply to an initial handshake
+
+   fastd_handshake_cookie_allowed() must be checked first with the same \e tail_space.
+*/
+fastd_buffer_t fastd_handshake_new_cookie(
+	const fastd_peer_address_t *remote_addr, const fastd_handshake_t *handshake, size_t tail_space) {
+	update_cookie_secret();
+
+	fastd_buffer_t buffer = fastd_buffer_alloc(sizeof(fastd_handshake_packet_t), 0, cookie_space(tail_space));
+	fastd_handshake_packet_t *packet = buffer.data;
+
+	packet->packet_type = PACKET_HANDSHAKE;
+	packet->rsv = 0;
+	packet->tlv_len = 0;
+
+	fastd_handshake_add_uint8(&buffer, RECORD_HANDSHAKE_TYPE, handshake->type + 1);
+	fastd_handshake_add_uint8(&buffer, RECORD_REPLY_CODE, REPLY_COOKIE);
+
+	uint8_t *cookie = fastd_handshake_extend(&buffer, RECORD_COOKIE, COOKIE_BYTES);
+	make_cookie(cookie, ctx.cookie_secret, remote_addr, handshake);
+
+	ctx.cookie_replies++;
+
+	return buffer;
+}
+
 /** Prints the error corresponding to the given reply code and error detail */
 static void print_error(
 	const char *prefix, const fastd_peer_t *peer, const fastd_peer_address_t *remote_addr, uint8_t reply_code,
@@ -268,6 +418,9 @@ static void print_error(
 	default:
 		pr_warn("Handshake with %I failed: %s error: unknown code %i", remote_addr, prefix, reply_code);
 	}
+
+	if (reply_code != REPLY_SUCCESS)
+		fastd_status_event_handshake_failed(peer, remote_addr, prefix, reply_code, error_field_str);
 }
 
 /** Sends an error reply to a peer */
@@ -372,7 +525,18 @@ static inline bool check_records(
 			return false;
 		}
 
-		if (as_uint8(&handshake->records[RECORD_REPLY_CODE]) != REPLY_SUCCESS) {
+		switch (as_uint8(&handshake->records[RECORD_REPLY_CODE])) {
+		case REPLY_SUCCESS:
+			break;
+
+		case REPLY_COOKIE:
+			if (handshake->type == 2 && handshake->records[RECORD_COOKIE].length == COOKIE_BYTES)
+				break;
+
+			pr_debug("received invalid cookie reply from %I", remote_addr);
+			return false;
+
+		default:
 			print_error_reply(peer, remote_addr, handshake);
 			return false;
 		}
@@ -469,10 +633,17 @@ void fastd_handshake_handle(
 
 	handshake.type = as_uint8(&handshake.records[RECORD_HANDSHAKE_TYPE]);
 
+	if (handshake.type == 1) {
+		update_handshake_rate();
+		ctx.handshake_rate_count++;
+	}
+
 	if (!check_records(sock, local_addr, remote_addr, peer, &handshake))
 		goto end_free;
 
 	if (handshake.type > 1) {
+		handshake.reply_code = as_uint8(&handshake.records[RECORD_REPLY_CODE]);
+
 		if (handshake.records[RECORD_VERSION_NAME].data)
 			handshake.peer_version = peer_version = fastd_strndup(
 				(const char *)handshake.records[RECORD_VERSION_NAME].data,
@@ -24,6 +24,9 @@
  */
 #define MAX_HANDSHAKE_SIZE 1232
 
+/** The length of a handshake cookie */
+#define COOKIE_BYTES 16
+
 
 /**
    The type field of a handshake TLV record
@@ -47,6 +50,7 @@ typedef enum fastd_handshake_record_type {
 	RECORD_VERSION_NAME,            /**< The fastd version */
 	RECORD_METHOD_LIST,             /**< Zero-separated list of supported methods */
 	RECORD_TLV_MAC,                 /**< Message authentication code of the TLV records */
+	RECORD_COOKIE,                  /**< Cookie binding an initial handshake to the sender address */
 	RECORD_MAX,                     /**< (Number of defined record types) */
 } fastd_handshake_record_type_t;
 
@@ -55,6 +59,7 @@ typedef enum fastd_reply_code {
 	REPLY_SUCCESS = 0,        /**< The handshake was sucessfull */
 	REPLY_MANDATORY_MISSING,  /**< A required TLV field is missing */
 	REPLY_UNACCEPTABLE_VALUE, /**< A TLV field has an invalid value */
+	REPLY_COOKIE,             /**< The handshake must be repeated with the enclosed cookie */
 	REPLY_MAX,                /**< (Number of defined reply codes */
 } fastd_reply_code_t;
 
@@ -80,6 +85,7 @@ typedef struct fastd_handshake_record {
 /** Describes a handshake packet */
 struct fastd_handshake {
 	uint8_t type;                                 /**< The handshake type */
+	uint8_t reply_code;                           /**< The reply code (for handshake types > 1) */
 	const char *peer_version;                     /**< The fastd version of the peer */
 	fastd_handshake_record_t records[RECORD_MAX]; /**< The TLV records of the handshake */
 	uint16_t tlv_len;                             /**< The length of the TLV record data */
@@ -91,6 +97,12 @@ fastd_buffer_t fastd_handshake_new_init(size_t tail_space);
 fastd_buffer_t fastd_handshake_new_reply(
 	uint8_t type, uint16_t mtu, const fastd_method_info_t *method, const fastd_string_stack_t *methods,
 	size_t tail_space);
+bool fastd_handshake_cookie_allowed(const fastd_handshake_t *handshake, size_t tail_space);
+fastd_buffer_t fastd_handshake_new_cookie(
+	const fastd_peer_address_t *remote_addr, const fastd_handshake_t *handshake, size_t tail_space);
+
+bool fastd_handshake_cookie_mode(void);
+bool fastd_handshake_check_cookie(const fastd_peer_address_t *remote_addr, const fastd_handshake_t *handshake);
 
 void fastd_handshake_send_error(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
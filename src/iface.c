@@ -16,8 +16,11 @@
 
 #include "config.h"
 #include "fastd.h"
+#include "latency.h"
 #include "peer.h"
 #include "polling.h"
+#include "trace.h"
+#include "uring.h"
 
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -406,22 +409,34 @@ void fastd_iface_handle(fastd_iface_t *iface) {
 	else
 		buffer = fastd_buffer_alloc(max_len, conf.encrypt_headroom, 0);
 
+	int64_t start = fastd_latency_start();
 	ssize_t len = read(iface->fd.fd, buffer.data, max_len);
 	if (len < 0)
 		exit_errno("read");
 
 	buffer.len = len;
 
+	fastd_latency_record(LATENCY_TX_IFACE, start);
+	fastd_latency_begin_path(LATENCY_TX_TOTAL, start);
+
 	if (multiaf_tun && get_iface_type() == IFACE_TYPE_TUN)
 		fastd_buffer_pull(&buffer, 4);
 
 	fastd_send_data(buffer, NULL, iface->peer);
+	fastd_latency_end_path(LATENCY_TX_TOTAL);
 }
 
-/** Writes a packet to the TUN/TAP device */
-void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t buffer) {
+/**
+   Writes a packet to the TUN/TAP device
+
+   The buffer is freed unless \e keep is set; in this case, the packet is always written synchronously, so the caller
+   can continue to use the buffer afterwards.
+*/
+void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t buffer, bool keep) {
 	if (!buffer.len) {
 		pr_debug("fastd_iface_write: truncated packet");
+		if (!keep)
+			fastd_buffer_free(buffer);
 		return;
 	}
 
@@ -440,6 +455,8 @@ void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t buffer) {
 
 		default:
 			pr_debug("fastd_iface_write: unknown IP version %u", version);
+			if (!keep)
+				fastd_buffer_free(buffer);
 			return;
 		}
 
@@ -447,8 +464,19 @@ void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t buffer) {
 		memcpy(buffer.data, &af, 4);
 	}
 
-	if (write(iface->fd.fd, buffer.data, buffer.len) < 0)
-		pr_debug2_errno("write");
+	int64_t start = fastd_latency_start();
+
+	if (keep || !fastd_uring_write(iface->fd.fd, buffer)) {
+		if (write(iface->fd.fd, buffer.data, buffer.len) < 0)
+			pr_debug2_errno("write");
+
+		fastd_trace(iface_write, iface->fd.fd, buffer.len);
+
+		if (!keep)
+			fastd_buffer_free(buffer);
+	}
+
+	fastd_latency_record(LATENCY_RX_IFACE, start);
 }
 
 /** Opens a new TUN/TAP interface, optionally associated with a specific peer */
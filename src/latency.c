@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Latency histograms of the packet path and the main loop
+
+   When enabled, the duration of the individual stages of the receive and transmit paths is recorded in histograms
+   with logarithmic buckets, which allow to derive quantiles with a bounded relative error at the cost of a constant
+   amount of memory. The histograms are exposed through the status and metrics sockets.
+*/
+
+
+#include "latency.h"
+
+
+/** The names of the measured stages */
+static const char *const stage_names[LATENCY_MAX] = {
+	[LATENCY_RX_RECV] = "rx_recv",
+	[LATENCY_RX_DECRYPT] = "rx_decrypt",
+	[LATENCY_RX_IFACE] = "rx_iface",
+	[LATENCY_RX_TOTAL] = "rx_total",
+	[LATENCY_TX_IFACE] = "tx_iface",
+	[LATENCY_TX_ENCRYPT] = "tx_encrypt",
+	[LATENCY_TX_SEND] = "tx_send",
+	[LATENCY_TX_TOTAL] = "tx_total",
+	[LATENCY_POLL] = "poll",
+};
+
+
+/** Returns the name of a measured stage */
+const char *fastd_latency_stage_name(fastd_latency_stage_t stage) {
+	return stage_names[stage];
+}
+
+/** Returns the smallest value counted in a histogram bucket */
+static uint64_t bucket_lower_bound(size_t bucket) {
+	size_t row = bucket / HISTOGRAM_SUB_BUCKETS, sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+	if (!row)
+		return sub;
+
+	return (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << (row - 1);
+}
+
+/**
+   Returns the \e q quantile (0 <= q <= 1) of the values recorded in a histogram
+
+   The result is the lower bound of the bucket containing the quantile, limited to the largest recorded value.
+*/
+uint64_t fastd_histogram_quantile(const fastd_histogram_t *histogram, double q) {
+	if (!histogram->count)
+		return 0;
+
+	uint64_t rank = q * histogram->count;
+	if (rank >= histogram->count)
+		rank = histogram->count - 1;
+
+	uint64_t seen = 0;
+	size_t i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	uint64_t value = bucket_lower_bound(i);
+	return (value < histogram->max) ? value : histogram->max;
+}
+
+/**
+   Returns the number of recorded values smaller than \e value
+
+   \e value is rounded down to the lower bound of its bucket, so the result is exact for powers of two.
+*/
+uint64_t fastd_histogram_count_below(const fastd_histogram_t *histogram, uint64_t value) {
+	size_t bucket = fastd_histogram_bucket(value), i;
+	uint64_t count = 0;
+
+	for (i = 0; i < bucket; i++)
+		count += histogram->buckets[i];
+
+	return count;
+}
+
+
+#ifdef WITH_STATISTICS
+
+/** Allocates the latency histograms if latency statistics are enabled */
+void fastd_latency_init(void) {
+	if (!conf.latency_stats)
+		return;
+
+	fastd_latency_t *latency = fastd_new0(fastd_latency_t);
+
+	while (conf.methods[latency->n_methods].name)
+		latency->n_methods++;
+
+	latency->method_stages = fastd_new0_array(2 * latency->n_methods, fastd_histogram_t);
+
+	ctx.latency = latency;
+}
+
+/** Frees the latency histograms */
+void fastd_latency_free(void) {
+	if (!ctx.latency)
+		return;
+
+	free(ctx.latency->method_stages);
+	free(ctx.latency);
+	ctx.latency = NULL;
+}
+
+#endif
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Latency histograms of the packet path and the main loop
+*/
+
+
+#pragma once
+
+#include "fastd.h"
+#include "method.h"
+
+
+/** The number of bits below the most significant one that select a histogram bucket */
+#define HISTOGRAM_SUB_BITS 3
+
+/** The number of buckets per power of two */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/** Values of 2^HISTOGRAM_MAX_EXP and larger are counted in the last bucket */
+#define HISTOGRAM_MAX_EXP 36
+
+/** The number of buckets of a histogram */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+
+/** The measured stages of the packet path */
+typedef enum fastd_latency_stage {
+	LATENCY_RX_RECV = 0, /**< Receiving a packet from a socket */
+	LATENCY_RX_DECRYPT,  /**< Decrypting a received payload packet */
+	LATENCY_RX_IFACE,    /**< Writing a received packet to the TUN/TAP interface */
+	LATENCY_RX_TOTAL,    /**< The whole receive path, from the socket to the TUN/TAP interface */
+	LATENCY_TX_IFACE,    /**< Reading a packet from the TUN/TAP interface */
+	LATENCY_TX_ENCRYPT,  /**< Encrypting a payload packet */
+	LATENCY_TX_SEND,     /**< Sending a packet on a socket */
+	LATENCY_TX_TOTAL,    /**< The whole transmit path, from the TUN/TAP interface to the socket(s) */
+	LATENCY_POLL,        /**< Handling all events of a single wakeup of the main loop */
+	LATENCY_MAX,         /**< (Number of stages) */
+} fastd_latency_stage_t;
+
+/**
+   A histogram with logarithmic buckets
+
+   Each power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so the relative error of a value derived
+   from the histogram is at most 1/HISTOGRAM_SUB_BUCKETS; values smaller than 2*HISTOGRAM_SUB_BUCKETS are counted
+   exactly.
+*/
+typedef struct fastd_histogram {
+	uint64_t count;                      /**< The number of recorded values */
+	uint64_t sum;                        /**< The sum of all recorded values */
+	uint64_t max;                        /**< The largest recorded value */
+	uint64_t buckets[HISTOGRAM_BUCKETS]; /**< The number of recorded values per bucket */
+} fastd_histogram_t;
+
+/** The latency statistics */
+struct fastd_latency {
+	fastd_histogram_t stages[LATENCY_MAX]; /**< The durations of the stages (in nanoseconds) */
+	fastd_histogram_t poll_events;         /**< The number of events handled per wakeup of the main loop */
+
+	size_t n_methods;                 /**< The number of configured methods */
+	fastd_histogram_t *method_stages; /**< The decryption and encryption durations of each method (in nanoseconds;
+					     two histograms per method, decryption first) */
+
+	int64_t rx_start; /**< The start of the receive path of the current packet */
+	int64_t tx_start; /**< The start of the transmit path of the current packet */
+};
+
+
+/** Returns the index of the bucket counting a value */
+static inline size_t fastd_histogram_bucket(uint64_t value) {
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	size_t exp = 63 - __builtin_clzll(value);
+	if (exp >= HISTOGRAM_MAX_EXP)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return (exp - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS + (value >> (exp - HISTOGRAM_SUB_BITS));
+}
+
+/** Records a value in a histogram */
+static inline void fastd_histogram_add(fastd_histogram_t *histogram, uint64_t value) {
+	histogram->count++;
+	histogram->sum += value;
+
+	if (value > histogram->max)
+		histogram->max = value;
+
+	histogram->buckets[fastd_histogram_bucket(value)]++;
+}
+
+const char *fastd_latency_stage_name(fastd_latency_stage_t stage);
+uint64_t fastd_histogram_quantile(const fastd_histogram_t *histogram, double q);
+uint64_t fastd_histogram_count_below(const fastd_histogram_t *histogram, uint64_t value);
+
+
+#ifdef WITH_STATISTICS
+
+void fastd_latency_init(void);
+void fastd_latency_free(void);
+
+/** Returns the time a measured stage starts, or 0 if latency statistics are disabled */
+static inline int64_t fastd_latency_start(void) {
+	if (!ctx.latency)
+		return 0;
+
+	return fastd_get_time_ns();
+}
+
+/** Records the duration of a stage that started at \e start */
+static inline void fastd_latency_record(fastd_latency_stage_t stage, int64_t start) {
+	if (!start)
+		return;
+
+	fastd_histogram_add(&ctx.latency->stages[stage], fastd_get_time_ns() - start);
+}
+
+/** Records the duration of an encryption or decryption that started at \e start, globally and for the method */
+static inline void fastd_latency_record_method(
+	fastd_latency_stage_t stage, const fastd_method_info_t *method, int64_t start) {
+	if (!start)
+		return;
+
+	uint64_t duration = fastd_get_time_ns() - start;
+	size_t index = 2 * (method - conf.methods) + (stage == LATENCY_TX_ENCRYPT);
+
+	fastd_histogram_add(&ctx.latency->stages[stage], duration);
+	fastd_histogram_add(&ctx.latency->method_stages[index], duration);
+}
+
+/** Records the handling time and the number of events of a wakeup of the main loop */
+static inline void fastd_latency_record_poll(int64_t start, size_t events) {
+	if (!start)
+		return;
+
+	fastd_latency_record(LATENCY_POLL, start);
+	fastd_histogram_add(&ctx.latency->poll_events, events);
+}
+
+/** Marks the start of the receive or transmit path of a packet */
+static inline void fastd_latency_begin_path(fastd_latency_stage_t total, int64_t start) {
+	if (!start)
+		return;
+
+	if (total == LATENCY_RX_TOTAL)
+		ctx.latency->rx_start = start;
+	else
+		ctx.latency->tx_start = start;
+}
+
+/** Records the duration of the receive or transmit path of the current packet */
+static inline void fastd_latency_end_path(fastd_latency_stage_t total) {
+	if (!ctx.latency)
+		return;
+
+	fastd_latency_record(total, (total == LATENCY_RX_TOTAL) ? ctx.latency->rx_start : ctx.latency->tx_start);
+}
+
+#else
+
+static inline void fastd_latency_init(void) {}
+static inline void fastd_latency_free(void) {}
+
+static inline int64_t fastd_latency_start(void) {
+	return 0;
+}
+
+static inline void fastd_latency_record(UNUSED fastd_latency_stage_t stage, UNUSED int64_t start) {}
+static inline void fastd_latency_record_method(
+	UNUSED fastd_latency_stage_t stage, UNUSED const fastd_method_info_t *method, UNUSED int64_t start) {}
+static inline void fastd_latency_record_poll(UNUSED int64_t start, UNUSED size_t events) {}
+static inline void fastd_latency_begin_path(UNUSED fastd_latency_stage_t total, UNUSED int64_t start) {}
+static inline void fastd_latency_end_path(UNUSED fastd_latency_stage_t total) {}
+
+#endif
@@ -48,12 +48,16 @@ static const keyword_t keywords[] = {
 	{ "async", TOK_ASYNC },
 	{ "auto", TOK_AUTO },
 	{ "bind", TOK_BIND },
+	{ "cache", TOK_CACHE },
 	{ "capabilities", TOK_CAPABILITIES },
 	{ "cipher", TOK_CIPHER },
 	{ "connect", TOK_CONNECT },
+	{ "cookie", TOK_COOKIE },
+	{ "cpu", TOK_CPU },
 	{ "debug", TOK_DEBUG },
 	{ "debug2", TOK_DEBUG2 },
 	{ "default", TOK_DEFAULT },
+	{ "dirs", TOK_DIRS },
 	{ "disestablish", TOK_DISESTABLISH },
 	{ "down", TOK_DOWN },
 	{ "drop", TOK_DROP },
@@ -61,29 +65,36 @@ static const keyword_t keywords[] = {
 	{ "error", TOK_ERROR },
 	{ "establish", TOK_ESTABLISH },
 	{ "fatal", TOK_FATAL },
+	{ "file", TOK_FILE },
 	{ "float", TOK_FLOAT },
 	{ "force", TOK_FORCE },
 	{ "forward", TOK_FORWARD },
 	{ "from", TOK_FROM },
 	{ "group", TOK_GROUP },
+	{ "handshake", TOK_HANDSHAKE },
 	{ "handshakes", TOK_HANDSHAKES },
+	{ "helper", TOK_HELPER },
 	{ "hide", TOK_HIDE },
 	{ "include", TOK_INCLUDE },
 	{ "info", TOK_INFO },
 	{ "interface", TOK_INTERFACE },
+	{ "io-uring", TOK_IO_URING },
 	{ "ip", TOK_IP },
 	{ "ipv4", TOK_IPV4 },
 	{ "ipv6", TOK_IPV6 },
 	{ "key", TOK_KEY },
+	{ "latency", TOK_LATENCY },
 	{ "level", TOK_LEVEL },
 	{ "limit", TOK_LIMIT },
 	{ "log", TOK_LOG },
 	{ "mac", TOK_MAC },
 	{ "mark", TOK_MARK },
 	{ "method", TOK_METHOD },
+	{ "metrics", TOK_METRICS },
 	{ "mode", TOK_MODE },
 	{ "mtu", TOK_MTU },
 	{ "multitap", TOK_MULTITAP },
+	{ "negative", TOK_NEGATIVE },
 	{ "no", TOK_NO },
 	{ "on", TOK_ON },
 	{ "packet", TOK_PACKET },
@@ -95,16 +106,23 @@ static const keyword_t keywords[] = {
 	{ "post-down", TOK_POST_DOWN },
 	{ "pre-up", TOK_PRE_UP },
 	{ "protocol", TOK_PROTOCOL },
+	{ "rate", TOK_RATE },
 	{ "remote", TOK_REMOTE },
+	{ "replay", TOK_REPLAY },
 	{ "secret", TOK_SECRET },
 	{ "secure", TOK_SECURE },
+	{ "size", TOK_SIZE },
 	{ "socket", TOK_SOCKET },
+	{ "stats", TOK_STATS },
 	{ "status", TOK_STATUS },
 	{ "stderr", TOK_STDERR },
 	{ "sync", TOK_SYNC },
 	{ "syslog", TOK_SYSLOG },
 	{ "tap", TOK_TAP },
+	{ "threads", TOK_THREADS },
+	{ "threshold", TOK_THRESHOLD },
 	{ "to", TOK_TO },
+	{ "ttl", TOK_TTL },
 	{ "tun", TOK_TUN },
 	{ "up", TOK_UP },
 	{ "use", TOK_USE },
@@ -112,6 +130,10 @@ static const keyword_t keywords[] = {
 	{ "verbose", TOK_VERBOSE },
 	{ "verify", TOK_VERIFY },
 	{ "warn", TOK_WARN },
+	{ "watch", TOK_WATCH },
+	{ "window", TOK_WINDOW },
+	{ "worker", TOK_WORKER },
+	{ "xdp", TOK_XDP },
 	{ "yes", TOK_YES },
 };
 
@@ -8,14 +8,20 @@
    \file
 
    Logging function implementations
+
+   Log messages can be written from a separate thread, so slow log destinations (like a blocked syslog daemon) don't
+   stall the main loop. Messages are formatted before they are queued, as their arguments (e.g. peers) may be
+   freed before the message is written.
 */
 
 
 #include "fastd.h"
 #include "peer.h"
+#include "sem.h"
 
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <sched.h>
 #include <syslog.h>
 
 
@@ -245,36 +251,292 @@ static inline int get_syslog_level(fastd_loglevel_t log_level) {
 	}
 }
 
-/** printf-like function handling different conversion specifiers and using the configured log destinations */
-void fastd_logf(fastd_loglevel_t level, const char *format, ...) {
-	bool log_stderr = !ctx.log_initialized || level <= conf.log_stderr_level;
-	bool log_syslog = ctx.log_initialized && level <= conf.log_syslog_level;
-	va_list ap;
-	char buffer[1024];
-
-	if (!log_stderr && !log_syslog)
-		return;
-
-	va_start(ap, format);
-	fastd_vsnprintf(buffer, sizeof(buffer), format, ap);
-	va_end(ap);
-
-	buffer[sizeof(buffer) - 1] = 0;
-
+/** Writes a formatted message to the selected log destinations */
+static void write_message(fastd_loglevel_t level, bool log_stderr, bool log_syslog, time_t t, const char *message) {
 	if (log_stderr) {
 		char timestr[100] = "";
-		time_t t;
 		struct tm tm;
 
-		t = time(NULL);
 		if (localtime_r(&t, &tm) != NULL) {
 			if (strftime(timestr, sizeof(timestr), "%F %T %z --- ", &tm) <= 0)
 				timestr[0] = 0;
 		}
 
-		fprintf(stderr, "%s%s%s\n", timestr, get_log_prefix(level), buffer);
+		fprintf(stderr, "%s%s%s\n", timestr, get_log_prefix(level), message);
 	}
 
 	if (log_syslog)
-		syslog(get_syslog_level(level), "%s", buffer);
+		syslog(get_syslog_level(level), "%s", message);
+}
+
+/** Formats a log message, noting the number of preceding messages suppressed by the rate limit */
+static void format_message(char *buffer, size_t size, unsigned suppressed, const char *format, va_list ap) {
+	fastd_vsnprintf(buffer, size, format, ap);
+	buffer[size - 1] = 0;
+
+	if (suppressed) {
+		size_t len = strlen(buffer);
+		snprintf_safe(buffer + len, size - len, " (%u similar messages suppressed)", suppressed);
+	}
+}
+
+/**
+   Applies the configured rate limit to a logging call site
+
+   Returns false if the message must be suppressed. Otherwise, \e suppressed is set to the number of messages of the
+   call site that have been suppressed since the last logged one.
+*/
+static bool site_allow(fastd_log_site_t *site, unsigned *suppressed) {
+	*suppressed = 0;
+
+	if (!conf.log_rate_limit)
+		return true;
+
+	/* Call sites may be shared by the main loop and other threads; concurrent resets only make the limit inexact */
+	uint64_t second = ctx.now / 1000;
+	if (__atomic_load_n(&site->second, __ATOMIC_RELAXED) != second) {
+		__atomic_store_n(&site->second, second, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < conf.log_rate_limit) {
+		*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx.log_suppressed, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+
+/** The number of records in the queue of the asynchronous logging thread (must be a power of two) */
+#define LOG_RING_SIZE 512
+
+/** The maximum length of a log message */
+#define LOG_MESSAGE_SIZE 1024
+
+/** A log message queued for the asynchronous logging thread */
+typedef struct log_record {
+	size_t seq; /**< The position the record can be claimed at (plus 1 when it is ready to be written) */
+
+	fastd_loglevel_t level;         /**< The log level of the message */
+	bool log_stderr;                /**< Write the message to stderr */
+	bool log_syslog;                /**< Write the message to syslog */
+	time_t time;                    /**< The time the message has been logged at */
+	char message[LOG_MESSAGE_SIZE]; /**< The formatted message */
+} log_record_t;
+
+/**
+   The queue of the asynchronous logging thread
+
+   The queue is a bounded lock-free ring buffer for multiple producers and a single consumer: producers claim a
+   record by advancing \e enqueue_pos, format the message into it and mark it as ready by updating its sequence
+   number. When the queue is full, messages are dropped instead of blocking the caller.
+*/
+struct fastd_log_ring {
+	size_t enqueue_pos; /**< The position of the next record to claim (advanced by the producers) */
+	size_t dequeue_pos; /**< The position of the next record to write (only used by the logging thread) */
+	size_t written;     /**< The number of records that have been written by the logging thread */
+
+	uint64_t dropped_reported; /**< The number of dropped messages that have already been reported */
+	bool stop;                 /**< Tells the logging thread to exit when the queue is empty */
+
+	fastd_sem_t ready; /**< Counts the records that have been queued, but not written yet */
+	pthread_t thread;  /**< The logging thread */
+
+	log_record_t records[LOG_RING_SIZE]; /**< The records of the queue */
+};
+
+
+/** Claims a record of the logging queue, returning NULL when the queue is full */
+static log_record_t *ring_claim(fastd_log_ring_t *ring, size_t *pos) {
+	size_t p = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+	while (true) {
+		log_record_t *record = &ring->records[p % LOG_RING_SIZE];
+		ssize_t diff = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - p;
+
+		if (diff < 0)
+			return NULL;
+
+		if (diff > 0) {
+			p = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(
+			    &ring->enqueue_pos, &p, p + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			*pos = p;
+			return record;
+		}
+	}
+}
+
+/** Hands a claimed record to the logging thread */
+static void ring_publish(fastd_log_ring_t *ring, log_record_t *record, size_t pos) {
+	__atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+	fastd_sem_post(&ring->ready);
+}
+
+/** Waits until all messages queued so far have been written */
+static void ring_flush(fastd_log_ring_t *ring) {
+	size_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_ACQUIRE);
+
+	while (__atomic_load_n(&ring->written, __ATOMIC_ACQUIRE) < pos)
+		sched_yield();
+}
+
+/** Reports messages that have been dropped since the last report */
+static void report_dropped(fastd_log_ring_t *ring, bool log_stderr, bool log_syslog) {
+	uint64_t dropped = __atomic_load_n(&ctx.log_dropped, __ATOMIC_RELAXED);
+	if (dropped == ring->dropped_reported)
+		return;
+
+	char message[64];
+	snprintf_safe(
+		message, sizeof(message), "%llu log messages dropped",
+		(unsigned long long)(dropped - ring->dropped_reported));
+	write_message(LL_WARN, log_stderr, log_syslog, time(NULL), message);
+
+	ring->dropped_reported = dropped;
+}
+
+/** The logging thread: writes the queued messages to the log destinations */
+static void *log_thread(void *p) {
+	fastd_log_ring_t *ring = p;
+
+	while (true) {
+		fastd_sem_wait(&ring->ready);
+
+		log_record_t *record = &ring->records[ring->dequeue_pos % LOG_RING_SIZE];
+
+		/* With multiple producers, a later record may become ready before this one is */
+		while (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != ring->dequeue_pos + 1) {
+			if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE))
+				return NULL;
+
+			sched_yield();
+		}
+
+		report_dropped(ring, record->log_stderr, record->log_syslog);
+		write_message(record->level, record->log_stderr, record->log_syslog, record->time, record->message);
+
+		__atomic_store_n(&record->seq, ring->dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		ring->dequeue_pos++;
+		__atomic_store_n(&ring->written, ring->dequeue_pos, __ATOMIC_RELEASE);
+	}
+}
+
+/** The logging thread doesn't exist in forked child processes, so they log synchronously */
+static void log_atfork_child(void) {
+	ctx.log_ring = NULL;
+}
+
+/** Starts the asynchronous logging thread if it is enabled */
+void fastd_log_async_start(void) {
+	static bool atfork_registered = false;
+
+	if (!conf.log_async)
+		return;
+
+	fastd_log_ring_t *ring = fastd_new0(fastd_log_ring_t);
+
+	size_t i;
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		ring->records[i].seq = i;
+
+	fastd_sem_init(&ring->ready, 0);
+
+	if ((errno = pthread_create(&ring->thread, NULL, log_thread, ring)) != 0)
+		exit_errno("unable to create logging thread");
+
+	if (!atfork_registered) {
+		if ((errno = pthread_atfork(NULL, NULL, log_atfork_child)) != 0)
+			exit_errno("pthread_atfork");
+
+		atfork_registered = true;
+	}
+
+	ctx.log_ring = ring;
+}
+
+/** Writes all queued messages and stops the asynchronous logging thread */
+void fastd_log_async_stop(void) {
+	fastd_log_ring_t *ring = ctx.log_ring;
+	if (!ring)
+		return;
+
+	ctx.log_ring = NULL;
+
+	__atomic_store_n(&ring->stop, true, __ATOMIC_RELEASE);
+	fastd_sem_post(&ring->ready);
+
+	if ((errno = pthread_join(ring->thread, NULL)) != 0)
+		pr_error_errno("unable to join logging thread");
+
+	report_dropped(ring, true, ctx.log_initialized && conf.log_syslog_level > LL_UNSPEC);
+
+	free(ring);
+}
+
+
+/** Logs a message to the configured log destinations */
+static void logv(fastd_log_site_t *site, fastd_loglevel_t level, const char *format, va_list ap) {
+	bool log_stderr = !ctx.log_initialized || level <= conf.log_stderr_level;
+	bool log_syslog = ctx.log_initialized && level <= conf.log_syslog_level;
+	unsigned suppressed = 0;
+
+	if (!log_stderr && !log_syslog)
+		return;
+
+	if (site && !site_allow(site, &suppressed))
+		return;
+
+	fastd_log_ring_t *ring = ctx.log_ring;
+
+	/* Errors are written synchronously (after the queued messages), so they aren't lost when fastd exits */
+	if (ring && level > LL_ERROR) {
+		size_t pos;
+		log_record_t *record = ring_claim(ring, &pos);
+		if (!record) {
+			__atomic_fetch_add(&ctx.log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		record->level = level;
+		record->log_stderr = log_stderr;
+		record->log_syslog = log_syslog;
+		record->time = time(NULL);
+		format_message(record->message, sizeof(record->message), suppressed, format, ap);
+
+		ring_publish(ring, record, pos);
+		return;
+	}
+
+	char buffer[LOG_MESSAGE_SIZE];
+	format_message(buffer, sizeof(buffer), suppressed, format, ap);
+
+	if (ring)
+		ring_flush(ring);
+
+	write_message(level, log_stderr, log_syslog, time(NULL), buffer);
+}
+
+/** printf-like function handling different conversion specifiers and using the configured log destinations */
+void fastd_logf(fastd_loglevel_t level, const char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	logv(NULL, level, format, ap);
+	va_end(ap);
+}
+
+/** Like fastd_logf(), applying the configured rate limit to the calling site */
+void fastd_logf_site(fastd_log_site_t *site, fastd_loglevel_t level, const char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	logv(site, level, format, ap);
+	va_end(ap);
 }
@@ -33,6 +33,13 @@ typedef enum fastd_loglevel {
 	LL_DEFAULT = LL_VERBOSE, /**< The default log level */
 } fastd_loglevel_t;
 
+/** The rate limiting state of a single logging call site */
+typedef struct fastd_log_site {
+	uint64_t second;     /**< The second the messages of the call site are currently counted in */
+	unsigned count;      /**< The number of messages of the call site in the current second */
+	unsigned suppressed; /**< The number of messages suppressed since the last logged message of the call site */
+} fastd_log_site_t;
+
 
 size_t fastd_snprint_peer_address(
 	char *buffer, size_t size, const fastd_peer_address_t *address, const char *iface, bool bind_address,
@@ -40,21 +47,32 @@ size_t fastd_snprint_peer_address(
 
 
 void fastd_logf(const fastd_loglevel_t level, const char *format, ...);
+void fastd_logf_site(fastd_log_site_t *site, const fastd_loglevel_t level, const char *format, ...);
+
+void fastd_log_async_start(void);
+void fastd_log_async_stop(void);
+
+/** Logs a formatted message, applying the configured rate limit to the calling site */
+#define fastd_logf_limited(level, args...)                \
+	do {                                              \
+		static fastd_log_site_t _log_site;        \
+		fastd_logf_site(&_log_site, level, args); \
+	} while (0)
 
 /** Logs a formatted fatal error message */
 #define pr_fatal(args...) fastd_logf(LL_FATAL, args)
 /** Logs a formatted error message */
-#define pr_error(args...) fastd_logf(LL_ERROR, args)
+#define pr_error(args...) fastd_logf_limited(LL_ERROR, args)
 /** Logs a formatted warning message */
-#define pr_warn(args...) fastd_logf(LL_WARN, args)
+#define pr_warn(args...) fastd_logf_limited(LL_WARN, args)
 /** Logs a formatted informational message */
-#define pr_info(args...) fastd_logf(LL_INFO, args)
+#define pr_info(args...) fastd_logf_limited(LL_INFO, args)
 /** Logs a formatted verbose message */
-#define pr_verbose(args...) fastd_logf(LL_VERBOSE, args)
+#define pr_verbose(args...) fastd_logf_limited(LL_VERBOSE, args)
 /** Logs a formatted debug message */
-#define pr_debug(args...) fastd_logf(LL_DEBUG, args)
+#define pr_debug(args...) fastd_logf_limited(LL_DEBUG, args)
 /** Logs a formatted debug2 message */
-#define pr_debug2(args...) fastd_logf(LL_DEBUG2, args)
+#define pr_debug2(args...) fastd_logf_limited(LL_DEBUG2, args)
 
 /** Logs a simple error message adding the error found in \e errno */
 #define pr_error_errno(message) pr_error("%s: %s", message, strerror(errno))
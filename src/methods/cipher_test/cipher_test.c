@@ -108,6 +108,7 @@ static void method_session_superseded(fastd_method_session_state_t *session) {
 static void method_session_free(fastd_method_session_state_t *session) {
 	if (session) {
 		session->cipher->free(session->cipher_state);
+		fastd_method_common_free(&session->common);
 		free(session);
 	}
 }
@@ -175,7 +176,7 @@ static bool method_decrypt(
 		    session->cipher_state, outblocks, inblocks, n_blocks * sizeof(fastd_block128_t), nonce))
 		goto fail;
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age, out->len);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -12,6 +12,31 @@
 
 
 #include "common.h"
+#include "../peer.h"
+
+
+/** Returns the sequence number of a nonce (i.e. the nonce without the initiator/responder bit) */
+static inline uint64_t nonce_seq(const uint8_t nonce[COMMON_NONCEBYTES]) {
+	uint64_t ret = 0;
+	size_t i;
+
+	for (i = 0; i < COMMON_NONCEBYTES; i++) {
+		ret <<= 8;
+		ret |= nonce[i];
+	}
+
+	return ret >> 1;
+}
+
+/** Returns the word of the reorder ring containing the bit for a given sequence number */
+static inline uint64_t *reorder_word(const fastd_method_common_t *session, uint64_t seq) {
+	return &session->receive_reorder_seen[(seq / 64) % session->reorder_words];
+}
+
+/** Returns the bit for a given sequence number in its word of the reorder ring */
+static inline uint64_t reorder_bit(uint64_t seq) {
+	return (uint64_t)1 << (seq % 64);
+}
 
 
 /** Common initialization for a new session */
@@ -27,9 +52,28 @@ void fastd_method_common_init(fastd_method_common_t *session, bool initiator) {
 		session->send_nonce[COMMON_NONCEBYTES - 1] = 2;
 		session->receive_nonce[COMMON_NONCEBYTES - 1] = 1;
 	}
+
+	/* The ring has an additional word, as the word containing the newest
+	   sequence number is only partially in use */
+	session->reorder_window = conf.replay_window;
+	session->reorder_words = block_count(conf.replay_window, 64) + 1;
+	session->receive_reorder_seen = fastd_new0_array(session->reorder_words, uint64_t);
+
+	uint64_t seq = nonce_seq(session->receive_nonce);
+	*reorder_word(session, seq) |= reorder_bit(seq);
+}
+
+/** Frees the common session state */
+void fastd_method_common_free(fastd_method_common_t *session) {
+	free(session->receive_reorder_seen);
 }
 
-/** Checks if a received nonce is valid */
+/**
+   Checks if a received nonce is valid
+
+   Nonces that are too old are not rejected here, but by fastd_method_reorder_check() after the packet has been
+   authenticated, so forged packets can't affect the drop statistics.
+*/
 bool fastd_method_is_nonce_valid(
 	const fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t *age) {
 	if ((nonce[0] & 1) != (session->receive_nonce[0] & 1))
@@ -45,14 +89,6 @@ bool fastd_method_is_nonce_valid(
 
 	*age >>= 1;
 
-	if (*age >= 0) {
-		if (fastd_timed_out(session->reorder_timeout))
-			return false;
-
-		if (*age > 64)
-			return false;
-	}
-
 	return true;
 }
 
@@ -64,27 +100,44 @@ bool fastd_method_is_nonce_valid(
    if it is reordered.
 */
 fastd_tristate_t fastd_method_reorder_check(
-	fastd_peer_t *peer, fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age) {
+	fastd_peer_t *peer, fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age,
+	size_t len) {
+	uint64_t seq = nonce_seq(nonce);
+
 	if (age < 0) {
-		size_t shift = -age;
+		uint64_t word = nonce_seq(session->receive_nonce) / 64;
+		uint64_t shift = seq / 64 - word;
+		size_t i;
+
+		if (shift > session->reorder_words)
+			shift = session->reorder_words;
 
-		if (shift >= 64)
-			session->receive_reorder_seen = 0;
-		else
-			session->receive_reorder_seen <<= shift;
+		for (i = 1; i <= shift; i++)
+			session->receive_reorder_seen[(word + i) % session->reorder_words] = 0;
 
-		if (shift <= 64)
-			session->receive_reorder_seen |= ((uint64_t)1 << (shift - 1));
+		*reorder_word(session, seq) |= reorder_bit(seq);
 
 		memcpy(session->receive_nonce, nonce, COMMON_NONCEBYTES);
 		session->reorder_timeout = ctx.now + REORDER_TIME;
 		return FASTD_TRISTATE_FALSE;
-	} else if (age == 0 || session->receive_reorder_seen & ((uint64_t)1 << (age - 1))) {
+	}
+
+	if ((uint64_t)age > session->reorder_window || fastd_timed_out(session->reorder_timeout)) {
+		pr_debug("dropping too old packet from %P (age %u)", peer, (unsigned)age);
+		fastd_stats_add(peer, STAT_RX_TOO_OLD, len);
+		return FASTD_TRISTATE_UNDEF;
+	}
+
+	uint64_t *word = reorder_word(session, seq);
+	uint64_t bit = reorder_bit(seq);
+
+	if (*word & bit) {
 		pr_debug("dropping duplicate packet from %P (age %u)", peer, (unsigned)age);
+		fastd_stats_add(peer, STAT_RX_DUPLICATE, len);
 		return FASTD_TRISTATE_UNDEF;
-	} else {
-		pr_debug2("accepting reordered packet from %P (age %u)", peer, (unsigned)age);
-		session->receive_reorder_seen |= ((uint64_t)1 << (age - 1));
-		return FASTD_TRISTATE_TRUE;
 	}
+
+	pr_debug2("accepting reordered packet from %P (age %u)", peer, (unsigned)age);
+	*word |= bit;
+	return FASTD_TRISTATE_TRUE;
 }
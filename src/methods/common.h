@@ -36,16 +36,21 @@ typedef struct fastd_method_common {
 
 	fastd_timeout_t reorder_timeout; /**< How long to packets with a lower sequence number (nonce) than the newest
 					    received */
-	uint64_t receive_reorder_seen;   /**< Bitmap specifying which of the 64 sequence numbers (nonces) before \a
-					    receive_nonce have bit seen */
+
+	size_t reorder_window;          /**< The number of sequence numbers before \a receive_nonce that are accepted */
+	size_t reorder_words;           /**< The number of 64bit words in \a receive_reorder_seen */
+	uint64_t *receive_reorder_seen; /**< Ring of bitmaps specifying which sequence numbers (nonces) in the reorder
+					   window have been seen */
 } fastd_method_common_t;
 
 
 void fastd_method_common_init(fastd_method_common_t *session, bool initiator);
+void fastd_method_common_free(fastd_method_common_t *session);
 bool fastd_method_is_nonce_valid(
 	const fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t *age);
 fastd_tristate_t fastd_method_reorder_check(
-	fastd_peer_t *peer, fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age);
+	fastd_peer_t *peer, fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age,
+	size_t len);
 
 
 /**
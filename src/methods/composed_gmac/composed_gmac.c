@@ -135,6 +135,7 @@ method_session_init(const fastd_method_t *method, const uint8_t *secret, bool in
 		    session->gmac_cipher_state, &H, &ZERO_BLOCK, sizeof(fastd_block128_t), zeroiv)) {
 		session->cipher->free(session->cipher_state);
 		session->gmac_cipher->free(session->gmac_cipher_state);
+		fastd_method_common_free(&session->common);
 		free(session);
 
 		return NULL;
@@ -173,6 +174,7 @@ static void method_session_free(fastd_method_session_state_t *session) {
 		session->gmac_cipher->free(session->gmac_cipher_state);
 		session->ghash->free(session->ghash_state);
 
+		fastd_method_common_free(&session->common);
 		free(session);
 	}
 }
@@ -285,7 +287,7 @@ static bool method_decrypt(
 
 	fastd_buffer_pull(out, sizeof(fastd_block128_t));
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age, out->len);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -153,6 +153,7 @@ static void method_session_free(fastd_method_session_state_t *session) {
 		session->umac_cipher->free(session->umac_cipher_state);
 		session->uhash->free(session->uhash_state);
 
+		fastd_method_common_free(&session->common);
 		free(session);
 	}
 }
@@ -251,7 +252,7 @@ static bool method_decrypt(
 
 	fastd_buffer_pull(out, sizeof(fastd_block128_t));
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age, out->len);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -106,6 +106,7 @@ method_session_init(const fastd_method_t *method, const uint8_t *secret, bool in
 
 	if (!session->cipher->crypt(session->cipher_state, &H, &zeroblock, sizeof(fastd_block128_t), zeroiv)) {
 		session->cipher->free(session->cipher_state);
+		fastd_method_common_free(&session->common);
 		free(session);
 		return NULL;
 	}
@@ -142,6 +143,7 @@ static void method_session_free(fastd_method_session_state_t *session) {
 		session->cipher->free(session->cipher_state);
 		session->ghash->free(session->ghash_state);
 
+		fastd_method_common_free(&session->common);
 		free(session);
 	}
 }
@@ -244,7 +246,7 @@ static bool method_decrypt(
 
 	fastd_buffer_pull(out, sizeof(fastd_block128_t));
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age, out->len);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
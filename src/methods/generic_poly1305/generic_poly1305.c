@@ -122,6 +122,7 @@ static void method_session_superseded(fastd_method_session_state_t *session) {
 static void method_session_free(fastd_method_session_state_t *session) {
 	if (session) {
 		session->cipher->free(session->cipher_state);
+		fastd_method_common_free(&session->common);
 		free(session);
 	}
 }
@@ -213,7 +214,7 @@ static bool method_decrypt(
 
 	fastd_buffer_pull(out, KEYBYTES);
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(peer, &session->common, in_nonce, age, out->len);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -0,0 +1,718 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   OpenMetrics exporter
+
+   Clients connecting to the metrics socket get the current metrics in the OpenMetrics text format. Clients may
+   send an HTTP GET request, which is answered with an HTTP response, so the socket can be scraped through any
+   HTTP proxy supporting UNIX sockets; clients that don't send a request line within METRICS_REQUEST_TIMEOUT, or
+   send an empty line or close their side of the connection, get the plain metrics.
+
+   The metrics are never rendered as a whole: each connection has a buffer of METRICS_BUFFER_SIZE bytes which is
+   refilled from the main loop whenever the client has read its contents. The position in the output is kept as
+   the current metric family and the ID of the last peer written, so peers may come and go while a connection is
+   being served. When the client doesn't read, sending is retried every METRICS_RETRY; connections that haven't
+   been served completely after METRICS_TIMEOUT are closed.
+*/
+
+
+#include "metrics.h"
+
+
+#ifdef WITH_METRICS_SOCKET
+
+#include "handshake.h"
+#include "latency.h"
+#include "peer.h"
+#include "polling.h"
+#include "task.h"
+#include "version.h"
+#include "worker.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+
+
+/** A connection on the metrics socket */
+typedef struct metrics_conn {
+	fastd_poll_fd_t fd;      /**< The accepted socket, until the request has been received */
+	int out_fd;              /**< The socket the metrics are sent to, after the request has been received */
+	fastd_task_t task;       /**< Request timeout; after the request has been received, retries sending */
+	fastd_timeout_t timeout; /**< The time after which the connection is closed */
+
+	size_t family;    /**< The index of the metric family being written */
+	bool header_done; /**< Specifies if the TYPE and HELP lines of the current family have been written */
+	uint64_t peer_id; /**< The ID of the last peer written for the current family */
+	size_t sample;    /**< The number of label sets written for the current (non-peer) family */
+	bool done;        /**< Specifies if the whole output has been written to the buffer */
+
+	size_t buf_start;              /**< The number of bytes of \e buf that have already been sent */
+	size_t buf_len;                /**< The number of bytes in \e buf */
+	size_t buf_committed;          /**< The number of bytes in \e buf that contain complete samples */
+	char buf[METRICS_BUFFER_SIZE]; /**< The request, later the output waiting to be sent */
+} metrics_conn_t;
+
+/** A metric family */
+typedef struct metrics_family {
+	const char *name;                    /**< The name of the family */
+	const char *type;                    /**< The OpenMetrics type of the family */
+	const char *help;                    /**< The description of the family */
+	bool (*available)(void);             /**< Returns if the family is exported (NULL if it always is) */
+	bool (*write)(metrics_conn_t *conn); /**< Writes the samples; returns false if the buffer is full */
+} metrics_family_t;
+
+
+/** The names of the traffic stat types used as label values */
+static const char *const stat_names[STAT_MAX] = {
+	[STAT_RX] = "rx",
+	[STAT_RX_REORDERED] = "rx_reordered",
+	[STAT_RX_TOO_OLD] = "rx_too_old",
+	[STAT_RX_DUPLICATE] = "rx_duplicate",
+	[STAT_TX] = "tx",
+	[STAT_TX_DROPPED] = "tx_dropped",
+	[STAT_TX_ERROR] = "tx_error",
+};
+
+/** The names of the peer states used as label values */
+static const char *const state_names[] = {
+	[STATE_INACTIVE] = "inactive",
+	[STATE_PASSIVE] = "passive",
+	[STATE_RESOLVING] = "resolving",
+	[STATE_HANDSHAKE] = "handshake",
+	[STATE_ESTABLISHED] = "established",
+};
+
+/** The bucket bounds of the latency histograms (in nanoseconds) */
+static const uint64_t latency_bounds[] = {
+	1 << 10, 1 << 12, 1 << 14, 1 << 16, 1 << 18, 1 << 20, 1 << 22, 1 << 24, 1 << 26, 1 << 28, 1 << 30,
+};
+
+/** The bucket bounds of the histogram of events per main loop wakeup */
+static const uint64_t poll_events_bounds[] = { 1, 2, 4, 8 };
+
+
+/** The open metrics socket connections */
+static VECTOR(metrics_conn_t *) conns = {};
+
+
+/** Appends formatted output to the buffer of a connection; returns false if it doesn't fit */
+static bool append(metrics_conn_t *conn, const char *format, ...) {
+	size_t space = sizeof(conn->buf) - conn->buf_len;
+
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(conn->buf + conn->buf_len, space, format, ap);
+	va_end(ap);
+
+	if (len < 0 || (size_t)len >= space)
+		return false;
+
+	conn->buf_len += len;
+	return true;
+}
+
+/** Appends a string to the buffer of a connection, escaped as a label value */
+static bool append_escaped(metrics_conn_t *conn, const char *str) {
+	for (; *str; str++) {
+		const char *escaped;
+		char c[2] = { *str, 0 };
+
+		switch (*str) {
+		case '\\':
+			escaped = "\\\\";
+			break;
+
+		case '"':
+			escaped = "\\\"";
+			break;
+
+		case '\n':
+			escaped = "\\n";
+			break;
+
+		default:
+			escaped = c;
+		}
+
+		if (!append(conn, "%s", escaped))
+			return false;
+	}
+
+	return true;
+}
+
+/** Appends the labels identifying a peer (without the closing brace) */
+static bool append_peer_labels(metrics_conn_t *conn, const fastd_peer_t *peer) {
+	char key[65];
+	if (!conf.protocol->describe_peer(peer, key, sizeof(key)))
+		key[0] = 0;
+
+	if (!append(conn, "{key=\"%s\"", key))
+		return false;
+
+	if (peer->name && (!append(conn, ",name=\"") || !append_escaped(conn, peer->name) || !append(conn, "\"")))
+		return false;
+
+	return true;
+}
+
+/**
+   Appends the samples of a histogram
+
+   \e labels is a list of labels to add to each sample (may be empty), and the bounds are divided by \e scale. The
+   bounds should be powers of two or smaller than 2*HISTOGRAM_SUB_BUCKETS, so the bucket counts are exact.
+*/
+static bool append_histogram(
+	metrics_conn_t *conn, const char *name, const char *labels, const fastd_histogram_t *histogram,
+	const uint64_t *bounds, size_t n_bounds, double scale) {
+	const char *sep = *labels ? "," : "";
+	size_t i;
+
+	for (i = 0; i < n_bounds; i++) {
+		/* le is inclusive; larger bounds share their bucket with the following values, so they are excluded */
+		uint64_t bound = (bounds[i] < 2 * HISTOGRAM_SUB_BUCKETS) ? bounds[i] + 1 : bounds[i];
+
+		if (!append(conn, "%s_bucket{%s%sle=\"%.12g\"} %" PRIu64 "\n", name, labels, sep, bounds[i] / scale,
+			    fastd_histogram_count_below(histogram, bound)))
+			return false;
+	}
+
+	if (!append(conn, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, histogram->count))
+		return false;
+
+	if (*labels)
+		return append(conn, "%s_count{%s} %" PRIu64 "\n%s_sum{%s} %.12g\n", name, labels, histogram->count, name,
+			      labels, histogram->sum / scale);
+	else
+		return append(conn, "%s_count %" PRIu64 "\n%s_sum %.12g\n", name, histogram->count, name,
+			      histogram->sum / scale);
+}
+
+
+/** Writes the build information */
+static bool write_build_info(metrics_conn_t *conn) {
+	return append(conn, "fastd_build_info{version=\"%s\"} 1\n", FASTD_VERSION);
+}
+
+/** Writes the uptime */
+static bool write_uptime(metrics_conn_t *conn) {
+	return append(conn, "fastd_uptime_seconds %.3f\n", (ctx.now - ctx.started) / 1000.0);
+}
+
+/** Writes the global packet counters */
+static bool write_packets(metrics_conn_t *conn) {
+	size_t i;
+	for (i = 0; i < STAT_MAX; i++) {
+		uint64_t packets = ctx.stats.packets[i];
+		if (!append(conn, "fastd_packets_total{type=\"%s\"} %" PRIu64 "\n", stat_names[i], packets))
+			return false;
+	}
+
+	return true;
+}
+
+/** Writes the global byte counters */
+static bool write_bytes(metrics_conn_t *conn) {
+	size_t i;
+	for (i = 0; i < STAT_MAX; i++) {
+		if (!append(conn, "fastd_bytes_total{type=\"%s\"} %" PRIu64 "\n", stat_names[i], ctx.stats.bytes[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/** Writes the number of peers in each state */
+static bool write_peers(metrics_conn_t *conn) {
+	size_t counts[array_size(state_names)] = {};
+	size_t i;
+
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+		if (fastd_peer_is_enabled(peer))
+			counts[peer->state]++;
+	}
+
+	for (i = 0; i < array_size(state_names); i++) {
+		if (!append(conn, "fastd_peers{state=\"%s\"} %zu\n", state_names[i], counts[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/** Writes the number of initial handshakes received in the last second */
+static bool write_handshake_rate(metrics_conn_t *conn) {
+	return append(conn, "fastd_handshake_rate %u\n", ctx.handshake_rate);
+}
+
+/** Writes if handshakes are currently answered with cookies */
+static bool write_cookie_mode(metrics_conn_t *conn) {
+	return append(conn, "fastd_cookie_mode %i\n", fastd_handshake_cookie_mode() ? 1 : 0);
+}
+
+/** Writes the number of cookie replies sent */
+static bool write_cookie_replies(metrics_conn_t *conn) {
+	return append(conn, "fastd_cookie_replies_total %" PRIu64 "\n", ctx.cookie_replies);
+}
+
+/** Writes the number of log messages that have been dropped or suppressed */
+static bool write_log_messages(metrics_conn_t *conn) {
+	uint64_t dropped = __atomic_load_n(&ctx.log_dropped, __ATOMIC_RELAXED);
+	uint64_t suppressed = __atomic_load_n(&ctx.log_suppressed, __ATOMIC_RELAXED);
+
+	return append(conn, "fastd_log_messages_total{state=\"dropped\"} %" PRIu64 "\n", dropped) &&
+	       append(conn, "fastd_log_messages_total{state=\"suppressed\"} %" PRIu64 "\n", suppressed);
+}
+
+/** Writes the length of the worker job queue */
+static bool write_worker_jobs(metrics_conn_t *conn) {
+	size_t jobs = 0;
+
+	if (fastd_worker_enabled()) {
+		pthread_mutex_lock(&ctx.worker_mutex);
+		jobs = ctx.n_worker_jobs;
+		pthread_mutex_unlock(&ctx.worker_mutex);
+	}
+
+	return append(conn, "fastd_worker_jobs %zu\n", jobs);
+}
+
+/** Writes the number of known MAC addresses */
+static bool write_mac_addresses(metrics_conn_t *conn) {
+	return append(conn, "fastd_mac_addresses %zu\n", VECTOR_LEN(ctx.eth_addrs));
+}
+
+/**
+   Writes the samples of a per-peer family for all established peers, continuing after the last peer written
+
+   The samples of a peer are written completely or not at all. A peer whose samples don't even fit into the empty
+   buffer is skipped.
+*/
+static bool write_peer_samples(metrics_conn_t *conn, bool (*write_peer)(metrics_conn_t *, const fastd_peer_t *)) {
+	size_t i;
+	for (i = fastd_peer_index_after(conn->peer_id); i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+		if (!fastd_peer_is_enabled(peer) || !fastd_peer_is_established(peer))
+			continue;
+
+		if (!write_peer(conn, peer)) {
+			conn->buf_len = conn->buf_committed;
+			if (conn->buf_len)
+				return false;
+		}
+
+		conn->buf_committed = conn->buf_len;
+		conn->peer_id = peer->id;
+	}
+
+	return true;
+}
+
+/** Writes the session age of a peer */
+static bool write_peer_age(metrics_conn_t *conn, const fastd_peer_t *peer) {
+	return append(conn, "fastd_peer_established_seconds") && append_peer_labels(conn, peer) &&
+	       append(conn, "} %.3f\n", (ctx.now - peer->established) / 1000.0);
+}
+
+/** Writes the packet counters of a peer */
+static bool write_peer_packets(metrics_conn_t *conn, const fastd_peer_t *peer) {
+	size_t i;
+	for (i = 0; i < STAT_MAX; i++) {
+		if (!append(conn, "fastd_peer_packets_total") || !append_peer_labels(conn, peer) ||
+		    !append(conn, ",type=\"%s\"} %" PRIu64 "\n", stat_names[i], peer->stats.packets[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/** Writes the byte counters of a peer */
+static bool write_peer_bytes(metrics_conn_t *conn, const fastd_peer_t *peer) {
+	size_t i;
+	for (i = 0; i < STAT_MAX; i++) {
+		if (!append(conn, "fastd_peer_bytes_total") || !append_peer_labels(conn, peer) ||
+		    !append(conn, ",type=\"%s\"} %" PRIu64 "\n", stat_names[i], peer->stats.bytes[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/** Writes the session ages of all established peers */
+static bool write_peers_age(metrics_conn_t *conn) {
+	return write_peer_samples(conn, write_peer_age);
+}
+
+/** Writes the packet counters of all established peers */
+static bool write_peers_packets(metrics_conn_t *conn) {
+	return write_peer_samples(conn, write_peer_packets);
+}
+
+/** Writes the byte counters of all established peers */
+static bool write_peers_bytes(metrics_conn_t *conn) {
+	return write_peer_samples(conn, write_peer_bytes);
+}
+
+/** Returns if latency statistics are enabled */
+static bool latency_available(void) {
+	return ctx.latency;
+}
+
+/** Writes the latency histograms of the packet path stages, continuing after the last stage written */
+static bool write_latency(metrics_conn_t *conn) {
+	for (; conn->sample < LATENCY_MAX; conn->sample++) {
+		char labels[32];
+		snprintf(labels, sizeof(labels), "stage=\"%s\"", fastd_latency_stage_name(conn->sample));
+
+		if (!append_histogram(
+			    conn, "fastd_latency_seconds", labels, &ctx.latency->stages[conn->sample], latency_bounds,
+			    array_size(latency_bounds), 1e9))
+			return false;
+
+		conn->buf_committed = conn->buf_len;
+	}
+
+	return true;
+}
+
+/** Writes the encryption and decryption latency histograms of each method, continuing after the last one written */
+static bool write_method_latency(metrics_conn_t *conn) {
+	for (; conn->sample < 2 * ctx.latency->n_methods; conn->sample++) {
+		char labels[128];
+		snprintf(
+			labels, sizeof(labels), "method=\"%s\",operation=\"%s\"", conf.methods[conn->sample / 2].name,
+			(conn->sample % 2) ? "encrypt" : "decrypt");
+
+		if (!append_histogram(
+			    conn, "fastd_method_latency_seconds", labels, &ctx.latency->method_stages[conn->sample],
+			    latency_bounds, array_size(latency_bounds), 1e9))
+			return false;
+
+		conn->buf_committed = conn->buf_len;
+	}
+
+	return true;
+}
+
+/** Writes the histogram of the number of events handled per main loop wakeup */
+static bool write_poll_events(metrics_conn_t *conn) {
+	return append_histogram(
+		conn, "fastd_poll_events", "", &ctx.latency->poll_events, poll_events_bounds,
+		array_size(poll_events_bounds), 1);
+}
+
+
+/** The exported metric families */
+static const metrics_family_t families[] = {
+	{ "fastd_build", "info", "Information about the fastd build", NULL, write_build_info },
+	{ "fastd_uptime_seconds", "gauge", "Time since fastd has been started", NULL, write_uptime },
+	{ "fastd_packets", "counter", "Packets transferred by type", NULL, write_packets },
+	{ "fastd_bytes", "counter", "Bytes transferred by type", NULL, write_bytes },
+	{ "fastd_peers", "gauge", "Configured peers by state", NULL, write_peers },
+	{ "fastd_handshake_rate", "gauge", "Initial handshakes received in the last second", NULL,
+	  write_handshake_rate },
+	{ "fastd_cookie_mode", "gauge", "Whether handshakes are answered with cookies", NULL, write_cookie_mode },
+	{ "fastd_cookie_replies", "counter", "Cookie replies sent", NULL, write_cookie_replies },
+	{ "fastd_log_messages", "counter", "Log messages dropped or suppressed by the rate limit", NULL,
+	  write_log_messages },
+	{ "fastd_worker_jobs", "gauge", "Jobs waiting for a worker thread", NULL, write_worker_jobs },
+	{ "fastd_mac_addresses", "gauge", "MAC addresses known in TAP mode", NULL, write_mac_addresses },
+	{ "fastd_peer_established_seconds", "gauge", "Age of the current session of a peer", NULL, write_peers_age },
+	{ "fastd_peer_packets", "counter", "Packets transferred with a peer by type", NULL, write_peers_packets },
+	{ "fastd_peer_bytes", "counter", "Bytes transferred with a peer by type", NULL, write_peers_bytes },
+	{ "fastd_latency_seconds", "histogram", "Duration of the stages of the packet path", latency_available,
+	  write_latency },
+	{ "fastd_method_latency_seconds", "histogram", "Duration of encryption and decryption by method",
+	  latency_available, write_method_latency },
+	{ "fastd_poll_events", "histogram", "Events handled per main loop wakeup", latency_available,
+	  write_poll_events },
+};
+
+
+/** Refills the buffer of a connection with the next part of the output */
+static void fill_buffer(metrics_conn_t *conn) {
+	conn->buf_committed = conn->buf_len;
+
+	while (conn->family < array_size(families)) {
+		const metrics_family_t *family = &families[conn->family];
+
+		if (family->available && !family->available()) {
+			conn->family++;
+			continue;
+		}
+
+		if (!conn->header_done) {
+			if (!append(conn, "# TYPE %s %s\n# HELP %s %s\n", family->name, family->type, family->name,
+				    family->help))
+				return;
+
+			conn->header_done = true;
+			conn->buf_committed = conn->buf_len;
+		}
+
+		if (!family->write(conn)) {
+			conn->buf_len = conn->buf_committed;
+			return;
+		}
+
+		conn->buf_committed = conn->buf_len;
+
+		conn->family++;
+		conn->header_done = false;
+		conn->peer_id = 0;
+		conn->sample = 0;
+	}
+
+	if (append(conn, "# EOF\n"))
+		conn->done = true;
+}
+
+/** Unregisters a metrics socket connection and frees it (closing the socket) */
+static void conn_close(metrics_conn_t *conn) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(conns); i++) {
+		if (VECTOR_INDEX(conns, i) == conn) {
+			VECTOR_DELETE(conns, i);
+			break;
+		}
+	}
+
+	fastd_task_unschedule(&conn->task);
+
+	if (conn->fd.fd >= 0 && !fastd_poll_fd_close(&conn->fd))
+		pr_warn_errno("metrics socket: close");
+
+	if (conn->out_fd >= 0 && close(conn->out_fd))
+		pr_warn_errno("metrics socket: close");
+
+	free(conn);
+}
+
+/** Sends as much output as possible without blocking, closing the connection when everything has been sent */
+static void conn_send(metrics_conn_t *conn) {
+	while (true) {
+		if (conn->buf_start == conn->buf_len) {
+			conn->buf_start = conn->buf_len = 0;
+
+			if (!conn->done)
+				fill_buffer(conn);
+
+			if (!conn->buf_len) {
+				conn_close(conn);
+				return;
+			}
+		}
+
+		ssize_t ret = send(
+			conn->out_fd, conn->buf + conn->buf_start, conn->buf_len - conn->buf_start,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (fastd_timed_out(conn->timeout)) {
+					pr_debug("metrics socket: client timed out");
+					conn_close(conn);
+				} else {
+					fastd_task_schedule(
+						&conn->task, TASK_TYPE_METRICS_CONN, ctx.now + METRICS_RETRY);
+				}
+
+				return;
+			}
+
+			pr_debug_errno("metrics socket: send");
+			conn_close(conn);
+			return;
+		}
+
+		conn->buf_start += ret;
+	}
+}
+
+/**
+   Starts sending the metrics, as a HTTP response if \e http is set
+
+   The socket isn't polled anymore afterwards, as further input (or the client closing its side of the connection)
+   would wake up the main loop again and again.
+*/
+static void conn_respond(metrics_conn_t *conn, bool http, bool get) {
+	fastd_task_unschedule(&conn->task);
+
+	conn->out_fd = dup(conn->fd.fd);
+	if (conn->out_fd < 0)
+		pr_error_errno("metrics socket: dup");
+
+	if (!fastd_poll_fd_close(&conn->fd))
+		pr_warn_errno("metrics socket: close");
+	conn->fd.fd = -1;
+
+	if (conn->out_fd < 0) {
+		conn_close(conn);
+		return;
+	}
+
+	conn->buf_len = 0;
+	conn->timeout = ctx.now + METRICS_TIMEOUT;
+
+	if (http) {
+		if (get) {
+			append(conn, "HTTP/1.0 200 OK\r\n"
+				     "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				     "Connection: close\r\n\r\n");
+		} else {
+			append(conn, "HTTP/1.0 405 Method Not Allowed\r\n"
+				     "Allow: GET\r\n"
+				     "Connection: close\r\n\r\n");
+			conn->done = true;
+		}
+	}
+
+	conn_send(conn);
+}
+
+/** Checks if a line (without the line break) is an HTTP request line, i.e. "<method> <target> HTTP/1.x" */
+static bool is_http_request(const char *line, size_t len) {
+	if (len && line[len - 1] == '\r')
+		len--;
+
+	return len > 8 && memchr(line, ' ', len - 8) && !memcmp(line + len - 9, " HTTP/1.", 8);
+}
+
+/** Handles the request line (and the headers, for HTTP requests) received so far */
+static void conn_handle_request(metrics_conn_t *conn, bool eof) {
+	char *end = memchr(conn->buf, '\n', conn->buf_len);
+	if (!end) {
+		if (!eof && conn->buf_len < METRICS_REQUEST_MAX)
+			return;
+
+		conn_respond(conn, false, false);
+		return;
+	}
+
+	/* Anything but an HTTP request line just requests the plain metrics */
+	if (!is_http_request(conn->buf, end - conn->buf)) {
+		conn_respond(conn, false, false);
+		return;
+	}
+
+	/* Wait for the end of the request headers, which are ignored */
+	bool complete = false;
+	char *line;
+	for (line = end + 1; line < conn->buf + conn->buf_len; line = end + 1) {
+		end = memchr(line, '\n', conn->buf + conn->buf_len - line);
+		if (!end)
+			break;
+
+		if (end == line || (end == line + 1 && *line == '\r')) {
+			complete = true;
+			break;
+		}
+	}
+
+	if (!complete && !eof && conn->buf_len < METRICS_REQUEST_MAX)
+		return;
+
+	conn_respond(conn, true, conn->buf_len >= 4 && !memcmp(conn->buf, "GET ", 4));
+}
+
+
+/** Deletes the metrics socket file */
+static void unlink_metrics_socket(void) {
+	if (!conf.metrics_socket || ctx.metrics_fd.fd < 0)
+		return;
+
+	if (unlink(conf.metrics_socket))
+		pr_warn_errno("unlink_metrics_socket: unlink");
+}
+
+/** Initializes the metrics socket */
+void fastd_metrics_init(void) {
+	if (!conf.metrics_socket) {
+		ctx.metrics_fd.fd = -1;
+		return;
+	}
+
+	ctx.metrics_fd = FASTD_POLL_FD(POLL_TYPE_METRICS, -1);
+	fastd_socket_listen_unix(&ctx.metrics_fd, conf.metrics_socket, "metrics", false, unlink_metrics_socket);
+}
+
+/** Closes the metrics socket */
+void fastd_metrics_close(void) {
+	if (!conf.metrics_socket || ctx.metrics_fd.fd < 0)
+		return;
+
+	while (VECTOR_LEN(conns))
+		conn_close(VECTOR_INDEX(conns, 0));
+
+	VECTOR_FREE(conns);
+
+	if (!fastd_poll_fd_close(&ctx.metrics_fd))
+		pr_warn_errno("fastd_metrics_close: close");
+
+	unlink_metrics_socket();
+
+	ctx.metrics_fd.fd = -1;
+}
+
+/** Accepts a connection on the metrics socket */
+void fastd_metrics_handle(void) {
+	int fd = accept(ctx.metrics_fd.fd, NULL, NULL);
+
+	if (fd < 0) {
+		pr_warn_errno("fastd_metrics_handle: accept");
+		return;
+	}
+
+	metrics_conn_t *conn = fastd_new0(metrics_conn_t);
+	conn->fd = FASTD_POLL_FD(POLL_TYPE_METRICS_CONN, fd);
+	conn->out_fd = -1;
+
+	fastd_poll_fd_register(&conn->fd);
+	fastd_task_schedule(&conn->task, TASK_TYPE_METRICS_CONN, ctx.now + METRICS_REQUEST_TIMEOUT);
+
+	VECTOR_ADD(conns, conn);
+}
+
+/** Handles input on a metrics socket connection */
+void fastd_metrics_handle_conn(fastd_poll_fd_t *fd) {
+	metrics_conn_t *conn = container_of(fd, metrics_conn_t, fd);
+
+	/* The socket is only read from when it is readable, so a single read never blocks */
+	ssize_t len = read(conn->fd.fd, conn->buf + conn->buf_len, METRICS_REQUEST_MAX - conn->buf_len);
+	if (len < 0) {
+		if (errno != EINTR) {
+			pr_debug_errno("metrics socket: read");
+			conn_close(conn);
+		}
+
+		return;
+	}
+
+	conn->buf_len += len;
+	conn_handle_request(conn, !len);
+}
+
+/**
+   Handles the task of a metrics socket connection
+
+   Connections that haven't sent a request in time get the plain metrics; otherwise, sending is retried.
+*/
+void fastd_metrics_handle_task(fastd_task_t *task) {
+	metrics_conn_t *conn = container_of(task, metrics_conn_t, task);
+
+	if (conn->fd.fd >= 0)
+		conn_respond(conn, false, false);
+	else
+		conn_send(conn);
+}
+
+#endif /* WITH_METRICS_SOCKET */
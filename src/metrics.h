@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   OpenMetrics exporter
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef WITH_METRICS_SOCKET
+
+void fastd_metrics_init(void);
+void fastd_metrics_close(void);
+void fastd_metrics_handle(void);
+void fastd_metrics_handle_conn(fastd_poll_fd_t *fd);
+void fastd_metrics_handle_task(fastd_task_t *task);
+
+#else
+
+static inline void fastd_metrics_init(void) {}
+static inline void fastd_metrics_close(void) {}
+
+#endif
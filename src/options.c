@@ -357,6 +357,7 @@ static void option_on_disestablish(const char *arg) {
 static void option_on_verify(const char *arg) {
 	fastd_shell_command_set(&conf.on_verify, arg, false);
 	conf.on_verify_group = conf.peer_group;
+	conf.on_verify_helper = false;
 }
 
 #endif
@@ -368,6 +369,11 @@ static void option_verify_config(void) {
 	conf.verify_config = true;
 }
 
+/** Handles the --compile-peers option */
+static void option_compile_peers(void) {
+	conf.compile_peers = true;
+}
+
 /** Handles the --generate-key option */
 static void option_generate_key(void) {
 	conf.generate_key = true;
@@ -72,6 +72,7 @@ SEPARATOR;
 #endif
 
 OPTION(option_verify_config, "--verify-config", "Checks the configuration and exits");
+OPTION(option_compile_peers, "--compile-peers", "Compiles the peer directories into binary peer databases and exits");
 OPTION(option_generate_key, "--generate-key", "Generates a new keypair");
 OPTION(option_show_key, "--show-key", "Shows the public key corresponding to the configured secret");
 OPTION(option_machine_readable, "--machine-readable",
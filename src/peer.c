@@ -14,6 +14,7 @@
 #include "peer_group.h"
 #include "peer_hashtable.h"
 #include "polling.h"
+#include "trace.h"
 
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -73,10 +74,19 @@ void fastd_peer_set_shell_env(
 	conf.protocol->set_shell_env(env, peer);
 }
 
-/** Executes a shell command, providing peer-specific enviroment fields */
+/**
+   Executes a shell command, providing peer-specific enviroment fields
+
+   The time needed to start the command (and to wait for it for synchronous commands) is accounted to the peer.
+*/
 void fastd_peer_exec_shell_command(
-	const fastd_shell_command_t *command, const fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
+	const fastd_shell_command_t *command, fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
 	const fastd_peer_address_t *peer_addr, bool sync) {
+	if (!fastd_shell_command_isset(command))
+		return;
+
+	int64_t start = fastd_cpu_start();
+
 	fastd_shell_env_t *env = fastd_shell_env_alloc();
 	fastd_peer_set_shell_env(env, peer, local_addr, peer_addr);
 
@@ -86,28 +96,31 @@ void fastd_peer_exec_shell_command(
 		fastd_shell_command_exec(command, env);
 
 	fastd_shell_env_free(env);
+
+	if (peer)
+		fastd_cpu_add(peer, CPU_HOOK, start);
 }
 
 /** Calls the on-up command */
-static inline void on_up(const fastd_peer_t *peer, bool sync) {
+static inline void on_up(fastd_peer_t *peer, bool sync) {
 	const fastd_shell_command_t *on_up = fastd_peer_group_lookup_peer_shell_command(peer, on_up);
 	fastd_peer_exec_shell_command(on_up, peer, NULL, NULL, sync);
 }
 
 /** Calls the on-down command */
-static inline void on_down(const fastd_peer_t *peer, bool sync) {
+static inline void on_down(fastd_peer_t *peer, bool sync) {
 	const fastd_shell_command_t *on_down = fastd_peer_group_lookup_peer_shell_command(peer, on_down);
 	fastd_peer_exec_shell_command(on_down, peer, NULL, NULL, sync);
 }
 
 /** Executes the on-establish command for a peer */
-static inline void on_establish(const fastd_peer_t *peer) {
+static inline void on_establish(fastd_peer_t *peer) {
 	const fastd_shell_command_t *on_establish = fastd_peer_group_lookup_peer_shell_command(peer, on_establish);
 	fastd_peer_exec_shell_command(on_establish, peer, &peer->local_address, &peer->address, false);
 }
 
 /** Executes the on-disestablish command for a peer */
-static inline void on_disestablish(const fastd_peer_t *peer) {
+static inline void on_disestablish(fastd_peer_t *peer) {
 	const fastd_shell_command_t *on_disestablish =
 		fastd_peer_group_lookup_peer_shell_command(peer, on_disestablish);
 	fastd_peer_exec_shell_command(on_disestablish, peer, &peer->local_address, &peer->address, false);
@@ -156,6 +169,27 @@ fastd_peer_t *fastd_peer_find_by_id(uint64_t id) {
 		return NULL;
 }
 
+/**
+   Returns the index of the first peer in \e ctx.peers with an ID larger than \e id
+
+   As peer IDs start at 1, passing 0 returns the index of the first peer.
+*/
+size_t fastd_peer_index_after(uint64_t id) {
+	/* ctx.peers is sorted by ID */
+	size_t min = 0, max = VECTOR_LEN(ctx.peers);
+
+	while (min < max) {
+		size_t mid = min + (max - min) / 2;
+
+		if (VECTOR_INDEX(ctx.peers, mid)->id <= id)
+			min = mid + 1;
+		else
+			max = mid;
+	}
+
+	return min;
+}
+
 /** Closes and frees a peer's dynamic socket */
 static inline void free_socket(fastd_peer_t *peer) {
 	if (!peer->sock)
@@ -247,10 +281,14 @@ static void set_next_handshake_default(fastd_peer_t *peer) {
 /**
    Schedules a handshake after the given delay
 
+   A handshake that is still waiting for the handshake budget is dropped.
+
    @param peer	the peer
    @param delay	the delay in milliseconds
 */
 void fastd_peer_schedule_handshake(fastd_peer_t *peer, int delay) {
+	fastd_pqueue_remove(&peer->handshake_queue_entry);
+
 	set_next_handshake(peer, delay);
 	schedule_peer_task(peer);
 }
@@ -283,6 +321,7 @@ static void reset_peer(fastd_peer_t *peer) {
 	if (fastd_peer_is_established(peer)) {
 		on_disestablish(peer);
 		pr_info("connection with %P disestablished.", peer);
+		fastd_status_event_established(peer, false);
 	}
 
 	free_socket(peer);
@@ -301,6 +340,7 @@ static void reset_peer(fastd_peer_t *peer) {
 	VECTOR_RESIZE(ctx.eth_addrs, VECTOR_LEN(ctx.eth_addrs) - deleted);
 
 	fastd_task_unschedule(&peer->task);
+	fastd_pqueue_remove(&peer->handshake_queue_entry);
 
 	fastd_peer_hashtable_remove(peer);
 
@@ -360,8 +400,6 @@ static void setup_peer(fastd_peer_t *peer) {
 		for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
 			fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
 
-			remote->last_resolve_timeout = ctx.now;
-
 			if (!remote->hostname) {
 				remote->n_addresses = 1;
 				remote->addresses = &remote->address;
@@ -617,10 +655,15 @@ bool fastd_peer_claim_address(
 		}
 	}
 
+	fastd_peer_address_t old_address = new_peer->address;
+
 	fastd_peer_hashtable_remove(new_peer);
 	new_peer->address = *remote_addr;
 	fastd_peer_hashtable_insert(new_peer);
 
+	if (fastd_peer_is_established(new_peer) && !fastd_peer_address_equal(&old_address, remote_addr))
+		fastd_status_event_roamed(new_peer, &old_address);
+
 	if (sock && sock->addr && sock != new_peer->sock) {
 		free_socket(new_peer);
 		new_peer->sock = sock;
@@ -778,6 +821,83 @@ static inline void no_valid_address_debug(const fastd_peer_t *peer) {
 	pr_debug("not sending a handshake to %P (no valid address resolved)", peer);
 }
 
+/** Sends a handshake to the current address of a peer */
+static void send_handshake_now(fastd_peer_t *peer) {
+	peer->last_handshake_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+	peer->last_handshake_address = peer->address;
+	conf.protocol->handshake_init(peer->sock, &peer->local_address, &peer->address, peer);
+}
+
+/**
+   Tries to take one handshake from the global handshake budget
+
+   The budget is implemented as a virtual scheduling algorithm: every handshake moves the theoretical send time
+   \e ctx.handshake_tat forward by 1/rate seconds, and a handshake may only be sent if this time lies less than
+   HANDSHAKE_BURST_TIME in the future.
+*/
+static bool take_handshake_budget(void) {
+	if (!conf.handshake_rate)
+		return true;
+
+	int64_t now = ctx.now * 1000;
+
+	if (ctx.handshake_tat < now)
+		ctx.handshake_tat = now;
+
+	if (ctx.handshake_tat - now > HANDSHAKE_BURST_TIME * 1000)
+		return false;
+
+	ctx.handshake_tat += 1000000 / conf.handshake_rate;
+	return true;
+}
+
+/** Returns the time the next handshake may be sent at according to the handshake budget */
+static inline fastd_timeout_t handshake_budget_timeout(void) {
+	return (ctx.handshake_tat - HANDSHAKE_BURST_TIME * 1000 + 999) / 1000;
+}
+
+/**
+   Puts a peer into the queue of handshakes waiting for the handshake budget
+
+   Established peers are put into a separate queue which is always served first, so rekeys of sessions carrying
+   traffic aren't delayed by a large number of initial handshakes.
+*/
+static void queue_handshake(fastd_peer_t *peer) {
+	pr_debug2("delaying handshake with %P as the handshake budget is exhausted", peer);
+
+	peer->handshake_queue_entry.value = ctx.now;
+
+	if (fastd_peer_is_established(peer))
+		fastd_pqueue_insert(&ctx.handshake_queue_established, &peer->handshake_queue_entry);
+	else
+		fastd_pqueue_insert(&ctx.handshake_queue, &peer->handshake_queue_entry);
+
+	if (!fastd_task_scheduled(&ctx.next_queued_handshake))
+		fastd_task_schedule(&ctx.next_queued_handshake, TASK_TYPE_HANDSHAKE_QUEUE, handshake_budget_timeout());
+}
+
+/** Sends as many queued handshakes as the handshake budget allows */
+void fastd_peer_handle_handshake_queue(void) {
+	while (ctx.handshake_queue_established || ctx.handshake_queue) {
+		if (!take_handshake_budget()) {
+			fastd_task_schedule(
+				&ctx.next_queued_handshake, TASK_TYPE_HANDSHAKE_QUEUE, handshake_budget_timeout());
+			return;
+		}
+
+		fastd_pqueue_t *entry = ctx.handshake_queue_established ?: ctx.handshake_queue;
+		fastd_peer_t *peer = container_of(entry, fastd_peer_t, handshake_queue_entry);
+		fastd_pqueue_remove(entry);
+
+		if (!peer->sock || peer->address.sa.sa_family == AF_UNSPEC) {
+			no_valid_address_debug(peer);
+			continue;
+		}
+
+		send_handshake_now(peer);
+	}
+}
+
 /** Sends a new handshake to the current address of the given remote of a peer */
 static void send_handshake(fastd_peer_t *peer, fastd_remote_t *next_remote) {
 	if (!fastd_peer_is_established(peer)) {
@@ -805,9 +925,17 @@ static void send_handshake(fastd_peer_t *peer, fastd_remote_t *next_remote) {
 		return;
 	}
 
-	peer->last_handshake_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
-	peer->last_handshake_address = peer->address;
-	conf.protocol->handshake_init(peer->sock, &peer->local_address, &peer->address, peer);
+	if (fastd_pqueue_linked(&peer->handshake_queue_entry))
+		/* Keep the position in the handshake queue, the handshake is sent to the current address when it is
+		   dequeued */
+		return;
+
+	if (!take_handshake_budget()) {
+		queue_handshake(peer);
+		return;
+	}
+
+	send_handshake_now(peer);
 }
 
 /** Marks a peer as established */
@@ -832,6 +960,8 @@ bool fastd_peer_set_established(fastd_peer_t *peer) {
 
 	on_establish(peer);
 	pr_info("connection with %P established.", peer);
+	fastd_trace(session_establish, peer->id);
+	fastd_status_event_established(peer, true);
 
 	return true;
 }
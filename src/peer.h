@@ -72,7 +72,8 @@ struct fastd_peer {
 
 	fastd_peer_state_t state; /**< The peer's state */
 
-	fastd_task_t task; /**< Task queue entry for periodic maintenance tasks */
+	fastd_task_t task;                    /**< Task queue entry for periodic maintenance tasks */
+	fastd_pqueue_t handshake_queue_entry; /**< Entry in the queue of handshakes waiting for the handshake budget */
 
 	fastd_timeout_t next_handshake;         /**< The time of the next handshake */
 	fastd_timeout_t last_handshake_timeout; /**< No handshakes are sent to the peer until this timeout has occured
@@ -86,7 +87,12 @@ struct fastd_peer {
 	fastd_timeout_t reset_timeout;     /**< The timeout after which the peer is reset */
 	fastd_timeout_t keepalive_timeout; /**< The timeout after which a keepalive is sent to the peer */
 
-	fastd_stats_t stats; /**< Traffic statistics */
+	fastd_stats_t stats;   /**< Traffic statistics */
+	fastd_cpu_stats_t cpu; /**< CPU time spent on behalf of the peer (kept when the peer is reset) */
+
+#ifdef WITH_XDP
+	fastd_xdp_dest_t xdp; /**< The destination for sending payload packets through AF_XDP */
+#endif
 
 #ifdef WITH_DYNAMIC_PEERS
 	fastd_timeout_t verify_timeout; /**< Specifies the minimum time after which on-verify may be run again */
@@ -111,8 +117,6 @@ struct fastd_remote {
 	size_t n_addresses;              /**< The size of the \e addresses array */
 	size_t current_address;          /**< The index of the remote the next handshake will be sent to */
 	fastd_peer_address_t *addresses; /**< The IP addresses the remote was resolved to */
-
-	fastd_timeout_t last_resolve_timeout; /**< Timeout before the remote must not be resolved again */
 };
 
 
@@ -136,18 +140,20 @@ bool fastd_peer_claim_address(
 void fastd_peer_reset_socket(fastd_peer_t *peer);
 void fastd_peer_schedule_handshake(fastd_peer_t *peer, int delay);
 fastd_peer_t *fastd_peer_find_by_id(uint64_t id);
+size_t fastd_peer_index_after(uint64_t id);
 
 void fastd_peer_set_shell_env(
 	fastd_shell_env_t *env, const fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
 	const fastd_peer_address_t *peer_addr);
 void fastd_peer_exec_shell_command(
-	const fastd_shell_command_t *command, const fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
+	const fastd_shell_command_t *command, fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
 	const fastd_peer_address_t *peer_addr, bool sync);
 
 void fastd_peer_eth_addr_add(fastd_peer_t *peer, fastd_eth_addr_t addr);
 bool fastd_peer_find_by_eth_addr(const fastd_eth_addr_t addr, fastd_peer_t **peer);
 
 void fastd_peer_handle_task(fastd_task_t *task);
+void fastd_peer_handle_handshake_queue(void);
 void fastd_peer_eth_addr_cleanup(void);
 void fastd_peer_reset_all(void);
 
@@ -181,6 +187,7 @@ static inline void fastd_peer_schedule_handshake_default(fastd_peer_t *peer) {
 /** Cancels a scheduled handshake */
 static inline void fastd_peer_unschedule_handshake(fastd_peer_t *peer) {
 	peer->next_handshake = FASTD_TIMEOUT_INV;
+	fastd_pqueue_remove(&peer->handshake_queue_entry);
 }
 
 #ifdef WITH_DYNAMIC_PEERS
@@ -283,7 +290,7 @@ static inline bool fastd_eth_addr_is_unicast(fastd_eth_addr_t addr) {
 
 /** Adds statistics for a single packet of a given size */
 static inline void fastd_stats_add(UNUSED fastd_peer_t *peer, UNUSED fastd_stat_type_t stat, UNUSED size_t bytes) {
-#ifdef WITH_STATUS_SOCKET
+#ifdef WITH_STATISTICS
 	if (!bytes)
 		return;
 
@@ -294,3 +301,31 @@ static inline void fastd_stats_add(UNUSED fastd_peer_t *peer, UNUSED fastd_stat_
 	peer->stats.bytes[stat] += bytes;
 #endif
 }
+
+/** Returns the start time of a CPU cost measurement, or 0 if CPU accounting is disabled */
+static inline int64_t fastd_cpu_start(void) {
+#ifdef WITH_STATISTICS
+	if (conf.cpu_stats)
+		return fastd_get_time_ns();
+#endif
+
+	return 0;
+}
+
+/** Adds time measured elsewhere (e.g. on a worker thread) to a peer's CPU cost, without counting an operation */
+static inline void fastd_cpu_add_time(UNUSED fastd_peer_t *peer, UNUSED fastd_cpu_type_t type, UNUSED uint64_t time) {
+#ifdef WITH_STATISTICS
+	peer->cpu.time[type] += time;
+#endif
+}
+
+/** Adds an operation that started at \e start (as returned by fastd_cpu_start()) to a peer's CPU cost */
+static inline void fastd_cpu_add(UNUSED fastd_peer_t *peer, UNUSED fastd_cpu_type_t type, int64_t start) {
+	if (!start)
+		return;
+
+#ifdef WITH_STATISTICS
+	peer->cpu.time[type] += fastd_get_time_ns() - start;
+	peer->cpu.count[type]++;
+#endif
+}
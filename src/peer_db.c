@@ -0,0 +1,619 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Compiled peer databases
+
+   Parsing thousands of peer files on startup and on every SIGHUP is slow, so `fastd --compile-peers` can compile
+   each peer directory into a binary database file, which is stored in the directory as PEER_DB_NAME. The database
+   contains the parsed remotes and the unpacked keys of all peers and can be used by mapping it into memory.
+
+   The database stores the modification time of the directory and the modification time, change time, size and
+   inode of each peer file. When any of them doesn't match anymore, the database is considered stale and the peer
+   files are read instead. Files included by peer files are not tracked.
+
+   The database file is only meant to be used on the system it was created on, so all fields are stored in host
+   byte order, and a database created by a different fastd version is ignored.
+*/
+
+
+#include "peer_db.h"
+#include "config.h"
+#include "fastd.h"
+#include "peer.h"
+#include "peer_group.h"
+#include "version.h"
+
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/** The filename of a compiled peer database in a peer directory */
+#define PEER_DB_NAME ".fastd-peers.db"
+
+/** The temporary filename used while a peer database is written */
+#define PEER_DB_TMP_NAME ".fastd-peers.db.tmp"
+
+/** The magic identifying a peer database */
+#define PEER_DB_MAGIC "fastd peer db"
+
+/** The version of the database format */
+#define PEER_DB_FORMAT 2
+
+/** The alignment of the sections of a peer database */
+#define PEER_DB_ALIGN 64
+
+/** Marks an unset string or key reference */
+#define PEER_DB_NONE UINT32_MAX
+
+
+/** The peer file could be parsed successfully */
+#define PEER_DB_VALID 0x01
+/** The peer is floating */
+#define PEER_DB_FLOATING 0x02
+
+
+/** The header of a peer database */
+typedef struct peer_db_header {
+	char magic[16];    /**< PEER_DB_MAGIC */
+	char version[64];  /**< The version of fastd that has created the database */
+	char protocol[32]; /**< The name of the protocol the keys belong to */
+	uint32_t format;   /**< PEER_DB_FORMAT */
+	uint32_t key_size; /**< The size of a key */
+
+	int64_t dir_mtime; /**< The modification time of the peer directory (in nanoseconds) */
+
+	uint32_t n_peers;   /**< The number of peers */
+	uint32_t n_remotes; /**< The number of remotes */
+	uint32_t n_keys;    /**< The number of keys */
+
+	uint64_t peers_offset;   /**< The offset of the peer records */
+	uint64_t remotes_offset; /**< The offset of the remote records */
+	uint64_t keys_offset;    /**< The offset of the keys (each aligned to PEER_DB_ALIGN) */
+	uint64_t strings_offset; /**< The offset of the string table */
+	uint64_t strings_len;    /**< The size of the string table */
+} peer_db_header_t;
+
+/** A peer record */
+typedef struct peer_db_peer {
+	uint32_t name;   /**< The filename of the peer */
+	uint32_t ifname; /**< The peer-specific interface name, or PEER_DB_NONE */
+	uint32_t key;    /**< The index of the peer's key, or PEER_DB_NONE */
+
+	uint32_t first_remote; /**< The index of the peer's first remote */
+	uint32_t n_remotes;    /**< The number of remotes of the peer */
+
+	uint16_t mtu;  /**< The peer-specific MTU */
+	uint8_t flags; /**< PEER_DB_VALID and PEER_DB_FLOATING */
+
+	int64_t mtime; /**< The modification time of the peer file (in nanoseconds) */
+	int64_t ctime; /**< The change time of the peer file (in nanoseconds) */
+	uint64_t size; /**< The size of the peer file */
+	uint64_t ino;  /**< The inode number of the peer file */
+} peer_db_peer_t;
+
+/** A remote record */
+typedef struct peer_db_remote {
+	uint32_t hostname;            /**< The hostname, or PEER_DB_NONE */
+	fastd_peer_address_t address; /**< The address (only family and port are used when hostname is set) */
+} peer_db_remote_t;
+
+/** A peer database that is being built */
+typedef struct peer_db_builder {
+	VECTOR(peer_db_peer_t) peers;     /**< The peer records */
+	VECTOR(peer_db_remote_t) remotes; /**< The remote records */
+	VECTOR(uint8_t) keys;             /**< The keys */
+	VECTOR(char) strings;             /**< The string table */
+} peer_db_builder_t;
+
+
+/** Returns the distance between two keys in the database */
+static inline size_t key_stride(void) {
+	return alignto(conf.protocol->key_size, PEER_DB_ALIGN);
+}
+
+/** Adds a string to the string table of a database that is being built */
+static uint32_t add_string(peer_db_builder_t *db, const char *str) {
+	if (!str)
+		return PEER_DB_NONE;
+
+	size_t offset = VECTOR_LEN(db->strings), len = strlen(str) + 1;
+	VECTOR_RESIZE(db->strings, offset + len);
+	memcpy(&VECTOR_INDEX(db->strings, offset), str, len);
+
+	return offset;
+}
+
+#ifdef __APPLE__
+/** Returns the modification time of a file */
+#define STAT_MTIM(statbuf) ((statbuf)->st_mtimespec)
+/** Returns the status change time of a file */
+#define STAT_CTIM(statbuf) ((statbuf)->st_ctimespec)
+#else
+/** Returns the modification time of a file */
+#define STAT_MTIM(statbuf) ((statbuf)->st_mtim)
+/** Returns the status change time of a file */
+#define STAT_CTIM(statbuf) ((statbuf)->st_ctim)
+#endif
+
+/**
+   Converts a file timestamp to nanoseconds
+
+   Seconds alone aren't precise enough: a peer file modified in the same second the database has been compiled in
+   would otherwise not be detected as changed.
+*/
+static inline int64_t timespec_ns(struct timespec ts) {
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Adds a peer file to a database that is being built; \e peer is NULL if the file is invalid */
+static void add_peer(peer_db_builder_t *db, const char *name, const struct stat *statbuf, const fastd_peer_t *peer) {
+	peer_db_peer_t record = {
+		.name = add_string(db, name),
+		.ifname = PEER_DB_NONE,
+		.key = PEER_DB_NONE,
+		.first_remote = VECTOR_LEN(db->remotes),
+		.mtime = timespec_ns(STAT_MTIM(statbuf)),
+		.ctime = timespec_ns(STAT_CTIM(statbuf)),
+		.size = statbuf->st_size,
+		.ino = statbuf->st_ino,
+	};
+
+	if (peer) {
+		record.flags |= PEER_DB_VALID;
+		if (peer->floating)
+			record.flags |= PEER_DB_FLOATING;
+
+		record.ifname = add_string(db, peer->ifname);
+		record.mtu = peer->mtu;
+
+		if (peer->key) {
+			size_t offset = VECTOR_LEN(db->keys);
+			record.key = offset / key_stride();
+
+			VECTOR_RESIZE(db->keys, offset + key_stride());
+			memset(&VECTOR_INDEX(db->keys, offset), 0, key_stride());
+			memcpy(&VECTOR_INDEX(db->keys, offset), peer->key, conf.protocol->key_size);
+		}
+
+		size_t i;
+		for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+			const fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
+			peer_db_remote_t remote_record = {
+				.hostname = add_string(db, remote->hostname),
+				.address = remote->address,
+			};
+
+			VECTOR_ADD(db->remotes, remote_record);
+		}
+
+		record.n_remotes = VECTOR_LEN(peer->remotes);
+	}
+
+	VECTOR_ADD(db->peers, record);
+}
+
+/** Writes a section of a database file, padded to PEER_DB_ALIGN */
+static bool write_section(FILE *file, const void *data, size_t len) {
+	static const uint8_t padding[PEER_DB_ALIGN] = {};
+
+	if (len && fwrite(data, len, 1, file) != 1)
+		return false;
+
+	size_t pad = alignto(len, PEER_DB_ALIGN) - len;
+	return !pad || fwrite(padding, pad, 1, file) == 1;
+}
+
+/** Writes a database to the current directory */
+static bool write_db(const peer_db_builder_t *db) {
+	peer_db_header_t header = {
+		.format = PEER_DB_FORMAT,
+		.key_size = conf.protocol->key_size,
+		.n_peers = VECTOR_LEN(db->peers),
+		.n_remotes = VECTOR_LEN(db->remotes),
+		.n_keys = VECTOR_LEN(db->keys) / key_stride(),
+		.strings_len = VECTOR_LEN(db->strings),
+	};
+
+	strncpy(header.magic, PEER_DB_MAGIC, sizeof(header.magic) - 1);
+	strncpy(header.version, FASTD_VERSION, sizeof(header.version) - 1);
+	strncpy(header.protocol, conf.protocol->name, sizeof(header.protocol) - 1);
+
+	header.peers_offset = alignto(sizeof(header), PEER_DB_ALIGN);
+	header.remotes_offset = header.peers_offset + alignto(header.n_peers * sizeof(peer_db_peer_t), PEER_DB_ALIGN);
+	header.keys_offset =
+		header.remotes_offset + alignto(header.n_remotes * sizeof(peer_db_remote_t), PEER_DB_ALIGN);
+	header.strings_offset = header.keys_offset + VECTOR_LEN(db->keys);
+
+	FILE *file = fopen(PEER_DB_TMP_NAME, "w");
+	if (!file) {
+		pr_error_errno("unable to create peer database: fopen");
+		return false;
+	}
+
+	bool ok = write_section(file, &header, sizeof(header)) &&
+		  write_section(file, VECTOR_DATA(db->peers), header.n_peers * sizeof(peer_db_peer_t)) &&
+		  write_section(file, VECTOR_DATA(db->remotes), header.n_remotes * sizeof(peer_db_remote_t)) &&
+		  write_section(file, VECTOR_DATA(db->keys), VECTOR_LEN(db->keys)) &&
+		  write_section(file, VECTOR_DATA(db->strings), header.strings_len);
+
+	if (fclose(file) < 0)
+		ok = false;
+
+	if (!ok) {
+		pr_error_errno("unable to write peer database");
+		goto error;
+	}
+
+	if (rename(PEER_DB_TMP_NAME, PEER_DB_NAME) < 0) {
+		pr_error_errno("unable to write peer database: rename");
+		goto error;
+	}
+
+	/* Creating the database has changed the directory's modification time, so it is recorded afterwards */
+	struct stat statbuf;
+	if (stat(".", &statbuf) < 0) {
+		pr_error_errno("unable to write peer database: stat");
+		return false;
+	}
+
+	int64_t dir_mtime = timespec_ns(STAT_MTIM(&statbuf));
+
+	int fd = open(PEER_DB_NAME, O_WRONLY);
+	if (fd < 0) {
+		pr_error_errno("unable to write peer database: open");
+		return false;
+	}
+
+	ok = (pwrite(fd, &dir_mtime, sizeof(dir_mtime), offsetof(peer_db_header_t, dir_mtime)) ==
+	      sizeof(dir_mtime));
+	if (!ok)
+		pr_error_errno("unable to write peer database: pwrite");
+
+	if (close(fd) < 0) {
+		pr_error_errno("unable to write peer database: close");
+		ok = false;
+	}
+
+	return ok;
+
+error:
+	unlink(PEER_DB_TMP_NAME);
+	return false;
+}
+
+/** Compiles the peer directory \e dir, which must be the current directory */
+static bool compile_dir(fastd_peer_group_t *group, const char *dir) {
+	peer_db_builder_t db = {};
+	size_t n_invalid = 0;
+
+	DIR *dirh = opendir(".");
+	if (!dirh) {
+		pr_error("opendir for `%s' failed: %s", dir, strerror(errno));
+		return false;
+	}
+
+	while (true) {
+		errno = 0;
+		struct dirent *result = readdir(dirh);
+		if (!result) {
+			if (errno)
+				pr_error_errno("readdir");
+
+			break;
+		}
+
+		struct stat statbuf;
+		if (!fastd_config_is_peer_file(result->d_name, &statbuf))
+			continue;
+
+		fastd_peer_t *peer = fastd_config_read_peer(group, dir, result->d_name);
+		add_peer(&db, result->d_name, &statbuf, peer);
+
+		if (peer)
+			fastd_peer_free(peer);
+		else
+			n_invalid++;
+	}
+
+	if (closedir(dirh) < 0)
+		pr_error_errno("closedir");
+
+	bool ok = write_db(&db);
+	if (ok)
+		pr_info("compiled %u peers from `%s' (%u invalid)", (unsigned)VECTOR_LEN(db.peers), dir,
+			(unsigned)n_invalid);
+
+	VECTOR_FREE(db.peers);
+	VECTOR_FREE(db.remotes);
+	VECTOR_FREE(db.keys);
+	VECTOR_FREE(db.strings);
+
+	return ok;
+}
+
+/** Compiles the peer directories of a peer group and its children */
+static bool compile_group(fastd_peer_group_t *group) {
+	bool ok = true;
+
+	fastd_string_stack_t *dir;
+	for (dir = group->peer_dirs; dir; dir = dir->next) {
+		if (chdir(dir->str)) {
+			pr_error("can't chdir to `%s': %s", dir->str, strerror(errno));
+			ok = false;
+			continue;
+		}
+
+		if (!compile_dir(group, dir->str))
+			ok = false;
+	}
+
+	fastd_peer_group_t *child;
+	for (child = group->children; child; child = child->next) {
+		if (!compile_group(child))
+			ok = false;
+	}
+
+	return ok;
+}
+
+/**
+   Compiles all configured peer directories into peer databases
+
+   \return false if any directory couldn't be compiled
+*/
+bool fastd_peer_db_compile(void) {
+	char *oldcwd = get_current_dir_name();
+	bool ok = compile_group(conf.peer_group);
+
+	if (chdir(oldcwd))
+		pr_error("can't chdir to `%s': %s", oldcwd, strerror(errno));
+
+	free(oldcwd);
+
+	return ok;
+}
+
+
+/** Checks if a section of \e n elements of size \e size at \e offset lies within a database of size \e len */
+static inline bool check_section(size_t len, uint64_t offset, uint64_t n, size_t size) {
+	if (offset % PEER_DB_ALIGN || offset > len)
+		return false;
+
+	return n <= (len - offset) / size;
+}
+
+/** Checks if a string reference is valid */
+static inline bool check_string(const peer_db_header_t *header, uint32_t str, bool optional) {
+	if (str == PEER_DB_NONE)
+		return optional;
+
+	return str < header->strings_len;
+}
+
+/** Checks if a mapped database has been created by this version of fastd */
+static bool check_header(const uint8_t *data) {
+	const peer_db_header_t *header = (const peer_db_header_t *)data;
+	peer_db_header_t expected = {};
+
+	strncpy(expected.magic, PEER_DB_MAGIC, sizeof(expected.magic) - 1);
+	strncpy(expected.version, FASTD_VERSION, sizeof(expected.version) - 1);
+	strncpy(expected.protocol, conf.protocol->name, sizeof(expected.protocol) - 1);
+
+	return !memcmp(header->magic, expected.magic, sizeof(expected.magic)) && header->format == PEER_DB_FORMAT &&
+	       !memcmp(header->version, expected.version, sizeof(expected.version)) &&
+	       !memcmp(header->protocol, expected.protocol, sizeof(expected.protocol)) &&
+	       header->key_size == conf.protocol->key_size;
+}
+
+/** Checks the structure of a mapped database */
+static bool check_db(const uint8_t *data, size_t len) {
+	const peer_db_header_t *header = (const peer_db_header_t *)data;
+
+	if (!check_section(len, header->peers_offset, header->n_peers, sizeof(peer_db_peer_t)) ||
+	    !check_section(len, header->remotes_offset, header->n_remotes, sizeof(peer_db_remote_t)) ||
+	    !check_section(len, header->keys_offset, header->n_keys, key_stride()) ||
+	    !check_section(len, header->strings_offset, header->strings_len, 1))
+		return false;
+
+	/* The last string must be terminated, so all strings are */
+	const char *strings = (const char *)data + header->strings_offset;
+	if (header->strings_len && strings[header->strings_len - 1])
+		return false;
+
+	const peer_db_peer_t *peers = (const peer_db_peer_t *)(data + header->peers_offset);
+	const peer_db_remote_t *remotes = (const peer_db_remote_t *)(data + header->remotes_offset);
+	size_t i;
+
+	for (i = 0; i < header->n_peers; i++) {
+		const peer_db_peer_t *peer = &peers[i];
+
+		if (!check_string(header, peer->name, false) || !check_string(header, peer->ifname, true))
+			return false;
+		if (peer->key != PEER_DB_NONE && peer->key >= header->n_keys)
+			return false;
+		if ((uint64_t)peer->first_remote + peer->n_remotes > header->n_remotes)
+			return false;
+	}
+
+	for (i = 0; i < header->n_remotes; i++) {
+		if (!check_string(header, remotes[i].hostname, true))
+			return false;
+	}
+
+	return true;
+}
+
+/** Checks if the peer directory and its peer files still match the database */
+static bool check_files(const uint8_t *data) {
+	const peer_db_header_t *header = (const peer_db_header_t *)data;
+	const peer_db_peer_t *peers = (const peer_db_peer_t *)(data + header->peers_offset);
+	const char *strings = (const char *)data + header->strings_offset;
+	struct stat statbuf;
+	size_t i;
+
+	/* Files have been added or removed */
+	if (stat(".", &statbuf) < 0 || timespec_ns(STAT_MTIM(&statbuf)) != header->dir_mtime)
+		return false;
+
+	for (i = 0; i < header->n_peers; i++) {
+		const peer_db_peer_t *peer = &peers[i];
+
+		if (stat(strings + peer->name, &statbuf) < 0)
+			return false;
+
+		if (timespec_ns(STAT_MTIM(&statbuf)) != peer->mtime ||
+		    timespec_ns(STAT_CTIM(&statbuf)) != peer->ctime || (uint64_t)statbuf.st_size != peer->size ||
+		    (uint64_t)statbuf.st_ino != peer->ino)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+   Checks if the keys in the database are compatible with this build of fastd
+
+   The internal representation of unpacked keys may differ between builds with the same version (for example, when
+   a different ECC implementation is used), so the first key is compared with the key read from its peer file.
+*/
+static bool check_keys(fastd_peer_group_t *group, const char *dir, const uint8_t *data) {
+	const peer_db_header_t *header = (const peer_db_header_t *)data;
+	const peer_db_peer_t *peers = (const peer_db_peer_t *)(data + header->peers_offset);
+	const char *strings = (const char *)data + header->strings_offset;
+	size_t i;
+
+	for (i = 0; i < header->n_peers; i++) {
+		if (peers[i].key != PEER_DB_NONE)
+			break;
+	}
+
+	if (i == header->n_peers)
+		return true;
+
+	fastd_peer_t *peer = fastd_config_read_peer(group, dir, strings + peers[i].name);
+	if (!peer)
+		return false;
+
+	const uint8_t *key = data + header->keys_offset + peers[i].key * key_stride();
+	bool ok = peer->key && !memcmp(peer->key, key, conf.protocol->key_size);
+
+	fastd_peer_free(peer);
+
+	if (!ok)
+		pr_verbose(
+			"peer database in `%s' was created by an incompatible build of fastd, reading peer files", dir);
+
+	return ok;
+}
+
+/** Adds the peers of a checked database */
+static void load_peers(fastd_peer_group_t *group, const char *dir, const uint8_t *data) {
+	const peer_db_header_t *header = (const peer_db_header_t *)data;
+	const peer_db_peer_t *peers = (const peer_db_peer_t *)(data + header->peers_offset);
+	const peer_db_remote_t *remotes = (const peer_db_remote_t *)(data + header->remotes_offset);
+	const char *strings = (const char *)data + header->strings_offset;
+	size_t i, j;
+
+	for (i = 0; i < header->n_peers; i++) {
+		const peer_db_peer_t *record = &peers[i];
+
+		if (!(record->flags & PEER_DB_VALID)) {
+			pr_warn("ignoring invalid peer file `%s' in `%s'", strings + record->name, dir);
+			continue;
+		}
+
+		fastd_peer_t *peer = fastd_new0(fastd_peer_t);
+		peer->name = fastd_strdup(strings + record->name);
+		peer->group = group;
+		peer->config_source_dir = dir;
+		peer->floating = record->flags & PEER_DB_FLOATING;
+		peer->mtu = record->mtu;
+
+		if (record->ifname != PEER_DB_NONE)
+			peer->ifname = fastd_strdup(strings + record->ifname);
+
+		if (record->key != PEER_DB_NONE) {
+			peer->key = fastd_alloc(conf.protocol->key_size);
+			memcpy(peer->key, data + header->keys_offset + record->key * key_stride(),
+			       conf.protocol->key_size);
+		}
+
+		for (j = 0; j < record->n_remotes; j++) {
+			const peer_db_remote_t *remote_record = &remotes[record->first_remote + j];
+			fastd_remote_t remote = { .address = remote_record->address };
+
+			if (remote_record->hostname != PEER_DB_NONE)
+				remote.hostname = fastd_strdup(strings + remote_record->hostname);
+
+			VECTOR_ADD(peer->remotes, remote);
+		}
+
+		fastd_peer_add(peer);
+	}
+
+	pr_verbose("loaded %u peers from the peer database in `%s'", (unsigned)header->n_peers, dir);
+}
+
+/**
+   Loads the peers of the peer directory \e dir (which must be the current directory) from its compiled database
+
+   \return false if there is no usable database, so the peer files must be read
+*/
+bool fastd_peer_db_load(fastd_peer_group_t *group, const char *dir) {
+	int fd = open(PEER_DB_NAME, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			pr_warn("unable to open peer database in `%s': %s", dir, strerror(errno));
+
+		return false;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0) {
+		pr_warn("unable to open peer database in `%s': fstat: %s", dir, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	size_t len = statbuf.st_size;
+	if (len < sizeof(peer_db_header_t)) {
+		pr_warn("peer database in `%s' is invalid, reading peer files", dir);
+		close(fd);
+		return false;
+	}
+
+	const uint8_t *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		pr_warn("unable to map peer database in `%s': %s", dir, strerror(errno));
+		return false;
+	}
+
+	bool ok = false;
+
+	if (!check_header(data))
+		pr_verbose(
+			"peer database in `%s' was created by a different version of fastd, reading peer files", dir);
+	else if (!check_db(data, len))
+		pr_warn("peer database in `%s' is invalid, reading peer files", dir);
+	else if (!check_files(data))
+		pr_verbose("peer database in `%s' is out of date, reading peer files", dir);
+	else if (check_keys(group, dir, data))
+		ok = true;
+
+	if (ok)
+		load_peers(group, dir, data);
+
+	munmap((void *)data, len);
+
+	return ok;
+}
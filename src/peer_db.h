@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Compiled peer databases
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+bool fastd_peer_db_compile(void);
+bool fastd_peer_db_load(fastd_peer_group_t *group, const char *dir);
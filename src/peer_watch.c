@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Watching peer directories for changes
+
+   When `watch peer dirs` is enabled, the configured peer directories are watched using inotify. Only the files
+   that have been written, moved or deleted are read again, instead of reloading all peer directories as on
+   SIGHUP. When the kernel's event queue overflows, all peer directories are reloaded.
+*/
+
+
+#include "peer_watch.h"
+
+
+#ifdef USE_INOTIFY
+
+#include "config.h"
+#include "fastd.h"
+#include "peer_group.h"
+#include "polling.h"
+
+#include <sys/inotify.h>
+
+
+/** The events that make fastd re-read a file in a watched peer directory */
+#define PEER_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+/** A watched peer directory */
+typedef struct peer_watch {
+	int wd;                    /**< The inotify watch descriptor */
+	fastd_peer_group_t *group; /**< The peer group the directory belongs to */
+	const char *dir;           /**< The path of the directory */
+} peer_watch_t;
+
+
+/** The watched peer directories */
+static VECTOR(peer_watch_t) watches = {};
+
+
+/** Adds watches for the peer dirs of a peer group and its children */
+static void watch_peer_group(fastd_peer_group_t *group) {
+	fastd_string_stack_t *dir;
+	for (dir = group->peer_dirs; dir; dir = dir->next) {
+		int wd = inotify_add_watch(ctx.peer_watch_fd.fd, dir->str, PEER_WATCH_EVENTS | IN_ONLYDIR);
+		if (wd < 0) {
+			pr_warn("unable to watch peer directory `%s': %s", dir->str, strerror(errno));
+			continue;
+		}
+
+		peer_watch_t watch = { .wd = wd, .group = group, .dir = dir->str };
+		VECTOR_ADD(watches, watch);
+	}
+
+	fastd_peer_group_t *child;
+	for (child = group->children; child; child = child->next)
+		watch_peer_group(child);
+}
+
+/**
+   Starts watching the peer directories (if enabled)
+
+   This must be called before the peer directories are loaded, so no change can get lost.
+*/
+void fastd_peer_watch_init(void) {
+	ctx.peer_watch_fd = FASTD_POLL_FD(POLL_TYPE_PEER_WATCH, -1);
+
+	if (!conf.watch_peer_dirs)
+		return;
+
+	ctx.peer_watch_fd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ctx.peer_watch_fd.fd < 0) {
+		pr_error_errno("unable to watch peer directories: inotify_init1");
+		return;
+	}
+
+	watch_peer_group(conf.peer_group);
+	fastd_poll_fd_register(&ctx.peer_watch_fd);
+}
+
+/** Stops watching the peer directories */
+void fastd_peer_watch_close(void) {
+	VECTOR_FREE(watches);
+
+	if (ctx.peer_watch_fd.fd < 0)
+		return;
+
+	if (!fastd_poll_fd_close(&ctx.peer_watch_fd))
+		pr_warn_errno("fastd_peer_watch_close: close");
+
+	ctx.peer_watch_fd.fd = -1;
+}
+
+/** Handles a single inotify event, returning true if a peer file has been re-read */
+static bool handle_event(const struct inotify_event *event) {
+	bool changed = false;
+	size_t i = 0;
+
+	/* The same directory may be watched for multiple peer groups */
+	while (i < VECTOR_LEN(watches)) {
+		const peer_watch_t *watch = &VECTOR_INDEX(watches, i);
+
+		if (watch->wd != event->wd) {
+			i++;
+			continue;
+		}
+
+		if (event->mask & IN_IGNORED) {
+			VECTOR_DELETE(watches, i);
+			continue;
+		}
+
+		if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+			pr_warn("peer directory `%s' has been removed or renamed, not watching it anymore", watch->dir);
+			inotify_rm_watch(ctx.peer_watch_fd.fd, watch->wd);
+		} else if (event->len && event->name[0] != '.') {
+			/* Hidden files are never peer configurations, and compiled peer databases are among them */
+			pr_debug("peer file `%s' in directory `%s' has changed", event->name, watch->dir);
+			fastd_config_reload_peer_file(watch->group, watch->dir, event->name);
+			changed = true;
+		}
+
+		i++;
+	}
+
+	return changed;
+}
+
+/** Handles the events of the inotify instance */
+void fastd_peer_watch_handle(void) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false, overflow = false;
+
+	while (true) {
+		ssize_t len = read(ctx.peer_watch_fd.fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pr_error_errno("fastd_peer_watch_handle: read");
+
+			break;
+		}
+
+		if (!len)
+			break;
+
+		const char *ptr = buf;
+		while (ptr < buf + len) {
+			const struct inotify_event *event = (const struct inotify_event *)ptr;
+			ptr += sizeof(*event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+				overflow = true;
+			else if (handle_event(event))
+				changed = true;
+		}
+	}
+
+	if (changed)
+		fastd_config_apply_peer_changes();
+
+	if (overflow) {
+		pr_warn("too many changes in the peer directories, reloading all peers");
+		fastd_config_load_peer_dirs(true);
+	}
+}
+
+#endif /* USE_INOTIFY */
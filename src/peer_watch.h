@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Watching peer directories for changes
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef USE_INOTIFY
+
+void fastd_peer_watch_init(void);
+void fastd_peer_watch_handle(void);
+void fastd_peer_watch_close(void);
+
+#else
+
+static inline void fastd_peer_watch_init(void) {}
+static inline void fastd_peer_watch_close(void) {}
+
+#endif
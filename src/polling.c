@@ -13,7 +13,14 @@
 
 #include "polling.h"
 #include "async.h"
+#include "latency.h"
 #include "peer.h"
+#include "metrics.h"
+#include "peer_watch.h"
+#include "spawn_server.h"
+#include "uring.h"
+#include "verify.h"
+#include "xdp.h"
 
 #include <signal.h>
 
@@ -47,7 +54,7 @@ static inline int task_timeout(void) {
 
 
 /** Handles a file descriptor that was selected on */
-static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
+void fastd_poll_handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 	switch (fd->type) {
 	case POLL_TYPE_ASYNC:
 		if (input)
@@ -59,6 +66,29 @@ static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 			fastd_status_handle();
 		break;
 
+#ifdef WITH_STATUS_SOCKET
+	case POLL_TYPE_STATUS_CONN:
+		/* A hangup is handled like EOF */
+		if (input || error)
+			fastd_status_handle_conn(fd);
+
+		return;
+#endif
+
+#ifdef WITH_METRICS_SOCKET
+	case POLL_TYPE_METRICS:
+		if (input)
+			fastd_metrics_handle();
+		break;
+
+	case POLL_TYPE_METRICS_CONN:
+		/* A hangup is handled like EOF */
+		if (input || error)
+			fastd_metrics_handle_conn(fd);
+
+		return;
+#endif
+
 	case POLL_TYPE_IFACE: {
 		fastd_iface_t *iface = container_of(fd, fastd_iface_t, fd);
 
@@ -86,6 +116,38 @@ static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 		break;
 	}
 
+#ifdef WITH_DYNAMIC_PEERS
+	case POLL_TYPE_VERIFY_HELPER:
+		/* A hangup is handled like EOF */
+		if (input || error)
+			fastd_verify_helper_handle();
+
+		return;
+#endif
+
+#ifdef USE_SPAWN_SERVER
+	case POLL_TYPE_SPAWN:
+		/* A hangup is handled like EOF */
+		if (input || error)
+			fastd_spawn_server_handle();
+
+		return;
+#endif
+
+#ifdef USE_INOTIFY
+	case POLL_TYPE_PEER_WATCH:
+		if (input)
+			fastd_peer_watch_handle();
+		break;
+#endif
+
+#ifdef WITH_XDP
+	case POLL_TYPE_XDP:
+		if (input)
+			fastd_xdp_handle(fd);
+		break;
+#endif
+
 	default:
 		exit_bug("unknown FD type");
 	}
@@ -110,12 +172,24 @@ static inline int epoll_wait_unblocked(int epfd, struct epoll_event *events, int
 
 
 void fastd_poll_init(void) {
+#ifdef USE_IO_URING
+	if (conf.io_uring && fastd_uring_init())
+		return;
+#endif
+
 	ctx.epoll_fd = epoll_create(1);
 	if (ctx.epoll_fd < 0)
 		exit_errno("epoll_create1");
 }
 
 void fastd_poll_free(void) {
+#ifdef USE_IO_URING
+	if (ctx.uring) {
+		fastd_uring_free();
+		return;
+	}
+#endif
+
 	if (close(ctx.epoll_fd))
 		pr_warn_errno("closing EPOLL: close");
 }
@@ -125,6 +199,13 @@ void fastd_poll_fd_register(fastd_poll_fd_t *fd) {
 	if (fd->fd < 0)
 		exit_bug("fastd_poll_fd_register: invalid FD");
 
+#ifdef USE_IO_URING
+	if (ctx.uring) {
+		fastd_uring_fd_register(fd);
+		return;
+	}
+#endif
+
 	struct epoll_event event = {
 		.events = EPOLLIN,
 		.data.ptr = fd,
@@ -135,6 +216,13 @@ void fastd_poll_fd_register(fastd_poll_fd_t *fd) {
 }
 
 bool fastd_poll_fd_close(fastd_poll_fd_t *fd) {
+#ifdef USE_IO_URING
+	if (ctx.uring) {
+		fastd_uring_fd_unregister(fd);
+		return (close(fd->fd) == 0);
+	}
+#endif
+
 	if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_DEL, fd->fd, NULL) < 0)
 		exit_errno("epoll_ctl");
 
@@ -145,6 +233,13 @@ bool fastd_poll_fd_close(fastd_poll_fd_t *fd) {
 void fastd_poll_handle(void) {
 	int timeout = task_timeout();
 
+#ifdef USE_IO_URING
+	if (ctx.uring) {
+		fastd_uring_handle(timeout);
+		return;
+	}
+#endif
+
 	struct epoll_event events[16];
 	int ret = epoll_wait_unblocked(ctx.epoll_fd, events, 16, timeout);
 	if (ret < 0 && errno != EINTR)
@@ -152,12 +247,17 @@ void fastd_poll_handle(void) {
 
 	fastd_update_time();
 
-	if (ret < 0)
+	if (ret <= 0)
 		return;
 
+	int64_t start = fastd_latency_start();
+
 	size_t i;
 	for (i = 0; i < (size_t)ret; i++)
-		handle_fd(events[i].data.ptr, events[i].events & EPOLLIN, events[i].events & (EPOLLERR | EPOLLHUP));
+		fastd_poll_handle_fd(
+			events[i].data.ptr, events[i].events & EPOLLIN, events[i].events & (EPOLLERR | EPOLLHUP));
+
+	fastd_latency_record_poll(start, ret);
 }
 
 #else
@@ -282,16 +382,21 @@ void fastd_poll_handle(void) {
 	if (ret <= 0)
 		return;
 
+	int64_t start = fastd_latency_start();
+	size_t events = ret;
+
 	for (i = 0; i < VECTOR_LEN(ctx.pollfds) && ret > 0; i++) {
 		struct pollfd *pollfd = &VECTOR_INDEX(ctx.pollfds, i);
 
 		if (pollfd->revents)
 			ret--;
 
-		handle_fd(
+		fastd_poll_handle_fd(
 			VECTOR_INDEX(ctx.fds, pollfd->fd), pollfd->revents & POLLIN,
 			pollfd->revents & (POLLERR | POLLHUP | POLLNVAL));
 	}
+
+	fastd_latency_record_poll(start, events);
 }
 
 #endif
@@ -39,3 +39,5 @@ bool fastd_poll_fd_close(fastd_poll_fd_t *fd);
 
 /** Waits for the next input event */
 void fastd_poll_handle(void);
+/** Handles an event of a file descriptor */
+void fastd_poll_handle_fd(fastd_poll_fd_t *fd, bool input, bool error);
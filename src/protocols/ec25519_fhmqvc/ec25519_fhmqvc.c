@@ -12,6 +12,8 @@
 
 
 #include "ec25519_fhmqvc.h"
+#include "../../latency.h"
+#include "../../trace.h"
 
 
 /** Converts a private or public key from a hexadecimal string representation to a uint8 array */
@@ -32,6 +34,7 @@ static inline void check_session_refresh(fastd_peer_t *peer) {
 
 	if (!session->refreshing && session->method->provider->session_want_refresh(session->method_state)) {
 		pr_verbose("refreshing session with %P", peer);
+		fastd_trace(session_refresh, peer->id);
 		session->handshakes_cleaned = true;
 		session->refreshing = true;
 		fastd_peer_schedule_handshake(peer, 0);
@@ -115,18 +118,30 @@ static void protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t buffer) {
 
 	fastd_buffer_zero_pad(buffer);
 
-	if (is_session_valid(&peer->protocol_state->old_session))
+	int64_t start = fastd_latency_start(), cpu_start = fastd_cpu_start();
+
+	if (is_session_valid(&peer->protocol_state->old_session)) {
 		ok = peer->protocol_state->old_session.method->provider->decrypt(
 			peer, peer->protocol_state->old_session.method_state, &recv_buffer, buffer, &reordered);
+		if (ok) {
+			fastd_latency_record_method(LATENCY_RX_DECRYPT, peer->protocol_state->old_session.method, start);
+			fastd_cpu_add(peer, CPU_DECRYPT, cpu_start);
+		}
+	}
 
 	if (!ok) {
 		ok = peer->protocol_state->session.method->provider->decrypt(
 			peer, peer->protocol_state->session.method_state, &recv_buffer, buffer, &reordered);
 		if (!ok) {
 			pr_debug2("verification failed for packet received from %P", peer);
+			fastd_trace(decrypt_fail, peer->id, buffer.len);
+			fastd_cpu_add(peer, CPU_DECRYPT, cpu_start);
 			goto fail;
 		}
 
+		fastd_latency_record_method(LATENCY_RX_DECRYPT, peer->protocol_state->session.method, start);
+		fastd_cpu_add(peer, CPU_DECRYPT, cpu_start);
+
 		if (peer->protocol_state->old_session.method) {
 			pr_debug("invalidating old session with %P", peer);
 			peer->protocol_state->old_session.method->provider->session_free(
@@ -148,6 +163,7 @@ static void protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t buffer) {
 	}
 
 	fastd_peer_seen(peer);
+	fastd_trace(decrypt_ok, peer->id, recv_buffer.len);
 
 	if (recv_buffer.len)
 		fastd_handle_receive(peer, recv_buffer, reordered);
@@ -166,6 +182,8 @@ static void session_send(fastd_peer_t *peer, fastd_buffer_t buffer, protocol_ses
 
 	fastd_buffer_zero_pad(buffer);
 
+	int64_t start = fastd_latency_start(), cpu_start = fastd_cpu_start();
+
 	fastd_buffer_t send_buffer;
 	if (!session->method->provider->encrypt(peer, session->method_state, &send_buffer, buffer)) {
 		fastd_buffer_free(buffer);
@@ -173,6 +191,9 @@ static void session_send(fastd_peer_t *peer, fastd_buffer_t buffer, protocol_ses
 		return;
 	}
 
+	fastd_latency_record_method(LATENCY_TX_ENCRYPT, session->method, start);
+	fastd_cpu_add(peer, CPU_ENCRYPT, cpu_start);
+
 	fastd_send(peer->sock, &peer->local_address, &peer->address, peer, send_buffer, stat_size);
 	fastd_peer_clear_keepalive(peer);
 }
@@ -199,6 +220,29 @@ void fastd_protocol_ec25519_fhmqvc_send_empty(fastd_peer_t *peer, protocol_sessi
 	session_send(peer, fastd_buffer_alloc(0, alignto(session->method->provider->encrypt_headroom, 8), 0), session);
 }
 
+/** Handles the result of a job run on a worker thread */
+static void protocol_handle_async_return(const void *data, size_t len) {
+	protocol_async_type_t *job;
+
+	if (len != sizeof(job))
+		exit_bug("ec25519-fhmqvc: invalid async return");
+
+	memcpy(&job, data, sizeof(job));
+
+	switch (*job) {
+	case PROTOCOL_ASYNC_HANDSHAKE:
+		fastd_protocol_ec25519_fhmqvc_handshake_return(job);
+		break;
+
+	case PROTOCOL_ASYNC_HANDSHAKE_KEY:
+		fastd_protocol_ec25519_fhmqvc_handshake_key_return(job);
+		break;
+
+	default:
+		exit_bug("ec25519-fhmqvc: unknown async return type");
+	}
+}
+
 /** get_current_method implementation for ec25519-fhmqvp */
 const fastd_method_info_t *protocol_get_current_method(const fastd_peer_t *peer) {
 	if (!peer->protocol_state || !fastd_peer_is_established(peer))
@@ -222,6 +266,7 @@ const fastd_protocol_t fastd_protocol_ec25519_fhmqvc = {
 #ifdef WITH_DYNAMIC_PEERS
 	.handle_verify_return = fastd_protocol_ec25519_fhmqvc_handle_verify_return,
 #endif
+	.handle_async_return = protocol_handle_async_return,
 
 	.handle_recv = protocol_handle_recv,
 	.send = protocol_send,
@@ -230,6 +275,7 @@ const fastd_protocol_t fastd_protocol_ec25519_fhmqvc = {
 	.reset_peer_state = fastd_protocol_ec25519_fhmqvc_reset_peer_state,
 	.free_peer_state = fastd_protocol_ec25519_fhmqvc_free_peer_state,
 
+	.key_size = sizeof(fastd_protocol_key_t),
 	.read_key = protocol_read_key,
 	.check_peer = protocol_check_peer,
 	.find_peer = fastd_protocol_ec25519_fhmqvc_find_peer,
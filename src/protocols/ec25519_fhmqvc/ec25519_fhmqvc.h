@@ -14,12 +14,38 @@
 #pragma once
 
 #include "../../fastd.h"
+#include "../../handshake.h"
 #include "../../method.h"
 #include "../../peer.h"
 #include "../../sha256.h"
 
+#ifdef USE_BUILTIN_ECC
+
+#include "../../ecc25519.h"
+
+/* Map the libuecc API to the built-in implementation */
+#define ecc_int256_t fastd_ecc_int256_t
+#define ecc_25519_work_t fastd_ecc_25519_work_t
+#define ecc_25519_work_identity fastd_ecc_25519_work_identity
+#define ecc_25519_load_packed_legacy fastd_ecc_25519_load_packed_legacy
+#define ecc_25519_store_packed_legacy fastd_ecc_25519_store_packed_legacy
+#define ecc_25519_is_identity fastd_ecc_25519_is_identity
+#define ecc_25519_double fastd_ecc_25519_double
+#define ecc_25519_add fastd_ecc_25519_add
+#define ecc_25519_sub fastd_ecc_25519_sub
+#define ecc_25519_scalarmult_bits fastd_ecc_25519_scalarmult_bits
+#define ecc_25519_scalarmult fastd_ecc_25519_scalarmult
+#define ecc_25519_scalarmult_base fastd_ecc_25519_scalarmult_base
+#define ecc_25519_gf_add fastd_ecc_25519_gf_add
+#define ecc_25519_gf_mult fastd_ecc_25519_gf_mult
+#define ecc_25519_gf_sanitize_secret fastd_ecc_25519_gf_sanitize_secret
+
+#else
+
 #include <libuecc/ecc.h>
 
+#endif
+
 
 /** The length of a \em ec25519-fhmqvc public key */
 #define PUBLICKEYBYTES 32
@@ -28,7 +54,7 @@
 #define SECRETKEYBYTES 32
 
 
-/** A \e libuecc int256, aligned to 32bit, so it can be used as input to the SHA256 functions */
+/** An ecc_int256_t, aligned to 32bit, so it can be used as input to the SHA256 functions */
 typedef union aligned_int256 {
 	ecc_int256_t int256; /**< ecc_int256_t access */
 	uint32_t u32[8];     /**< 32bit-wise access */
@@ -46,6 +72,20 @@ struct fastd_protocol_config {
 	keypair_t key; /**< The own keypair */
 };
 
+/** The number of precomputed odd multiples of a peer's public key (P, 3P, ..., 15P) */
+#define KEY_TABLE_SIZE 8
+
+/** Precomputed multiples of a peer's public key (see key_table.c) */
+typedef struct key_table {
+	struct key_table *prev; /**< The previous (more recently used) table in the LRU list */
+	struct key_table *next; /**< The next (less recently used) table in the LRU list */
+
+	const fastd_peer_t *peer; /**< The peer the table belongs to (NULL after the table has been evicted) */
+	unsigned refcount;        /**< The number of references (the cache and pending handshake jobs) */
+
+	ecc_25519_work_t multiples[KEY_TABLE_SIZE]; /**< The odd multiples of the public key */
+} key_table_t;
+
 /** A peer's public key */
 struct fastd_protocol_key {
 	aligned_int256_t key;      /**< The peer's public key */
@@ -80,9 +120,27 @@ struct fastd_protocol_peer_state {
 	aligned_int256_t peer_handshake_key; /**< The peer's ephemeral public key used in the last handshake */
 	aligned_int256_t sigma;              /**< The value of sigma used in the last handshake */
 	fastd_sha256_t shared_handshake_key; /**< The shared handshake key used in the last handshake */
+
+	uint64_t handshake_job;                /**< The serial number of the last handshake job queued for the peer */
+	fastd_timeout_t handshake_job_timeout; /**< Until when further handshakes are ignored as a handshake with the
+						  peer is processed on a worker thread */
+
+	uint8_t cookie[COOKIE_BYTES];        /**< The last cookie received from the peer */
+	uint64_t cookie_serial;              /**< The serial number of the ephemeral keypair the cookie is bound to */
+	fastd_peer_address_t cookie_address; /**< The address the cookie was received from */
+	fastd_timeout_t cookie_timeout;      /**< Until when the cookie is sent with initial handshakes */
+
+	key_table_t *key_table; /**< The cached precomputed multiples of the peer's public key (or NULL) */
 };
 
 
+/** The types of protocol-specific jobs that are run on worker threads */
+typedef enum protocol_async_type {
+	PROTOCOL_ASYNC_HANDSHAKE,     /**< A received handshake (see handshake.c) */
+	PROTOCOL_ASYNC_HANDSHAKE_KEY, /**< A new ephemeral keypair (see state.c) */
+} protocol_async_type_t;
+
+
 void fastd_protocol_ec25519_fhmqvc_maintenance(void);
 void fastd_protocol_ec25519_fhmqvc_init_peer_state(fastd_peer_t *peer);
 void fastd_protocol_ec25519_fhmqvc_reset_peer_state(fastd_peer_t *peer);
@@ -101,6 +159,15 @@ void fastd_protocol_ec25519_fhmqvc_handle_verify_return(
 	const fastd_peer_address_t *remote_addr, const void *protocol_data, bool ok);
 #endif
 
+void fastd_protocol_ec25519_fhmqvc_handshake_return(void *job);
+void fastd_protocol_ec25519_fhmqvc_handshake_key_return(void *job);
+
+const key_table_t *fastd_protocol_ec25519_fhmqvc_key_table_get(const fastd_peer_t *peer);
+void fastd_protocol_ec25519_fhmqvc_key_table_put(const key_table_t *table);
+void fastd_protocol_ec25519_fhmqvc_key_table_release(const fastd_peer_t *peer);
+void fastd_protocol_ec25519_fhmqvc_key_table_scalarmult(
+	ecc_25519_work_t *out, const ecc_int256_t *n, const key_table_t *table, unsigned bits);
+
 void fastd_protocol_ec25519_fhmqvc_send_empty(fastd_peer_t *peer, protocol_session_t *session);
 
 fastd_peer_t *fastd_protocol_ec25519_fhmqvc_find_peer(const fastd_protocol_key_t *key);
@@ -139,6 +206,21 @@ static inline bool divide_key(ecc_int256_t *key) {
 	return (c == 0);
 }
 
+/**
+   Stores multiple points in packed form
+
+   The built-in Curve25519 implementation shares a single field inversion between all points.
+*/
+static inline void store_packed_batch(ecc_int256_t *const out[], const ecc_25519_work_t in[], size_t n) {
+#ifdef USE_BUILTIN_ECC
+	fastd_ecc_25519_store_packed_legacy_batch(out, in, n);
+#else
+	size_t i;
+	for (i = 0; i < n; i++)
+		ecc_25519_store_packed_legacy(out[i], &in[i]);
+#endif
+}
+
 /** Multiplies a point by 8 */
 static inline void octuple_point(ecc_25519_work_t *p) {
 	ecc_25519_work_t work;
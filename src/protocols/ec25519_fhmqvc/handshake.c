@@ -11,11 +11,14 @@
 */
 
 #include "handshake.h"
+#include "../../async.h"
 #include "../../crypto.h"
 #include "../../handshake.h"
 #include "../../hkdf_sha256.h"
 #include "../../peer_group.h"
+#include "../../trace.h"
 #include "../../verify.h"
+#include "../../worker.h"
 
 
 /** The size of the hash outputs used in the handshake */
@@ -141,6 +144,7 @@ static bool establish(
 	peer->establish_handshake_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
 
 	pr_verbose("new session with %P established using method `%s'.", peer, method->name);
+	fastd_trace(handshake_finish, peer->id, initiator, method->name);
 
 	if (initiator)
 		fastd_peer_schedule_handshake_default(peer);
@@ -157,12 +161,43 @@ static inline bool has_field(const fastd_handshake_t *handshake, uint8_t type, s
 }
 
 
-/** Derives the shares handshake key for computing the MACs used in the handshake */
-static bool make_shared_handshake_key(
+/** Multiplies a peer's public key with a 128-bit scalar, using the precomputed key table if available */
+static inline void scalarmult_peer_key(
+	ecc_25519_work_t *out, const ecc_int256_t *n, const fastd_protocol_key_t *peer_key,
+	const key_table_t *peer_key_table) {
+	if (peer_key_table)
+		fastd_protocol_ec25519_fhmqvc_key_table_scalarmult(out, n, peer_key_table, 128);
+	else
+		ecc_25519_scalarmult_bits(out, n, &peer_key->unpacked, 128);
+}
+
+/** Assigns the public keys to the roles A, B (long-term keys) and X, Y (ephemeral keys) of the handshake */
+static inline void order_keys(
 	bool initiator, const keypair_t *handshake_key, const fastd_protocol_key_t *peer_key,
-	const aligned_int256_t *peer_handshake_key, aligned_int256_t *sigma, fastd_sha256_t *shared_handshake_key) {
-	static const uint32_t zero_salt[FASTD_HMACSHA256_KEY_WORDS] = {};
+	const aligned_int256_t *peer_handshake_key, const aligned_int256_t **A, const aligned_int256_t **B,
+	const aligned_int256_t **X, const aligned_int256_t **Y) {
+	if (initiator) {
+		*A = &conf.protocol_config->key.public;
+		*B = &peer_key->key;
+		*X = &handshake_key->public;
+		*Y = peer_handshake_key;
+	} else {
+		*A = &peer_key->key;
+		*B = &conf.protocol_config->key.public;
+		*X = peer_handshake_key;
+		*Y = &handshake_key->public;
+	}
+}
+
+/**
+   Computes the point sigma is the packed form of
 
+   The point is returned unpacked, so the field inversion needed to pack it can be shared between multiple
+   handshakes. \e peer_key_table may be NULL.
+*/
+static bool make_sigma_point(
+	bool initiator, const keypair_t *handshake_key, const fastd_protocol_key_t *peer_key,
+	const key_table_t *peer_key_table, const aligned_int256_t *peer_handshake_key, ecc_25519_work_t *out) {
 	const aligned_int256_t *A, *B, *X, *Y;
 	ecc_25519_work_t work, workXY;
 
@@ -172,17 +207,7 @@ static bool make_shared_handshake_key(
 	if (ecc_25519_is_identity(&workXY))
 		return false;
 
-	if (initiator) {
-		A = &conf.protocol_config->key.public;
-		B = &peer_key->key;
-		X = &handshake_key->public;
-		Y = peer_handshake_key;
-	} else {
-		A = &peer_key->key;
-		B = &conf.protocol_config->key.public;
-		X = peer_handshake_key;
-		Y = &handshake_key->public;
-	}
+	order_keys(initiator, handshake_key, peer_key, peer_handshake_key, &A, &B, &X, &Y);
 
 	fastd_sha256_t hashbuf;
 	fastd_sha256_blocks(&hashbuf, Y->u32, X->u32, B->u32, A->u32, NULL);
@@ -200,13 +225,13 @@ static bool make_shared_handshake_key(
 		ecc_25519_gf_mult(&da, &d, &conf.protocol_config->key.secret);
 		ecc_25519_gf_add(&s, &da, &handshake_key->secret);
 
-		ecc_25519_scalarmult_bits(&work, &e, &peer_key->unpacked, 128);
+		scalarmult_peer_key(&work, &e, peer_key, peer_key_table);
 	} else {
 		ecc_int256_t eb;
 		ecc_25519_gf_mult(&eb, &e, &conf.protocol_config->key.secret);
 		ecc_25519_gf_add(&s, &eb, &handshake_key->secret);
 
-		ecc_25519_scalarmult_bits(&work, &d, &peer_key->unpacked, 128);
+		scalarmult_peer_key(&work, &d, peer_key, peer_key_table);
 	}
 
 	ecc_25519_add(&work, &workXY, &work);
@@ -222,29 +247,77 @@ static bool make_shared_handshake_key(
 	*/
 	octuple_point(&work);
 
-	ecc_25519_scalarmult(&work, &s, &work);
+	ecc_25519_scalarmult(out, &s, &work);
 
-	if (ecc_25519_is_identity(&work))
+	return !ecc_25519_is_identity(out);
+}
+
+/** Derives the shared handshake key for computing the MACs used in the handshake from sigma */
+static void derive_shared_handshake_key(
+	bool initiator, const keypair_t *handshake_key, const fastd_protocol_key_t *peer_key,
+	const aligned_int256_t *peer_handshake_key, const aligned_int256_t *sigma,
+	fastd_sha256_t *shared_handshake_key) {
+	static const uint32_t zero_salt[FASTD_HMACSHA256_KEY_WORDS] = {};
+
+	const aligned_int256_t *A, *B, *X, *Y;
+	order_keys(initiator, handshake_key, peer_key, peer_handshake_key, &A, &B, &X, &Y);
+
+	derive_key(shared_handshake_key, 1, zero_salt, "", A, B, X, Y, sigma);
+}
+
+/**
+   Derives the shares handshake key for computing the MACs used in the handshake
+
+   \e peer_key_table may be NULL.
+*/
+static bool make_shared_handshake_key(
+	bool initiator, const keypair_t *handshake_key, const fastd_protocol_key_t *peer_key,
+	const key_table_t *peer_key_table, const aligned_int256_t *peer_handshake_key, aligned_int256_t *sigma,
+	fastd_sha256_t *shared_handshake_key) {
+	ecc_25519_work_t work;
+
+	if (!make_sigma_point(initiator, handshake_key, peer_key, peer_key_table, peer_handshake_key, &work))
 		return false;
 
 	ecc_25519_store_packed_legacy(&sigma->int256, &work);
 
-	derive_key(shared_handshake_key, 1, zero_salt, "", A, B, X, Y, sigma);
+	derive_shared_handshake_key(initiator, handshake_key, peer_key, peer_handshake_key, sigma, shared_handshake_key);
 
 	return true;
 }
 
+/** Checks if the shared handshake key for the given keys is in the peer's handshake cache */
+static inline bool is_shared_handshake_key_cached(
+	const fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key) {
+	return (peer->protocol_state->last_handshake_serial == handshake_key->serial &&
+		secure_memequal(&peer->protocol_state->peer_handshake_key, peer_handshake_key, PUBLICKEYBYTES));
+}
+
+/** Stores a shared handshake key in the peer's handshake cache */
+static void set_shared_handshake_key(
+	const fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
+	const aligned_int256_t *sigma, const fastd_sha256_t *shared_handshake_key) {
+	peer->protocol_state->last_handshake_serial = handshake_key->serial;
+	peer->protocol_state->peer_handshake_key = *peer_handshake_key;
+	peer->protocol_state->sigma = *sigma;
+	peer->protocol_state->shared_handshake_key = *shared_handshake_key;
+}
+
 /** Checks if the currently cached shared handshake key is valid and generates a new one otherwise  */
 static bool update_shared_handshake_key(
 	const fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key) {
-	if (peer->protocol_state->last_handshake_serial == handshake_key->serial) {
-		if (secure_memequal(&peer->protocol_state->peer_handshake_key, peer_handshake_key, PUBLICKEYBYTES))
-			return true;
-	}
+	if (is_shared_handshake_key_cached(peer, handshake_key, peer_handshake_key))
+		return true;
+
+	const key_table_t *peer_key_table = fastd_protocol_ec25519_fhmqvc_key_table_get(peer);
+
+	bool ok = make_shared_handshake_key(
+		false, &handshake_key->key, peer->key, peer_key_table, peer_handshake_key, &peer->protocol_state->sigma,
+		&peer->protocol_state->shared_handshake_key);
 
-	if (!make_shared_handshake_key(
-		    false, &handshake_key->key, peer->key, peer_handshake_key, &peer->protocol_state->sigma,
-		    &peer->protocol_state->shared_handshake_key))
+	fastd_protocol_ec25519_fhmqvc_key_table_put(peer_key_table);
+
+	if (!ok)
 		return false;
 
 	peer->protocol_state->last_handshake_serial = handshake_key->serial;
@@ -257,22 +330,179 @@ static bool update_shared_handshake_key(
 static void clear_shared_handshake_key(const fastd_peer_t *peer) {
 	memset(&peer->protocol_state->sigma, 0, sizeof(peer->protocol_state->sigma));
 	memset(&peer->protocol_state->shared_handshake_key, 0, sizeof(peer->protocol_state->shared_handshake_key));
-
 	peer->protocol_state->last_handshake_serial = 0;
 	memset(&peer->protocol_state->peer_handshake_key, 0, sizeof(peer->protocol_state->peer_handshake_key));
 }
 
-/** Sends a reply to an initial handshake (type 1) */
-static void respond_handshake(
-	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, const aligned_int256_t *peer_handshake_key) {
-	pr_debug("responding handshake with %P[%I]...", peer, remote_addr);
+/** Checks the MAC of a received handshake */
+static bool verify_handshake_mac(const fastd_handshake_t *handshake, const fastd_sha256_t *shared_handshake_key) {
+	uint8_t mac[HASHBYTES] __attribute__((aligned(8)));
+	memcpy(mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
+	memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
 
-	const handshake_key_t *handshake_key = &ctx.protocol_state->handshake_key;
+	return fastd_hmacsha256_verify(mac, shared_handshake_key->w, handshake->tlv_data, handshake->tlv_len);
+}
 
-	if (!update_shared_handshake_key(peer, handshake_key, peer_handshake_key))
+
+/**
+   A handshake processed on a worker thread
+
+   The worker thread derives the shared handshake key and verifies the handshake's MAC; all other
+   handling (including the session establishment) is done on the main thread after the job has been returned.
+*/
+typedef struct handshake_job {
+	protocol_async_type_t type; /**< Always PROTOCOL_ASYNC_HANDSHAKE */
+
+	uint64_t peer_id;                 /**< The ID of the peer the handshake was received from */
+	uint64_t serial;                  /**< The serial number of the job (see fastd_protocol_peer_state::handshake_job) */
+	size_t sock_index;                /**< The index of the socket the handshake was received on in \e ctx.socks
+					       (or SIZE_MAX for the peer's dynamic socket) */
+	fastd_peer_address_t local_addr;  /**< The local address the handshake was received on */
+	fastd_peer_address_t remote_addr; /**< The address the handshake was received from */
+
+	uint8_t handshake_type;            /**< The type of the received handshake (1, 2 or 3) */
+	const fastd_method_info_t *method; /**< The negotiated method (for handshakes of type 2 and 3) */
+
+	handshake_key_t handshake_key;       /**< The used ephemeral keypair */
+	fastd_protocol_key_t peer_key;       /**< The peer's public key */
+	const key_table_t *peer_key_table;   /**< Precomputed multiples of the peer's public key (or NULL) */
+	aligned_int256_t peer_handshake_key; /**< The peer's ephemeral public key */
+
+	bool key_valid;                      /**< true if the shared handshake key could be derived */
+	bool mac_valid;                      /**< true if the handshake's MAC is valid */
+	aligned_int256_t sigma;              /**< The derived value of sigma */
+	fastd_sha256_t shared_handshake_key; /**< The derived shared handshake key */
+	uint64_t cpu_time;                   /**< The time spent on the worker thread (in ns; 0 if not measured) */
+
+	uint8_t mac[HASHBYTES];                         /**< The handshake's MAC (for handshakes of type 2 and 3) */
+	size_t tlv_len;                                 /**< The length of \e tlv_data */
+	uint8_t tlv_data[] __attribute__((aligned(8))); /**< The handshake's TLV data with the MAC zeroed out */
+} handshake_job_t;
+
+/** Frees a handshake job, clearing its key material */
+static void free_handshake_job(void *p) {
+	handshake_job_t *job = p;
+
+	fastd_protocol_ec25519_fhmqvc_key_table_put(job->peer_key_table);
+
+	secure_memzero(job, sizeof(*job) + job->tlv_len);
+	free(job);
+}
+
+/**
+   Derives the shared handshake keys and verifies the MACs of a batch of handshakes (runs on a worker thread)
+
+   All handshakes are handled independently, only the field inversion needed to pack the sigma values is
+   shared by the batch.
+*/
+static void handshake_jobs_run(void *args[], size_t n) {
+	ecc_25519_work_t work[n];
+	ecc_int256_t *sigma[n];
+	size_t i, n_work = 0;
+
+	int64_t start = fastd_cpu_start();
+
+	for (i = 0; i < n; i++) {
+		handshake_job_t *job = args[i];
+
+		job->key_valid = make_sigma_point(
+			job->handshake_type == 2, &job->handshake_key.key, &job->peer_key, job->peer_key_table,
+			&job->peer_handshake_key, &work[n_work]);
+
+		if (job->key_valid)
+			sigma[n_work++] = &job->sigma.int256;
+	}
+
+	store_packed_batch(sigma, work, n_work);
+	secure_memzero(work, sizeof(work));
+
+	/* The time of the batched part is split evenly between the jobs */
+	uint64_t batch_time = 0;
+	if (start) {
+		int64_t now = fastd_get_time_ns();
+		batch_time = (now - start) / n;
+		start = now;
+	}
+
+	for (i = 0; i < n; i++) {
+		handshake_job_t *job = args[i];
+
+		if (job->key_valid) {
+			derive_shared_handshake_key(
+				job->handshake_type == 2, &job->handshake_key.key, &job->peer_key,
+				&job->peer_handshake_key, &job->sigma, &job->shared_handshake_key);
+
+			if (job->handshake_type != 1)
+				job->mac_valid = fastd_hmacsha256_verify(
+					job->mac, job->shared_handshake_key.w, (const uint32_t *)job->tlv_data,
+					job->tlv_len);
+		}
+
+		secure_memzero(&job->handshake_key.key.secret, sizeof(job->handshake_key.key.secret));
+
+		if (start) {
+			int64_t now = fastd_get_time_ns();
+			job->cpu_time = batch_time + (now - start);
+			start = now;
+		}
+
+		fastd_async_enqueue(ASYNC_TYPE_PROTOCOL_RETURN, &job, sizeof(job));
+	}
+}
+
+/**
+   Hands the expensive part of the processing of a handshake to a worker thread
+
+   \e handshake is used to verify the MAC and may be NULL for handshakes of type 1.
+
+   While a handshake job for a peer is pending, further handshakes from the peer are ignored, so the order
+   of session establishments is preserved.
+*/
+static void queue_handshake_job(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, uint8_t handshake_type, const fastd_method_info_t *method,
+	const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
+	const fastd_handshake_t *handshake) {
+	size_t tlv_len = handshake ? handshake->tlv_len : 0;
+	handshake_job_t *job = fastd_alloc0(sizeof(handshake_job_t) + tlv_len);
+
+	job->type = PROTOCOL_ASYNC_HANDSHAKE;
+	job->peer_id = peer->id;
+	job->serial = ++peer->protocol_state->handshake_job;
+	job->sock_index = sock->peer ? SIZE_MAX : (size_t)(sock - ctx.socks);
+	job->local_addr = *local_addr;
+	job->remote_addr = *remote_addr;
+
+	job->handshake_type = handshake_type;
+	job->method = method;
+
+	job->handshake_key = *handshake_key;
+	job->peer_key = *peer->key;
+	job->peer_key_table = fastd_protocol_ec25519_fhmqvc_key_table_get(peer);
+	job->peer_handshake_key = *peer_handshake_key;
+
+	if (handshake) {
+		memcpy(job->mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
+		memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
+
+		job->tlv_len = tlv_len;
+		memcpy(job->tlv_data, handshake->tlv_data, tlv_len);
+	}
+
+	if (!fastd_worker_enqueue_batch(handshake_jobs_run, free_handshake_job, job)) {
+		pr_debug("ignoring handshake from %P[%I] (too many pending handshakes)", peer, remote_addr);
+		free_handshake_job(job);
 		return;
+	}
+
+	peer->protocol_state->handshake_job_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+}
 
+
+/** Sends a reply to an initial handshake (type 1) after the shared handshake key has been derived */
+static void send_handshake_response(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key) {
 	fastd_buffer_t buffer = fastd_handshake_new_reply(
 		2, fastd_peer_get_mtu(peer), NULL, *fastd_peer_group_lookup_peer(peer, methods),
 		4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(HASHBYTES));
@@ -293,40 +523,35 @@ static void respond_handshake(
 	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
 }
 
-/** Sends a reply to a handshake response (type 2) */
-static void finish_handshake(
+/** Sends a reply to an initial handshake (type 1) */
+static void respond_handshake(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
-	const fastd_handshake_t *handshake) {
-	pr_debug("finishing handshake with %P[%I]...", peer, remote_addr);
+	fastd_peer_t *peer, const aligned_int256_t *peer_handshake_key) {
+	pr_debug("responding handshake with %P[%I]...", peer, remote_addr);
 
-	const fastd_method_info_t *method = fastd_handshake_get_method_by_name_list(peer, handshake);
-	if (!method) {
-		fastd_handshake_send_error(
-			sock, local_addr, remote_addr, peer, handshake, REPLY_UNACCEPTABLE_VALUE, RECORD_METHOD_LIST);
+	const handshake_key_t *handshake_key = &ctx.protocol_state->handshake_key;
+
+	if (fastd_worker_enabled() && !is_shared_handshake_key_cached(peer, handshake_key, peer_handshake_key)) {
+		queue_handshake_job(
+			sock, local_addr, remote_addr, peer, 1, NULL, handshake_key, peer_handshake_key, NULL);
 		return;
 	}
 
-	aligned_int256_t sigma;
-	fastd_sha256_t shared_handshake_key;
-	if (!make_shared_handshake_key(
-		    true, &handshake_key->key, peer->key, peer_handshake_key, &sigma, &shared_handshake_key))
+	if (!update_shared_handshake_key(peer, handshake_key, peer_handshake_key))
 		return;
 
-	uint8_t mac[HASHBYTES] __attribute__((aligned(8)));
-	memcpy(mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
-	memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
-
-	bool valid = fastd_hmacsha256_verify(mac, shared_handshake_key.w, handshake->tlv_data, handshake->tlv_len);
-
-	if (!valid) {
-		pr_warn("received invalid protocol handshake response from %P[%I]", peer, remote_addr);
-		return;
-	}
+	send_handshake_response(sock, local_addr, remote_addr, peer, handshake_key, peer_handshake_key);
+}
 
+/** Establishes the session and sends the reply to a handshake response (type 2) after the MAC has been verified */
+static void send_handshake_finish(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_method_info_t *method, const handshake_key_t *handshake_key,
+	const aligned_int256_t *peer_handshake_key, const aligned_int256_t *sigma,
+	const fastd_sha256_t *shared_handshake_key) {
 	if (!establish(
 		    peer, method, sock, local_addr, remote_addr, true, &handshake_key->key.public, peer_handshake_key,
-		    &conf.protocol_config->key.public, &peer->key->key, &sigma, shared_handshake_key.w,
+		    &conf.protocol_config->key.public, &peer->key->key, sigma, shared_handshake_key->w,
 		    handshake_key->serial))
 		return;
 
@@ -341,41 +566,59 @@ static void finish_handshake(
 	fastd_sha256_t hmacbuf;
 	uint8_t *tlv_mac = fastd_handshake_add_zero(&buffer, RECORD_TLV_MAC, HASHBYTES);
 	fastd_hmacsha256(
-		&hmacbuf, shared_handshake_key.w, fastd_handshake_tlv_data(&buffer), fastd_handshake_tlv_len(&buffer));
+		&hmacbuf, shared_handshake_key->w, fastd_handshake_tlv_data(&buffer), fastd_handshake_tlv_len(&buffer));
 	memcpy(tlv_mac, hmacbuf.b, HASHBYTES);
 
 	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
 }
 
-/** Handles a reply to a handshake response (type 3) */
-static void handle_finish_handshake(
+/** Sends a reply to a handshake response (type 2) */
+static void finish_handshake(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
 	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
 	const fastd_handshake_t *handshake) {
-	pr_debug("handling handshake finish with %P[%I]...", peer, remote_addr);
+	pr_debug("finishing handshake with %P[%I]...", peer, remote_addr);
 
-	const fastd_method_info_t *method = fastd_handshake_get_method_by_name(peer, handshake);
+	const fastd_method_info_t *method = fastd_handshake_get_method_by_name_list(peer, handshake);
 	if (!method) {
 		fastd_handshake_send_error(
-			sock, local_addr, remote_addr, peer, handshake, REPLY_UNACCEPTABLE_VALUE, RECORD_METHOD_NAME);
+			sock, local_addr, remote_addr, peer, handshake, REPLY_UNACCEPTABLE_VALUE, RECORD_METHOD_LIST);
 		return;
 	}
 
-	if (!update_shared_handshake_key(peer, handshake_key, peer_handshake_key))
+	if (fastd_worker_enabled()) {
+		queue_handshake_job(
+			sock, local_addr, remote_addr, peer, 2, method, handshake_key, peer_handshake_key, handshake);
 		return;
+	}
 
-	uint8_t mac[HASHBYTES];
-	memcpy(mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
-	memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
+	aligned_int256_t sigma;
+	fastd_sha256_t shared_handshake_key;
+	const key_table_t *peer_key_table = fastd_protocol_ec25519_fhmqvc_key_table_get(peer);
 
-	bool valid = fastd_hmacsha256_verify(
-		mac, peer->protocol_state->shared_handshake_key.w, handshake->tlv_data, handshake->tlv_len);
+	bool ok = make_shared_handshake_key(
+		true, &handshake_key->key, peer->key, peer_key_table, peer_handshake_key, &sigma, &shared_handshake_key);
 
-	if (!valid) {
-		pr_warn("received invalid protocol handshake finish from %P[%I]", peer, remote_addr);
+	fastd_protocol_ec25519_fhmqvc_key_table_put(peer_key_table);
+
+	if (!ok)
+		return;
+
+	if (!verify_handshake_mac(handshake, &shared_handshake_key)) {
+		pr_warn("received invalid protocol handshake response from %P[%I]", peer, remote_addr);
 		return;
 	}
 
+	send_handshake_finish(
+		sock, local_addr, remote_addr, peer, method, handshake_key, peer_handshake_key, &sigma,
+		&shared_handshake_key);
+}
+
+/** Establishes the session after the MAC of a handshake finish (type 3) has been verified */
+static void complete_handshake(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_method_info_t *method, const handshake_key_t *handshake_key,
+	const aligned_int256_t *peer_handshake_key) {
 	establish(
 		peer, method, sock, local_addr, remote_addr, false, peer_handshake_key, &handshake_key->key.public,
 		&peer->key->key, &conf.protocol_config->key.public, &peer->protocol_state->sigma,
@@ -384,6 +627,129 @@ static void handle_finish_handshake(
 	clear_shared_handshake_key(peer);
 }
 
+/** Handles a reply to a handshake response (type 3) */
+static void handle_finish_handshake(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
+	const fastd_handshake_t *handshake) {
+	pr_debug("handling handshake finish with %P[%I]...", peer, remote_addr);
+
+	const fastd_method_info_t *method = fastd_handshake_get_method_by_name(peer, handshake);
+	if (!method) {
+		fastd_handshake_send_error(
+			sock, local_addr, remote_addr, peer, handshake, REPLY_UNACCEPTABLE_VALUE, RECORD_METHOD_NAME);
+		return;
+	}
+
+	if (fastd_worker_enabled() && !is_shared_handshake_key_cached(peer, handshake_key, peer_handshake_key)) {
+		queue_handshake_job(
+			sock, local_addr, remote_addr, peer, 3, method, handshake_key, peer_handshake_key, handshake);
+		return;
+	}
+
+	if (!update_shared_handshake_key(peer, handshake_key, peer_handshake_key))
+		return;
+
+	if (!verify_handshake_mac(handshake, &peer->protocol_state->shared_handshake_key)) {
+		pr_warn("received invalid protocol handshake finish from %P[%I]", peer, remote_addr);
+		return;
+	}
+
+	complete_handshake(sock, local_addr, remote_addr, peer, method, handshake_key, peer_handshake_key);
+}
+
+/** Returns the (still valid) ephemeral keypair with the given serial number */
+static const handshake_key_t *get_handshake_key(uint64_t serial) {
+	if (ctx.protocol_state->handshake_key.serial == serial &&
+	    is_handshake_key_valid(&ctx.protocol_state->handshake_key))
+		return &ctx.protocol_state->handshake_key;
+
+	if (ctx.protocol_state->prev_handshake_key.serial == serial &&
+	    is_handshake_key_valid(&ctx.protocol_state->prev_handshake_key))
+		return &ctx.protocol_state->prev_handshake_key;
+
+	return NULL;
+}
+
+/**
+   Returns the socket to answer a returned handshake job on
+
+   A peer's dynamic socket may have been closed by a reset while the job was processed, so it is looked up again;
+   NULL is returned if the peer has no socket anymore.
+*/
+static fastd_socket_t *get_job_socket(const handshake_job_t *job, fastd_peer_t *peer) {
+	if (job->sock_index == SIZE_MAX)
+		return peer->sock;
+
+	return &ctx.socks[job->sock_index];
+}
+
+/** Continues the handling of a handshake after the job has been returned from a worker thread */
+void fastd_protocol_ec25519_fhmqvc_handshake_return(void *p) {
+	handshake_job_t *job = p;
+	fastd_peer_t *peer = fastd_peer_find_by_id(job->peer_id);
+
+	if (peer && job->cpu_time)
+		fastd_cpu_add_time(peer, CPU_HANDSHAKE, job->cpu_time);
+
+	if (!peer || job->serial != peer->protocol_state->handshake_job)
+		goto out;
+
+	peer->protocol_state->handshake_job_timeout = ctx.now;
+
+	if (!secure_memequal(&peer->key->key, &job->peer_key.key, PUBLICKEYBYTES))
+		goto out;
+
+	const handshake_key_t *handshake_key = get_handshake_key(job->handshake_key.serial);
+	if (!handshake_key) {
+		pr_debug("ignoring handshake from %P[%I] (handshake key has expired)", peer, &job->remote_addr);
+		goto out;
+	}
+
+	if (!job->key_valid)
+		goto out;
+
+	fastd_socket_t *sock = get_job_socket(job, peer);
+	if (!sock) {
+		pr_debug("ignoring handshake from %P[%I] (socket has been closed)", peer, &job->remote_addr);
+		goto out;
+	}
+
+	if (job->handshake_type != 2)
+		set_shared_handshake_key(
+			peer, handshake_key, &job->peer_handshake_key, &job->sigma, &job->shared_handshake_key);
+
+	if (job->handshake_type == 1) {
+		send_handshake_response(
+			sock, &job->local_addr, &job->remote_addr, peer, handshake_key, &job->peer_handshake_key);
+		goto out;
+	}
+
+	if (!job->mac_valid) {
+		pr_warn("received invalid protocol handshake %s from %P[%I]",
+			(job->handshake_type == 2) ? "response" : "finish", peer, &job->remote_addr);
+		goto out;
+	}
+
+	/* Another session may have been established while the job was processed */
+	if (!fastd_timed_out(peer->establish_handshake_timeout)) {
+		pr_debug("received repeated handshakes from %P[%I], ignoring", peer, &job->remote_addr);
+		goto out;
+	}
+
+	if (job->handshake_type == 2)
+		send_handshake_finish(
+			sock, &job->local_addr, &job->remote_addr, peer, job->method, handshake_key,
+			&job->peer_handshake_key, &job->sigma, &job->shared_handshake_key);
+	else
+		complete_handshake(
+			sock, &job->local_addr, &job->remote_addr, peer, job->method, handshake_key,
+			&job->peer_handshake_key);
+
+out:
+	free_handshake_job(job);
+}
+
 /** Searches the peer a public key belongs to, optionally restricting matches to a specific sender address */
 static fastd_peer_t *find_key(const uint8_t key[PUBLICKEYBYTES], const fastd_peer_address_t *address) {
 	errno = 0;
@@ -449,14 +815,20 @@ static fastd_peer_t *match_sender_key(
 	return find_key(key, address);
 }
 
-/** Sends an initial handshake (type 1) to a peer */
-void fastd_protocol_ec25519_fhmqvc_handshake_init(
+/** Checks if a cookie received from a peer may be sent with an initial handshake to a given address */
+static inline bool has_cookie(const fastd_peer_t *peer, const fastd_peer_address_t *remote_addr) {
+	return peer && !fastd_timed_out(peer->protocol_state->cookie_timeout) &&
+	       peer->protocol_state->cookie_serial == ctx.protocol_state->handshake_key.serial &&
+	       fastd_peer_address_equal(remote_addr, &peer->protocol_state->cookie_address);
+}
+
+/** Sends the actual initial handshake packet */
+static void send_handshake_init(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
 	fastd_peer_t *peer) {
-	fastd_protocol_ec25519_fhmqvc_maintenance();
-
-	fastd_buffer_t buffer =
-		fastd_handshake_new_init(3 * RECORD_LEN(PUBLICKEYBYTES) /* sender key, recipient key, handshake key */);
+	fastd_buffer_t buffer = fastd_handshake_new_init(
+		3 * RECORD_LEN(PUBLICKEYBYTES) /* sender key, recipient key, handshake key */ +
+		RECORD_LEN(COOKIE_BYTES) /* cookie */);
 
 	fastd_handshake_add(&buffer, RECORD_SENDER_KEY, PUBLICKEYBYTES, &conf.protocol_config->key.public);
 
@@ -471,6 +843,18 @@ void fastd_protocol_ec25519_fhmqvc_handshake_init(
 	fastd_handshake_add(
 		&buffer, RECORD_SENDER_HANDSHAKE_KEY, PUBLICKEYBYTES, &ctx.protocol_state->handshake_key.key.public);
 
+	if (has_cookie(peer, remote_addr))
+		fastd_handshake_add(&buffer, RECORD_COOKIE, COOKIE_BYTES, peer->protocol_state->cookie);
+
+	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
+}
+
+/** Sends an initial handshake (type 1) to a peer */
+void fastd_protocol_ec25519_fhmqvc_handshake_init(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer) {
+	fastd_protocol_ec25519_fhmqvc_maintenance();
+
 	if (!peer || !fastd_peer_is_established(peer)) {
 		const fastd_shell_command_t *on_connect = fastd_peer_group_lookup_peer_shell_command(peer, on_connect);
 		fastd_peer_exec_shell_command(
@@ -478,7 +862,74 @@ void fastd_protocol_ec25519_fhmqvc_handshake_init(
 			remote_addr, false);
 	}
 
-	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
+	fastd_trace(handshake_start, peer ? peer->id : 0);
+	send_handshake_init(sock, local_addr, remote_addr, peer);
+}
+
+/** Answers an initial handshake with a cookie reply instead of performing the key exchange */
+static void send_cookie(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	const fastd_handshake_t *handshake) {
+	const size_t tail_space = 2 * RECORD_LEN(PUBLICKEYBYTES); /* sender key, recipient handshake key */
+
+	if (!has_field(handshake, RECORD_SENDER_HANDSHAKE_KEY, PUBLICKEYBYTES))
+		return;
+
+	if (!fastd_handshake_cookie_allowed(handshake, tail_space)) {
+		pr_debug2("not sending cookie to %I (handshake too short)", remote_addr);
+		return;
+	}
+
+	pr_debug2("sending cookie to %I", remote_addr);
+
+	fastd_buffer_t buffer = fastd_handshake_new_cookie(remote_addr, handshake, tail_space);
+
+	fastd_handshake_add(&buffer, RECORD_SENDER_KEY, PUBLICKEYBYTES, &conf.protocol_config->key.public);
+	fastd_handshake_add(
+		&buffer, RECORD_RECIPIENT_HANDSHAKE_KEY, PUBLICKEYBYTES,
+		handshake->records[RECORD_SENDER_HANDSHAKE_KEY].data);
+
+	fastd_send(sock, local_addr, remote_addr, NULL, buffer, 0);
+}
+
+/** Handles a cookie reply by repeating the initial handshake with the received cookie */
+static void handle_cookie(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	const handshake_key_t *handshake_key = &ctx.protocol_state->handshake_key;
+
+	if (!has_field(handshake, RECORD_RECIPIENT_HANDSHAKE_KEY, PUBLICKEYBYTES) ||
+	    !is_handshake_key_valid(handshake_key) ||
+	    !secure_memequal(
+		    &handshake_key->key.public, handshake->records[RECORD_RECIPIENT_HANDSHAKE_KEY].data,
+		    PUBLICKEYBYTES)) {
+		pr_debug("received cookie with unexpected recipient handshake key from %I", remote_addr);
+		return;
+	}
+
+	peer = match_sender_key(sock, remote_addr, peer, handshake->records[RECORD_SENDER_KEY].data);
+	if (!peer) {
+		pr_debug("ignoring cookie from %I (unknown or unexpected key)", remote_addr);
+		return;
+	}
+
+	/* Cookie replies aren't authenticated, so a spoofed cookie must not keep the real one from being used: the
+	   latest cookie is always stored, but the handshake is only repeated right away for the first one, so two
+	   peers can't keep bouncing cookies and handshakes */
+	bool repeat = !has_cookie(peer, remote_addr);
+
+	memcpy(peer->protocol_state->cookie, handshake->records[RECORD_COOKIE].data, COOKIE_BYTES);
+	peer->protocol_state->cookie_serial = handshake_key->serial;
+	peer->protocol_state->cookie_address = *remote_addr;
+	peer->protocol_state->cookie_timeout = ctx.now + COOKIE_SECRET_LIFETIME;
+
+	if (!repeat) {
+		pr_debug("received repeated cookie from %P[%I], using it for the next handshake", peer, remote_addr);
+		return;
+	}
+
+	pr_verbose("received cookie from %P[%I], repeating handshake", peer, remote_addr);
+	send_handshake_init(sock, local_addr, remote_addr, peer);
 }
 
 
@@ -564,8 +1015,8 @@ static bool handle_dynamic(
 	memset(&verify_data, 0, sizeof(verify_data));
 	memcpy(&verify_data.peer_handshake_key, handshake->records[RECORD_SENDER_HANDSHAKE_KEY].data, PUBLICKEYBYTES);
 
-	fastd_tristate_t verified =
-		fastd_verify_peer(peer, sock, local_addr, remote_addr, &verify_data, sizeof(verify_data));
+	fastd_tristate_t verified = fastd_verify_peer(
+		peer, peer->key->key.u8, sock, local_addr, remote_addr, &verify_data, sizeof(verify_data));
 
 	if (!verified.set)
 		/* async verify */
@@ -606,38 +1057,10 @@ add_dynamic(UNUSED fastd_socket_t *sock, const fastd_peer_address_t *addr, const
 #endif /* WITH_DYNAMIC_PEERS */
 
 
-/** Handles a received handshake packet */
-void fastd_protocol_ec25519_fhmqvc_handshake_handle(
+/** Handles a received handshake packet after the sending peer has been identified */
+static void handle_peer_handshake(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
 	fastd_peer_t *peer, const fastd_handshake_t *handshake) {
-	fastd_protocol_ec25519_fhmqvc_maintenance();
-
-	if (!has_field(handshake, RECORD_SENDER_KEY, PUBLICKEYBYTES)) {
-		pr_debug("received handshake without sender key from %I", remote_addr);
-		return;
-	}
-
-	peer = match_sender_key(sock, remote_addr, peer, handshake->records[RECORD_SENDER_KEY].data);
-	if (!peer) {
-		switch (errno) {
-		case EPERM:
-			pr_debug(
-				"ignoring handshake from %I with key %H (incorrect source address)", remote_addr,
-				KEY_PRINT(handshake->records[RECORD_SENDER_KEY].data));
-			return;
-
-		case ENOENT:
-			peer = add_dynamic(sock, remote_addr, handshake->records[RECORD_SENDER_KEY].data);
-			if (peer)
-				break;
-
-			return;
-
-		default:
-			exit_bug("match_sender_key: unknown error");
-		}
-	}
-
 	if (!fastd_handshake_check_mtu(sock, local_addr, remote_addr, peer, handshake))
 		return;
 
@@ -656,6 +1079,13 @@ void fastd_protocol_ec25519_fhmqvc_handshake_handle(
 		return;
 	}
 
+	if (!fastd_timed_out(peer->protocol_state->handshake_job_timeout)) {
+		pr_debug(
+			"received handshake from %P[%I] while another one is being processed, ignoring", peer,
+			remote_addr);
+		return;
+	}
+
 	if (has_field(handshake, RECORD_RECIPIENT_KEY, PUBLICKEYBYTES)) {
 		if (!secure_memequal(
 			    &conf.protocol_config->key.public, handshake->records[RECORD_RECIPIENT_KEY].data,
@@ -750,3 +1180,59 @@ void fastd_protocol_ec25519_fhmqvc_handshake_handle(
 			remote_addr);
 	}
 }
+
+/** Handles a received handshake packet */
+void fastd_protocol_ec25519_fhmqvc_handshake_handle(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	fastd_protocol_ec25519_fhmqvc_maintenance();
+
+	if (!has_field(handshake, RECORD_SENDER_KEY, PUBLICKEYBYTES)) {
+		pr_debug("received handshake without sender key from %I", remote_addr);
+		return;
+	}
+
+	if (handshake->type == 1 && fastd_handshake_cookie_mode() &&
+	    !fastd_handshake_check_cookie(remote_addr, handshake)) {
+		send_cookie(sock, local_addr, remote_addr, handshake);
+		return;
+	}
+
+	if (handshake->type == 2 && handshake->reply_code == REPLY_COOKIE) {
+		handle_cookie(sock, local_addr, remote_addr, peer, handshake);
+		return;
+	}
+
+	peer = match_sender_key(sock, remote_addr, peer, handshake->records[RECORD_SENDER_KEY].data);
+	if (!peer) {
+		switch (errno) {
+		case EPERM:
+			pr_debug(
+				"ignoring handshake from %I with key %H (incorrect source address)", remote_addr,
+				KEY_PRINT(handshake->records[RECORD_SENDER_KEY].data));
+			return;
+
+		case ENOENT:
+			peer = add_dynamic(sock, remote_addr, handshake->records[RECORD_SENDER_KEY].data);
+			if (peer)
+				break;
+
+			return;
+
+		default:
+			exit_bug("match_sender_key: unknown error");
+		}
+	}
+
+	uint64_t peer_id = peer->id;
+	int64_t start = fastd_cpu_start();
+
+	handle_peer_handshake(sock, local_addr, remote_addr, peer, handshake);
+
+	if (start) {
+		/* The peer may have been deleted while its handshake was handled */
+		peer = fastd_peer_find_by_id(peer_id);
+		if (peer)
+			fastd_cpu_add(peer, CPU_HANDSHAKE, start);
+	}
+}
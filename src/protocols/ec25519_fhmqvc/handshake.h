@@ -45,6 +45,14 @@ typedef struct handshake_key {
 struct fastd_protocol_state {
 	handshake_key_t prev_handshake_key; /**< The previously generated handshake keypair */
 	handshake_key_t handshake_key;      /**< The newest handshake keypair */
+
+	keypair_t next_handshake_key;    /**< A keypair generated in advance on a worker thread */
+	bool next_handshake_key_valid;   /**< true if \e next_handshake_key is ready to be used */
+	bool next_handshake_key_pending; /**< true if \e next_handshake_key is being generated */
+
+	key_table_t *key_tables;      /**< The most recently used precomputed key table */
+	key_table_t *key_tables_tail; /**< The least recently used precomputed key table */
+	size_t n_key_tables;          /**< The number of cached precomputed key tables */
 };
 
 
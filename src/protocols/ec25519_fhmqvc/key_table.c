@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ec25519-fhmqvc protocol: precomputed multiples of peer public keys
+
+   The handshake multiplies the peer's long-term public key with a 128-bit scalar. As the scalar is derived
+   from public values only, the multiplication doesn't need to be constant-time, so a width-5 NAF with a table
+   of precomputed odd multiples of the key can be used, which needs about a sixth of the point additions
+   of the generic ecc_25519_scalarmult_bits().
+
+   The tables are built lazily and kept in a LRU cache of configurable size.
+*/
+
+
+#include "handshake.h"
+
+
+/** The window width of the NAF representation */
+#define NAF_WIDTH 5
+
+
+/** Unlinks a table from the LRU list */
+static void unlink_table(key_table_t *table) {
+	if (table->prev)
+		table->prev->next = table->next;
+	else
+		ctx.protocol_state->key_tables = table->next;
+
+	if (table->next)
+		table->next->prev = table->prev;
+	else
+		ctx.protocol_state->key_tables_tail = table->prev;
+
+	table->prev = table->next = NULL;
+	ctx.protocol_state->n_key_tables--;
+}
+
+/** Links a table at the head of the LRU list */
+static void link_table(key_table_t *table) {
+	table->prev = NULL;
+	table->next = ctx.protocol_state->key_tables;
+
+	if (table->next)
+		table->next->prev = table;
+	else
+		ctx.protocol_state->key_tables_tail = table;
+
+	ctx.protocol_state->key_tables = table;
+	ctx.protocol_state->n_key_tables++;
+}
+
+/** Removes a table from the cache and its peer, freeing it when it isn't used anymore */
+static void evict_table(key_table_t *table) {
+	unlink_table(table);
+
+	table->peer->protocol_state->key_table = NULL;
+	table->peer = NULL;
+
+	fastd_protocol_ec25519_fhmqvc_key_table_put(table);
+}
+
+/** Computes the odd multiples P, 3P, ..., 15P of a peer's public key */
+static key_table_t *new_table(const fastd_peer_t *peer) {
+	key_table_t *table = fastd_new0(key_table_t);
+	table->peer = peer;
+	table->refcount = 1;
+
+	ecc_25519_work_t P2;
+	ecc_25519_double(&P2, &peer->key->unpacked);
+
+	table->multiples[0] = peer->key->unpacked;
+
+	size_t i;
+	for (i = 1; i < KEY_TABLE_SIZE; i++)
+		ecc_25519_add(&table->multiples[i], &table->multiples[i - 1], &P2);
+
+	return table;
+}
+
+/**
+   Returns the precomputed table for a peer's public key, building it if necessary
+
+   The returned table must be released using fastd_protocol_ec25519_fhmqvc_key_table_put(). NULL is returned
+   if the key cache is disabled.
+*/
+const key_table_t *fastd_protocol_ec25519_fhmqvc_key_table_get(const fastd_peer_t *peer) {
+	if (!conf.key_cache_size)
+		return NULL;
+
+	key_table_t *table = peer->protocol_state->key_table;
+
+	if (table) {
+		unlink_table(table);
+	} else {
+		while (ctx.protocol_state->n_key_tables >= conf.key_cache_size)
+			evict_table(ctx.protocol_state->key_tables_tail);
+
+		table = new_table(peer);
+		peer->protocol_state->key_table = table;
+	}
+
+	link_table(table);
+
+	table->refcount++;
+	return table;
+}
+
+/** Releases a table returned by fastd_protocol_ec25519_fhmqvc_key_table_get() */
+void fastd_protocol_ec25519_fhmqvc_key_table_put(const key_table_t *table) {
+	if (!table)
+		return;
+
+	key_table_t *t = (key_table_t *)table;
+
+	if (--t->refcount)
+		return;
+
+	if (t->peer)
+		exit_bug("key_table_put: freeing cached table");
+
+	free(t);
+}
+
+/** Removes a peer's table from the cache (if there is one) */
+void fastd_protocol_ec25519_fhmqvc_key_table_release(const fastd_peer_t *peer) {
+	if (peer->protocol_state->key_table)
+		evict_table(peer->protocol_state->key_table);
+}
+
+/**
+   Converts the lowest \e bits bits of a scalar to width-5 non-adjacent form
+
+   Every non-zero digit is odd and lies between -15 and 15.
+*/
+static void make_naf(int8_t naf[], const ecc_int256_t *n, unsigned bits) {
+	unsigned i, j, k;
+
+	for (i = 0; i < bits; i++)
+		naf[i] = 1 & (n->p[i >> 3] >> (i & 7));
+
+	naf[bits] = 0;
+
+	for (i = 0; i < bits; i++) {
+		if (!naf[i])
+			continue;
+
+		for (j = 1; j < NAF_WIDTH + 1 && i + j <= bits; j++) {
+			if (!naf[i + j])
+				continue;
+
+			int shifted = naf[i + j] << j;
+
+			if (naf[i] + shifted <= 15) {
+				naf[i] += shifted;
+				naf[i + j] = 0;
+			} else if (naf[i] - shifted >= -15) {
+				naf[i] -= shifted;
+
+				for (k = i + j; k <= bits; k++) {
+					if (!naf[k]) {
+						naf[k] = 1;
+						break;
+					}
+
+					naf[k] = 0;
+				}
+			} else {
+				break;
+			}
+		}
+	}
+}
+
+/**
+   Multiplies a peer's public key with the lowest \e bits bits of a scalar using a precomputed table
+
+   This function is not constant-time, so it must only be used with public scalars. It may be called
+   on worker threads as long as a reference to the table is held.
+*/
+void fastd_protocol_ec25519_fhmqvc_key_table_scalarmult(
+	ecc_25519_work_t *out, const ecc_int256_t *n, const key_table_t *table, unsigned bits) {
+	int8_t naf[bits + 1];
+	make_naf(naf, n, bits);
+
+	*out = ecc_25519_work_identity;
+
+	size_t i = bits + 1;
+	while (i--) {
+		ecc_25519_double(out, out);
+
+		if (naf[i] > 0)
+			ecc_25519_add(out, out, &table->multiples[naf[i] / 2]);
+		else if (naf[i] < 0)
+			ecc_25519_sub(out, out, &table->multiples[-naf[i] / 2]);
+	}
+}
@@ -11,10 +11,19 @@
 */
 
 
+#include "../../async.h"
 #include "../../crypto.h"
+#include "../../worker.h"
 #include "handshake.h"
 
 
+/** An ephemeral keypair generated on a worker thread */
+typedef struct handshake_key_job {
+	protocol_async_type_t type; /**< Always PROTOCOL_ASYNC_HANDSHAKE_KEY */
+	keypair_t key;              /**< The generated keypair */
+} handshake_key_job_t;
+
+
 /** Allocates the protocol-specific state */
 static void init_protocol_state(void) {
 	if (!ctx.protocol_state) {
@@ -38,6 +47,46 @@ static void new_handshake_key(keypair_t *key) {
 		exit_bug("generated invalid ephemeral key");
 }
 
+/** Generates an ephemeral keypair (runs on a worker thread) */
+static void handshake_key_job_run(void *p) {
+	handshake_key_job_t *job = p;
+
+	new_handshake_key(&job->key);
+
+	fastd_async_enqueue(ASYNC_TYPE_PROTOCOL_RETURN, &job, sizeof(job));
+}
+
+/** Starts generating the next ephemeral keypair on a worker thread, so it is ready when it is needed */
+static void prepare_handshake_key(void) {
+	if (!fastd_worker_enabled())
+		return;
+
+	if (ctx.protocol_state->next_handshake_key_valid || ctx.protocol_state->next_handshake_key_pending)
+		return;
+
+	handshake_key_job_t *job = fastd_new0(handshake_key_job_t);
+	job->type = PROTOCOL_ASYNC_HANDSHAKE_KEY;
+
+	if (!fastd_worker_enqueue(handshake_key_job_run, NULL, job)) {
+		free(job);
+		return;
+	}
+
+	ctx.protocol_state->next_handshake_key_pending = true;
+}
+
+/** Stores an ephemeral keypair generated on a worker thread */
+void fastd_protocol_ec25519_fhmqvc_handshake_key_return(void *p) {
+	handshake_key_job_t *job = p;
+
+	ctx.protocol_state->next_handshake_key = job->key;
+	ctx.protocol_state->next_handshake_key_valid = true;
+	ctx.protocol_state->next_handshake_key_pending = false;
+
+	secure_memzero(job, sizeof(*job));
+	free(job);
+}
+
 /**
    Performs maintenance tasks on the protocol state
 
@@ -54,11 +103,20 @@ void fastd_protocol_ec25519_fhmqvc_maintenance(void) {
 
 		ctx.protocol_state->handshake_key.serial++;
 
-		new_handshake_key(&ctx.protocol_state->handshake_key.key);
+		if (ctx.protocol_state->next_handshake_key_valid) {
+			ctx.protocol_state->handshake_key.key = ctx.protocol_state->next_handshake_key;
+
+			secure_memzero(&ctx.protocol_state->next_handshake_key, sizeof(keypair_t));
+			ctx.protocol_state->next_handshake_key_valid = false;
+		} else {
+			new_handshake_key(&ctx.protocol_state->handshake_key.key);
+		}
 
 		ctx.protocol_state->handshake_key.preferred_till = ctx.now + 15000;
 		ctx.protocol_state->handshake_key.valid_till = ctx.now + 30000;
 	}
+
+	prepare_handshake_key();
 }
 
 /** Allocated protocol-specific peer state */
@@ -94,6 +152,8 @@ void fastd_protocol_ec25519_fhmqvc_free_peer_state(fastd_peer_t *peer) {
 		reset_session(&peer->protocol_state->old_session);
 		reset_session(&peer->protocol_state->session);
 
+		fastd_protocol_ec25519_fhmqvc_key_table_release(peer);
+
 		free(peer->protocol_state);
 	}
 }
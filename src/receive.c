@@ -14,8 +14,12 @@
 #include "fastd.h"
 #include "handshake.h"
 #include "hash.h"
+#include "latency.h"
 #include "peer.h"
 #include "peer_hashtable.h"
+#include "trace.h"
+#include "uring.h"
+#include "xdp.h"
 
 #include <sys/uio.h>
 
@@ -229,7 +233,6 @@ static inline void handle_socket_receive(
 void fastd_receive(fastd_socket_t *sock) {
 	size_t max_len = max_size_t(fastd_max_payload(ctx.max_mtu) + conf.overhead, MAX_HANDSHAKE_SIZE);
 	fastd_buffer_t buffer = fastd_buffer_alloc(max_len, conf.decrypt_headroom, conf.tailroom);
-	fastd_peer_address_t local_addr;
 	fastd_peer_address_t recvaddr;
 	struct iovec buffer_vec = { .iov_base = buffer.data, .iov_len = buffer.len };
 	uint8_t cbuf[1024] __attribute__((aligned(8)));
@@ -243,6 +246,7 @@ void fastd_receive(fastd_socket_t *sock) {
 		.msg_controllen = sizeof(cbuf),
 	};
 
+	int64_t start = fastd_latency_start();
 	ssize_t len = recvmsg(sock->fd.fd, &message, 0);
 	if (len <= 0) {
 		if (len < 0)
@@ -254,7 +258,21 @@ void fastd_receive(fastd_socket_t *sock) {
 
 	buffer.len = len;
 
-	handle_socket_control(&message, sock, &local_addr);
+	fastd_receive_packet(sock, &message, &recvaddr, buffer, start);
+}
+
+/**
+   Handles a packet received on a socket
+
+   \e message only needs to contain the ancillary data of the packet; \e start is the time the receive path of the
+   packet has started at (as returned by fastd_latency_start()).
+*/
+void fastd_receive_packet(
+	fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *remote_addr, fastd_buffer_t buffer,
+	int64_t start) {
+	fastd_peer_address_t local_addr;
+
+	handle_socket_control(message, sock, &local_addr);
 
 #ifdef USE_PKTINFO
 	if (!local_addr.sa.sa_family) {
@@ -264,14 +282,31 @@ void fastd_receive(fastd_socket_t *sock) {
 	}
 #endif
 
-	fastd_peer_address_simplify(&local_addr);
-	fastd_peer_address_simplify(&recvaddr);
+	fastd_receive_from(sock, &local_addr, remote_addr, buffer, start);
+}
 
-	handle_socket_receive(sock, &local_addr, &recvaddr, buffer);
+/**
+   Handles a packet received on a socket whose local address is already known
+
+   This is used directly for packets received through AF_XDP, whose headers are parsed by fastd itself.
+*/
+void fastd_receive_from(
+	fastd_socket_t *sock, fastd_peer_address_t *local_addr, fastd_peer_address_t *remote_addr,
+	fastd_buffer_t buffer, int64_t start) {
+	fastd_trace(receive, sock->fd.fd, buffer.len);
+	fastd_latency_record(LATENCY_RX_RECV, start);
+	fastd_latency_begin_path(LATENCY_RX_TOTAL, start);
+
+	fastd_peer_address_simplify(local_addr);
+	fastd_peer_address_simplify(remote_addr);
+
+	handle_socket_receive(sock, local_addr, remote_addr, buffer);
 }
 
 /** Handles a received and decrypted payload packet */
 void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t buffer, bool reordered) {
+	fastd_xdp_learn(peer);
+
 	if (conf.mode == MODE_TAP) {
 		if (buffer.len < sizeof(fastd_eth_header_t)) {
 			pr_debug("received truncated packet");
@@ -290,12 +325,18 @@ void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t buffer, bool reorde
 	if (reordered)
 		fastd_stats_add(peer, STAT_RX_REORDERED, buffer.len);
 
-	fastd_iface_write(peer->iface, buffer);
-
 	if (conf.mode == MODE_TAP && conf.forward) {
+		/* An asynchronous interface write needs its own copy of the packet, as the buffer is also sent on */
+		if (fastd_uring_enabled())
+			fastd_iface_write(peer->iface, fastd_buffer_dup(buffer, 0, 0), false);
+		else
+			fastd_iface_write(peer->iface, buffer, true);
+		fastd_latency_end_path(LATENCY_RX_TOTAL);
+
 		fastd_send_data(buffer, peer, NULL);
 		return;
 	}
 
-	fastd_buffer_free(buffer);
+	fastd_iface_write(peer->iface, buffer, false);
+	fastd_latency_end_path(LATENCY_RX_TOTAL);
 }
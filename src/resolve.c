@@ -8,36 +8,103 @@
    \file
 
    DNS resolver functions
+
+   Hostnames are resolved by a small pool of resolver threads, which is started on demand and never grows beyond
+   RESOLVER_THREADS threads. Resolves of the same hostname (with the same address family and port) share a cache
+   entry: requests for a hostname that is already being resolved just wait for the running resolve, and results are
+   reused for RESOLVE_CACHE_TTL. All remotes waiting for an entry are updated when a resolve result (or a cached
+   result) is received on the main thread.
+
+   As getaddrinfo() doesn't return the TTLs of the DNS records, all results (including failures) are cached for the
+   same fixed time.
  */
 
 #include "async.h"
 #include "fastd.h"
+#include "hash.h"
 #include "peer.h"
 
 #include <netdb.h>
 
 
-/** The argument given to the resolver thread */
-typedef struct resolv_arg {
-	uint64_t peer_id;                 /**< The ID of the peer the remote being resolved belongs to */
-	size_t remote;                    /**< The number of the remote to resolve */
+/** The number of hash buckets of the resolve cache */
+#define RESOLVE_CACHE_BUCKETS 256
+
+
+/** A remote waiting for a resolve result */
+typedef struct resolve_waiter {
+	uint64_t peer_id; /**< The ID of the peer the remote belongs to */
+	size_t remote;    /**< The index of the remote */
+} resolve_waiter_t;
+
+/** A resolve cache entry */
+struct fastd_resolve_entry {
+	fastd_resolve_entry_t *next; /**< The next entry in the same hash bucket */
+	uint64_t id;                 /**< A unique ID, used by results to find the entry again */
+
+	char *hostname;                   /**< The hostname to resolve */
+	fastd_peer_address_t constraints; /**< Contains address family and port of the remote entries to resolve */
+
+	fastd_timeout_t busy_timeout; /**< Set while the hostname is being resolved or a cached result is delivered */
+	fastd_timeout_t timeout;      /**< The time after which the cached result is invalid */
+
+	size_t n_addr;                    /**< The number of cached addresses */
+	fastd_peer_address_t *addr;       /**< The cached addresses */
+	VECTOR(resolve_waiter_t) waiters; /**< The remotes waiting for the result */
+};
+
+typedef struct resolve_job resolve_job_t;
+
+/** A queued resolve job */
+struct resolve_job {
+	resolve_job_t *next; /**< The next job in the queue */
+
+	uint64_t entry_id;                /**< The ID of the cache entry the result belongs to */
 	char *hostname;                   /**< The hostname to resolve */
 	fastd_peer_address_t constraints; /**< Contains address family and port of the remote entry to resolve */
-} resolv_arg_t;
+};
 
 
-/** The resolver thread main routine */
-static void *resolve_peer(void *varg) {
-	resolv_arg_t *arg = varg;
+/**
+   The shared state of the resolver threads
 
+   The resolver threads are detached, as they can't be stopped while they are blocked in getaddrinfo(). Therefore,
+   the state they share with the main thread is static and is never destroyed.
+*/
+static struct {
+	pthread_mutex_t mutex; /**< Protects the job queue */
+	pthread_cond_t cond;   /**< Signals new jobs to idle threads */
+
+	resolve_job_t *jobs;       /**< The job queue */
+	resolve_job_t **jobs_tail; /**< The end of the job queue */
+	size_t n_jobs;             /**< The number of queued jobs */
+
+	size_t n_threads; /**< The number of resolver threads */
+	size_t n_idle;    /**< The number of threads waiting for jobs */
+	bool stop;        /**< Makes the threads exit and discard new jobs */
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.jobs_tail = &pool.jobs,
+};
+
+/** The hash buckets of the resolve cache (only used on the main thread) */
+static fastd_resolve_entry_t *cache[RESOLVE_CACHE_BUCKETS];
+
+/** The ID of the next resolve cache entry (only used on the main thread) */
+static uint64_t next_entry_id = 1;
+
+
+/** Resolves a hostname and returns the result to the main thread */
+static void resolve(const resolve_job_t *job) {
 	struct addrinfo *res = NULL, *res2;
 	size_t n_addr = 0;
 	int gai_ret;
 
 	char portstr[6];
-	snprintf(portstr, 6, "%u", ntohs(arg->constraints.in.sin_port));
+	snprintf(portstr, 6, "%u", ntohs(job->constraints.in.sin_port));
 
-	struct addrinfo hints = { .ai_family = arg->constraints.sa.sa_family,
+	struct addrinfo hints = { .ai_family = job->constraints.sa.sa_family,
 				  .ai_socktype = SOCK_DGRAM,
 				  .ai_protocol = IPPROTO_UDP,
 				  .ai_flags = AI_NUMERICSERV
@@ -46,10 +113,10 @@ static void *resolve_peer(void *varg) {
 #endif
 	};
 
-	gai_ret = getaddrinfo(arg->hostname, portstr, &hints, &res);
+	gai_ret = getaddrinfo(job->hostname, portstr, &hints, &res);
 
 	if (gai_ret || !res) {
-		pr_verbose("resolving host `%s' failed: %s", arg->hostname, gai_strerror(gai_ret));
+		pr_verbose("resolving host `%s' failed: %s", job->hostname, gai_strerror(gai_ret));
 	} else {
 		for (res2 = res; res2; res2 = res2->ai_next)
 			n_addr++;
@@ -58,15 +125,15 @@ static void *resolve_peer(void *varg) {
 	uint8_t retbuf[sizeof(fastd_async_resolve_return_t) + n_addr * sizeof(fastd_peer_address_t)]
 		__attribute__((aligned(8)));
 	fastd_async_resolve_return_t *ret = (fastd_async_resolve_return_t *)retbuf;
-	ret->peer_id = arg->peer_id;
-	ret->remote = arg->remote;
+	ret->entry_id = job->entry_id;
+	ret->cached = false;
 
 	if (n_addr) {
 		n_addr = 0;
 		for (res2 = res; res2; res2 = res2->ai_next) {
 			if (res2->ai_addrlen > sizeof(fastd_peer_address_t) ||
 			    (res2->ai_addr->sa_family != AF_INET && res2->ai_addr->sa_family != AF_INET6)) {
-				pr_warn("resolving host `%s': unsupported address returned", arg->hostname);
+				pr_warn("resolving host `%s': unsupported address returned", job->hostname);
 				continue;
 			}
 
@@ -78,7 +145,7 @@ static void *resolve_peer(void *varg) {
 		}
 
 		if (n_addr)
-			pr_verbose("resolved host `%s' successfully", arg->hostname);
+			pr_verbose("resolved host `%s' successfully", job->hostname);
 	}
 
 	ret->n_addr = n_addr;
@@ -89,41 +156,290 @@ static void *resolve_peer(void *varg) {
 
 	if (res)
 		freeaddrinfo(res);
+}
+
+/** The resolver thread main routine */
+static void *resolver_thread(UNUSED void *p) {
+	pthread_mutex_lock(&pool.mutex);
+
+	while (true) {
+		pool.n_idle++;
+		while (!pool.jobs && !pool.stop)
+			pthread_cond_wait(&pool.cond, &pool.mutex);
+		pool.n_idle--;
+
+		if (pool.stop)
+			break;
+
+		resolve_job_t *job = pool.jobs;
+		pool.jobs = job->next;
+		if (!pool.jobs)
+			pool.jobs_tail = &pool.jobs;
+		pool.n_jobs--;
+
+		pthread_mutex_unlock(&pool.mutex);
+
+		resolve(job);
 
-	free(arg->hostname);
-	free(arg);
+		free(job->hostname);
+		free(job);
+
+		pthread_mutex_lock(&pool.mutex);
+	}
+
+	pool.n_threads--;
+	pthread_mutex_unlock(&pool.mutex);
 
 	return NULL;
 }
 
-/** Starts to resolve a given dynamic remote of a peer to an IP address asynchronously */
+/** Adds a job to the queue, starting a new resolver thread if there are more jobs than idle threads */
+static bool enqueue_job(resolve_job_t *job) {
+	bool ok = true;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	if (pool.n_jobs >= pool.n_idle && pool.n_threads < RESOLVER_THREADS) {
+		pthread_t thread;
+		if ((errno = pthread_create(&thread, &ctx.detached_thread, resolver_thread, NULL)) == 0)
+			pool.n_threads++;
+		else
+			pr_error_errno("unable to create resolver thread");
+	}
+
+	if (pool.n_threads) {
+		job->next = NULL;
+		*pool.jobs_tail = job;
+		pool.jobs_tail = &job->next;
+		pool.n_jobs++;
+
+		pthread_cond_signal(&pool.cond);
+	} else {
+		ok = false;
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	return ok;
+}
+
+
+/** Returns the hash bucket for a hostname */
+static fastd_resolve_entry_t **hostname_bucket(const char *hostname, const fastd_peer_address_t *constraints) {
+	uint32_t hash = 0;
+	fastd_hash(&hash, hostname, strlen(hostname));
+	fastd_hash(&hash, &constraints->sa.sa_family, sizeof(constraints->sa.sa_family));
+	fastd_hash(&hash, &constraints->in.sin_port, sizeof(constraints->in.sin_port));
+	fastd_hash_final(&hash);
+
+	return &cache[hash % RESOLVE_CACHE_BUCKETS];
+}
+
+/** Returns the cache entry for a remote, creating it if it doesn't exist yet */
+static fastd_resolve_entry_t *get_entry(const fastd_remote_t *remote) {
+	fastd_resolve_entry_t **bucket = hostname_bucket(remote->hostname, &remote->address), *entry;
+
+	for (entry = *bucket; entry; entry = entry->next) {
+		if (entry->constraints.sa.sa_family == remote->address.sa.sa_family &&
+		    entry->constraints.in.sin_port == remote->address.in.sin_port &&
+		    strcmp(entry->hostname, remote->hostname) == 0)
+			return entry;
+	}
+
+	entry = fastd_new0(fastd_resolve_entry_t);
+	entry->id = next_entry_id++;
+	entry->hostname = fastd_strdup(remote->hostname);
+	entry->constraints = remote->address;
+	entry->busy_timeout = ctx.now;
+	entry->timeout = ctx.now;
+
+	entry->next = *bucket;
+	*bucket = entry;
+
+	return entry;
+}
+
+/** Frees a cache entry */
+static void free_entry(fastd_resolve_entry_t *entry) {
+	VECTOR_FREE(entry->waiters);
+	free(entry->addr);
+	free(entry->hostname);
+	free(entry);
+}
+
+/** Adds a remote to the waiters of a cache entry */
+static void add_waiter(fastd_resolve_entry_t *entry, const fastd_peer_t *peer, const fastd_remote_t *remote) {
+	resolve_waiter_t waiter = {
+		.peer_id = peer->id,
+		.remote = remote - VECTOR_DATA(peer->remotes),
+	};
+	size_t i;
+
+	for (i = 0; i < VECTOR_LEN(entry->waiters); i++) {
+		const resolve_waiter_t *w = &VECTOR_INDEX(entry->waiters, i);
+		if (w->peer_id == waiter.peer_id && w->remote == waiter.remote)
+			return;
+	}
+
+	VECTOR_ADD(entry->waiters, waiter);
+}
+
+
+/**
+   Starts to resolve a given dynamic remote of a peer to an IP address asynchronously
+
+   If the hostname has been resolved recently, the cached result is used.
+*/
 void fastd_resolve_peer(fastd_peer_t *peer, fastd_remote_t *remote) {
 	if (fastd_peer_is_dynamic(peer))
 		exit_bug("trying to resolve dynamic peer");
 
-	if (!fastd_timed_out(remote->last_resolve_timeout)) {
-		/* last resolve was just a few seconds ago */
+	fastd_resolve_entry_t *entry = get_entry(remote);
+	add_waiter(entry, peer, remote);
+
+	/* If a result doesn't arrive in time (e.g. because getaddrinfo() is stuck), the request is abandoned; a late
+	 * result is still handled like any other */
+	if (!fastd_timed_out(entry->busy_timeout)) {
+		pr_debug("host `%s' for peer %P is already being resolved", remote->hostname, peer);
+		return;
+	}
+
+	entry->busy_timeout = ctx.now + RESOLVE_TIMEOUT;
+
+	if (!fastd_timed_out(entry->timeout)) {
+		/* The result is delivered through the async queue as well, so callers see the same behaviour */
+		pr_debug("using cached resolve result of host `%s' for peer %P", remote->hostname, peer);
+
+		fastd_async_resolve_return_t ret = { .entry_id = entry->id, .cached = true, .n_addr = 0 };
+		fastd_async_enqueue(ASYNC_TYPE_RESOLVE_RETURN, &ret, sizeof(ret));
 		return;
 	}
 
 	pr_verbose("resolving host `%s' for peer %P...", remote->hostname, peer);
 
-	remote->last_resolve_timeout = ctx.now + MIN_RESOLVE_INTERVAL;
+	resolve_job_t *job = fastd_new(resolve_job_t);
+	job->entry_id = entry->id;
+	job->hostname = fastd_strdup(remote->hostname);
+	job->constraints = remote->address;
 
-	resolv_arg_t *arg = fastd_new(resolv_arg_t);
+	if (!enqueue_job(job)) {
+		free(job->hostname);
+		free(job);
 
-	arg->peer_id = peer->id;
-	arg->remote = remote - VECTOR_DATA(peer->remotes);
-	arg->hostname = fastd_strdup(remote->hostname);
-	arg->constraints = remote->address;
+		entry->busy_timeout = ctx.now;
+		VECTOR_RESIZE(entry->waiters, 0);
+	}
+}
 
-	pthread_t thread;
-	if ((errno = pthread_create(&thread, &ctx.detached_thread, resolve_peer, arg)) != 0) {
-		pr_error_errno("unable to create resolver thread");
+/** Finds a resolve cache entry by its ID */
+static fastd_resolve_entry_t *find_entry(uint64_t id) {
+	size_t i;
+	for (i = 0; i < RESOLVE_CACHE_BUCKETS; i++) {
+		fastd_resolve_entry_t *entry;
+		for (entry = cache[i]; entry; entry = entry->next) {
+			if (entry->id == id)
+				return entry;
+		}
+	}
 
-		free(arg->hostname);
-		free(arg);
+	return NULL;
+}
 
+/** Handles a resolve result (or a cached result) on the main thread, updating all waiting remotes */
+void fastd_resolve_handle_return(const fastd_async_resolve_return_t *resolve_return) {
+	fastd_resolve_entry_t *entry = find_entry(resolve_return->entry_id);
+	if (!entry) {
+		pr_debug("ignoring resolve result for expired cache entry");
 		return;
 	}
+
+	entry->busy_timeout = ctx.now;
+
+	if (!resolve_return->cached) {
+		free(entry->addr);
+		entry->n_addr = resolve_return->n_addr;
+		entry->addr = fastd_new_array(entry->n_addr, fastd_peer_address_t);
+		memcpy(entry->addr, resolve_return->addr, entry->n_addr * sizeof(fastd_peer_address_t));
+
+		entry->timeout = ctx.now + RESOLVE_CACHE_TTL;
+	}
+
+	/* The waiter list is detached first, as handling the result may add new waiters */
+	size_t i, n_waiters = VECTOR_LEN(entry->waiters);
+	resolve_waiter_t *waiters = VECTOR_DATA(entry->waiters);
+	memset(&entry->waiters, 0, sizeof(entry->waiters));
+
+	for (i = 0; i < n_waiters; i++) {
+		fastd_peer_t *peer = fastd_peer_find_by_id(waiters[i].peer_id);
+		if (!peer || !fastd_peer_is_enabled(peer))
+			continue;
+
+		if (fastd_peer_is_dynamic(peer))
+			exit_bug("resolve return for dynamic peer");
+
+		fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, waiters[i].remote);
+		fastd_peer_handle_resolve(peer, remote, entry->n_addr, entry->addr);
+	}
+
+	free(waiters);
+}
+
+/**
+   Removes expired entries from the resolve cache
+
+   Entries are kept while they are being resolved, until the request is abandoned after RESOLVE_TIMEOUT. Results
+   find their entry by its ID, so results arriving after the entry has been removed are ignored.
+*/
+void fastd_resolve_cache_cleanup(void) {
+	size_t i;
+
+	for (i = 0; i < RESOLVE_CACHE_BUCKETS; i++) {
+		fastd_resolve_entry_t **entry = &cache[i];
+
+		while (*entry) {
+			fastd_resolve_entry_t *e = *entry;
+
+			if (!fastd_timed_out(e->busy_timeout) || !fastd_timed_out(e->timeout)) {
+				entry = &e->next;
+				continue;
+			}
+
+			*entry = e->next;
+			free_entry(e);
+		}
+	}
+}
+
+/**
+   Stops the resolver threads and frees the resolve cache
+
+   Threads that are still blocked in getaddrinfo() exit on their own later; their results are never handled.
+*/
+void fastd_resolve_cleanup(void) {
+	size_t i;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.cond);
+
+	while (pool.jobs) {
+		resolve_job_t *job = pool.jobs;
+		pool.jobs = job->next;
+
+		free(job->hostname);
+		free(job);
+	}
+	pool.jobs_tail = &pool.jobs;
+	pool.n_jobs = 0;
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (i = 0; i < RESOLVE_CACHE_BUCKETS; i++) {
+		while (cache[i]) {
+			fastd_resolve_entry_t *next = cache[i]->next;
+			free_entry(cache[i]);
+			cache[i] = next;
+		}
+	}
 }
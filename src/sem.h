@@ -42,6 +42,11 @@ static inline bool fastd_sem_trywait(fastd_sem_t *sem) {
 	return !dispatch_semaphore_wait(*sem, DISPATCH_TIME_NOW);
 }
 
+/** Decrements the semaphore, waiting until it is positive */
+static inline void fastd_sem_wait(fastd_sem_t *sem) {
+	dispatch_semaphore_wait(*sem, DISPATCH_TIME_FOREVER);
+}
+
 #else
 
 #include <semaphore.h>
@@ -67,4 +72,12 @@ static inline bool fastd_sem_trywait(fastd_sem_t *sem) {
 	return !sem_trywait(sem);
 }
 
+/** Decrements the semaphore, waiting until it is positive */
+static inline void fastd_sem_wait(fastd_sem_t *sem) {
+	while (sem_wait(sem)) {
+		if (errno != EINTR)
+			exit_errno("sem_wait");
+	}
+}
+
 #endif
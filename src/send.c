@@ -16,7 +16,11 @@
 
 
 #include "fastd.h"
+#include "latency.h"
 #include "peer.h"
+#include "trace.h"
+#include "uring.h"
+#include "xdp.h"
 
 #include <sys/uio.h>
 
@@ -65,6 +69,37 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 	}
 }
 
+/** Logs the result of sending a packet and adds it to the statistics (\e error is the errno value or 0) */
+void fastd_send_complete(fastd_peer_t *peer, size_t stat_size, int error) {
+	if (!error) {
+		fastd_stats_add(peer, STAT_TX, stat_size);
+		return;
+	}
+
+	errno = error;
+
+	switch (error) {
+	case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+	case EWOULDBLOCK:
+#endif
+		pr_debug2_errno("sendmsg");
+		fastd_stats_add(peer, STAT_TX_DROPPED, stat_size);
+		break;
+
+	case ENETDOWN:
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+		pr_debug_errno("sendmsg");
+		fastd_stats_add(peer, STAT_TX_ERROR, stat_size);
+		break;
+
+	default:
+		pr_warn_errno("sendmsg");
+		fastd_stats_add(peer, STAT_TX_ERROR, stat_size);
+	}
+}
+
 /** Sends a packet */
 void fastd_send(
 	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
@@ -72,6 +107,10 @@ void fastd_send(
 	if (!sock)
 		exit_bug("send: sock == NULL");
 
+	/* Payload packets to peers whose link-layer address is known bypass the socket */
+	if (stat_size && fastd_xdp_send(sock, remote_addr, buffer, peer, stat_size))
+		return;
+
 	struct msghdr msg = {};
 	uint8_t cbuf[1024] __attribute__((aligned(8))) = {};
 	fastd_peer_address_t remote_addr6;
@@ -111,6 +150,11 @@ void fastd_send(
 	if (!msg.msg_controllen)
 		msg.msg_control = NULL;
 
+	/* Payload packets are queued on the io_uring when it is used; see fastd_uring_sendmsg() */
+	if (stat_size && fastd_uring_sendmsg(sock->fd.fd, &msg, buffer, peer, stat_size))
+		return;
+
+	int64_t start = fastd_latency_start();
 	int ret = sendmsg(sock->fd.fd, &msg, 0);
 
 	if (ret < 0 && msg.msg_controllen) {
@@ -129,31 +173,10 @@ void fastd_send(
 		}
 	}
 
-	if (ret < 0) {
-		switch (errno) {
-		case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-		case EWOULDBLOCK:
-#endif
-			pr_debug2_errno("sendmsg");
-			fastd_stats_add(peer, STAT_TX_DROPPED, stat_size);
-			break;
-
-		case ENETDOWN:
-		case ENETUNREACH:
-		case EHOSTUNREACH:
-			pr_debug_errno("sendmsg");
-			fastd_stats_add(peer, STAT_TX_ERROR, stat_size);
-			break;
-
-		default:
-			pr_warn_errno("sendmsg");
-			fastd_stats_add(peer, STAT_TX_ERROR, stat_size);
-		}
-	} else {
-		fastd_stats_add(peer, STAT_TX, stat_size);
-	}
+	fastd_latency_record(LATENCY_TX_SEND, start);
+	fastd_trace(send, peer ? peer->id : 0, buffer.len, (ret < 0) ? errno : 0);
 
+	fastd_send_complete(peer, stat_size, (ret < 0) ? errno : 0);
 	fastd_buffer_free(buffer);
 }
 
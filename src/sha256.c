@@ -8,11 +8,19 @@
    \file
 
    Small SHA256 and HMAC-SHA256 implementation
+
+   The block compression function is selected at runtime: on x86 CPUs with the SHA extensions,
+   an implementation using the SHA-NI instructions is used.
 */
 
 
 #include "sha256.h"
 #include "crypto.h"
+#include "util.h"
+
+#ifdef WITH_SHA256_SHANI
+#include "cpuid.h"
+#endif
 
 #include <stdarg.h>
 #include <string.h>
@@ -49,27 +57,141 @@ static inline void copy_words(uint32_t w[8], const uint32_t *in, ssize_t *left)
 	}
 }
 
+/** The SHA256 round constants */
+const uint32_t fastd_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/** The portable block compression function */
+static void sha256_compress_generic(uint32_t h[FASTD_SHA256_HASH_WORDS], const uint32_t in[16]) {
+	uint32_t w[64], v[8];
+	size_t i;
+
+	memcpy(w, in, 16 * sizeof(uint32_t));
+
+	for (i = 16; i < 64; i++) {
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(v, h, sizeof(v));
+
+	for (i = 0; i < 64; i++) {
+		uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+		uint32_t ch = (v[4] & v[5]) ^ ((~v[4]) & v[6]);
+		uint32_t temp1 = v[7] + s1 + ch + fastd_sha256_k[i] + w[i];
+		uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+		uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+		uint32_t temp2 = s0 + maj;
+
+		v[7] = v[6];
+		v[6] = v[5];
+		v[5] = v[4];
+		v[4] = v[3] + temp1;
+		v[3] = v[2];
+		v[2] = v[1];
+		v[1] = v[0];
+		v[0] = temp1 + temp2;
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] += v[i];
+}
+
+/** Checks if the generic implementation is available (it always is) */
+static bool sha256_generic_available(void) {
+	return true;
+}
+
+/** The portable SHA256 implementation */
+const fastd_sha256_impl_t fastd_sha256_generic = {
+	.name = "generic",
+	.available = sha256_generic_available,
+	.compress = sha256_compress_generic,
+};
+
+
+#ifdef WITH_SHA256_SHANI
+
+/** Checks if the runtime platform supports the SHA-NI instructions */
+static bool sha256_shani_available(void) {
+	return ((fastd_cpuid() & (CPUID_SSSE3 | CPUID_SSE41)) == (CPUID_SSSE3 | CPUID_SSE41)) &&
+	       (fastd_cpuid7() & CPUID7_SHA);
+}
+
+/** The SHA256 implementation using the SHA-NI instructions of newer x86 CPUs */
+const fastd_sha256_impl_t fastd_sha256_shani = {
+	.name = "shani",
+	.available = sha256_shani_available,
+	.compress = fastd_sha256_compress_shani,
+};
+
+#endif
+
+
+/** All SHA256 implementations, the preferred ones first */
+static const fastd_sha256_impl_t *const sha256_impls[] = {
+#ifdef WITH_SHA256_SHANI
+	&fastd_sha256_shani,
+#endif
+	&fastd_sha256_generic,
+};
+
+/** The used SHA256 implementation */
+static const fastd_sha256_impl_t *sha256_impl = &fastd_sha256_generic;
+
+
+/**
+   Selects the fastest SHA256 implementation supported by the CPU
+
+   Must be called before any worker threads are started.
+*/
+const fastd_sha256_impl_t *fastd_sha256_init(void) {
+	size_t i;
+
+	for (i = 0; i < array_size(sha256_impls); i++) {
+		if (sha256_impls[i]->available()) {
+			sha256_impl = sha256_impls[i];
+			break;
+		}
+	}
+
+	return sha256_impl;
+}
+
+/**
+   Sets the SHA256 implementation to use (for tests and benchmarks)
+
+   \return false if the implementation isn't supported by the CPU
+*/
+bool fastd_sha256_set_impl(const fastd_sha256_impl_t *impl) {
+	if (!impl->available())
+		return false;
+
+	sha256_impl = impl;
+	return true;
+}
+
+
 /** Hashes a list of input blocks */
 static void sha256_list(uint32_t out[FASTD_SHA256_HASH_WORDS], const uint32_t *const *in, size_t len) {
-	static const uint32_t k[64] = {
-		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-	};
-
 	uint32_t h[8] = {
 		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
 	};
+	void (*compress)(uint32_t h[FASTD_SHA256_HASH_WORDS], const uint32_t in[16]) = sha256_impl->compress;
 	ssize_t left = len;
 	size_t i;
 
 	while (left >= -8) {
-		uint32_t w[64], v[8];
+		uint32_t w[16];
 
 		copy_words(w, *(in++), &left);
 		copy_words(w + 8, *(in++), &left);
@@ -77,34 +199,7 @@ static void sha256_list(uint32_t out[FASTD_SHA256_HASH_WORDS], const uint32_t *c
 		if (left < -8)
 			w[15] = len << 3;
 
-		for (i = 16; i < 64; i++) {
-			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
-			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
-			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
-		}
-
-		memcpy(v, h, sizeof(v));
-
-		for (i = 0; i < 64; i++) {
-			uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
-			uint32_t ch = (v[4] & v[5]) ^ ((~v[4]) & v[6]);
-			uint32_t temp1 = v[7] + s1 + ch + k[i] + w[i];
-			uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
-			uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
-			uint32_t temp2 = s0 + maj;
-
-			v[7] = v[6];
-			v[6] = v[5];
-			v[5] = v[4];
-			v[4] = v[3] + temp1;
-			v[3] = v[2];
-			v[2] = v[1];
-			v[1] = v[0];
-			v[0] = temp1 + temp2;
-		}
-
-		for (i = 0; i < 8; i++)
-			h[i] += v[i];
+		compress(h, w);
 	}
 
 	for (i = 0; i < 8; i++)
@@ -13,6 +13,8 @@
 
 #pragma once
 
+#include "build.h"
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -41,6 +43,30 @@ typedef union fastd_sha256 {
 	uint8_t b[FASTD_SHA256_HASH_BYTES];  /**< bytewise access */
 } fastd_sha256_t;
 
+/** An implementation of the SHA256 block compression function */
+typedef struct fastd_sha256_impl {
+	const char *name;        /**< The name of the implementation */
+	bool (*available)(void); /**< Checks if the implementation is supported by the CPU */
+
+	/** Updates the hash state \e h with a 64-byte block given as 16 words in host byte order */
+	void (*compress)(uint32_t h[FASTD_SHA256_HASH_WORDS], const uint32_t in[16]);
+} fastd_sha256_impl_t;
+
+
+extern const uint32_t fastd_sha256_k[64];
+
+extern const fastd_sha256_impl_t fastd_sha256_generic;
+
+#ifdef WITH_SHA256_SHANI
+extern const fastd_sha256_impl_t fastd_sha256_shani;
+
+void fastd_sha256_compress_shani(uint32_t h[FASTD_SHA256_HASH_WORDS], const uint32_t in[16]);
+#endif
+
+
+const fastd_sha256_impl_t *fastd_sha256_init(void);
+bool fastd_sha256_set_impl(const fastd_sha256_impl_t *impl);
+
 
 void fastd_sha256_blocks(fastd_sha256_t *out, ...);
 void fastd_sha256(fastd_sha256_t *out, const uint32_t *in, size_t len);
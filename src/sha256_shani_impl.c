@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   SHA256 block compression using the SHA-NI instructions of newer x86 CPUs: implementation
+
+   The SHA256RNDS2 instruction expects the state in the order ABEF/CDGH, so the state words are
+   shuffled on entry and exit.
+*/
+
+
+#include "sha256.h"
+
+#include <immintrin.h>
+
+
+/** Computes the message words of the next four rounds from the previous 16 words */
+static inline __m128i schedule(__m128i m0, __m128i m1, __m128i m2, __m128i m3) {
+	__m128i tmp = _mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4));
+	return _mm_sha256msg2_epu32(tmp, m3);
+}
+
+/** Updates the hash state with a 64-byte block given as 16 words in host byte order */
+void fastd_sha256_compress_shani(uint32_t h[FASTD_SHA256_HASH_WORDS], const uint32_t in[16]) {
+	__m128i state0, state1, tmp, msg, m[4];
+	size_t i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&h[0]);    /* DCBA */
+	state1 = _mm_loadu_si128((const __m128i *)&h[4]); /* HGFE */
+
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);          /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);    /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);    /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0); /* CDGH */
+
+	const __m128i abef = state0, cdgh = state1;
+
+	for (i = 0; i < 16; i++) {
+		if (i < 4)
+			m[i] = _mm_loadu_si128((const __m128i *)&in[4 * i]);
+		else
+			m[i & 3] = schedule(m[i & 3], m[(i + 1) & 3], m[(i + 2) & 3], m[(i + 3) & 3]);
+
+		msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&fastd_sha256_k[4 * i]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		msg = _mm_shuffle_epi32(msg, 0x0e);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	}
+
+	state0 = _mm_add_epi32(state0, abef);
+	state1 = _mm_add_epi32(state1, cdgh);
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);       /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);    /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0); /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);    /* HGFE */
+
+	_mm_storeu_si128((__m128i *)&h[0], state0);
+	_mm_storeu_si128((__m128i *)&h[4], state1);
+}
@@ -14,6 +14,7 @@
 
 #include "shell.h"
 #include "fastd.h"
+#include "spawn_server.h"
 
 #include <net/if.h>
 #include <signal.h>
@@ -56,6 +57,82 @@ void fastd_shell_env_free(fastd_shell_env_t *env) {
 	free(env);
 }
 
+/**
+   Formats a shell environment as a single line of space-separated \e KEY=value pairs
+
+   Unset variables are skipped. Whitespace, control characters and backslashes in the values are escaped as
+   \e \\xHH, so the result never contains spaces except as separators.
+
+   \return The length of the formatted string (without the zero termination), or -1 if it didn't fit into \e buf
+*/
+ssize_t fastd_shell_env_format(const fastd_shell_env_t *env, char *buf, size_t size) {
+	size_t i, len = 0;
+
+	for (i = 0; i < VECTOR_LEN(env->entries); i++) {
+		const shell_env_entry_t *entry = &VECTOR_INDEX(env->entries, i);
+		const char *c;
+
+		if (!entry->value)
+			continue;
+
+		int ret = snprintf(buf + len, size - len, "%s%s=", len ? " " : "", entry->key);
+		if (ret < 0 || (size_t)ret >= size - len)
+			return -1;
+		len += ret;
+
+		for (c = entry->value; *c; c++) {
+			unsigned char v = *c;
+
+			if (v <= ' ' || v == '\\' || v >= 0x7f)
+				ret = snprintf(buf + len, size - len, "\\x%02x", v);
+			else
+				ret = snprintf(buf + len, size - len, "%c", v);
+
+			if (ret < 0 || (size_t)ret >= size - len)
+				return -1;
+			len += ret;
+		}
+	}
+
+	if (!size)
+		return -1;
+
+	buf[len] = 0;
+	return len;
+}
+
+/**
+   Packs a shell environment into a sequence of zero-terminated \e KEY=value strings (or just \e KEY for unset
+   variables)
+
+   \return The size of the packed environment. If it is larger than \e size, nothing is written to \e buf.
+*/
+size_t fastd_shell_env_pack(const fastd_shell_env_t *env, char *buf, size_t size) {
+	size_t i, len = 0;
+
+	for (i = 0; i < VECTOR_LEN(env->entries); i++) {
+		const shell_env_entry_t *entry = &VECTOR_INDEX(env->entries, i);
+
+		len += strlen(entry->key) + 1;
+		if (entry->value)
+			len += strlen(entry->value) + 1;
+	}
+
+	if (len > size)
+		return len;
+
+	for (i = 0; i < VECTOR_LEN(env->entries); i++) {
+		const shell_env_entry_t *entry = &VECTOR_INDEX(env->entries, i);
+
+		if (entry->value)
+			buf += sprintf(buf, "%s=%s", entry->key, entry->value) + 1;
+		else
+			buf += sprintf(buf, "%s", entry->key) + 1;
+	}
+
+	return len;
+}
+
 /** Adds an interface name to a shell environment */
 void fastd_shell_env_set_iface(fastd_shell_env_t *env, const fastd_iface_t *iface) {
 	if (iface) {
@@ -94,8 +171,13 @@ static void shell_command_setenv(pid_t pid, const fastd_shell_env_t *env) {
 	}
 }
 
-/** Tries to fork and execute the given command with some environment */
-static bool shell_command_do_exec(const fastd_shell_command_t *command, const fastd_shell_env_t *env, pid_t *pid) {
+/**
+   Tries to fork and execute the given command with some environment
+
+   If \e in_fd or \e out_fd are not negative, they are used as the standard input and output of the command.
+*/
+static bool shell_command_do_exec(
+	const fastd_shell_command_t *command, const fastd_shell_env_t *env, int in_fd, int out_fd, pid_t *pid) {
 	pid_t parent = getpid();
 
 	*pid = fork();
@@ -108,6 +190,11 @@ static bool shell_command_do_exec(const fastd_shell_command_t *command, const fa
 
 	/* child process */
 
+	if (in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0)
+		_exit(126);
+	if (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0)
+		_exit(126);
+
 	fastd_close_all_fds();
 
 	if (chdir(command->dir))
@@ -133,15 +220,21 @@ bool fastd_shell_command_exec_sync(const fastd_shell_command_t *command, const f
 	if (!fastd_shell_command_isset(command))
 		return true;
 
-	pid_t pid;
-	if (!shell_command_do_exec(command, env, &pid))
-		return false;
-
 	int status;
-	pid_t err = waitpid(pid, &status, 0);
+	fastd_tristate_t spawned = fastd_spawn_server_exec(command, env, -1, -1, &status);
 
-	if (err <= 0) {
-		pr_error_errno("fastd_shell_command_exec_sync: waitpid");
+	if (!spawned.set) {
+		pid_t pid;
+		if (!shell_command_do_exec(command, env, -1, -1, &pid))
+			return false;
+
+		pid_t err = waitpid(pid, &status, 0);
+
+		if (err <= 0) {
+			pr_error_errno("fastd_shell_command_exec_sync: waitpid");
+			return false;
+		}
+	} else if (!spawned.state) {
 		return false;
 	}
 
@@ -158,15 +251,24 @@ bool fastd_shell_command_exec_sync(const fastd_shell_command_t *command, const f
 }
 
 /**
-   Executes a shell command asynchronously
+   Starts a shell command without waiting for it, with its standard input and output connected to the given file
+   descriptors (if they are not negative)
 
-   The new process's pid is added to \e ctx.async_pids so it can be reaped later
-   on SIGCHLD.
+   The command is started by the spawn server if possible. Otherwise, the new process's pid is added to
+   \e ctx.async_pids so it can be reaped later on SIGCHLD.
 */
-static void shell_command_exec_async(const fastd_shell_command_t *command, const fastd_shell_env_t *env) {
+bool fastd_shell_command_spawn(
+	const fastd_shell_command_t *command, const fastd_shell_env_t *env, int in_fd, int out_fd) {
+	fastd_tristate_t spawned = fastd_spawn_server_exec(command, env, in_fd, out_fd, NULL);
+	if (spawned.set)
+		return spawned.state;
+
 	pid_t pid;
-	if (shell_command_do_exec(command, env, &pid))
-		VECTOR_ADD(ctx.async_pids, pid);
+	if (!shell_command_do_exec(command, env, in_fd, out_fd, &pid))
+		return false;
+
+	VECTOR_ADD(ctx.async_pids, pid);
+	return true;
 }
 
 /** Executes a shell command */
@@ -177,5 +279,5 @@ void fastd_shell_command_exec(const fastd_shell_command_t *command, const fastd_
 	if (command->sync)
 		fastd_shell_command_exec_sync(command, env, NULL);
 	else
-		shell_command_exec_async(command, env);
+		fastd_shell_command_spawn(command, env, -1, -1);
 }
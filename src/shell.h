@@ -54,6 +54,10 @@ fastd_shell_env_t *fastd_shell_env_alloc(void);
 void fastd_shell_env_set(fastd_shell_env_t *env, const char *key, const char *value);
 void fastd_shell_env_set_iface(fastd_shell_env_t *env, const fastd_iface_t *iface);
 void fastd_shell_env_free(fastd_shell_env_t *env);
+size_t fastd_shell_env_pack(const fastd_shell_env_t *env, char *buf, size_t size);
+ssize_t fastd_shell_env_format(const fastd_shell_env_t *env, char *buf, size_t size);
 
 bool fastd_shell_command_exec_sync(const fastd_shell_command_t *command, const fastd_shell_env_t *env, int *ret);
 void fastd_shell_command_exec(const fastd_shell_command_t *command, const fastd_shell_env_t *env);
+bool fastd_shell_command_spawn(
+	const fastd_shell_command_t *command, const fastd_shell_env_t *env, int in_fd, int out_fd);
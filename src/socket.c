@@ -12,8 +12,11 @@
 
 #include "fastd.h"
 #include "polling.h"
+#include "xdp.h"
 
 #include <net/if.h>
+#include <sys/file.h>
+#include <sys/un.h>
 
 
 /**
@@ -195,6 +198,8 @@ void fastd_socket_bind_all(void) {
 
 		fastd_poll_fd_register(&sock->fd);
 	}
+
+	fastd_xdp_init();
 }
 
 /** Opens a single socket bound to a random port for the given address family */
@@ -220,7 +225,7 @@ fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af) {
 	if (fd < 0)
 		return NULL;
 
-	fastd_socket_t *sock = fastd_new(fastd_socket_t);
+	fastd_socket_t *sock = fastd_new0(fastd_socket_t);
 
 	sock->fd = FASTD_POLL_FD(POLL_TYPE_SOCKET, fd);
 	sock->addr = NULL;
@@ -259,3 +264,100 @@ void fastd_socket_error(fastd_socket_t *sock) {
 	else
 		exit_error("error on socket bound to %B", &sock->addr->addr);
 }
+
+
+/** Takes an exclusive lock on the lock file of a UNIX socket path, exiting if it's held by another process */
+static void lock_unix_socket(const char *path, const char *name) {
+	const char *lock_format = "%s.lock";
+
+	size_t lockname_len = strlen(lock_format) + strlen(path) + 1;
+	char lockname[lockname_len];
+	snprintf(lockname, lockname_len, lock_format, path);
+
+	int lock_fd = open(lockname, O_RDONLY | O_CREAT, 0600);
+	if (lock_fd < 0)
+		exit_error("unable to open %s socket lock file: %s", name, strerror(errno));
+
+	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		switch (errno) {
+		case EWOULDBLOCK:
+			exit_error("%s socket already in use", name);
+
+		default:
+			exit_error("unable to set %s socket lock", name);
+		}
+	}
+}
+
+/**
+   Creates a listening UNIX socket at \e path and registers it with the poll loop
+
+   The socket (and its lock file, if \e lock is set) is created with the effective user and group IDs of the
+   configured user, so it can access it after fastd has switched to that user. \e fd must be initialized with the
+   poll type of the socket; \e name is used in the log messages. \e unlink_socket is registered with atexit() once
+   the socket file exists.
+*/
+void fastd_socket_listen_unix(
+	fastd_poll_fd_t *fd, const char *path, const char *name, bool lock, void (*unlink_socket)(void)) {
+#ifdef USE_USER
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+
+	if (conf.user || conf.group) {
+		if (setegid(conf.gid) < 0)
+			pr_debug_errno("setegid");
+		if (seteuid(conf.uid) < 0)
+			pr_debug_errno("seteuid");
+	}
+#endif
+
+	if (lock)
+		lock_unix_socket(path, name);
+
+	if (unlink(path) == 0)
+		pr_info("removing old %s socket", name);
+	else if (errno != ENOENT)
+		pr_warn("unable to remove old %s socket: %s", name, strerror(errno));
+
+	fd->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd->fd < 0)
+		exit_error("unable to create %s socket: socket: %s", name, strerror(errno));
+
+	size_t path_len = strlen(path);
+	size_t len = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+	uint8_t buf[len] __attribute__((aligned(__alignof__(struct sockaddr_un))));
+	memset(buf, 0, offsetof(struct sockaddr_un, sun_path));
+
+	struct sockaddr_un *sa = (struct sockaddr_un *)buf;
+
+	sa->sun_family = AF_UNIX;
+	memcpy(sa->sun_path, path, path_len + 1);
+
+	if (bind(fd->fd, (struct sockaddr *)sa, len)) {
+		switch (errno) {
+		case EADDRINUSE:
+			exit_error("unable to create %s socket: the path `%s' already exists", name, path);
+
+		default:
+			exit_error("unable to create %s socket: %s", name, strerror(errno));
+		}
+	}
+
+	if (atexit(unlink_socket)) {
+		pr_error_errno("atexit");
+		unlink_socket();
+		exit(1);
+	}
+
+	if (listen(fd->fd, 4))
+		exit_error("unable to create %s socket: listen: %s", name, strerror(errno));
+
+#ifdef USE_USER
+	if (seteuid(uid) < 0)
+		pr_debug_errno("seteuid");
+	if (setegid(gid) < 0)
+		pr_debug_errno("setegid");
+#endif
+
+	fastd_poll_fd_register(fd);
+}
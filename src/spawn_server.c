@@ -0,0 +1,698 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Spawn server for shell commands
+
+   Forking the fastd process for every shell command gets more expensive the larger its address space grows, and
+   establish storms can trigger thousands of commands. Therefore, a small helper process is forked at startup
+   before most memory is allocated. It receives requests over a Unix socket and starts the commands using
+   posix_spawn(), which can avoid copying the address space altogether.
+
+   Each request consists of a spawn_request_header_t, followed by the working directory, the command and
+   environment entries as zero-terminated strings. Environment entries have the form \e KEY=value, or just \e KEY
+   for variables to unset. File descriptors for the standard input and output of the command and a pipe to
+   return the exit status of synchronous commands on are passed as SCM_RIGHTS control messages. The exit statuses
+   of asynchronous commands are sent back over the socket and handled in fastd's main loop.
+
+   When the spawn server isn't available, fastd falls back to forking itself.
+*/
+
+
+#include "spawn_server.h"
+
+
+#ifdef USE_SPAWN_SERVER
+
+#include "fastd.h"
+#include "polling.h"
+#include "shell.h"
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+
+/** The maximum size of a request (without the header) */
+#define SPAWN_MAX_REQUEST 65536
+
+/** The maximum number of file descriptors attached to a request */
+#define SPAWN_MAX_FDS 3
+
+
+/** Types of requests sent to the spawn server */
+typedef enum spawn_request_type {
+	SPAWN_REQUEST_EXEC,       /**< Runs a shell command */
+	SPAWN_REQUEST_SET_GROUPS, /**< Switches to the configured supplementary groups */
+	SPAWN_REQUEST_SET_USER,   /**< Switches to the configured user */
+} spawn_request_type_t;
+
+/** A pipe to write the result of a synchronous command to is attached to the request */
+#define SPAWN_FLAG_RESULT 0x01
+/** A file descriptor to use as the standard input of the command is attached to the request */
+#define SPAWN_FLAG_STDIN 0x02
+/** A file descriptor to use as the standard output of the command is attached to the request */
+#define SPAWN_FLAG_STDOUT 0x04
+
+/** The header of a request */
+typedef struct spawn_request_header {
+	uint32_t len;  /**< The length of the data following the header */
+	uint8_t type;  /**< The request type (see spawn_request_type_t) */
+	uint8_t flags; /**< Flags defining which file descriptors are attached */
+} spawn_request_header_t;
+
+/** The result of a command */
+typedef struct spawn_result {
+	pid_t pid;  /**< The PID of the command (0 if it couldn't be started) */
+	int status; /**< The status as returned by waitpid() */
+	bool ok;    /**< false if the command couldn't be started */
+} spawn_result_t;
+
+/** A command started by the spawn server that hasn't exited yet */
+typedef struct spawn_child {
+	pid_t pid;     /**< The PID of the command */
+	int result_fd; /**< The pipe to write the result to, or -1 for asynchronous commands */
+} spawn_child_t;
+
+
+/** The environment of the spawn server */
+extern char **environ;
+
+/** The socket of the spawn server process */
+static int server_sock = -1;
+
+/** The commands started by the spawn server process */
+static VECTOR(spawn_child_t) server_children = {};
+
+/** Set by the SIGCHLD handler of the spawn server */
+static volatile bool server_sig_child = false;
+
+
+/** SIGCHLD handler of the spawn server */
+static void server_on_sigchld(UNUSED int signo) {
+	server_sig_child = true;
+}
+
+/** Sets the close-on-exec flag on a file descriptor */
+static void set_cloexec(int fd) {
+	int flags = fcntl(fd, F_GETFD);
+	if (flags < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+		pr_error_errno("spawn server: fcntl");
+}
+
+/** Reads exactly \e len bytes from a blocking file descriptor */
+static bool read_full(int fd, void *buf, size_t len) {
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		p += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+/** Reports the result of a command, either on its result pipe, or on the socket for asynchronous commands */
+static void send_result(int result_fd, const spawn_result_t *result) {
+	if (result_fd >= 0) {
+		if (write(result_fd, result, sizeof(*result)) < 0)
+			pr_error_errno("spawn server: write");
+
+		close(result_fd);
+	} else {
+		/* Results of asynchronous commands are only informational, so don't block if fastd is busy */
+		if (send(server_sock, result, sizeof(*result), MSG_DONTWAIT) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pr_error_errno("spawn server: send");
+		}
+	}
+}
+
+/** Reaps finished commands and reports their results */
+static void reap_children(void) {
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		size_t i;
+		for (i = 0; i < VECTOR_LEN(server_children); i++) {
+			spawn_child_t *child = &VECTOR_INDEX(server_children, i);
+			if (child->pid != pid)
+				continue;
+
+			spawn_result_t result = { .pid = pid, .status = status, .ok = true };
+			send_result(child->result_fd, &result);
+
+			VECTOR_DELETE(server_children, i);
+			break;
+		}
+	}
+}
+
+/** Checks if the environment entry \e entry sets or unsets the variable \e key (given as a \e KEY=value string) */
+static bool env_key_equal(const char *entry, const char *key) {
+	size_t len = strcspn(entry, "=");
+	return strncmp(entry, key, len) == 0 && (key[len] == '=' || key[len] == 0);
+}
+
+/**
+   Starts a command
+
+   \e data contains the working directory, the command and the environment entries, as described at the top of the
+   file.
+*/
+static spawn_result_t spawn_command(char *data, size_t len, int in_fd, int out_fd) {
+	spawn_result_t result = { .pid = 0, .status = 0, .ok = false };
+	char *end = data + len, *dir = data, *command, *entry;
+	VECTOR(char *) env = {};
+	char **base;
+
+	command = memchr(dir, 0, end - dir);
+	if (!command++)
+		return result;
+
+	entry = memchr(command, 0, end - command);
+	if (!entry++)
+		return result;
+
+	if (len && data[len - 1]) {
+		pr_error("spawn server: invalid request");
+		return result;
+	}
+
+	/* Build the environment: the entries of the request override the spawn server's environment */
+	for (base = environ; *base; base++) {
+		char *e;
+		for (e = entry; e < end; e += strlen(e) + 1) {
+			if (env_key_equal(e, *base))
+				break;
+		}
+
+		if (e >= end)
+			VECTOR_ADD(env, *base);
+	}
+
+	for (; entry < end; entry += strlen(entry) + 1) {
+		char *e;
+
+		if (!strchr(entry, '='))
+			continue;
+
+		/* Later entries override earlier ones */
+		for (e = entry + strlen(entry) + 1; e < end; e += strlen(e) + 1) {
+			if (env_key_equal(e, entry))
+				break;
+		}
+
+		if (e >= end)
+			VECTOR_ADD(env, entry);
+	}
+
+	VECTOR_ADD(env, NULL);
+
+	if (chdir(dir)) {
+		/* Same status as a child process that failed to chdir() */
+		result.ok = true;
+		result.status = 126 << 8;
+		VECTOR_FREE(env);
+		return result;
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t set;
+
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+	/* unblock signals */
+	sigemptyset(&set);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &set);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	char *argv[] = { "sh", "-c", command, NULL };
+	int err = posix_spawn(&result.pid, "/bin/sh", &actions, &attr, argv, VECTOR_DATA(env));
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	VECTOR_FREE(env);
+
+	if (err) {
+		errno = err;
+		pr_error_errno("spawn server: posix_spawn");
+		result.pid = 0;
+		return result;
+	}
+
+	result.ok = true;
+	return result;
+}
+
+/** Receives and handles a single request */
+static bool handle_request(void) {
+	spawn_request_header_t header;
+	int fds[SPAWN_MAX_FDS], n_fds = 0, i;
+	char *data = NULL;
+	bool ok = false;
+
+	struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+	uint8_t cbuf[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+
+	ssize_t ret = recvmsg(server_sock, &msg, 0);
+	if (ret < 0 && errno == EINTR)
+		return true;
+	if (ret <= 0)
+		return false;
+
+	/* All received file descriptors are collected first, so they can be closed on every error path */
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t j, n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (j = 0; j < n; j++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + j * sizeof(int), sizeof(int));
+
+			if (n_fds < SPAWN_MAX_FDS)
+				fds[n_fds++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	for (i = 0; i < n_fds; i++)
+		set_cloexec(fds[i]);
+
+	if ((size_t)ret < sizeof(header) && !read_full(server_sock, (uint8_t *)&header + ret, sizeof(header) - ret))
+		goto out;
+
+	if (header.len > SPAWN_MAX_REQUEST)
+		goto out;
+
+	data = fastd_alloc(header.len + 1);
+	if (!read_full(server_sock, data, header.len))
+		goto out;
+
+	/* The request has been read completely, so an invalid request doesn't stop the spawn server */
+	ok = true;
+
+	if (msg.msg_flags & MSG_CTRUNC) {
+		pr_error("spawn server: truncated control data");
+		goto out;
+	}
+
+	switch (header.type) {
+	case SPAWN_REQUEST_EXEC: {
+		int result_fd = -1, in_fd = -1, out_fd = -1, n_expected = 0;
+
+		if (header.flags & SPAWN_FLAG_RESULT)
+			result_fd = n_expected++;
+		if (header.flags & SPAWN_FLAG_STDIN)
+			in_fd = n_expected++;
+		if (header.flags & SPAWN_FLAG_STDOUT)
+			out_fd = n_expected++;
+
+		if (n_fds != n_expected) {
+			pr_error("spawn server: unexpected number of file descriptors");
+			goto out;
+		}
+
+		/* The indices are replaced by the file descriptors, which are then owned by this request */
+		if (result_fd >= 0)
+			result_fd = fds[result_fd];
+		if (in_fd >= 0)
+			in_fd = fds[in_fd];
+		if (out_fd >= 0)
+			out_fd = fds[out_fd];
+		n_fds = 0;
+
+		spawn_result_t result = spawn_command(data, header.len, in_fd, out_fd);
+
+		if (in_fd >= 0)
+			close(in_fd);
+		if (out_fd >= 0)
+			close(out_fd);
+
+		if (result.pid) {
+			spawn_child_t child = { .pid = result.pid, .result_fd = result_fd };
+			VECTOR_ADD(server_children, child);
+		} else if (result_fd >= 0 || !result.ok) {
+			send_result(result_fd, &result);
+		}
+
+		break;
+	}
+
+	case SPAWN_REQUEST_SET_GROUPS:
+		fastd_set_supplementary_groups();
+		break;
+
+	case SPAWN_REQUEST_SET_USER:
+		fastd_set_user_ids();
+		break;
+
+	default:
+		pr_error("spawn server: invalid request type");
+	}
+
+out:
+	for (i = 0; i < n_fds; i++)
+		close(fds[i]);
+
+	free(data);
+	return ok;
+}
+
+/** Main loop of the spawn server process */
+static void server_run(void) {
+	sigset_t set, unblocked;
+
+	/* The environment is the same for all commands */
+	char buf[20];
+	snprintf(buf, sizeof(buf), "%u", (unsigned)getppid());
+	setenv("FASTD_PID", buf, 1);
+	unsetenv("NOTIFY_SOCKET");
+
+	/* SIGCHLD is only delivered while waiting for requests */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &set, &unblocked);
+	sigdelset(&unblocked, SIGCHLD);
+
+	struct sigaction action = {};
+	action.sa_handler = server_on_sigchld;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGCHLD, &action, NULL))
+		pr_error_errno("spawn server: sigaction");
+
+	while (true) {
+		if (server_sig_child) {
+			server_sig_child = false;
+			reap_children();
+		}
+
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(server_sock, &rfds);
+
+		int ret = pselect(server_sock + 1, &rfds, NULL, NULL, NULL, &unblocked);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			pr_error_errno("spawn server: pselect");
+			break;
+		}
+
+		/* EOF means that fastd has terminated */
+		if (!handle_request())
+			break;
+	}
+
+	_exit(0);
+}
+
+
+/**
+   Forks the spawn server
+
+   This should be called as early as possible, so the spawn server process stays small.
+*/
+void fastd_spawn_server_start(void) {
+	int fds[2];
+
+	ctx.spawn_fd = FASTD_POLL_FD(POLL_TYPE_SPAWN, -1);
+
+	if ((errno = pthread_mutex_init(&ctx.spawn_mutex, NULL)) != 0)
+		exit_errno("pthread_mutex_init");
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		pr_error_errno("spawn server: socketpair");
+		return;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		pr_error_errno("spawn server: fork");
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		fastd_close_all_fds_except(fds[1]);
+		set_cloexec(fds[1]);
+
+		server_sock = fds[1];
+		server_run();
+	}
+
+	close(fds[1]);
+	set_cloexec(fds[0]);
+
+	VECTOR_ADD(ctx.async_pids, pid);
+
+	ctx.spawn_fd.fd = fds[0];
+}
+
+/** Registers the spawn server socket with the poll interface */
+void fastd_spawn_server_register(void) {
+	if (ctx.spawn_fd.fd >= 0)
+		fastd_poll_fd_register(&ctx.spawn_fd);
+}
+
+/**
+   Closes the connection to the spawn server, which makes it exit
+
+   As this is called after the poll interface has been freed, the socket is closed directly.
+*/
+void fastd_spawn_server_stop(void) {
+	if (ctx.spawn_fd.fd >= 0) {
+		if (close(ctx.spawn_fd.fd))
+			pr_warn_errno("spawn server: close");
+
+		ctx.spawn_fd.fd = -1;
+	}
+
+	pthread_mutex_destroy(&ctx.spawn_mutex);
+}
+
+/** Handles the exit statuses of asynchronous commands sent by the spawn server */
+void fastd_spawn_server_handle(void) {
+	spawn_result_t result;
+
+	while (true) {
+		ssize_t ret = recv(ctx.spawn_fd.fd, &result, sizeof(result), MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+
+		if (ret <= 0 || !read_full(ctx.spawn_fd.fd, (uint8_t *)&result + ret, sizeof(result) - ret)) {
+			pr_error("spawn server exited unexpectedly, falling back to forking for shell commands");
+
+			pthread_mutex_lock(&ctx.spawn_mutex);
+			fastd_poll_fd_close(&ctx.spawn_fd);
+			ctx.spawn_fd.fd = -1;
+			pthread_mutex_unlock(&ctx.spawn_mutex);
+
+			return;
+		}
+
+		if (!result.ok)
+			pr_error("unable to start shell command");
+		else
+			pr_debug("child process %u finished", (unsigned)result.pid);
+	}
+}
+
+/** Sends a request to the spawn server */
+static bool send_request(spawn_request_type_t type, uint8_t flags, const char *data, size_t len, const int *fds,
+	size_t n_fds) {
+	spawn_request_header_t header = { .len = len, .type = type, .flags = flags };
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+	uint8_t cbuf[CMSG_SPACE(SPAWN_MAX_FDS * sizeof(int))] = {};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	if (n_fds) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+	}
+
+	bool ok = false;
+
+	pthread_mutex_lock(&ctx.spawn_mutex);
+
+	if (ctx.spawn_fd.fd >= 0) {
+		size_t total = sizeof(header) + len;
+		ssize_t ret;
+
+		do {
+			ret = sendmsg(ctx.spawn_fd.fd, &msg, 0);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			pr_error_errno("spawn server: sendmsg");
+		} else {
+			/* The file descriptors have been sent with the first byte, send the rest without them */
+			size_t sent = ret;
+			ok = true;
+
+			while (sent < total) {
+				const uint8_t *p;
+				size_t chunk;
+
+				if (sent < sizeof(header)) {
+					p = (const uint8_t *)&header + sent;
+					chunk = sizeof(header) - sent;
+				} else {
+					p = (const uint8_t *)data + (sent - sizeof(header));
+					chunk = total - sent;
+				}
+
+				ret = write(ctx.spawn_fd.fd, p, chunk);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0) {
+					/* The stream is out of sync now, so the spawn server can't be used anymore */
+					pr_error_errno("spawn server: write");
+					shutdown(ctx.spawn_fd.fd, SHUT_RDWR);
+					ok = false;
+					break;
+				}
+
+				sent += ret;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&ctx.spawn_mutex);
+
+	return ok;
+}
+
+/**
+   Runs a shell command using the spawn server
+
+   If \e status is not NULL, the function waits for the command to exit and returns its status in \e status.
+   May be called from secondary threads.
+
+   \return \e true if the command was started, \e false if it couldn't be started, and \e undef if the spawn
+   server isn't available
+*/
+fastd_tristate_t fastd_spawn_server_exec(
+	const fastd_shell_command_t *command, const fastd_shell_env_t *env, int in_fd, int out_fd, int *status) {
+	if (ctx.spawn_fd.fd < 0)
+		return FASTD_TRISTATE_UNDEF;
+
+	size_t dir_len = strlen(command->dir) + 1, command_len = strlen(command->command) + 1;
+	size_t env_len = env ? fastd_shell_env_pack(env, NULL, 0) : 0;
+	size_t len = dir_len + command_len + env_len;
+
+	if (len > SPAWN_MAX_REQUEST)
+		return FASTD_TRISTATE_UNDEF;
+
+	char *data = fastd_alloc(len);
+	memcpy(data, command->dir, dir_len);
+	memcpy(data + dir_len, command->command, command_len);
+	if (env)
+		fastd_shell_env_pack(env, data + dir_len + command_len, env_len);
+
+	int fds[SPAWN_MAX_FDS], result_pipe[2] = { -1, -1 };
+	size_t n_fds = 0;
+	uint8_t flags = 0;
+
+	if (status) {
+		if (pipe(result_pipe)) {
+			pr_error_errno("spawn server: pipe");
+			free(data);
+			return FASTD_TRISTATE_UNDEF;
+		}
+
+		flags |= SPAWN_FLAG_RESULT;
+		fds[n_fds++] = result_pipe[1];
+	}
+	if (in_fd >= 0) {
+		flags |= SPAWN_FLAG_STDIN;
+		fds[n_fds++] = in_fd;
+	}
+	if (out_fd >= 0) {
+		flags |= SPAWN_FLAG_STDOUT;
+		fds[n_fds++] = out_fd;
+	}
+
+	bool sent = send_request(SPAWN_REQUEST_EXEC, flags, data, len, fds, n_fds);
+	free(data);
+
+	if (!status)
+		return sent ? FASTD_TRISTATE_TRUE : FASTD_TRISTATE_UNDEF;
+
+	close(result_pipe[1]);
+
+	if (!sent) {
+		close(result_pipe[0]);
+		return FASTD_TRISTATE_UNDEF;
+	}
+
+	spawn_result_t result;
+	bool received = read_full(result_pipe[0], &result, sizeof(result));
+
+	close(result_pipe[0]);
+
+	/* Don't fall back to forking here, the command might have been started already */
+	if (!received) {
+		pr_error("spawn server: no result for command");
+		return FASTD_TRISTATE_FALSE;
+	}
+	if (!result.ok)
+		return FASTD_TRISTATE_FALSE;
+
+	*status = result.status;
+	return FASTD_TRISTATE_TRUE;
+}
+
+/** Makes the spawn server switch to the configured supplementary groups */
+void fastd_spawn_server_set_groups(void) {
+	send_request(SPAWN_REQUEST_SET_GROUPS, 0, NULL, 0, NULL, 0);
+}
+
+/** Makes the spawn server switch to the configured user */
+void fastd_spawn_server_set_user(void) {
+	send_request(SPAWN_REQUEST_SET_USER, 0, NULL, 0, NULL, 0);
+}
+
+#endif /* USE_SPAWN_SERVER */
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Spawn server for shell commands
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef USE_SPAWN_SERVER
+
+void fastd_spawn_server_start(void);
+void fastd_spawn_server_register(void);
+void fastd_spawn_server_stop(void);
+void fastd_spawn_server_handle(void);
+
+fastd_tristate_t fastd_spawn_server_exec(
+	const fastd_shell_command_t *command, const fastd_shell_env_t *env, int in_fd, int out_fd, int *status);
+
+void fastd_spawn_server_set_groups(void);
+void fastd_spawn_server_set_user(void);
+
+#else
+
+static inline void fastd_spawn_server_start(void) {}
+static inline void fastd_spawn_server_register(void) {}
+static inline void fastd_spawn_server_stop(void) {}
+
+/** Dummy exec function for platforms without a spawn server, always makes the caller fall back to forking */
+static inline fastd_tristate_t fastd_spawn_server_exec(
+	UNUSED const fastd_shell_command_t *command, UNUSED const fastd_shell_env_t *env, UNUSED int in_fd,
+	UNUSED int out_fd, UNUSED int *status) {
+	return FASTD_TRISTATE_UNDEF;
+}
+
+static inline void fastd_spawn_server_set_groups(void) {}
+static inline void fastd_spawn_server_set_user(void) {}
+
+#endif
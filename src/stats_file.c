@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Shared-memory statistics file
+
+   The global and per-peer traffic statistics are published to a file mapped into fastd's memory, so monitoring
+   tools can map the same file and sample the counters without talking to fastd at all. The file starts with a
+   header, followed by an array of fixed-size peer slots; the layout is described in the documentation of the
+   `stats file` option.
+
+   The header and each slot are protected by a sequence counter which is odd while fastd is updating them. A reader
+   copies the data it is interested in and retries when the counter was odd or has changed in the meantime. The
+   statistics are copied to the file every STATS_FILE_INTERVAL from the main loop, so packet processing isn't
+   affected at all.
+*/
+
+
+#include "stats_file.h"
+
+
+#ifdef WITH_STATS_FILE
+
+#include "fastd.h"
+#include "peer.h"
+#include "task.h"
+
+#include <sys/mman.h>
+
+
+/** The magic string at the start of the statistics file */
+#define STATS_FILE_MAGIC "fastdsts"
+
+/** The version of the statistics file layout */
+#define STATS_FILE_VERSION 1
+
+/** The maximum length of a peer name in the statistics file (including the terminating zero) */
+#define STATS_FILE_NAME_SIZE 64
+
+/** The maximum length of a peer key in the statistics file */
+#define STATS_FILE_KEY_SIZE 32
+
+/** The minimum number of peer slots in the statistics file */
+#define STATS_FILE_MIN_SLOTS 64
+
+
+/** The header of the statistics file */
+typedef struct stats_file_header {
+	char magic[8];              /**< STATS_FILE_MAGIC (without terminating zero) */
+	uint32_t version;           /**< STATS_FILE_VERSION */
+	uint32_t header_size;       /**< The size of the header, i.e. the offset of the first slot */
+	uint32_t slot_size;         /**< The size of a peer slot */
+	uint32_t n_slots;           /**< The number of peer slots in the file (the file only grows) */
+	uint32_t n_counters;        /**< The number of elements of the packets and bytes arrays */
+	uint32_t pid;               /**< The process ID of fastd */
+	uint64_t seq;               /**< Sequence counter of the header; odd while the header is updated */
+	int64_t started;            /**< The time fastd has been started (CLOCK_MONOTONIC, in milliseconds) */
+	int64_t updated;            /**< The time of the last update (CLOCK_MONOTONIC, in milliseconds) */
+	uint64_t packets[STAT_MAX]; /**< The global packet counters, indexed by fastd_stat_type_t */
+	uint64_t bytes[STAT_MAX];   /**< The global byte counters, indexed by fastd_stat_type_t */
+} stats_file_header_t;
+
+/** A peer slot in the statistics file */
+typedef struct stats_file_slot {
+	uint64_t seq;                     /**< Sequence counter of the slot; odd while the slot is updated */
+	uint64_t id;                      /**< The peer's internal ID (starting at 1); 0 for unused slots */
+	uint8_t key[STATS_FILE_KEY_SIZE]; /**< The peer's public key */
+	char name[STATS_FILE_NAME_SIZE];  /**< The peer's name (zero-terminated, possibly truncated) */
+	uint32_t state;                   /**< The peer's state (a fastd_peer_state_t value) */
+	uint32_t reserved;                /**< Padding, always 0 */
+	int64_t established;              /**< The time the connection has been established; 0 if not established */
+	int64_t last_seen;                /**< The time of the last valid packet received; 0 if there was none */
+	uint64_t packets[STAT_MAX];       /**< The peer's packet counters, indexed by fastd_stat_type_t */
+	uint64_t bytes[STAT_MAX];         /**< The peer's byte counters, indexed by fastd_stat_type_t */
+} stats_file_slot_t;
+
+/** Associates a peer with its slot in the statistics file */
+typedef struct stats_file_entry {
+	uint64_t id; /**< The peer's ID */
+	size_t slot; /**< The index of the peer's slot */
+} stats_file_entry_t;
+
+
+static int stats_fd = -1;           /**< The file descriptor of the statistics file */
+static stats_file_header_t *header; /**< The mapped statistics file */
+static size_t n_slots;              /**< The number of slots in the mapped file */
+static fastd_task_t stats_task;     /**< Task updating the statistics file periodically */
+
+/** The slots assigned to peers, sorted by peer ID like ctx.peers */
+static VECTOR(stats_file_entry_t) entries = {};
+
+/** The unused slots */
+static VECTOR(size_t) free_slots = {};
+
+
+/** Returns the size of the statistics file for a given number of slots */
+static inline size_t file_size(size_t slots) {
+	return sizeof(stats_file_header_t) + slots * sizeof(stats_file_slot_t);
+}
+
+/** Returns a peer slot of the mapped file */
+static inline stats_file_slot_t *get_slot(size_t i) {
+	return &((stats_file_slot_t *)(header + 1))[i];
+}
+
+/** Marks the start of an update of data protected by a sequence counter */
+static inline void write_begin(uint64_t *seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/** Marks the end of an update of data protected by a sequence counter */
+static inline void write_end(uint64_t *seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/** Enlarges the statistics file, so it contains at least the given number of slots */
+static bool grow_file(size_t slots) {
+	size_t new_slots = n_slots ? n_slots : STATS_FILE_MIN_SLOTS;
+	while (new_slots < slots)
+		new_slots *= 2;
+
+	if (new_slots == n_slots)
+		return true;
+
+	if (new_slots > UINT32_MAX) {
+		pr_error("unable to enlarge stats file: too many peers");
+		return false;
+	}
+
+	if (ftruncate(stats_fd, file_size(new_slots))) {
+		pr_error_errno("unable to enlarge stats file: ftruncate");
+		return false;
+	}
+
+	void *map = mmap(NULL, file_size(new_slots), PROT_READ | PROT_WRITE, MAP_SHARED, stats_fd, 0);
+	if (map == MAP_FAILED) {
+		pr_error_errno("unable to enlarge stats file: mmap");
+		return false;
+	}
+
+	if (header)
+		munmap(header, file_size(n_slots));
+
+	header = map;
+
+	/* The new slots are zeroed by ftruncate(), i.e. unused */
+	size_t i;
+	for (i = new_slots; i > n_slots; i--)
+		VECTOR_ADD(free_slots, i - 1);
+
+	write_begin(&header->seq);
+	header->n_slots = new_slots;
+	write_end(&header->seq);
+
+	n_slots = new_slots;
+
+	return true;
+}
+
+/** Assigns a free slot to a peer, returning false if the file couldn't be enlarged */
+static bool alloc_slot(size_t *slot) {
+	if (!VECTOR_LEN(free_slots) && !grow_file(n_slots + 1))
+		return false;
+
+	*slot = VECTOR_INDEX(free_slots, VECTOR_LEN(free_slots) - 1);
+	VECTOR_DELETE(free_slots, VECTOR_LEN(free_slots) - 1);
+
+	return true;
+}
+
+/** Marks the slot of a removed peer as unused */
+static void free_slot(size_t slot) {
+	stats_file_slot_t *s = get_slot(slot);
+
+	write_begin(&s->seq);
+	memset((uint8_t *)s + sizeof(s->seq), 0, sizeof(*s) - sizeof(s->seq));
+	write_end(&s->seq);
+
+	VECTOR_ADD(free_slots, slot);
+}
+
+/** Copies the current state and statistics of a peer to its slot */
+static void update_slot(size_t slot, const fastd_peer_t *peer, bool new) {
+	stats_file_slot_t *s = get_slot(slot);
+
+	write_begin(&s->seq);
+
+	if (new) {
+		s->id = peer->id;
+
+		memset(s->key, 0, sizeof(s->key));
+		if (peer->key)
+			memcpy(s->key, peer->key, min_size_t(conf.protocol->key_size, sizeof(s->key)));
+
+		memset(s->name, 0, sizeof(s->name));
+		if (peer->name)
+			strncpy(s->name, peer->name, sizeof(s->name) - 1);
+
+		s->last_seen = 0;
+	}
+
+	s->state = peer->state;
+
+	if (fastd_peer_is_established(peer)) {
+		s->established = peer->established;
+		s->last_seen = peer->reset_timeout - PEER_STALE_TIME;
+	} else {
+		s->established = 0;
+	}
+
+	memcpy(s->packets, peer->stats.packets, sizeof(s->packets));
+	memcpy(s->bytes, peer->stats.bytes, sizeof(s->bytes));
+
+	write_end(&s->seq);
+}
+
+/**
+   Updates the peer slots
+
+   As both ctx.peers and the slot assignments are sorted by peer ID, they can be merged in a single pass: entries
+   that don't have a matching peer anymore belong to removed peers, peers without an entry are new.
+*/
+static void update_peers(void) {
+	VECTOR(stats_file_entry_t) new_entries = {};
+	size_t i, j = 0;
+
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+
+		while (j < VECTOR_LEN(entries) && VECTOR_INDEX(entries, j).id < peer->id)
+			free_slot(VECTOR_INDEX(entries, j++).slot);
+
+		bool found = (j < VECTOR_LEN(entries) && VECTOR_INDEX(entries, j).id == peer->id);
+
+		if (!fastd_peer_is_enabled(peer)) {
+			if (found)
+				free_slot(VECTOR_INDEX(entries, j++).slot);
+
+			continue;
+		}
+
+		stats_file_entry_t entry = { .id = peer->id };
+
+		if (found)
+			entry.slot = VECTOR_INDEX(entries, j++).slot;
+		else if (!alloc_slot(&entry.slot))
+			continue;
+
+		update_slot(entry.slot, peer, !found);
+		VECTOR_ADD(new_entries, entry);
+	}
+
+	while (j < VECTOR_LEN(entries))
+		free_slot(VECTOR_INDEX(entries, j++).slot);
+
+	VECTOR_FREE(entries);
+	entries.desc = new_entries.desc;
+	entries.data = new_entries.data;
+}
+
+/** Copies the current statistics to the statistics file */
+static void update_file(void) {
+	update_peers();
+
+	write_begin(&header->seq);
+	header->updated = ctx.now;
+	memcpy(header->packets, ctx.stats.packets, sizeof(header->packets));
+	memcpy(header->bytes, ctx.stats.bytes, sizeof(header->bytes));
+	write_end(&header->seq);
+}
+
+
+/** Creates the statistics file */
+void fastd_stats_file_init(void) {
+	if (!conf.stats_file)
+		return;
+
+#ifdef USE_USER
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+
+	if (conf.user || conf.group) {
+		if (setegid(conf.gid) < 0)
+			pr_debug_errno("setegid");
+		if (seteuid(conf.uid) < 0)
+			pr_debug_errno("seteuid");
+	}
+#endif
+
+	/* Readers may still have the file of a previous instance mapped, so it is replaced instead of truncated */
+	if (unlink(conf.stats_file) && errno != ENOENT)
+		pr_warn_errno("unable to remove old stats file");
+
+	stats_fd = open(conf.stats_file, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (stats_fd < 0)
+		exit_errno("unable to create stats file");
+
+#ifdef USE_USER
+	if (seteuid(uid) < 0)
+		pr_debug_errno("seteuid");
+	if (setegid(gid) < 0)
+		pr_debug_errno("setegid");
+#endif
+
+	if (!grow_file(VECTOR_LEN(ctx.peers)))
+		exit_error("unable to create stats file");
+
+	write_begin(&header->seq);
+	memcpy(header->magic, STATS_FILE_MAGIC, sizeof(header->magic));
+	header->version = STATS_FILE_VERSION;
+	header->header_size = sizeof(stats_file_header_t);
+	header->slot_size = sizeof(stats_file_slot_t);
+	header->n_counters = STAT_MAX;
+	header->pid = getpid();
+	header->started = ctx.started;
+	write_end(&header->seq);
+
+	update_file();
+
+	fastd_task_schedule(&stats_task, TASK_TYPE_STATS_FILE, ctx.now + STATS_FILE_INTERVAL);
+}
+
+/** Updates the statistics file and reschedules the update task */
+void fastd_stats_file_handle_task(void) {
+	update_file();
+	fastd_task_schedule(&stats_task, TASK_TYPE_STATS_FILE, ctx.now + STATS_FILE_INTERVAL);
+}
+
+/** Removes the statistics file */
+void fastd_stats_file_close(void) {
+	if (stats_fd < 0)
+		return;
+
+	fastd_task_unschedule(&stats_task);
+
+	if (unlink(conf.stats_file))
+		pr_warn_errno("unable to remove stats file");
+
+	munmap(header, file_size(n_slots));
+	close(stats_fd);
+
+	header = NULL;
+	n_slots = 0;
+	stats_fd = -1;
+
+	VECTOR_FREE(entries);
+	VECTOR_FREE(free_slots);
+}
+
+#endif /* WITH_STATS_FILE */
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Shared-memory statistics file
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef WITH_STATS_FILE
+
+void fastd_stats_file_init(void);
+void fastd_stats_file_handle_task(void);
+void fastd_stats_file_close(void);
+
+#else
+
+static inline void fastd_stats_file_init(void) {}
+static inline void fastd_stats_file_close(void) {}
+
+#endif
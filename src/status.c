@@ -8,6 +8,15 @@
    \file
 
    Status socket support
+
+   A client connecting to the status socket may send a single-line JSON request selecting the peers and fields it
+   is interested in. Clients that don't send a request within STATUS_REQUEST_TIMEOUT, or send an empty line or
+   close their side of the connection without sending anything, get the full status dump.
+
+   A request can also subscribe to events instead. The connection is kept open and the events are sent as
+   newline-delimited JSON objects. Each subscriber has a queue of at most STATUS_EVENT_QUEUE events; when a
+   subscriber doesn't keep up, further events are dropped and the number of dropped events is reported once the
+   queue has space again, so a stuck client never blocks the main loop.
 */
 
 
@@ -17,12 +26,84 @@
 #ifdef WITH_STATUS_SOCKET
 
 #include "method.h"
+#include "handshake.h"
+#include "latency.h"
 #include "peer.h"
+#include "polling.h"
+#include "task.h"
 
+#include <inttypes.h>
 #include <json-c/json.h>
 #include <net/if.h>
-#include <sys/file.h>
-#include <sys/un.h>
+
+
+/** A connection on the status socket waiting for its request, or subscribed to events */
+typedef struct status_conn {
+	fastd_poll_fd_t fd;      /**< The accepted socket */
+	fastd_task_t task;       /**< Sends the full status if no request has been received in time; for subscribers,
+				    sends the next stats event */
+	fastd_task_t flush_task; /**< Retries sending queued events to a subscriber */
+
+	size_t buf_len;                   /**< The number of bytes in \e buf */
+	char buf[STATUS_REQUEST_MAX + 1]; /**< The request received so far (with space for a terminating zero) */
+
+	unsigned events;                /**< The subscribed events (a combination of status_event_t values) */
+	fastd_timeout_t stats_interval; /**< The interval of stats events */
+	fastd_timeout_t stats_time;     /**< The time of the last stats event */
+	fastd_stats_t stats;            /**< The global statistics at the time of the last stats event */
+
+	char *queue[STATUS_EVENT_QUEUE]; /**< The events waiting to be sent (a ring buffer of JSON lines) */
+	size_t queue_head;               /**< The index of the first queued event */
+	size_t queue_len;                /**< The number of queued events */
+	size_t queue_offset;             /**< The number of bytes of the first queued event that have been sent */
+	uint64_t dropped;                /**< The number of events dropped since the last dropped notification */
+} status_conn_t;
+
+/** The events that can be subscribed to */
+typedef enum status_event {
+	STATUS_EVENT_ESTABLISH = (1 << 0),         /**< A connection has been established */
+	STATUS_EVENT_DISESTABLISH = (1 << 1),      /**< A connection has been disestablished */
+	STATUS_EVENT_HANDSHAKE_FAILURE = (1 << 2), /**< A handshake error has been sent or received */
+	STATUS_EVENT_ROAM = (1 << 3),              /**< The address of an established peer has changed */
+	STATUS_EVENT_STATS = (1 << 4),             /**< Periodic deltas of the global statistics */
+} status_event_t;
+
+/** The peer fields that can be selected by a status request */
+typedef enum status_field {
+	STATUS_FIELD_NAME = (1 << 0),       /**< The peer's name */
+	STATUS_FIELD_ADDRESS = (1 << 1),    /**< The peer's current address */
+	STATUS_FIELD_INTERFACE = (1 << 2),  /**< The peer's interface (when there is no common interface) */
+	STATUS_FIELD_CONNECTION = (1 << 3), /**< The state and statistics of the peer's connection */
+	STATUS_FIELD_CPU = (1 << 4),        /**< The CPU time spent on behalf of the peer (if CPU stats are enabled) */
+	STATUS_FIELDS_ALL = (1 << 5) - 1,   /**< All fields */
+} status_field_t;
+
+/** A parsed status request */
+typedef struct status_query {
+	fastd_protocol_key_t *key; /**< Only dump the peer with this key (or NULL) */
+	const char *name;          /**< Only dump peers with this name (or NULL) */
+	unsigned fields;           /**< The peer fields to dump (a combination of status_field_t values) */
+	bool global;               /**< Dump uptime, interface and global statistics as well */
+	uint64_t after;            /**< Only dump peers with a larger peer ID (for paging) */
+	uint64_t limit;            /**< The maximum number of peers to dump (0 for no limit) */
+	bool sort_cpu;             /**< Dump the peers with the highest total CPU time first */
+} status_query_t;
+
+/** A peer with its total CPU time, for sorting peers by CPU time */
+typedef struct cpu_rank {
+	uint64_t total;             /**< The total CPU time spent on behalf of the peer */
+	const fastd_peer_t *peer;   /**< The peer */
+} cpu_rank_t;
+
+
+/** The names of the peer fields in a status request, in the order of status_field_t */
+static const char *const status_field_names[] = { "name", "address", "interface", "connection", "cpu" };
+
+/** The names of the events in a subscription request, in the order of status_event_t */
+static const char *const status_event_names[] = { "establish", "disestablish", "handshake_failure", "roam", "stats" };
+
+/** The accepted connections that haven't been answered yet and the subscribers */
+static VECTOR(status_conn_t *) conns = {};
 
 
 /** Argument for dump_thread */
@@ -73,12 +154,23 @@ static json_object *dump_iface(const fastd_iface_t *iface) {
 	return (iface && iface->name) ? json_object_new_string(iface->name) : NULL;
 }
 
+/** Dumps a peer address as a JSON string */
+static json_object *dump_address(const fastd_peer_address_t *address) {
+	/* '[' + IPv6 addresss + '%' + interface + ']:' + port + NUL */
+	char addr_buf[1 + INET6_ADDRSTRLEN + 2 + IFNAMSIZ + 1 + 5 + 1];
+	fastd_snprint_peer_address(addr_buf, sizeof(addr_buf), address, NULL, false, false);
+
+	return json_object_new_string(addr_buf);
+}
+
 /** Dumps a fastd_stats_t as a JSON object */
 static json_object *dump_stats(const fastd_stats_t *stats) {
 	struct json_object *statistics = json_object_new_object();
 
 	json_object_object_add(statistics, "rx", dump_stat(stats, STAT_RX));
 	json_object_object_add(statistics, "rx_reordered", dump_stat(stats, STAT_RX_REORDERED));
+	json_object_object_add(statistics, "rx_too_old", dump_stat(stats, STAT_RX_TOO_OLD));
+	json_object_object_add(statistics, "rx_duplicate", dump_stat(stats, STAT_RX_DUPLICATE));
 
 	json_object_object_add(statistics, "tx", dump_stat(stats, STAT_TX));
 	json_object_object_add(statistics, "tx_dropped", dump_stat(stats, STAT_TX_DROPPED));
@@ -88,20 +180,120 @@ static json_object *dump_stats(const fastd_stats_t *stats) {
 }
 
 
-/** Dumps a peer's status as a JSON object */
-static json_object *dump_peer(const fastd_peer_t *peer) {
+/** Dumps the handshake rate and cookie state as a JSON object */
+static json_object *dump_handshakes(void) {
 	struct json_object *ret = json_object_new_object();
 
-	/* '[' + IPv6 addresss + '%' + interface + ']:' + port + NUL */
-	char addr_buf[1 + INET6_ADDRSTRLEN + 2 + IFNAMSIZ + 1 + 5 + 1];
-	fastd_snprint_peer_address(addr_buf, sizeof(addr_buf), &peer->address, NULL, false, false);
+	bool cookie_mode = fastd_handshake_cookie_mode();
+
+	json_object_object_add(ret, "rate", json_object_new_int64(ctx.handshake_rate));
+	json_object_object_add(ret, "current", json_object_new_int64(ctx.handshake_rate_count));
+	json_object_object_add(ret, "cookie_mode", json_object_new_boolean(cookie_mode));
+	json_object_object_add(ret, "cookie_replies", json_object_new_int64(ctx.cookie_replies));
+
+	return ret;
+}
+
+
+/** Dumps the count, sum, maximum and some quantiles of a histogram as a JSON object */
+static json_object *dump_histogram(const fastd_histogram_t *histogram) {
+	struct json_object *ret = json_object_new_object();
 
-	json_object_object_add(ret, "name", peer->name ? json_object_new_string(peer->name) : NULL);
-	json_object_object_add(ret, "address", json_object_new_string(addr_buf));
+	json_object_object_add(ret, "count", json_object_new_int64(histogram->count));
+	json_object_object_add(ret, "sum", json_object_new_int64(histogram->sum));
+	json_object_object_add(ret, "max", json_object_new_int64(histogram->max));
+	json_object_object_add(ret, "p50", json_object_new_int64(fastd_histogram_quantile(histogram, 0.5)));
+	json_object_object_add(ret, "p90", json_object_new_int64(fastd_histogram_quantile(histogram, 0.9)));
+	json_object_object_add(ret, "p99", json_object_new_int64(fastd_histogram_quantile(histogram, 0.99)));
+	json_object_object_add(ret, "p999", json_object_new_int64(fastd_histogram_quantile(histogram, 0.999)));
 
-	if (!ctx.iface)
+	return ret;
+}
+
+/** Dumps the latency histograms as a JSON object (durations are given in nanoseconds) */
+static json_object *dump_latency(void) {
+	const fastd_latency_t *latency = ctx.latency;
+	struct json_object *ret = json_object_new_object();
+	size_t i;
+
+	for (i = 0; i < LATENCY_MAX; i++)
+		json_object_object_add(ret, fastd_latency_stage_name(i), dump_histogram(&latency->stages[i]));
+
+	json_object_object_add(ret, "poll_events", dump_histogram(&latency->poll_events));
+
+	struct json_object *methods = json_object_new_object();
+	json_object_object_add(ret, "methods", methods);
+
+	for (i = 0; i < latency->n_methods; i++) {
+		struct json_object *method = json_object_new_object();
+
+		json_object_object_add(method, "decrypt", dump_histogram(&latency->method_stages[2 * i]));
+		json_object_object_add(method, "encrypt", dump_histogram(&latency->method_stages[2 * i + 1]));
+
+		json_object_object_add(methods, conf.methods[i].name, method);
+	}
+
+	return ret;
+}
+
+/** The names of the per-peer CPU cost types */
+static const char *const cpu_type_names[CPU_MAX] = {
+	[CPU_DECRYPT] = "decrypt",
+	[CPU_ENCRYPT] = "encrypt",
+	[CPU_HANDSHAKE] = "handshake",
+	[CPU_HOOK] = "hook",
+};
+
+/** Returns the total CPU time spent on behalf of a peer */
+static uint64_t cpu_total(const fastd_cpu_stats_t *cpu) {
+	uint64_t total = 0;
+	size_t i;
+
+	for (i = 0; i < CPU_MAX; i++)
+		total += cpu->time[i];
+
+	return total;
+}
+
+/** Dumps the CPU time spent on behalf of a peer as a JSON object (times are given in nanoseconds) */
+static json_object *dump_cpu(const fastd_cpu_stats_t *cpu) {
+	struct json_object *ret = json_object_new_object();
+	size_t i;
+
+	for (i = 0; i < CPU_MAX; i++) {
+		struct json_object *type = json_object_new_object();
+
+		json_object_object_add(type, "time", json_object_new_int64(cpu->time[i]));
+		json_object_object_add(type, "count", json_object_new_int64(cpu->count[i]));
+
+		json_object_object_add(ret, cpu_type_names[i], type);
+	}
+
+	json_object_object_add(ret, "total", json_object_new_int64(cpu_total(cpu)));
+
+	return ret;
+}
+
+
+/** Dumps the selected fields of a peer's status as a JSON object */
+static json_object *dump_peer(const fastd_peer_t *peer, unsigned fields) {
+	struct json_object *ret = json_object_new_object();
+
+	if (fields & STATUS_FIELD_NAME)
+		json_object_object_add(ret, "name", peer->name ? json_object_new_string(peer->name) : NULL);
+
+	if (fields & STATUS_FIELD_ADDRESS)
+		json_object_object_add(ret, "address", dump_address(&peer->address));
+
+	if ((fields & STATUS_FIELD_INTERFACE) && !ctx.iface)
 		json_object_object_add(ret, "interface", dump_iface(peer->iface));
 
+	if ((fields & STATUS_FIELD_CPU) && conf.cpu_stats)
+		json_object_object_add(ret, "cpu", dump_cpu(&peer->cpu));
+
+	if (!(fields & STATUS_FIELD_CONNECTION))
+		return ret;
+
 	struct json_object *connection = NULL;
 
 	if (fastd_peer_is_established(peer)) {
@@ -148,8 +340,8 @@ static json_object *dump_peer(const fastd_peer_t *peer) {
 	return ret;
 }
 
-/** Dumps fastd's status to a connected socket */
-static void dump_status(int fd) {
+/** Dumps uptime, interface and global statistics as a JSON object */
+static json_object *dump_global(void) {
 	struct json_object *json = json_object_new_object();
 
 	json_object_object_add(json, "uptime", json_object_new_int64(ctx.now - ctx.started));
@@ -158,23 +350,118 @@ static void dump_status(int fd) {
 		json_object_object_add(json, "interface", dump_iface(ctx.iface));
 
 	json_object_object_add(json, "statistics", dump_stats(&ctx.stats));
+	json_object_object_add(json, "handshakes", dump_handshakes());
+
+	if (ctx.latency)
+		json_object_object_add(json, "latency", dump_latency());
+
+	struct json_object *log = json_object_new_object();
+	json_object_object_add(
+		log, "dropped", json_object_new_int64(__atomic_load_n(&ctx.log_dropped, __ATOMIC_RELAXED)));
+	json_object_object_add(
+		log, "suppressed", json_object_new_int64(__atomic_load_n(&ctx.log_suppressed, __ATOMIC_RELAXED)));
+	json_object_object_add(json, "log", log);
+
+	return json;
+}
+
+/** Checks if a peer is selected by a status request */
+static bool query_matches(const status_query_t *query, const fastd_peer_t *peer) {
+	if (!fastd_peer_is_enabled(peer))
+		return false;
+
+	return !query->name || strequal(query->name, peer->name);
+}
+
+/** Adds a peer's status to the peers object of a status dump */
+static void add_peer(struct json_object *peers, const fastd_peer_t *peer, unsigned fields) {
+	char buf[65];
+	if (conf.protocol->describe_peer(peer, buf, sizeof(buf)))
+		json_object_object_add(peers, buf, dump_peer(peer, fields));
+}
+
+/** Orders peers by descending CPU time (and by ID for equal times) */
+static int cpu_rank_cmp(const void *a, const void *b) {
+	const cpu_rank_t *r1 = a, *r2 = b;
+
+	if (r1->total != r2->total)
+		return (r1->total > r2->total) ? -1 : 1;
+
+	return (r1->peer->id > r2->peer->id) - (r1->peer->id < r2->peer->id);
+}
+
+/** Adds the matching peers with the highest total CPU time to the peers object of a status dump */
+static void add_peers_by_cpu(struct json_object *peers, const status_query_t *query) {
+	cpu_rank_t *ranks = fastd_new_array(VECTOR_LEN(ctx.peers), cpu_rank_t);
+	size_t i, n = 0;
+
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+
+		if (query_matches(query, peer))
+			ranks[n++] = (cpu_rank_t){ .total = cpu_total(&peer->cpu), .peer = peer };
+	}
+
+	qsort(ranks, n, sizeof(cpu_rank_t), cpu_rank_cmp);
+
+	if (query->limit && n > query->limit)
+		n = query->limit;
+
+	for (i = 0; i < n; i++)
+		add_peer(peers, ranks[i].peer, query->fields);
+
+	free(ranks);
+}
+
+/**
+   Dumps the status selected by a request as a JSON object
+
+   When the number of matching peers exceeds the limit of the request, the ID of the last dumped peer is returned
+   as \e next; passing it as \e after in the next request continues with the following peer. When the peers are
+   sorted by CPU time, only the first \e limit peers are dumped.
+*/
+static json_object *dump_query(const status_query_t *query) {
+	struct json_object *json = query->global ? dump_global() : json_object_new_object();
 
 	struct json_object *peers = json_object_new_object();
 	json_object_object_add(json, "peers", peers);
 
+	if (query->key) {
+		const fastd_peer_t *peer = conf.protocol->find_peer(query->key);
+		if (peer && query_matches(query, peer))
+			add_peer(peers, peer, query->fields);
+
+		return json;
+	}
+
+	if (query->sort_cpu) {
+		add_peers_by_cpu(peers, query);
+		return json;
+	}
+
+	uint64_t n = 0, last = 0;
 	size_t i;
-	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
-		fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+	for (i = fastd_peer_index_after(query->after); i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
 
-		if (!fastd_peer_is_enabled(peer))
+		if (!query_matches(query, peer))
 			continue;
 
-		char buf[65];
-		if (conf.protocol->describe_peer(peer, buf, sizeof(buf)))
-			json_object_object_add(peers, buf, dump_peer(peer));
+		if (query->limit && n == query->limit) {
+			json_object_object_add(json, "next", json_object_new_int64(last));
+			break;
+		}
+
+		add_peer(peers, peer, query->fields);
+		last = peer->id;
+		n++;
 	}
 
+	return json;
+}
 
+/** Writes a JSON object to a connected socket (in a separate thread) and closes the socket */
+static void send_json(int fd, struct json_object *json) {
 	dump_thread_arg_t *arg = fastd_new(dump_thread_arg_t);
 
 	arg->json = json;
@@ -190,106 +477,401 @@ static void dump_status(int fd) {
 	}
 }
 
-/** Deletes the status socket file */
-static void unlink_status_socket(void) {
-	if (!conf.status_socket || ctx.status_fd.fd < 0)
-		return;
+/** Parses a non-negative integer field of a status request */
+static bool parse_uint(struct json_object *value, uint64_t *ret) {
+	if (json_object_get_type(value) != json_type_int)
+		return false;
 
-	if (unlink(conf.status_socket))
-		pr_warn_errno("unlink_status_socket: unlink");
+	int64_t v = json_object_get_int64(value);
+	if (v < 0)
+		return false;
+
+	*ret = v;
+	return true;
 }
 
-static void status_socket_lock(void) {
-	const char *lock_format = "%s.lock";
+/** Parses a status request, returning an error message if it is invalid */
+static const char *parse_query(struct json_object *request, status_query_t *query) {
+	struct json_object *value;
+
+	if (!request || json_object_get_type(request) != json_type_object)
+		return "request must be a JSON object";
 
-	size_t lockname_len = strlen(lock_format) + strlen(conf.status_socket) + 1;
-	char lockname[lockname_len];
-	snprintf(lockname, lockname_len, lock_format, conf.status_socket);
+	if (json_object_object_get_ex(request, "peer", &value)) {
+		if (json_object_get_type(value) != json_type_string)
+			return "`peer' must be a string";
 
-	int lock_fd = open(lockname, O_RDONLY | O_CREAT, 0600);
-	if (lock_fd < 0)
-		exit_errno("unable to open status socket lock file");
+		query->key = conf.protocol->read_key(json_object_get_string(value));
+		if (!query->key)
+			return "invalid peer key";
+	}
 
-	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
-		switch (errno) {
-		case EWOULDBLOCK:
-			exit_error("status socket already in use");
+	if (json_object_object_get_ex(request, "name", &value)) {
+		if (json_object_get_type(value) != json_type_string)
+			return "`name' must be a string";
 
-		default:
-			exit_error("unable to set status socket lock");
+		query->name = json_object_get_string(value);
+	}
+
+	if (json_object_object_get_ex(request, "fields", &value)) {
+		if (json_object_get_type(value) != json_type_array)
+			return "`fields' must be an array";
+
+		query->fields = 0;
+
+		size_t i, j;
+		for (i = 0; i < json_object_array_length(value); i++) {
+			struct json_object *field = json_object_array_get_idx(value, i);
+			if (json_object_get_type(field) != json_type_string)
+				return "`fields' must contain strings";
+
+			for (j = 0; j < array_size(status_field_names); j++) {
+				if (!strcmp(json_object_get_string(field), status_field_names[j]))
+					break;
+			}
+
+			if (j == array_size(status_field_names))
+				return "unknown field";
+
+			query->fields |= (1 << j);
 		}
 	}
+
+	if (json_object_object_get_ex(request, "global", &value)) {
+		if (json_object_get_type(value) != json_type_boolean)
+			return "`global' must be a boolean";
+
+		query->global = json_object_get_boolean(value);
+	}
+
+	if (json_object_object_get_ex(request, "after", &value) && !parse_uint(value, &query->after))
+		return "`after' must be a non-negative integer";
+
+	if (json_object_object_get_ex(request, "limit", &value) && !parse_uint(value, &query->limit))
+		return "`limit' must be a non-negative integer";
+
+	if (json_object_object_get_ex(request, "sort", &value)) {
+		if (json_object_get_type(value) != json_type_string || strcmp(json_object_get_string(value), "cpu"))
+			return "`sort' must be \"cpu\"";
+		if (!conf.cpu_stats)
+			return "CPU stats are disabled";
+		if (query->after)
+			return "`after' can't be combined with `sort'";
+
+		query->sort_cpu = true;
+	}
+
+	return NULL;
 }
 
-/** Initialized the status socket */
-void fastd_status_init(void) {
-	if (!conf.status_socket) {
-		ctx.status_fd.fd = -1;
-		return;
+/** Returns a JSON object with an error message */
+static json_object *error_response(const char *error) {
+	struct json_object *response = json_object_new_object();
+	json_object_object_add(response, "error", json_object_new_string(error));
+	return response;
+}
+
+/** Returns the JSON response to a status query */
+static json_object *handle_query(struct json_object *request) {
+	status_query_t query = { .fields = STATUS_FIELDS_ALL };
+	struct json_object *response;
+
+	const char *error = parse_query(request, &query);
+	if (error)
+		response = error_response(error);
+	else
+		response = dump_query(&query);
+
+	free(query.key);
+	return response;
+}
+
+/** Unregisters a status socket connection and frees it (closing the socket) */
+static void conn_close(status_conn_t *conn) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(conns); i++) {
+		if (VECTOR_INDEX(conns, i) == conn) {
+			VECTOR_DELETE(conns, i);
+			break;
+		}
 	}
 
-#ifdef USE_USER
-	uid_t uid = geteuid();
-	gid_t gid = getegid();
+	fastd_task_unschedule(&conn->task);
+	fastd_task_unschedule(&conn->flush_task);
+
+	if (!fastd_poll_fd_close(&conn->fd))
+		pr_warn_errno("status socket: close");
 
-	if (conf.user || conf.group) {
-		if (setegid(conf.gid) < 0)
-			pr_debug_errno("setegid");
-		if (seteuid(conf.uid) < 0)
-			pr_debug_errno("seteuid");
+	for (i = 0; i < conn->queue_len; i++)
+		free(conn->queue[(conn->queue_head + i) % STATUS_EVENT_QUEUE]);
+
+	free(conn);
+}
+
+/** Sends a response to a status socket connection, which is closed afterwards */
+static void conn_respond(status_conn_t *conn, struct json_object *response) {
+	/* The socket is written to by the dump thread, which needs its own descriptor */
+	int fd = dup(conn->fd.fd);
+	if (fd < 0) {
+		pr_error_errno("status socket: dup");
+		json_object_put(response);
+	} else {
+		send_json(fd, response);
 	}
-#endif
 
-	status_socket_lock();
+	conn_close(conn);
+}
+
+/**
+   Sends as many queued events to a subscriber as possible without blocking
+
+   Returns false if the connection has been closed because of an error.
+*/
+static bool conn_flush(status_conn_t *conn) {
+	while (conn->queue_len) {
+		char *line = conn->queue[conn->queue_head];
+		size_t len = strlen(line);
+
+		ssize_t ret = send(conn->fd.fd, line + conn->queue_offset, len - conn->queue_offset, MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!fastd_task_scheduled(&conn->flush_task))
+					fastd_task_schedule(
+						&conn->flush_task, TASK_TYPE_STATUS_FLUSH, ctx.now + STATUS_EVENT_RETRY);
+
+				return true;
+			}
+
+			pr_debug_errno("status socket: send");
+			conn_close(conn);
+			return false;
+		}
 
-	if (unlink(conf.status_socket) == 0)
-		pr_info("removing old status socket");
-	else if (errno != ENOENT)
-		pr_warn_errno("unable to remove old status socket");
+		conn->queue_offset += ret;
+		if (conn->queue_offset < len)
+			continue;
 
-	ctx.status_fd = FASTD_POLL_FD(POLL_TYPE_STATUS, socket(AF_UNIX, SOCK_STREAM, 0));
-	if (ctx.status_fd.fd < 0)
-		exit_errno("fastd_status_init: socket");
+		free(line);
+		conn->queue_head = (conn->queue_head + 1) % STATUS_EVENT_QUEUE;
+		conn->queue_len--;
+		conn->queue_offset = 0;
+	}
 
+	return true;
+}
 
-	size_t status_socket_len = strlen(conf.status_socket);
-	size_t len = offsetof(struct sockaddr_un, sun_path) + status_socket_len + 1;
-	uint8_t buf[len] __attribute__((aligned(__alignof__(struct sockaddr_un))));
-	memset(buf, 0, offsetof(struct sockaddr_un, sun_path));
+/** Adds a JSON line to the queue of a subscriber, which must have space for it */
+static void conn_push(status_conn_t *conn, const char *str) {
+	size_t len = strlen(str);
+	char *line = fastd_alloc(len + 2);
 
-	struct sockaddr_un *sa = (struct sockaddr_un *)buf;
+	memcpy(line, str, len);
+	memcpy(line + len, "\n", 2);
+
+	conn->queue[(conn->queue_head + conn->queue_len) % STATUS_EVENT_QUEUE] = line;
+	conn->queue_len++;
+}
+
+/**
+   Queues an event for a subscriber and tries to send it
 
-	sa->sun_family = AF_UNIX;
-	memcpy(sa->sun_path, conf.status_socket, status_socket_len + 1);
+   When the queue is full, the event is dropped. A notification with the number of dropped events is queued before
+   the next event that fits into the queue.
+*/
+static bool conn_queue(status_conn_t *conn, const char *str) {
+	size_t needed = conn->dropped ? 2 : 1;
+
+	if (conn->queue_len + needed > STATUS_EVENT_QUEUE) {
+		conn->dropped++;
+		return true;
+	}
+
+	if (conn->dropped) {
+		char notice[64];
+		snprintf(notice, sizeof(notice), "{ \"event\": \"dropped\", \"count\": %" PRIu64 " }", conn->dropped);
+		conn_push(conn, notice);
+		conn->dropped = 0;
+	}
+
+	conn_push(conn, str);
+
+	return conn_flush(conn);
+}
+
+/** Returns the event bit for an event name, or 0 if the name is unknown */
+static unsigned parse_event(const char *name) {
+	size_t i;
+	for (i = 0; i < array_size(status_event_names); i++) {
+		if (!strcmp(name, status_event_names[i]))
+			return 1 << i;
+	}
+
+	return 0;
+}
+
+/** Turns a connection into a subscriber, returning an error message if the request is invalid */
+static const char *conn_subscribe(status_conn_t *conn, struct json_object *request) {
+	struct json_object *value;
+	unsigned events = 0;
+	uint64_t interval = STATUS_STATS_INTERVAL;
+
+	json_object_object_get_ex(request, "subscribe", &value);
+	if (json_object_get_type(value) != json_type_array || !json_object_array_length(value))
+		return "`subscribe' must be a non-empty array";
+
+	size_t i;
+	for (i = 0; i < json_object_array_length(value); i++) {
+		struct json_object *name = json_object_array_get_idx(value, i);
+		if (json_object_get_type(name) != json_type_string)
+			return "`subscribe' must contain strings";
 
-	if (bind(ctx.status_fd.fd, (struct sockaddr *)sa, len)) {
-		switch (errno) {
-		case EADDRINUSE:
-			exit_error("unable to create status socket: the path `%s' already exists", conf.status_socket);
+		unsigned event = parse_event(json_object_get_string(name));
+		if (!event)
+			return "unknown event";
 
-		default:
-			exit_errno("unable to create status socket");
+		events |= event;
+	}
+
+	if (json_object_object_get_ex(request, "stats_interval", &value)) {
+		if (!parse_uint(value, &interval) || !interval || interval > STATUS_STATS_INTERVAL_MAX)
+			return "invalid `stats_interval'";
+	}
+
+	conn->events = events;
+	conn->stats_interval = 1000 * interval;
+
+	fastd_task_unschedule(&conn->task);
+
+	if (events & STATUS_EVENT_STATS) {
+		conn->stats = ctx.stats;
+		conn->stats_time = ctx.now;
+		fastd_task_schedule(&conn->task, TASK_TYPE_STATUS_CONN, ctx.now + conn->stats_interval);
+	}
+
+	return NULL;
+}
+
+/** Handles a request line received on a status socket connection */
+static void conn_handle_request(status_conn_t *conn, const char *line) {
+	/* An empty request yields the full status dump */
+	if (!*line) {
+		status_query_t query = { .fields = STATUS_FIELDS_ALL, .global = true };
+		conn_respond(conn, dump_query(&query));
+		return;
+	}
+
+	struct json_object *request = json_tokener_parse(line), *response;
+
+	if (request && json_object_get_type(request) == json_type_object &&
+	    json_object_object_get_ex(request, "subscribe", NULL)) {
+		const char *error = conn_subscribe(conn, request);
+		json_object_put(request);
+
+		if (!error) {
+			conn_queue(conn, "{ \"event\": \"subscribed\" }");
+			return;
 		}
+
+		response = error_response(error);
+	} else {
+		response = handle_query(request);
+
+		if (request)
+			json_object_put(request);
 	}
 
-	if (atexit(unlink_status_socket)) {
-		pr_error_errno("atexit");
-		unlink_status_socket();
-		exit(1);
+	conn_respond(conn, response);
+}
+
+/** Returns true if any connection is subscribed to an event */
+static bool has_subscribers(status_event_t event) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(conns); i++) {
+		if (VECTOR_INDEX(conns, i)->events & event)
+			return true;
 	}
 
-	if (listen(ctx.status_fd.fd, 4))
-		exit_errno("fastd_status_init: listen");
+	return false;
+}
 
+/** Creates the JSON object of an event concerning a peer */
+static json_object *new_event(status_event_t event, const fastd_peer_t *peer) {
+	struct json_object *json = json_object_new_object();
 
-#ifdef USE_USER
-	if (seteuid(uid) < 0)
-		pr_debug_errno("seteuid");
-	if (setegid(gid) < 0)
-		pr_debug_errno("setegid");
-#endif
+	size_t i;
+	for (i = 0; i < array_size(status_event_names); i++) {
+		if (event == (1u << i))
+			json_object_object_add(json, "event", json_object_new_string(status_event_names[i]));
+	}
 
-	fastd_poll_fd_register(&ctx.status_fd);
+	char buf[65];
+	if (peer && conf.protocol->describe_peer(peer, buf, sizeof(buf))) {
+		json_object_object_add(json, "peer", json_object_new_string(buf));
+		json_object_object_add(json, "name", peer->name ? json_object_new_string(peer->name) : NULL);
+	}
+
+	return json;
+}
+
+/** Queues an event for all subscribers of the event and frees the JSON object */
+static void send_event(status_event_t event, struct json_object *json) {
+	const char *str = json_object_to_json_string(json);
+
+	/* Iterate backwards, as subscribers may be removed on errors */
+	size_t i;
+	for (i = VECTOR_LEN(conns); i > 0; i--) {
+		status_conn_t *conn = VECTOR_INDEX(conns, i - 1);
+
+		if (conn->events & event)
+			conn_queue(conn, str);
+	}
+
+	json_object_put(json);
+}
+
+/** Sends a stats event to a subscriber with the changes of the global statistics since the last one */
+static void conn_send_stats(status_conn_t *conn) {
+	fastd_stats_t delta;
+	size_t i;
+
+	for (i = 0; i < STAT_MAX; i++) {
+		delta.packets[i] = ctx.stats.packets[i] - conn->stats.packets[i];
+		delta.bytes[i] = ctx.stats.bytes[i] - conn->stats.bytes[i];
+	}
+
+	struct json_object *json = new_event(STATUS_EVENT_STATS, NULL);
+	json_object_object_add(json, "interval", json_object_new_int64(ctx.now - conn->stats_time));
+	json_object_object_add(json, "statistics", dump_stats(&delta));
+
+	conn->stats = ctx.stats;
+	conn->stats_time = ctx.now;
+	fastd_task_schedule(&conn->task, TASK_TYPE_STATUS_CONN, ctx.now + conn->stats_interval);
+
+	conn_queue(conn, json_object_to_json_string(json));
+	json_object_put(json);
+}
+
+/** Deletes the status socket file */
+static void unlink_status_socket(void) {
+	if (!conf.status_socket || ctx.status_fd.fd < 0)
+		return;
+
+	if (unlink(conf.status_socket))
+		pr_warn_errno("unlink_status_socket: unlink");
+}
+
+/** Initialized the status socket */
+void fastd_status_init(void) {
+	if (!conf.status_socket) {
+		ctx.status_fd.fd = -1;
+		return;
+	}
+
+	ctx.status_fd = FASTD_POLL_FD(POLL_TYPE_STATUS, -1);
+	fastd_socket_listen_unix(&ctx.status_fd, conf.status_socket, "status", true, unlink_status_socket);
 }
 
 /** Closes the status socket */
@@ -297,6 +879,11 @@ void fastd_status_close(void) {
 	if (!conf.status_socket || ctx.status_fd.fd < 0)
 		return;
 
+	while (VECTOR_LEN(conns))
+		conn_close(VECTOR_INDEX(conns, 0));
+
+	VECTOR_FREE(conns);
+
 	if (!fastd_poll_fd_close(&ctx.status_fd))
 		pr_warn_errno("fastd_status_cleanup: close");
 
@@ -314,7 +901,114 @@ void fastd_status_handle(void) {
 		return;
 	}
 
-	dump_status(fd);
+	status_conn_t *conn = fastd_new0(status_conn_t);
+	conn->fd = FASTD_POLL_FD(POLL_TYPE_STATUS_CONN, fd);
+
+	fastd_poll_fd_register(&conn->fd);
+	fastd_task_schedule(&conn->task, TASK_TYPE_STATUS_CONN, ctx.now + STATUS_REQUEST_TIMEOUT);
+
+	VECTOR_ADD(conns, conn);
+}
+
+/** Handles input on a status socket connection */
+void fastd_status_handle_conn(fastd_poll_fd_t *fd) {
+	status_conn_t *conn = container_of(fd, status_conn_t, fd);
+
+	if (conn->events) {
+		/* Anything a subscriber sends is ignored, the subscription ends when the client closes the connection */
+		char buf[256];
+		ssize_t len = read(conn->fd.fd, buf, sizeof(buf));
+		if (len == 0 || (len < 0 && errno != EINTR))
+			conn_close(conn);
+
+		return;
+	}
+
+	/* The socket is only read from when it is readable, so a single read never blocks */
+	ssize_t len = read(conn->fd.fd, conn->buf + conn->buf_len, STATUS_REQUEST_MAX - conn->buf_len);
+	if (len < 0) {
+		if (errno != EINTR) {
+			pr_debug_errno("status socket: read");
+			conn_close(conn);
+		}
+
+		return;
+	}
+
+	conn->buf_len += len;
+
+	char *end = memchr(conn->buf, '\n', conn->buf_len);
+	if (!end) {
+		if (len && conn->buf_len < STATUS_REQUEST_MAX)
+			return;
+
+		/* The client has closed its side of the connection or the request is too long; the latter will fail
+		 * to parse */
+		end = conn->buf + conn->buf_len;
+	}
+
+	if (end > conn->buf && end[-1] == '\r')
+		end--;
+
+	*end = 0;
+	conn_handle_request(conn, conn->buf);
+}
+
+/**
+   Handles the task of a status socket connection
+
+   The full status is sent to connections that haven't sent a request in time; subscribers get their next stats
+   event.
+*/
+void fastd_status_handle_task(fastd_task_t *task) {
+	status_conn_t *conn = container_of(task, status_conn_t, task);
+
+	if (conn->events)
+		conn_send_stats(conn);
+	else
+		conn_handle_request(conn, "");
+}
+
+/** Retries sending the queued events to a subscriber */
+void fastd_status_handle_flush(fastd_task_t *task) {
+	conn_flush(container_of(task, status_conn_t, flush_task));
+}
+
+/** Notifies subscribers that a connection has been established or disestablished */
+void fastd_status_event_established(const fastd_peer_t *peer, bool established) {
+	status_event_t event = established ? STATUS_EVENT_ESTABLISH : STATUS_EVENT_DISESTABLISH;
+	if (!has_subscribers(event))
+		return;
+
+	struct json_object *json = new_event(event, peer);
+	json_object_object_add(json, "address", dump_address(&peer->address));
+	send_event(event, json);
+}
+
+/** Notifies subscribers that the address of an established peer has changed */
+void fastd_status_event_roamed(const fastd_peer_t *peer, const fastd_peer_address_t *old_address) {
+	if (!has_subscribers(STATUS_EVENT_ROAM))
+		return;
+
+	struct json_object *json = new_event(STATUS_EVENT_ROAM, peer);
+	json_object_object_add(json, "address", dump_address(&peer->address));
+	json_object_object_add(json, "old_address", dump_address(old_address));
+	send_event(STATUS_EVENT_ROAM, json);
+}
+
+/** Notifies subscribers that a handshake error reply has been sent or received */
+void fastd_status_event_handshake_failed(
+	const fastd_peer_t *peer, const fastd_peer_address_t *remote_addr, const char *direction, unsigned reply_code,
+	const char *field) {
+	if (!has_subscribers(STATUS_EVENT_HANDSHAKE_FAILURE))
+		return;
+
+	struct json_object *json = new_event(STATUS_EVENT_HANDSHAKE_FAILURE, peer);
+	json_object_object_add(json, "address", dump_address(remote_addr));
+	json_object_object_add(json, "direction", json_object_new_string(direction));
+	json_object_object_add(json, "reply_code", json_object_new_int(reply_code));
+	json_object_object_add(json, "field", json_object_new_string(field));
+	send_event(STATUS_EVENT_HANDSHAKE_FAILURE, json);
 }
 
 #endif
@@ -11,12 +11,16 @@
 */
 
 #include "task.h"
+#include "metrics.h"
 #include "peer.h"
+#include "stats_file.h"
+#include "trace.h"
 
 
 /** Performs periodic maintenance tasks */
 static inline void maintenance(void) {
 	fastd_peer_eth_addr_cleanup();
+	fastd_resolve_cache_cleanup();
 	fastd_task_reschedule_relative(&ctx.next_maintenance, MAINTENANCE_INTERVAL);
 }
 
@@ -25,6 +29,8 @@ static void handle_task(void) {
 	fastd_task_t *task = container_of(ctx.task_queue, fastd_task_t, entry);
 	fastd_pqueue_remove(ctx.task_queue);
 
+	fastd_trace(task, task->type);
+
 	switch (task->type) {
 	case TASK_TYPE_MAINTENANCE:
 		maintenance();
@@ -34,6 +40,32 @@ static void handle_task(void) {
 		fastd_peer_handle_task(task);
 		break;
 
+	case TASK_TYPE_HANDSHAKE_QUEUE:
+		fastd_peer_handle_handshake_queue();
+		break;
+
+#ifdef WITH_STATUS_SOCKET
+	case TASK_TYPE_STATUS_CONN:
+		fastd_status_handle_task(task);
+		break;
+
+	case TASK_TYPE_STATUS_FLUSH:
+		fastd_status_handle_flush(task);
+		break;
+#endif
+
+#ifdef WITH_METRICS_SOCKET
+	case TASK_TYPE_METRICS_CONN:
+		fastd_metrics_handle_task(task);
+		break;
+#endif
+
+#ifdef WITH_STATS_FILE
+	case TASK_TYPE_STATS_FILE:
+		fastd_stats_file_handle_task();
+		break;
+#endif
+
 	default:
 		exit_bug("unknown task type");
 	}
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Static tracepoints (USDT probes)
+
+   When fastd is built with USDT support, the following probes of the provider \e fastd can be attached to with
+   tools like bpftrace or perf. An unused probe is a single no-op instruction, so they don't affect the timing of
+   the packet path like raising the log level does. Peer IDs start at 1; a peer ID of 0 means that the packet
+   doesn't belong to a known peer (e.g. a handshake sent to an unknown address).
+
+   \li \e receive(fd, len): A packet has been received on a socket
+   \li \e decrypt_ok(peer_id, len): A payload packet has been decrypted (len is the decrypted length)
+   \li \e decrypt_fail(peer_id, len): A payload packet couldn't be decrypted
+   \li \e iface_write(fd, len): A packet has been written to a TUN/TAP interface
+   \li \e send(peer_id, len, errno): A packet has been sent (errno is 0 on success)
+   \li \e handshake_start(peer_id): An initial handshake is sent
+   \li \e handshake_finish(peer_id, initiator, method): A handshake has been completed
+   \li \e session_establish(peer_id): A connection has been established
+   \li \e session_refresh(peer_id): A session refresh has been triggered by the method
+   \li \e task(type): A scheduled task is handled
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef WITH_USDT
+
+#include <sys/sdt.h>
+
+/** Fires the static tracepoint \e name with the given arguments */
+#define fastd_trace(name, args...) STAP_PROBEV(fastd, name, ##args)
+
+#else
+
+/** Fires the static tracepoint \e name with the given arguments (USDT support is disabled) */
+#define fastd_trace(name, args...) \
+	do {                       \
+	} while (0)
+
+#endif
@@ -61,18 +61,30 @@ typedef enum fastd_drop_caps {
 
 /** Types of file descriptors to poll on */
 typedef enum fastd_poll_type {
-	POLL_TYPE_UNSPEC = 0, /**< Unspecified file descriptor type */
-	POLL_TYPE_ASYNC,      /**< The async action socket */
-	POLL_TYPE_STATUS,     /**< The status socket */
-	POLL_TYPE_IFACE,      /**< A TUN/TAP interface */
-	POLL_TYPE_SOCKET,     /**< A network socket */
+	POLL_TYPE_UNSPEC = 0,    /**< Unspecified file descriptor type */
+	POLL_TYPE_ASYNC,         /**< The async action socket */
+	POLL_TYPE_STATUS,        /**< The status socket */
+	POLL_TYPE_STATUS_CONN,   /**< A connection on the status socket */
+	POLL_TYPE_METRICS,       /**< The metrics socket */
+	POLL_TYPE_METRICS_CONN,  /**< A connection on the metrics socket */
+	POLL_TYPE_IFACE,         /**< A TUN/TAP interface */
+	POLL_TYPE_SOCKET,        /**< A network socket */
+	POLL_TYPE_VERIFY_HELPER, /**< The output pipe of the verify helper */
+	POLL_TYPE_SPAWN,         /**< The socket connected to the spawn server */
+	POLL_TYPE_PEER_WATCH,    /**< The inotify instance watching the peer directories */
+	POLL_TYPE_XDP,           /**< An AF_XDP socket */
 } fastd_poll_type_t;
 
 /** Task types */
 typedef enum fastd_task_type {
-	TASK_TYPE_UNSPEC = 0,  /**< Unspecified task type */
-	TASK_TYPE_MAINTENANCE, /**< Scheduled maintenance */
-	TASK_TYPE_PEER,        /**< Peer maintenance (handshake, reset, keepalive) */
+	TASK_TYPE_UNSPEC = 0,      /**< Unspecified task type */
+	TASK_TYPE_MAINTENANCE,     /**< Scheduled maintenance */
+	TASK_TYPE_PEER,            /**< Peer maintenance (handshake, reset, keepalive) */
+	TASK_TYPE_HANDSHAKE_QUEUE, /**< Sending handshakes delayed by the handshake budget */
+	TASK_TYPE_STATUS_CONN,     /**< Request timeout or stats event of a status socket connection */
+	TASK_TYPE_STATUS_FLUSH,    /**< Retrying to send events to a status socket subscriber */
+	TASK_TYPE_STATS_FILE,      /**< Updating the statistics file */
+	TASK_TYPE_METRICS_CONN,    /**< Request timeout or send retry of a metrics socket connection */
 } fastd_task_type_t;
 
 
@@ -87,6 +99,7 @@ typedef struct fastd_buffer fastd_buffer_t;
 typedef struct fastd_poll_fd fastd_poll_fd_t;
 typedef struct fastd_pqueue fastd_pqueue_t;
 typedef struct fastd_task fastd_task_t;
+typedef struct fastd_worker_job fastd_worker_job_t;
 
 typedef union fastd_peer_address fastd_peer_address_t;
 typedef struct fastd_bind_address fastd_bind_address_t;
@@ -98,7 +111,9 @@ typedef struct fastd_eth_header fastd_eth_header_t;
 typedef struct fastd_peer fastd_peer_t;
 typedef struct fastd_peer_eth_addr fastd_peer_eth_addr_t;
 typedef struct fastd_remote fastd_remote_t;
+typedef struct fastd_resolve_entry fastd_resolve_entry_t;
 typedef struct fastd_stats fastd_stats_t;
+typedef struct fastd_cpu_stats fastd_cpu_stats_t;
 typedef struct fastd_handshake_timeout fastd_handshake_timeout_t;
 
 typedef struct fastd_config fastd_config_t;
@@ -122,6 +137,14 @@ typedef struct fastd_string_stack fastd_string_stack_t;
 
 typedef struct fastd_shell_command fastd_shell_command_t;
 typedef struct fastd_shell_env fastd_shell_env_t;
+typedef struct fastd_verify_helper fastd_verify_helper_t;
+typedef struct fastd_async_msg fastd_async_msg_t;
+typedef struct fastd_verify_cache fastd_verify_cache_t;
+typedef struct fastd_latency fastd_latency_t;
+typedef struct fastd_log_ring fastd_log_ring_t;
+typedef struct fastd_uring fastd_uring_t;
+typedef struct fastd_xdp fastd_xdp_t;
+typedef struct fastd_xdp_dest fastd_xdp_dest_t;
 
 
 /** A 128-bit aligned block of data, primarily used by the cryptographic functions */
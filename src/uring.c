@@ -0,0 +1,585 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   io_uring event loop backend
+
+   Instead of waiting for readiness with epoll and doing one syscall per packet, the main loop queues its requests
+   on an io_uring and submits them together with waiting for completions, using a single io_uring_enter() call per
+   iteration:
+
+   \li The UDP sockets are read with multishot recvmsg requests taking their buffers from a provided buffer ring,
+       so a single request keeps receiving packets until it is cancelled.
+   \li Payload packets are sent and written to the TUN/TAP interfaces with requests that are submitted with the
+       next wait, so all packets produced by an iteration of the main loop are handed to the kernel at once.
+   \li All other file descriptors (including the TUN/TAP interfaces, which are still read with read()) are watched
+       with one-shot poll requests. These are queued again after each completion, which keeps the level-triggered
+       semantics of the epoll backend.
+*/
+
+
+#include "uring.h"
+#include "handshake.h"
+#include "latency.h"
+#include "peer.h"
+#include "polling.h"
+#include "trace.h"
+
+#include <liburing.h>
+#include <signal.h>
+
+
+/** The number of submission queue entries */
+#define URING_SQ_ENTRIES 256
+
+/** The number of completion queue entries */
+#define URING_CQ_ENTRIES 4096
+
+/** The maximum number of completions handled per iteration of the main loop */
+#define URING_BATCH 64
+
+/** The number of buffers provided for receiving packets (must be a power of two) */
+#define URING_RECV_BUFFERS 256
+
+/** The ID of the buffer group of the buffers provided for receiving packets */
+#define URING_RECV_GROUP 0
+
+/** The space reserved for the ancillary data of a received packet */
+#define URING_RECV_CONTROL 256
+
+/** The space for the ancillary data of a sent packet */
+#define URING_SEND_CONTROL CMSG_SPACE(sizeof(struct in6_pktinfo))
+
+
+/** The request types, stored in the low bits of the user data of a request */
+typedef enum uring_op {
+	URING_OP_NONE = 0, /**< A request whose completion is ignored */
+	URING_OP_POLL,     /**< A one-shot poll request of a registered file descriptor */
+	URING_OP_RECV,     /**< A multishot recvmsg request of a registered socket */
+	URING_OP_SEND,     /**< A sendmsg request (the rest of the user data points to its uring_req_t) */
+	URING_OP_WRITE,    /**< A write request (the rest of the user data points to its uring_req_t) */
+} uring_op_t;
+
+/** The mask of the request type in the user data of a request */
+#define URING_OP_MASK 7
+
+
+/** A file descriptor number registered with the io_uring */
+typedef struct uring_fd {
+	fastd_poll_fd_t *fd; /**< The registered file descriptor (NULL if the number isn't registered) */
+	uint32_t gen;        /**< Incremented whenever the number is unregistered, invalidating pending completions */
+} uring_fd_t;
+
+/** A queued sendmsg or write request */
+typedef struct uring_req {
+	int fd;                /**< The file descriptor the data is sent on or written to */
+	fastd_buffer_t buffer; /**< The data */
+	uint64_t peer_id;      /**< The ID of the peer a packet is sent to */
+	size_t stat_size;      /**< The size to add to the statistics of the peer */
+
+	struct msghdr msg;                                           /**< The message header of a sendmsg request */
+	struct iovec iov;                                            /**< The data vector of a sendmsg request */
+	fastd_peer_address_t addr;                                   /**< The destination of a sendmsg request */
+	uint8_t cbuf[URING_SEND_CONTROL] __attribute__((aligned(8))); /**< The ancillary data of a sendmsg request */
+} uring_req_t;
+
+/** A completion copied from the completion queue */
+typedef struct uring_completion {
+	uint64_t data;  /**< The user data of the request */
+	int32_t res;    /**< The result of the request */
+	uint32_t flags; /**< The completion flags */
+} uring_completion_t;
+
+/** The state of the io_uring backend */
+struct fastd_uring {
+	struct io_uring ring; /**< The io_uring instance */
+
+	VECTOR(uring_fd_t) fds; /**< The registered file descriptors, indexed by the FD itself */
+
+	struct io_uring_buf_ring *buf_ring; /**< The ring of buffers provided for receiving packets */
+	uint8_t *bufs;                      /**< The memory of the provided buffers */
+	size_t buf_size;                    /**< The size of each provided buffer */
+	uint16_t mtu;                       /**< The largest MTU the provided buffers can receive packets for */
+	bool mtu_warned;                    /**< Set when a warning about a larger peer MTU has been logged */
+	struct msghdr recv_msg;             /**< Describes the layout of the received messages in the buffers */
+
+	size_t inflight; /**< The number of sendmsg and write requests that haven't completed yet */
+};
+
+
+/** Returns the user data of a request watching a registered file descriptor */
+static inline uint64_t fd_data(int fd, uring_op_t op) {
+	const uring_fd_t *entry = &VECTOR_INDEX(ctx.uring->fds, fd);
+	return ((uint64_t)entry->gen << 32) | ((uint64_t)fd << 3) | op;
+}
+
+/** Returns the registration a request belongs to, or NULL if the file descriptor has been unregistered since */
+static uring_fd_t *fd_entry(uint64_t data) {
+	size_t fd = (data & 0xffffffff) >> 3;
+
+	if (fd >= VECTOR_LEN(ctx.uring->fds))
+		return NULL;
+
+	uring_fd_t *entry = &VECTOR_INDEX(ctx.uring->fds, fd);
+	if (!entry->fd || entry->gen != (data >> 32))
+		return NULL;
+
+	return entry;
+}
+
+/** Returns a free submission queue entry, or NULL if the queue is full and can't be submitted */
+static struct io_uring_sqe *get_sqe(void) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx.uring->ring);
+	if (sqe)
+		return sqe;
+
+	int ret = io_uring_submit(&ctx.uring->ring);
+	if (ret < 0) {
+		errno = -ret;
+		pr_debug_errno("io_uring_submit");
+		return NULL;
+	}
+
+	return io_uring_get_sqe(&ctx.uring->ring);
+}
+
+/** Queues the request watching a registered file descriptor */
+static void arm_fd(fastd_poll_fd_t *fd) {
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe)
+		exit_error("unable to queue io_uring request");
+
+	if (fd->type == POLL_TYPE_SOCKET) {
+		io_uring_prep_recvmsg_multishot(sqe, fd->fd, &ctx.uring->recv_msg, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_RECV_GROUP;
+		io_uring_sqe_set_data64(sqe, fd_data(fd->fd, URING_OP_RECV));
+	} else {
+		io_uring_prep_poll_add(sqe, fd->fd, POLLIN);
+		io_uring_sqe_set_data64(sqe, fd_data(fd->fd, URING_OP_POLL));
+	}
+}
+
+/** Returns a provided buffer to the buffer ring */
+static void recycle_buffer(uint16_t bid) {
+	fastd_uring_t *uring = ctx.uring;
+
+	io_uring_buf_ring_add(
+		uring->buf_ring, uring->bufs + bid * uring->buf_size, uring->buf_size, bid,
+		io_uring_buf_ring_mask(URING_RECV_BUFFERS), 0);
+	io_uring_buf_ring_advance(uring->buf_ring, 1);
+}
+
+/** Handles a packet received by a multishot recvmsg request */
+static void handle_recv(fastd_socket_t *sock, uint8_t *buf, int len) {
+	fastd_uring_t *uring = ctx.uring;
+	int64_t start = fastd_latency_start();
+
+	struct io_uring_recvmsg_out *out = io_uring_recvmsg_validate(buf, len, &uring->recv_msg);
+	if (!out)
+		return;
+
+	if (out->flags & MSG_TRUNC) {
+		pr_debug("received truncated packet");
+		return;
+	}
+
+	size_t payload_len = io_uring_recvmsg_payload_length(out, len, &uring->recv_msg);
+	if (!payload_len)
+		return;
+
+	fastd_peer_address_t remote_addr = {};
+	memcpy(&remote_addr, io_uring_recvmsg_name(out), min_size_t(out->namelen, sizeof(remote_addr)));
+
+	struct msghdr message = {
+		.msg_control = (uint8_t *)io_uring_recvmsg_name(out) + uring->recv_msg.msg_namelen,
+		.msg_controllen = out->controllen,
+	};
+
+	/* The provided buffers have no room for the headroom and tailroom needed for decryption, so the packet is
+	 * copied; this also allows returning the provided buffer to the kernel right away */
+	fastd_buffer_t buffer = fastd_buffer_alloc(payload_len, conf.decrypt_headroom, conf.tailroom);
+	memcpy(buffer.data, io_uring_recvmsg_payload(out, &uring->recv_msg), payload_len);
+
+	fastd_receive_packet(sock, &message, &remote_addr, buffer, start);
+}
+
+/** Handles the completion of a request watching a registered file descriptor */
+static void handle_fd_completion(uint64_t data, int32_t res, uint32_t flags) {
+	uring_fd_t *entry = fd_entry(data);
+	fastd_poll_fd_t *fd = entry ? entry->fd : NULL;
+
+	if ((data & URING_OP_MASK) == URING_OP_RECV) {
+		if (flags & IORING_CQE_F_BUFFER) {
+			uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+			uint8_t *buf = ctx.uring->bufs + bid * ctx.uring->buf_size;
+
+			if (fd)
+				handle_recv(container_of(fd, fastd_socket_t, fd), buf, res);
+
+			recycle_buffer(bid);
+		} else if (fd && res < 0 && res != -ENOBUFS) {
+			errno = -res;
+			pr_debug_errno("recvmsg");
+
+			fastd_poll_handle_fd(fd, false, true);
+		}
+	} else if (fd && res >= 0) {
+		fastd_poll_handle_fd(fd, res & POLLIN, res & (POLLERR | POLLHUP | POLLNVAL));
+	}
+
+	if (flags & IORING_CQE_F_MORE)
+		return;
+
+	/* The request has finished; queue it again unless the file descriptor has been unregistered meanwhile */
+	if (fd && fd_entry(data))
+		arm_fd(fd);
+}
+
+/** Handles the completion of a sendmsg request */
+static void handle_send(uring_req_t *req, int32_t res) {
+	fastd_peer_t *peer = fastd_peer_find_by_id(req->peer_id);
+	int error = (res < 0) ? -res : 0;
+
+	/* Like fastd_send(), try again without packet info if the local address has become invalid (as long as the
+	   socket is still the one of the peer) */
+	if ((error == EINVAL || error == ENETUNREACH) && req->msg.msg_controllen && peer && peer->sock &&
+	    peer->sock->fd.fd == req->fd) {
+		pr_debug2("sendmsg: %s (trying again without pktinfo)", strerror(error));
+
+		if (!fastd_peer_handshake_scheduled(peer))
+			fastd_peer_schedule_handshake_default(peer);
+
+		req->msg.msg_control = NULL;
+		req->msg.msg_controllen = 0;
+
+		error = (sendmsg(req->fd, &req->msg, 0) < 0) ? errno : 0;
+	}
+
+	fastd_trace(send, req->peer_id, req->buffer.len, error);
+
+	/* The peer may have been deleted in the meantime */
+	fastd_send_complete(peer, peer ? req->stat_size : 0, error);
+}
+
+/** Handles the completion of a write request */
+static void handle_write(uring_req_t *req, int32_t res) {
+	if (res < 0) {
+		errno = -res;
+		pr_debug2_errno("write");
+	}
+
+	fastd_trace(iface_write, req->fd, req->buffer.len);
+}
+
+/** Frees a finished sendmsg or write request */
+static void free_req(uring_req_t *req) {
+	fastd_buffer_free(req->buffer);
+	free(req);
+
+	ctx.uring->inflight--;
+}
+
+/** Handles a completion */
+static void handle_completion(const uring_completion_t *completion) {
+	uring_req_t *req = (uring_req_t *)(uintptr_t)(completion->data & ~(uint64_t)URING_OP_MASK);
+
+	switch (completion->data & URING_OP_MASK) {
+	case URING_OP_POLL:
+	case URING_OP_RECV:
+		handle_fd_completion(completion->data, completion->res, completion->flags);
+		return;
+
+	case URING_OP_SEND:
+		handle_send(req, completion->res);
+		break;
+
+	case URING_OP_WRITE:
+		handle_write(req, completion->res);
+		break;
+
+	default:
+		return;
+	}
+
+	free_req(req);
+}
+
+
+/**
+   Returns the largest MTU of the configured interfaces
+
+   Only the peers of the configuration file are known at this point; peers from peer directories are checked by
+   fastd_uring_check_mtu() when they are loaded.
+*/
+static uint16_t max_config_mtu(void) {
+	uint16_t mtu = conf.mtu;
+
+	if (conf.mode == MODE_TAP)
+		return mtu;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+		if (peer->mtu > mtu)
+			mtu = peer->mtu;
+	}
+
+	return mtu;
+}
+
+/**
+   Sets up the io_uring backend
+
+   Returns false if the running kernel doesn't support the required io_uring features; epoll is used in this case.
+*/
+bool fastd_uring_init(void) {
+	fastd_uring_t *uring = fastd_new0(fastd_uring_t);
+
+	/* Only the main thread submits requests, so the kernel may defer the completion work until fastd waits */
+	struct io_uring_params params = {
+		.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+		.cq_entries = URING_CQ_ENTRIES,
+	};
+
+	int ret = io_uring_queue_init_params(URING_SQ_ENTRIES, &uring->ring, &params);
+	if (ret < 0) {
+		errno = -ret;
+		pr_warn_errno("unable to set up io_uring (Linux 6.1 or newer is required), using epoll");
+		free(uring);
+		return false;
+	}
+
+	uring->buf_ring = io_uring_setup_buf_ring(&uring->ring, URING_RECV_BUFFERS, URING_RECV_GROUP, 0, &ret);
+	if (!uring->buf_ring) {
+		errno = -ret;
+		pr_warn_errno("unable to set up io_uring buffer ring, using epoll");
+		io_uring_queue_exit(&uring->ring);
+		free(uring);
+		return false;
+	}
+
+	uring->mtu = max_config_mtu();
+	size_t max_len = max_size_t(fastd_max_payload(uring->mtu) + conf.overhead, MAX_HANDSHAKE_SIZE);
+
+	uring->recv_msg.msg_namelen = sizeof(fastd_peer_address_t);
+	uring->recv_msg.msg_controllen = URING_RECV_CONTROL;
+	uring->buf_size = alignto(
+		sizeof(struct io_uring_recvmsg_out) + sizeof(fastd_peer_address_t) + URING_RECV_CONTROL + max_len,
+		sizeof(fastd_block128_t));
+	uring->bufs = fastd_alloc_array(URING_RECV_BUFFERS, uring->buf_size);
+
+	ctx.uring = uring;
+
+	uint16_t bid;
+	for (bid = 0; bid < URING_RECV_BUFFERS; bid++)
+		recycle_buffer(bid);
+
+	pr_verbose("using io_uring for the main loop");
+	return true;
+}
+
+/**
+   Warns if the MTU of a peer exceeds the size of the provided buffers
+
+   The provided buffers can't be resized while the kernel may fill them, so packets for peers with a larger MTU than
+   the buffers have been set up for are truncated and dropped.
+*/
+void fastd_uring_check_mtu(void) {
+	fastd_uring_t *uring = ctx.uring;
+
+	if (!uring || ctx.max_mtu <= uring->mtu || uring->mtu_warned)
+		return;
+
+	pr_warn("peer MTU %u exceeds the MTU of %u the io_uring receive buffers have been set up for, larger "
+		"packets will be dropped; configure the peer in the main configuration or disable io_uring",
+		(unsigned)ctx.max_mtu, (unsigned)uring->mtu);
+	uring->mtu_warned = true;
+}
+
+/** Frees the io_uring backend after waiting for the pending sendmsg and write requests */
+void fastd_uring_free(void) {
+	fastd_uring_t *uring = ctx.uring;
+
+	io_uring_submit(&uring->ring);
+
+	while (uring->inflight) {
+		struct io_uring_cqe *cqe;
+		int ret = io_uring_wait_cqe(&uring->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			break;
+
+		uint64_t data = io_uring_cqe_get_data64(cqe);
+		io_uring_cqe_seen(&uring->ring, cqe);
+
+		uring_op_t op = data & URING_OP_MASK;
+		if (op == URING_OP_SEND || op == URING_OP_WRITE)
+			free_req((uring_req_t *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK));
+	}
+
+	io_uring_free_buf_ring(&uring->ring, uring->buf_ring, URING_RECV_BUFFERS, URING_RECV_GROUP);
+	io_uring_queue_exit(&uring->ring);
+
+	VECTOR_FREE(uring->fds);
+	free(uring->bufs);
+	free(uring);
+
+	ctx.uring = NULL;
+}
+
+
+/** Registers a file descriptor with the io_uring */
+void fastd_uring_fd_register(fastd_poll_fd_t *fd) {
+	fastd_uring_t *uring = ctx.uring;
+
+	while (VECTOR_LEN(uring->fds) <= (size_t)fd->fd)
+		VECTOR_ADD(uring->fds, ((uring_fd_t){}));
+
+	VECTOR_INDEX(uring->fds, fd->fd).fd = fd;
+	arm_fd(fd);
+}
+
+/** Cancels the request watching a file descriptor before it is closed */
+void fastd_uring_fd_unregister(fastd_poll_fd_t *fd) {
+	fastd_uring_t *uring = ctx.uring;
+
+	if (fd->fd < 0 || (size_t)fd->fd >= VECTOR_LEN(uring->fds) || VECTOR_INDEX(uring->fds, fd->fd).fd != fd)
+		exit_bug("fastd_uring_fd_unregister: invalid FD");
+
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe)
+		exit_error("unable to queue io_uring request");
+
+	io_uring_prep_cancel64(sqe, fd_data(fd->fd, (fd->type == POLL_TYPE_SOCKET) ? URING_OP_RECV : URING_OP_POLL), 0);
+	io_uring_sqe_set_data64(sqe, URING_OP_NONE);
+
+	uring_fd_t *entry = &VECTOR_INDEX(uring->fds, fd->fd);
+	entry->fd = NULL;
+	entry->gen++;
+
+	/* Submit the cancellation right away, so the request releases the file before it is closed */
+	io_uring_submit(&uring->ring);
+}
+
+
+/** Submits the queued requests and handles the completions, waiting at most \e timeout milliseconds (-1: forever) */
+void fastd_uring_handle(int timeout) {
+	fastd_uring_t *uring = ctx.uring;
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000,
+	};
+	struct io_uring_cqe *cqe;
+	sigset_t set;
+
+	/* Like with epoll_pwait(), signals are only unblocked while waiting */
+	sigemptyset(&set);
+
+	int ret = io_uring_submit_and_wait_timeout(&uring->ring, &cqe, 1, (timeout >= 0) ? &ts : NULL, &set);
+	if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+		errno = -ret;
+		exit_errno("io_uring_submit_and_wait_timeout");
+	}
+
+	fastd_update_time();
+
+	struct io_uring_cqe *cqes[URING_BATCH];
+	unsigned n = io_uring_peek_batch_cqe(&uring->ring, cqes, URING_BATCH);
+	if (!n)
+		return;
+
+	int64_t start = fastd_latency_start();
+
+	/* The completions are copied, so the queue can be advanced before handling them */
+	uring_completion_t completions[URING_BATCH];
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		completions[i] = (uring_completion_t){
+			.data = io_uring_cqe_get_data64(cqes[i]),
+			.res = cqes[i]->res,
+			.flags = cqes[i]->flags,
+		};
+	}
+
+	io_uring_cq_advance(&uring->ring, n);
+
+	for (i = 0; i < n; i++)
+		handle_completion(&completions[i]);
+
+	fastd_latency_record_poll(start, n);
+}
+
+
+/**
+   Queues a packet to be sent with the next submission, taking ownership of the buffer
+
+   This is only used for payload packets: they are always sent on the socket of their peer, so a send failing because
+   of the packet info can be repeated like in fastd_send(). Returns false if the packet must be sent synchronously.
+*/
+bool fastd_uring_sendmsg(
+	int fd, const struct msghdr *msg, fastd_buffer_t buffer, fastd_peer_t *peer, size_t stat_size) {
+	if (!ctx.uring || msg->msg_namelen > sizeof(fastd_peer_address_t) || msg->msg_controllen > URING_SEND_CONTROL)
+		return false;
+
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe)
+		return false;
+
+	uring_req_t *req = fastd_new(uring_req_t);
+	req->fd = fd;
+	req->buffer = buffer;
+	req->peer_id = peer->id;
+	req->stat_size = stat_size;
+
+	memcpy(&req->addr, msg->msg_name, msg->msg_namelen);
+	if (msg->msg_controllen)
+		memcpy(req->cbuf, msg->msg_control, msg->msg_controllen);
+
+	req->iov = (struct iovec){ .iov_base = buffer.data, .iov_len = buffer.len };
+	req->msg = (struct msghdr){
+		.msg_name = &req->addr,
+		.msg_namelen = msg->msg_namelen,
+		.msg_iov = &req->iov,
+		.msg_iovlen = 1,
+		.msg_control = msg->msg_controllen ? req->cbuf : NULL,
+		.msg_controllen = msg->msg_controllen,
+	};
+
+	io_uring_prep_sendmsg(sqe, fd, &req->msg, 0);
+	io_uring_sqe_set_data64(sqe, (uintptr_t)req | URING_OP_SEND);
+	ctx.uring->inflight++;
+
+	return true;
+}
+
+/**
+   Queues a packet to be written to a TUN/TAP interface with the next submission, taking ownership of the buffer
+
+   Returns false if the packet must be written synchronously.
+*/
+bool fastd_uring_write(int fd, fastd_buffer_t buffer) {
+	if (!ctx.uring)
+		return false;
+
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe)
+		return false;
+
+	uring_req_t *req = fastd_new(uring_req_t);
+	req->fd = fd;
+	req->buffer = buffer;
+
+	io_uring_prep_write(sqe, fd, buffer.data, buffer.len, (uint64_t)-1);
+	io_uring_sqe_set_data64(sqe, (uintptr_t)req | URING_OP_WRITE);
+	ctx.uring->inflight++;
+
+	return true;
+}
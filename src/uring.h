@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   io_uring event loop backend
+*/
+
+
+#pragma once
+
+#include "fastd.h"
+
+
+#ifdef USE_IO_URING
+
+bool fastd_uring_init(void);
+void fastd_uring_check_mtu(void);
+void fastd_uring_free(void);
+
+void fastd_uring_fd_register(fastd_poll_fd_t *fd);
+void fastd_uring_fd_unregister(fastd_poll_fd_t *fd);
+
+void fastd_uring_handle(int timeout);
+
+bool fastd_uring_sendmsg(int fd, const struct msghdr *msg, fastd_buffer_t buffer, fastd_peer_t *peer, size_t stat_size);
+bool fastd_uring_write(int fd, fastd_buffer_t buffer);
+
+/** Returns true if the io_uring backend is used for the main loop */
+static inline bool fastd_uring_enabled(void) {
+	return ctx.uring;
+}
+
+#else
+
+static inline void fastd_uring_check_mtu(void) {}
+
+static inline bool fastd_uring_enabled(void) {
+	return false;
+}
+
+static inline bool fastd_uring_sendmsg(
+	UNUSED int fd, UNUSED const struct msghdr *msg, UNUSED fastd_buffer_t buffer, UNUSED fastd_peer_t *peer,
+	UNUSED size_t stat_size) {
+	return false;
+}
+
+static inline bool fastd_uring_write(UNUSED int fd, UNUSED fastd_buffer_t buffer) {
+	return false;
+}
+
+#endif
@@ -17,8 +17,11 @@
 #ifdef WITH_DYNAMIC_PEERS
 
 #include "async.h"
+#include "polling.h"
 #include "shell.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <sys/wait.h>
 
 
@@ -70,28 +73,308 @@ static void *do_verify_thread(void *p) {
 	return NULL;
 }
 
+
+/** A request sent to the verify helper which hasn't been answered yet */
+typedef struct verify_helper_request {
+	fastd_timeout_t timeout;          /**< The time after which the request is discarded */
+	size_t ret_len;                   /**< Length of the \e ret field (as it contains a flexible member) */
+	fastd_async_verify_return_t *ret; /**< Information to return to the main thread after the verification */
+} verify_helper_request_t;
+
+/** State of the persistent on-verify helper process */
+struct fastd_verify_helper {
+	fastd_poll_fd_t fd;               /**< The pipe connected to the helper's standard output */
+	int wfd;                          /**< The pipe connected to the helper's standard input */
+	fastd_timeout_t restart_timeout;  /**< The time after which the helper may be restarted */
+	size_t buf_len;                   /**< The number of bytes in \e buf */
+	char buf[VERIFY_HELPER_LINE_MAX]; /**< Buffer for incomplete response lines */
+
+	VECTOR(verify_helper_request_t) requests; /**< The requests waiting for a response */
+};
+
+
+/** Closes the pipes to the verify helper and discards all pending requests */
+static void verify_helper_stop(void) {
+	fastd_verify_helper_t *helper = ctx.verify_helper;
+	size_t i;
+
+	if (helper->fd.fd < 0)
+		return;
+
+	fastd_poll_fd_close(&helper->fd);
+	if (close(helper->wfd))
+		pr_warn_errno("verify helper: close");
+
+	helper->fd.fd = -1;
+	helper->wfd = -1;
+	helper->buf_len = 0;
+
+	for (i = 0; i < VECTOR_LEN(helper->requests); i++)
+		free(VECTOR_INDEX(helper->requests, i).ret);
+
+	VECTOR_RESIZE(helper->requests, 0);
+}
+
+/**
+   Starts the verify helper if it isn't running
+
+   To avoid busy loops with helpers that exit immediately, the helper is started at most once every
+   VERIFY_HELPER_RESTART_INTERVAL milliseconds.
+*/
+static bool verify_helper_start(void) {
+	if (!ctx.verify_helper) {
+		ctx.verify_helper = fastd_new0(fastd_verify_helper_t);
+		ctx.verify_helper->fd = FASTD_POLL_FD(POLL_TYPE_VERIFY_HELPER, -1);
+		ctx.verify_helper->wfd = -1;
+		ctx.verify_helper->restart_timeout = ctx.now;
+	}
+
+	fastd_verify_helper_t *helper = ctx.verify_helper;
+	int in[2], out[2];
+
+	if (helper->fd.fd >= 0)
+		return true;
+
+	if (!fastd_timed_out(helper->restart_timeout))
+		return false;
+
+	helper->restart_timeout = ctx.now + VERIFY_HELPER_RESTART_INTERVAL;
+
+	if (pipe(in)) {
+		pr_error_errno("verify helper: pipe");
+		return false;
+	}
+
+	if (pipe(out)) {
+		pr_error_errno("verify helper: pipe");
+		close(in[0]);
+		close(in[1]);
+		return false;
+	}
+
+	bool ok = fastd_shell_command_spawn(&conf.on_verify, NULL, in[0], out[1]);
+
+	close(in[0]);
+	close(out[1]);
+
+	if (!ok) {
+		close(in[1]);
+		close(out[0]);
+		return false;
+	}
+
+	fastd_setnonblock(in[1]);
+	fastd_setnonblock(out[0]);
+
+	helper->fd.fd = out[0];
+	helper->wfd = in[1];
+	fastd_poll_fd_register(&helper->fd);
+
+	pr_verbose("started verify helper");
+
+	return true;
+}
+
+/** Handles a single response line of the verify helper */
+static void verify_helper_handle_line(const char *line) {
+	fastd_verify_helper_t *helper = ctx.verify_helper;
+	char *end;
+	size_t i;
+
+	errno = 0;
+	uint64_t id = strtoull(line, &end, 10);
+	if (errno || end == line || *end != ' ') {
+		pr_warn("verify helper: invalid response `%s'", line);
+		return;
+	}
+
+	for (i = 0; i < VECTOR_LEN(helper->requests); i++) {
+		verify_helper_request_t *request = &VECTOR_INDEX(helper->requests, i);
+		if (request->ret->peer_id != id)
+			continue;
+
+		request->ret->ok = !strcmp(end + 1, "ok");
+
+		/* Hand the result to the async handler, so it is processed exactly like a return of a verifier thread */
+		fastd_async_enqueue(ASYNC_TYPE_VERIFY_RETURN, request->ret, request->ret_len);
+
+		free(request->ret);
+		VECTOR_DELETE(helper->requests, i);
+		return;
+	}
+
+	pr_debug("verify helper: ignoring response for unknown request %" PRIu64, id);
+}
+
+/** Handles input from the verify helper */
+void fastd_verify_helper_handle(void) {
+	fastd_verify_helper_t *helper = ctx.verify_helper;
+
+	while (true) {
+		ssize_t len = read(helper->fd.fd, helper->buf + helper->buf_len, sizeof(helper->buf) - helper->buf_len);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+
+		if (len <= 0) {
+			if (len < 0)
+				pr_error_errno("verify helper: read");
+			else
+				pr_error("verify helper exited");
+
+			verify_helper_stop();
+			return;
+		}
+
+		helper->buf_len += len;
+
+		char *line = helper->buf, *nl;
+		while ((nl = memchr(line, '\n', helper->buf + helper->buf_len - line)) != NULL) {
+			*nl = 0;
+			verify_helper_handle_line(line);
+			line = nl + 1;
+		}
+
+		helper->buf_len -= line - helper->buf;
+		memmove(helper->buf, line, helper->buf_len);
+
+		if (helper->buf_len == sizeof(helper->buf)) {
+			pr_warn("verify helper: discarding overlong response");
+			helper->buf_len = 0;
+		}
+	}
+}
+
+/**
+   Sends a request to the verify helper
+
+   Requests are sent as a single line consisting of the peer ID and the environment on-verify commands are given,
+   formatted by fastd_shell_env_format(). The helper answers with a line containing the peer ID and \e ok (any
+   other answer rejects the peer). Responses may be sent in any order.
+*/
+static bool verify_helper_request(const fastd_shell_env_t *env, fastd_async_verify_return_t *ret, size_t ret_len) {
+	fastd_verify_helper_t *helper;
+	char line[PIPE_BUF];
+	size_t i;
+
+	if (!verify_helper_start())
+		return false;
+
+	helper = ctx.verify_helper;
+
+	/* Drop expired requests and requests superseded by this one */
+	for (i = 0; i < VECTOR_LEN(helper->requests);) {
+		verify_helper_request_t *request = &VECTOR_INDEX(helper->requests, i);
+
+		if (request->ret->peer_id == ret->peer_id || fastd_timed_out(request->timeout)) {
+			free(request->ret);
+			VECTOR_DELETE(helper->requests, i);
+		} else {
+			i++;
+		}
+	}
+
+	if (VECTOR_LEN(helper->requests) >= VERIFY_HELPER_LIMIT) {
+		pr_debug("maximum number of pending verify helper requests reached");
+		return false;
+	}
+
+	int len = snprintf(line, sizeof(line), "%" PRIu64 " ", ret->peer_id);
+	ssize_t env_len = fastd_shell_env_format(env, line + len, sizeof(line) - len - 1);
+	if (env_len < 0) {
+		pr_warn("verify helper: request too long");
+		return false;
+	}
+
+	len += env_len;
+	line[len++] = '\n';
+
+	/* Writes of at most PIPE_BUF bytes are atomic, so requests are never split */
+	if (write(helper->wfd, line, len) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			pr_debug("verify helper is busy");
+		} else {
+			pr_error_errno("verify helper: write");
+			verify_helper_stop();
+		}
+
+		return false;
+	}
+
+	verify_helper_request_t request = {
+		.timeout = ctx.now + VERIFY_HELPER_TIMEOUT,
+		.ret_len = ret_len,
+		.ret = ret,
+	};
+	VECTOR_ADD(helper->requests, request);
+
+	return true;
+}
+
+/** Stops the verify helper and frees its resources */
+void fastd_verify_helper_cleanup(void) {
+	if (!ctx.verify_helper)
+		return;
+
+	verify_helper_stop();
+	VECTOR_FREE(ctx.verify_helper->requests);
+	free(ctx.verify_helper);
+	ctx.verify_helper = NULL;
+}
+
+
 /**
    Verifies a peer
 
+   \e key is the peer's public key, which identifies the peer in the verification result cache.
+
    \return A tristate. If on-verify is a synchronous command, it will be \e true or \e false, but if the command is
    asynchronous (which is the default), \e undef will be returned and the result is sent via the asyncronous
    notification mechanism.
 */
 fastd_tristate_t fastd_verify_peer(
-	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
-	const fastd_peer_address_t *remote_addr, const void *data, size_t data_len) {
+	fastd_peer_t *peer, const uint8_t key[FASTD_VERIFY_KEY_SIZE], fastd_socket_t *sock,
+	const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr, const void *data,
+	size_t data_len) {
 	if (!fastd_shell_command_isset(&conf.on_verify))
 		exit_bug("tried to verify peer without on-verify command");
 
 	fastd_peer_set_verifying(peer);
 
+	fastd_tristate_t cached = fastd_verify_cache_lookup(key);
+	if (cached.set) {
+		pr_debug("using cached verification result for %P", peer);
+		fastd_peer_set_verified(peer, cached.state);
+		return cached;
+	}
+
 	fastd_shell_env_t *env = fastd_shell_env_alloc();
 	fastd_peer_set_shell_env(env, peer, local_addr, remote_addr);
 
-	if (conf.on_verify.sync) {
+	if (conf.on_verify_helper) {
+		size_t ret_len = sizeof(fastd_async_verify_return_t) + data_len;
+		fastd_async_verify_return_t *ret = fastd_alloc0(ret_len);
+
+		ret->peer_id = peer->id;
+		memcpy(ret->key, key, FASTD_VERIFY_KEY_SIZE);
+		ret->sock = sock;
+		ret->local_addr = *local_addr;
+		ret->remote_addr = *remote_addr;
+		memcpy(ret->protocol_data, data, data_len);
+
+		bool ok = verify_helper_request(env, ret, ret_len);
+		fastd_shell_env_free(env);
+
+		if (!ok) {
+			free(ret);
+			return FASTD_TRISTATE_FALSE;
+		}
+
+		return FASTD_TRISTATE_UNDEF;
+	} else if (conf.on_verify.sync) {
 		bool ret = do_verify(env);
 		fastd_shell_env_free(env);
 		fastd_peer_set_verified(peer, ret);
+		fastd_verify_cache_add(key, ret);
 		return ret ? FASTD_TRISTATE_TRUE : FASTD_TRISTATE_FALSE;
 	} else {
 		if (!fastd_sem_trywait(&ctx.verify_limit)) {
@@ -105,6 +388,7 @@ fastd_tristate_t fastd_verify_peer(
 		arg->ret_len = sizeof(fastd_async_verify_return_t) + data_len;
 
 		arg->ret.peer_id = peer->id;
+		memcpy(arg->ret.key, key, FASTD_VERIFY_KEY_SIZE);
 		arg->ret.sock = sock;
 		arg->ret.local_addr = *local_addr;
 		arg->ret.remote_addr = *remote_addr;
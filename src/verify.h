@@ -15,10 +15,24 @@
 
 #include "types.h"
 
+
+/** The size of the public keys identifying peers in the verification result cache */
+#define FASTD_VERIFY_KEY_SIZE 32
+
+
 #ifdef WITH_DYNAMIC_PEERS
 
 fastd_tristate_t fastd_verify_peer(
-	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
-	const fastd_peer_address_t *remote_addr, const void *data, size_t data_len);
+	fastd_peer_t *peer, const uint8_t key[FASTD_VERIFY_KEY_SIZE], fastd_socket_t *sock,
+	const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr, const void *data,
+	size_t data_len);
+
+void fastd_verify_helper_handle(void);
+void fastd_verify_helper_cleanup(void);
+
+void fastd_verify_cache_init(void);
+void fastd_verify_cache_free(void);
+fastd_tristate_t fastd_verify_cache_lookup(const uint8_t key[FASTD_VERIFY_KEY_SIZE]);
+void fastd_verify_cache_add(const uint8_t key[FASTD_VERIFY_KEY_SIZE], bool ok);
 
 #endif /* WITH_DYNAMIC_PEERS */
@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Cache of on-verify results
+
+   The verdicts of on-verify runs are kept in a LRU cache keyed by the peer's public key, so dynamic peers that
+   reconnect after their peer entry has been removed don't need to be verified again. Positive and negative
+   results have separate lifetimes. The cache can be written to a file on shutdown and loaded on startup.
+*/
+
+
+#include "verify.h"
+
+
+#ifdef WITH_DYNAMIC_PEERS
+
+#include "fastd.h"
+#include "hash.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+
+typedef struct verify_cache_entry verify_cache_entry_t;
+
+/** A cached verification result */
+struct verify_cache_entry {
+	verify_cache_entry_t *hash_next; /**< The next entry in the same hash bucket */
+	verify_cache_entry_t *prev;      /**< The previous (more recently used) entry in the LRU list */
+	verify_cache_entry_t *next;      /**< The next (less recently used) entry in the LRU list */
+
+	fastd_timeout_t timeout;            /**< The time after which the entry is invalid */
+	bool ok;                            /**< The verification result */
+	uint8_t key[FASTD_VERIFY_KEY_SIZE]; /**< The public key of the verified peer */
+};
+
+/** The verification result cache */
+struct fastd_verify_cache {
+	uint32_t seed;                  /**< The hash seed */
+	size_t n_buckets;               /**< The number of hash buckets (a power of two) */
+	verify_cache_entry_t **buckets; /**< The hash buckets */
+
+	verify_cache_entry_t *head; /**< The most recently used entry */
+	verify_cache_entry_t *tail; /**< The least recently used entry */
+	size_t n_entries;           /**< The number of entries */
+};
+
+
+/** Returns the hash bucket for a key */
+static verify_cache_entry_t **key_bucket(const uint8_t key[FASTD_VERIFY_KEY_SIZE]) {
+	fastd_verify_cache_t *cache = ctx.verify_cache;
+
+	uint32_t hash = cache->seed;
+	fastd_hash(&hash, key, FASTD_VERIFY_KEY_SIZE);
+	fastd_hash_final(&hash);
+
+	return &cache->buckets[hash & (cache->n_buckets - 1)];
+}
+
+/** Unlinks an entry from the LRU list */
+static void unlink_entry(verify_cache_entry_t *entry) {
+	fastd_verify_cache_t *cache = ctx.verify_cache;
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+}
+
+/** Links an entry at the head of the LRU list */
+static void link_entry(verify_cache_entry_t *entry) {
+	fastd_verify_cache_t *cache = ctx.verify_cache;
+
+	entry->prev = NULL;
+	entry->next = cache->head;
+
+	if (entry->next)
+		entry->next->prev = entry;
+	else
+		cache->tail = entry;
+
+	cache->head = entry;
+}
+
+/** Searches the entry for a key, returning the pointer referencing it in its hash bucket */
+static verify_cache_entry_t **find_entry(const uint8_t key[FASTD_VERIFY_KEY_SIZE]) {
+	verify_cache_entry_t **entry;
+
+	for (entry = key_bucket(key); *entry; entry = &(*entry)->hash_next) {
+		if (memcmp((*entry)->key, key, FASTD_VERIFY_KEY_SIZE) == 0)
+			break;
+	}
+
+	return entry;
+}
+
+/** Removes an entry from the cache and frees it */
+static void remove_entry(verify_cache_entry_t **entry) {
+	verify_cache_entry_t *e = *entry;
+
+	*entry = e->hash_next;
+	unlink_entry(e);
+	ctx.verify_cache->n_entries--;
+
+	free(e);
+}
+
+/** Returns the configured lifetime of a cache entry in milliseconds */
+static inline fastd_timeout_t entry_ttl(bool ok) {
+	return 1000 * (fastd_timeout_t)(ok ? conf.verify_cache_ttl : conf.verify_cache_negative_ttl);
+}
+
+/** Adds or updates an entry with the given timeout */
+static void add_entry(const uint8_t key[FASTD_VERIFY_KEY_SIZE], bool ok, fastd_timeout_t timeout) {
+	fastd_verify_cache_t *cache = ctx.verify_cache;
+	verify_cache_entry_t **entry = find_entry(key);
+	verify_cache_entry_t *e = *entry;
+
+	if (e) {
+		unlink_entry(e);
+	} else {
+		if (cache->n_entries >= conf.verify_cache_size) {
+			verify_cache_entry_t *tail = cache->tail;
+			remove_entry(find_entry(tail->key));
+
+			/* The bucket may have changed */
+			entry = find_entry(key);
+		}
+
+		e = fastd_new0(verify_cache_entry_t);
+		memcpy(e->key, key, FASTD_VERIFY_KEY_SIZE);
+
+		*entry = e;
+		cache->n_entries++;
+	}
+
+	e->ok = ok;
+	e->timeout = timeout;
+	link_entry(e);
+}
+
+
+/** Returns the value of a hexadecimal digit, or -1 if \e c isn't one */
+static inline int hex_digit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/** Converts a hexadecimal key representation */
+static bool parse_key(uint8_t key[FASTD_VERIFY_KEY_SIZE], const char *hex) {
+	size_t i;
+
+	if (strlen(hex) != 2 * FASTD_VERIFY_KEY_SIZE)
+		return false;
+
+	for (i = 0; i < FASTD_VERIFY_KEY_SIZE; i++) {
+		int hi = hex_digit(hex[2 * i]), lo = hex_digit(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+
+		key[i] = (hi << 4) | lo;
+	}
+
+	return true;
+}
+
+/** Loads cached verification results from the cache file */
+static void load_cache(void) {
+	FILE *file = fopen(conf.verify_cache_file, "r");
+	if (!file) {
+		if (errno != ENOENT)
+			pr_warn_errno("unable to open verify cache file");
+
+		return;
+	}
+
+	time_t now = time(NULL);
+	char hex[2 * FASTD_VERIFY_KEY_SIZE + 1], result[7];
+	int64_t expires;
+	size_t n = 0;
+
+	while (fscanf(file, "%64s %6s %" SCNd64, hex, result, &expires) == 3) {
+		uint8_t key[FASTD_VERIFY_KEY_SIZE];
+		bool ok = !strcmp(result, "accept");
+
+		if (!parse_key(key, hex) || (!ok && strcmp(result, "reject"))) {
+			pr_warn("invalid entry in verify cache file");
+			break;
+		}
+
+		/* Never keep a result longer than the configured lifetime, in case it has been reduced */
+		fastd_timeout_t ttl = 1000 * (fastd_timeout_t)(expires - now);
+		if (ttl > entry_ttl(ok))
+			ttl = entry_ttl(ok);
+		if (ttl <= 0)
+			continue;
+
+		add_entry(key, ok, ctx.now + ttl);
+		n++;
+	}
+
+	fclose(file);
+
+	pr_verbose("loaded %u cached verification results", (unsigned)n);
+}
+
+/**
+   Writes the cached verification results to the cache file
+
+   Entries are written least recently used first, so loading the file restores the LRU order. The file is
+   replaced atomically.
+*/
+static void save_cache(void) {
+	const verify_cache_entry_t *entry;
+	size_t len = strlen(conf.verify_cache_file);
+	char tmp[len + 5];
+
+	memcpy(tmp, conf.verify_cache_file, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	FILE *file = fopen(tmp, "w");
+	if (!file) {
+		pr_error_errno("unable to write verify cache file");
+		return;
+	}
+
+	time_t now = time(NULL);
+
+	for (entry = ctx.verify_cache->tail; entry; entry = entry->prev) {
+		if (fastd_timed_out(entry->timeout))
+			continue;
+
+		size_t i;
+		for (i = 0; i < FASTD_VERIFY_KEY_SIZE; i++)
+			fprintf(file, "%02x", entry->key[i]);
+
+		fprintf(file, " %s %" PRId64 "\n", entry->ok ? "accept" : "reject",
+			(int64_t)now + (entry->timeout - ctx.now + 999) / 1000);
+	}
+
+	if (fclose(file) < 0) {
+		pr_error_errno("unable to write verify cache file");
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, conf.verify_cache_file) < 0) {
+		pr_error_errno("unable to write verify cache file: rename");
+		unlink(tmp);
+	}
+}
+
+
+/** Initializes the verification result cache (if it is enabled) */
+void fastd_verify_cache_init(void) {
+	if (!fastd_allow_verify() || !conf.verify_cache_size)
+		return;
+
+	fastd_verify_cache_t *cache = fastd_new0(fastd_verify_cache_t);
+	ctx.verify_cache = cache;
+
+	fastd_random_bytes(&cache->seed, sizeof(cache->seed), false);
+
+	cache->n_buckets = 1;
+	while (cache->n_buckets < conf.verify_cache_size)
+		cache->n_buckets <<= 1;
+
+	cache->buckets = fastd_new0_array(cache->n_buckets, verify_cache_entry_t *);
+
+	if (conf.verify_cache_file)
+		load_cache();
+}
+
+/** Saves the cache file (if configured) and frees the verification result cache */
+void fastd_verify_cache_free(void) {
+	fastd_verify_cache_t *cache = ctx.verify_cache;
+	if (!cache)
+		return;
+
+	if (conf.verify_cache_file)
+		save_cache();
+
+	while (cache->head) {
+		verify_cache_entry_t *next = cache->head->next;
+		free(cache->head);
+		cache->head = next;
+	}
+
+	free(cache->buckets);
+	free(cache);
+	ctx.verify_cache = NULL;
+}
+
+/** Returns the cached verification result for a key, or \e undef if there is none */
+fastd_tristate_t fastd_verify_cache_lookup(const uint8_t key[FASTD_VERIFY_KEY_SIZE]) {
+	if (!ctx.verify_cache)
+		return FASTD_TRISTATE_UNDEF;
+
+	verify_cache_entry_t **entry = find_entry(key);
+	verify_cache_entry_t *e = *entry;
+	if (!e)
+		return FASTD_TRISTATE_UNDEF;
+
+	if (fastd_timed_out(e->timeout)) {
+		remove_entry(entry);
+		return FASTD_TRISTATE_UNDEF;
+	}
+
+	unlink_entry(e);
+	link_entry(e);
+
+	return e->ok ? FASTD_TRISTATE_TRUE : FASTD_TRISTATE_FALSE;
+}
+
+/** Adds a verification result to the cache */
+void fastd_verify_cache_add(const uint8_t key[FASTD_VERIFY_KEY_SIZE], bool ok) {
+	if (!ctx.verify_cache)
+		return;
+
+	if (!entry_ttl(ok)) {
+		verify_cache_entry_t **entry = find_entry(key);
+		if (*entry)
+			remove_entry(entry);
+
+		return;
+	}
+
+	add_entry(key, ok, ctx.now + entry_ttl(ok));
+}
+
+#endif /* WITH_DYNAMIC_PEERS */
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Worker threads for CPU-intensive tasks
+
+   The main thread enqueues jobs; the worker threads process them in FIFO order
+   and return their results using the asynchronous notification mechanism.
+
+   Jobs enqueued with fastd_worker_enqueue_batch() are batched: when a worker thread
+   takes such a job from the queue, it also takes all directly following jobs with the
+   same batch function, so jobs that have accumulated under load are processed together.
+*/
+
+
+#include "worker.h"
+
+
+/** A queued worker job */
+struct fastd_worker_job {
+	fastd_worker_job_t *next; /**< The next job in the queue */
+
+	fastd_worker_func_t func;             /**< The function to run (NULL for batched jobs) */
+	fastd_worker_batch_func_t batch_func; /**< The batch function to run (NULL for unbatched jobs) */
+	fastd_worker_free_func_t free_func;   /**< Frees the argument if the job is discarded (NULL to use free()) */
+	void *arg;                            /**< The argument to pass to the function */
+};
+
+
+/** Removes the first job from the queue (the worker mutex must be held) */
+static fastd_worker_job_t *dequeue_job(void) {
+	fastd_worker_job_t *job = ctx.worker_jobs;
+
+	ctx.worker_jobs = job->next;
+	if (!ctx.worker_jobs)
+		ctx.worker_jobs_tail = &ctx.worker_jobs;
+	ctx.n_worker_jobs--;
+
+	return job;
+}
+
+/** Takes a batched job and all directly following jobs with the same batch function from the queue and runs them */
+static void run_batch(fastd_worker_job_t *job) {
+	fastd_worker_batch_func_t batch_func = job->batch_func;
+	void *args[WORKER_BATCH_SIZE];
+	size_t n = 0;
+
+	args[n++] = job->arg;
+	free(job);
+
+	while (n < WORKER_BATCH_SIZE && ctx.worker_jobs && ctx.worker_jobs->batch_func == batch_func) {
+		job = dequeue_job();
+		args[n++] = job->arg;
+		free(job);
+	}
+
+	pthread_mutex_unlock(&ctx.worker_mutex);
+
+	batch_func(args, n);
+
+	pthread_mutex_lock(&ctx.worker_mutex);
+}
+
+/** Worker thread main function */
+static void *worker_thread(UNUSED void *p) {
+	pthread_mutex_lock(&ctx.worker_mutex);
+
+	while (true) {
+		while (!ctx.worker_jobs && !ctx.workers_stop)
+			pthread_cond_wait(&ctx.worker_cond, &ctx.worker_mutex);
+
+		if (ctx.workers_stop)
+			break;
+
+		fastd_worker_job_t *job = dequeue_job();
+
+		if (job->batch_func) {
+			run_batch(job);
+			continue;
+		}
+
+		pthread_mutex_unlock(&ctx.worker_mutex);
+
+		job->func(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&ctx.worker_mutex);
+	}
+
+	pthread_mutex_unlock(&ctx.worker_mutex);
+
+	return NULL;
+}
+
+/** Starts the configured number of worker threads */
+void fastd_worker_init(void) {
+	ctx.worker_jobs = NULL;
+	ctx.worker_jobs_tail = &ctx.worker_jobs;
+	ctx.n_worker_jobs = 0;
+	ctx.workers_stop = false;
+
+	if (!conf.worker_threads)
+		return;
+
+	if ((errno = pthread_mutex_init(&ctx.worker_mutex, NULL)) != 0)
+		exit_errno("pthread_mutex_init");
+
+	if ((errno = pthread_cond_init(&ctx.worker_cond, NULL)) != 0)
+		exit_errno("pthread_cond_init");
+
+	ctx.workers = fastd_new_array(conf.worker_threads, pthread_t);
+
+	for (ctx.n_workers = 0; ctx.n_workers < conf.worker_threads; ctx.n_workers++) {
+		if ((errno = pthread_create(&ctx.workers[ctx.n_workers], NULL, worker_thread, NULL)) != 0)
+			exit_errno("unable to create worker thread");
+	}
+
+	pr_debug("started %u worker threads", (unsigned)ctx.n_workers);
+}
+
+/** Stops all worker threads and discards unprocessed jobs */
+void fastd_worker_cleanup(void) {
+	if (!ctx.n_workers)
+		return;
+
+	pthread_mutex_lock(&ctx.worker_mutex);
+	ctx.workers_stop = true;
+	pthread_cond_broadcast(&ctx.worker_cond);
+	pthread_mutex_unlock(&ctx.worker_mutex);
+
+	size_t i;
+	for (i = 0; i < ctx.n_workers; i++)
+		pthread_join(ctx.workers[i], NULL);
+
+	while (ctx.worker_jobs) {
+		fastd_worker_job_t *job = ctx.worker_jobs;
+		ctx.worker_jobs = job->next;
+
+		if (job->free_func)
+			job->free_func(job->arg);
+		else
+			free(job->arg);
+
+		free(job);
+	}
+
+	free(ctx.workers);
+	ctx.n_workers = 0;
+
+	pthread_cond_destroy(&ctx.worker_cond);
+	pthread_mutex_destroy(&ctx.worker_mutex);
+}
+
+/** Adds a job to the queue, freeing it if the queue is full */
+static bool enqueue_job(fastd_worker_job_t *job) {
+	if (!fastd_worker_enabled())
+		exit_bug("fastd_worker_enqueue: no worker threads");
+
+	pthread_mutex_lock(&ctx.worker_mutex);
+
+	if (ctx.n_worker_jobs >= WORKER_QUEUE_LIMIT) {
+		pthread_mutex_unlock(&ctx.worker_mutex);
+
+		pr_debug("worker queue full, dropping job");
+		free(job);
+		return false;
+	}
+
+	*ctx.worker_jobs_tail = job;
+	ctx.worker_jobs_tail = &job->next;
+	ctx.n_worker_jobs++;
+
+	pthread_cond_signal(&ctx.worker_cond);
+	pthread_mutex_unlock(&ctx.worker_mutex);
+
+	return true;
+}
+
+/**
+   Enqueues a job to be run on a worker thread
+
+   \return false if the job queue is full; the caller keeps the ownership of the argument in this case
+*/
+bool fastd_worker_enqueue(fastd_worker_func_t func, fastd_worker_free_func_t free_func, void *arg) {
+	fastd_worker_job_t *job = fastd_new(fastd_worker_job_t);
+	job->next = NULL;
+	job->func = func;
+	job->batch_func = NULL;
+	job->free_func = free_func;
+	job->arg = arg;
+
+	return enqueue_job(job);
+}
+
+/**
+   Enqueues a job to be run on a worker thread as part of a batch
+
+   \return false if the job queue is full; the caller keeps the ownership of the argument in this case
+*/
+bool fastd_worker_enqueue_batch(fastd_worker_batch_func_t func, fastd_worker_free_func_t free_func, void *arg) {
+	fastd_worker_job_t *job = fastd_new(fastd_worker_job_t);
+	job->next = NULL;
+	job->func = NULL;
+	job->batch_func = func;
+	job->free_func = free_func;
+	job->arg = arg;
+
+	return enqueue_job(job);
+}
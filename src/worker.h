@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Worker threads for CPU-intensive tasks
+*/
+
+
+#pragma once
+
+#include "fastd.h"
+
+
+/**
+   A function to run on a worker thread
+
+   The function takes ownership of its argument, which must have been allocated using one of the fastd_alloc()
+   functions. Results are returned to the main thread using fastd_async_enqueue().
+*/
+typedef void (*fastd_worker_func_t)(void *arg);
+
+/**
+   A function to run on a worker thread for a batch of jobs
+
+   Consecutive queued jobs with the same batch function are passed to a single call (at most WORKER_BATCH_SIZE at
+   once), so the function can share work between them. It takes ownership of all arguments.
+*/
+typedef void (*fastd_worker_batch_func_t)(void *args[], size_t n);
+
+/**
+   A function freeing the argument of a job that is discarded without having been run
+
+   This allows clearing key material in the argument; jobs without a free function have their argument freed using
+   free().
+*/
+typedef void (*fastd_worker_free_func_t)(void *arg);
+
+
+void fastd_worker_init(void);
+void fastd_worker_cleanup(void);
+bool fastd_worker_enqueue(fastd_worker_func_t func, fastd_worker_free_func_t free_func, void *arg);
+bool fastd_worker_enqueue_batch(fastd_worker_batch_func_t func, fastd_worker_free_func_t free_func, void *arg);
+
+
+/** Checks if CPU-intensive tasks should be run on worker threads */
+static inline bool fastd_worker_enabled(void) {
+	return ctx.n_workers > 0;
+}
@@ -0,0 +1,1040 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   AF_XDP packet path for the bind addresses configured with the \e xdp flag
+
+   For each interface with such bind addresses, fastd loads a small XDP program redirecting the UDP packets sent to
+   these addresses to AF_XDP sockets (one per receive queue), bypassing the kernel's network stack. All other packets,
+   including fragments and packets with IP options or IPv6 extension headers, are passed on to the kernel, so the
+   regular sockets, which stay bound, still receive them.
+
+   fastd parses the Ethernet, IP and UDP headers of the redirected packets itself before handing them to the same
+   receive path as packets from the regular sockets. The link-layer source of authenticated payload packets is
+   remembered for each peer, so payload packets to the peer can be sent by building the frames in the UMEM and
+   putting them on the transmit ring of the queue the peer's packets arrive on. Everything else (handshakes, peers
+   whose address has changed, packets that are too large for the interface MTU) is sent through the regular socket.
+
+   The XDP program is attached in native mode if the driver supports it, and in generic mode otherwise. The AF_XDP
+   sockets use zero-copy mode if the driver supports it, and fall back to copy mode (e.g. on veth interfaces).
+*/
+
+
+#include "xdp.h"
+#include "latency.h"
+#include "polling.h"
+#include "trace.h"
+
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+
+/** The size of a frame in the UMEM */
+#define XDP_FRAME_SIZE 2048
+
+/** The number of frames used for receiving packets (which is also the size of the fill and RX rings) */
+#define XDP_RX_FRAMES 2048
+
+/** The number of frames used for sending packets (which is also the size of the TX and completion rings) */
+#define XDP_TX_FRAMES 2048
+
+/** The size of the UMEM of each queue */
+#define XDP_UMEM_SIZE ((size_t)(XDP_RX_FRAMES + XDP_TX_FRAMES) * XDP_FRAME_SIZE)
+
+/** The maximum number of packets received per call of fastd_xdp_handle() */
+#define XDP_BATCH 64
+
+/** The TTL/hop limit of sent packets */
+#define XDP_TTL 64
+
+/** The size of the Ethernet header */
+#define XDP_ETH_HLEN sizeof(fastd_eth_header_t)
+
+/** The Ethernet protocol number of IPv4 */
+#define XDP_ETH_P_IP 0x0800
+
+/** The Ethernet protocol number of IPv6 */
+#define XDP_ETH_P_IPV6 0x86dd
+
+
+/** Builds a BPF instruction */
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/** dst = src */
+#define INSN_MOV_REG(dst, src) INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+/** dst = imm */
+#define INSN_MOV_IMM(dst, imm) INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+/** dst += imm */
+#define INSN_ADD_IMM(dst, imm) INSN(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+/** (u32)dst &= imm */
+#define INSN_AND32_IMM(dst, imm) INSN(BPF_ALU | BPF_AND | BPF_K, dst, 0, 0, imm)
+/** dst = *(size *)(src + off) */
+#define INSN_LOAD(size, dst, src, off) INSN(BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+/** Jumps if dst > src (the offset is set later) */
+#define INSN_JGT_REG(dst, src) INSN(BPF_JMP | BPF_JGT | BPF_X, dst, src, 0, 0)
+/** Jumps if (u32)dst == imm (the offset is set later) */
+#define INSN_JEQ32_IMM(dst, imm) INSN(BPF_JMP32 | BPF_JEQ | BPF_K, dst, 0, 0, imm)
+/** Jumps if (u32)dst != imm (the offset is set later) */
+#define INSN_JNE32_IMM(dst, imm) INSN(BPF_JMP32 | BPF_JNE | BPF_K, dst, 0, 0, imm)
+/** Jumps unconditionally (the offset is set later) */
+#define INSN_JA() INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+/** Calls a helper function */
+#define INSN_CALL(func) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func)
+/** Returns from the program */
+#define INSN_EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+
+/** An XDP program that is being assembled */
+typedef struct xdp_prog {
+	VECTOR(struct bpf_insn) insns; /**< The instructions */
+	VECTOR(size_t) pass;           /**< The jumps to the end of the program, passing the packet to the kernel */
+	VECTOR(size_t) redirect;       /**< The jumps to the redirection of the packet to the AF_XDP sockets */
+} xdp_prog_t;
+
+/** A ring shared with the kernel */
+typedef struct xdp_ring {
+	void *map;         /**< The mapping of the ring */
+	size_t map_len;    /**< The length of the mapping */
+	uint32_t *producer; /**< The producer index */
+	uint32_t *consumer; /**< The consumer index */
+	uint32_t *flags;    /**< The flags of the ring (XDP_RING_NEED_WAKEUP) */
+	void *desc;         /**< The descriptors */
+	uint32_t mask;      /**< The number of descriptors minus one */
+} xdp_ring_t;
+
+/** An AF_XDP socket bound to a single receive queue, with its own UMEM */
+typedef struct xdp_queue {
+	fastd_poll_fd_t fd; /**< The AF_XDP socket */
+	fastd_xdp_t *xdp;   /**< The interface the queue belongs to */
+	uint16_t index;     /**< The index of the queue */
+
+	uint8_t *umem;   /**< The frames of the UMEM */
+	xdp_ring_t rx;   /**< The RX ring (received packets) */
+	xdp_ring_t tx;   /**< The TX ring (packets to send) */
+	xdp_ring_t fill; /**< The fill ring (frames to receive packets into) */
+	xdp_ring_t comp; /**< The completion ring (frames of sent packets) */
+
+	size_t n_free;                       /**< The number of frames in free_frames */
+	uint64_t free_frames[XDP_TX_FRAMES]; /**< The frames available for sending packets */
+	bool kick;                           /**< Set when packets have been put on the TX ring since the last wakeup */
+} xdp_queue_t;
+
+/** The AF_XDP state of an interface */
+struct fastd_xdp {
+	fastd_xdp_t *next; /**< The next interface in the list */
+
+	const char *ifname;   /**< The name of the interface */
+	unsigned ifindex;     /**< The index of the interface */
+	fastd_eth_addr_t mac; /**< The MAC address of the interface */
+	size_t mtu;           /**< The MTU of the interface */
+
+	int map_fd;    /**< The XSKMAP containing the AF_XDP socket of each queue */
+	int prog_fd;   /**< The XDP program */
+	int link_fd;   /**< The link attaching the program to the interface */
+	bool native;   /**< Set if the program is attached in native (driver) mode */
+	bool zerocopy; /**< Set if the AF_XDP sockets use zero-copy mode */
+
+	uint16_t ip_id; /**< The identification of the next sent IPv4 packet */
+
+	size_t n_queues;      /**< The number of receive queues */
+	xdp_queue_t **queues; /**< The AF_XDP socket of each receive queue */
+};
+
+
+/** Calls the bpf() syscall */
+static inline int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+/** Adds an instruction to a program, returning its index */
+static size_t emit(xdp_prog_t *prog, struct bpf_insn insn) {
+	VECTOR_ADD(prog->insns, insn);
+	return VECTOR_LEN(prog->insns) - 1;
+}
+
+/** Adds a jump to the end of the program, passing the packet to the kernel */
+static void emit_pass(xdp_prog_t *prog, struct bpf_insn insn) {
+	VECTOR_ADD(prog->pass, emit(prog, insn));
+}
+
+/** Adds a jump to the redirection of the packet to the AF_XDP sockets */
+static void emit_redirect(xdp_prog_t *prog, struct bpf_insn insn) {
+	VECTOR_ADD(prog->redirect, emit(prog, insn));
+}
+
+/** Makes the jump at index \e jump target the next instruction that is added */
+static void land(xdp_prog_t *prog, size_t jump) {
+	VECTOR_INDEX(prog->insns, jump).off = VECTOR_LEN(prog->insns) - jump - 1;
+}
+
+/**
+   Adds the matching of IPv4 packets to the program
+
+   On entry, r2 points to the Ethernet header and r3 to the end of the packet.
+*/
+static void emit_ipv4(const fastd_xdp_t *xdp, xdp_prog_t *prog) {
+	const int ip = XDP_ETH_HLEN, udp = ip + sizeof(struct iphdr);
+
+	/* IPv4 without options, not fragmented, carrying UDP */
+	emit(prog, INSN_MOV_REG(BPF_REG_4, BPF_REG_2));
+	emit(prog, INSN_ADD_IMM(BPF_REG_4, udp + sizeof(struct udphdr)));
+	emit_pass(prog, INSN_JGT_REG(BPF_REG_4, BPF_REG_3));
+
+	emit(prog, INSN_LOAD(BPF_B, BPF_REG_5, BPF_REG_2, ip));
+	emit_pass(prog, INSN_JNE32_IMM(BPF_REG_5, 0x45));
+
+	emit(prog, INSN_LOAD(BPF_H, BPF_REG_5, BPF_REG_2, ip + offsetof(struct iphdr, frag_off)));
+	emit(prog, INSN_AND32_IMM(BPF_REG_5, htons(IP_MF | IP_OFFMASK)));
+	emit_pass(prog, INSN_JNE32_IMM(BPF_REG_5, 0));
+
+	emit(prog, INSN_LOAD(BPF_B, BPF_REG_5, BPF_REG_2, ip + offsetof(struct iphdr, protocol)));
+	emit_pass(prog, INSN_JNE32_IMM(BPF_REG_5, IPPROTO_UDP));
+
+	emit(prog, INSN_LOAD(BPF_W, BPF_REG_4, BPF_REG_2, ip + offsetof(struct iphdr, daddr)));
+	emit(prog, INSN_LOAD(BPF_H, BPF_REG_5, BPF_REG_2, udp + offsetof(struct udphdr, dest)));
+
+	size_t i;
+	for (i = 0; i < ctx.n_socks; i++) {
+		const fastd_socket_t *sock = &ctx.socks[i];
+		if (sock->xdp != xdp || sock->bound_addr->sa.sa_family != AF_INET)
+			continue;
+
+		size_t next = emit(prog, INSN_JNE32_IMM(BPF_REG_4, sock->bound_addr->in.sin_addr.s_addr));
+		emit_redirect(prog, INSN_JEQ32_IMM(BPF_REG_5, sock->bound_addr->in.sin_port));
+		land(prog, next);
+	}
+
+	emit_pass(prog, INSN_JA());
+}
+
+/**
+   Adds the matching of IPv6 packets to the program
+
+   On entry, r2 points to the Ethernet header and r3 to the end of the packet.
+*/
+static void emit_ipv6(const fastd_xdp_t *xdp, xdp_prog_t *prog) {
+	const int ip = XDP_ETH_HLEN, udp = ip + sizeof(struct ip6_hdr);
+
+	/* IPv6 without extension headers, carrying UDP */
+	emit(prog, INSN_MOV_REG(BPF_REG_4, BPF_REG_2));
+	emit(prog, INSN_ADD_IMM(BPF_REG_4, udp + sizeof(struct udphdr)));
+	emit_pass(prog, INSN_JGT_REG(BPF_REG_4, BPF_REG_3));
+
+	emit(prog, INSN_LOAD(BPF_B, BPF_REG_5, BPF_REG_2, ip + offsetof(struct ip6_hdr, ip6_nxt)));
+	emit_pass(prog, INSN_JNE32_IMM(BPF_REG_5, IPPROTO_UDP));
+
+	emit(prog, INSN_LOAD(BPF_H, BPF_REG_5, BPF_REG_2, udp + offsetof(struct udphdr, dest)));
+
+	size_t i, j;
+	for (i = 0; i < ctx.n_socks; i++) {
+		const fastd_socket_t *sock = &ctx.socks[i];
+		if (sock->xdp != xdp || sock->bound_addr->sa.sa_family != AF_INET6)
+			continue;
+
+		uint32_t addr[4];
+		memcpy(addr, &sock->bound_addr->in6.sin6_addr, sizeof(addr));
+
+		size_t next[5];
+		next[0] = emit(prog, INSN_JNE32_IMM(BPF_REG_5, sock->bound_addr->in6.sin6_port));
+
+		for (j = 0; j < 4; j++) {
+			emit(prog,
+			     INSN_LOAD(BPF_W, BPF_REG_4, BPF_REG_2, ip + offsetof(struct ip6_hdr, ip6_dst) + 4 * j));
+			next[j + 1] = emit(prog, INSN_JNE32_IMM(BPF_REG_4, addr[j]));
+		}
+
+		emit_redirect(prog, INSN_JA());
+
+		for (j = 0; j < 5; j++)
+			land(prog, next[j]);
+	}
+
+	emit_pass(prog, INSN_JA());
+}
+
+/** Assembles and loads the XDP program redirecting the packets for the bind addresses of an interface */
+static int load_prog(const fastd_xdp_t *xdp) {
+	xdp_prog_t prog = {};
+	size_t i;
+
+	emit(&prog, INSN_MOV_REG(BPF_REG_6, BPF_REG_1));
+	emit(&prog, INSN_LOAD(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)));
+	emit(&prog, INSN_LOAD(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)));
+
+	/* Ethernet without VLAN tags */
+	emit(&prog, INSN_MOV_REG(BPF_REG_4, BPF_REG_2));
+	emit(&prog, INSN_ADD_IMM(BPF_REG_4, XDP_ETH_HLEN));
+	emit_pass(&prog, INSN_JGT_REG(BPF_REG_4, BPF_REG_3));
+	emit(&prog, INSN_LOAD(BPF_H, BPF_REG_5, BPF_REG_2, offsetof(fastd_eth_header_t, proto)));
+
+	size_t not_ipv4 = emit(&prog, INSN_JNE32_IMM(BPF_REG_5, htons(XDP_ETH_P_IP)));
+	emit_ipv4(xdp, &prog);
+
+	land(&prog, not_ipv4);
+	emit_pass(&prog, INSN_JNE32_IMM(BPF_REG_5, htons(XDP_ETH_P_IPV6)));
+	emit_ipv6(xdp, &prog);
+
+	/* Redirect to the AF_XDP socket of the receive queue; the packet is passed if there is none */
+	for (i = 0; i < VECTOR_LEN(prog.redirect); i++)
+		land(&prog, VECTOR_INDEX(prog.redirect, i));
+
+	emit(&prog, INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xdp->map_fd));
+	emit(&prog, INSN(0, 0, 0, 0, 0));
+	emit(&prog, INSN_LOAD(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)));
+	emit(&prog, INSN_MOV_IMM(BPF_REG_3, XDP_PASS));
+	emit(&prog, INSN_CALL(BPF_FUNC_redirect_map));
+	emit(&prog, INSN_EXIT());
+
+	for (i = 0; i < VECTOR_LEN(prog.pass); i++)
+		land(&prog, VECTOR_INDEX(prog.pass, i));
+
+	emit(&prog, INSN_MOV_IMM(BPF_REG_0, XDP_PASS));
+	emit(&prog, INSN_EXIT());
+
+	union bpf_attr attr = {
+		.prog_type = BPF_PROG_TYPE_XDP,
+		.insn_cnt = VECTOR_LEN(prog.insns),
+		.insns = (uintptr_t)VECTOR_DATA(prog.insns),
+		.license = (uintptr_t) "BSD",
+		.prog_name = "fastd",
+	};
+
+	int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+
+	VECTOR_FREE(prog.insns);
+	VECTOR_FREE(prog.pass);
+	VECTOR_FREE(prog.redirect);
+
+	return fd;
+}
+
+/** Attaches the XDP program to the interface in the given mode */
+static bool attach_prog(fastd_xdp_t *xdp, uint32_t flags) {
+	union bpf_attr attr = {
+		.link_create = {
+			.prog_fd = xdp->prog_fd,
+			.target_ifindex = xdp->ifindex,
+			.attach_type = BPF_XDP,
+			.flags = flags,
+		},
+	};
+
+	xdp->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	return (xdp->link_fd >= 0);
+}
+
+
+/** Maps a ring of an AF_XDP socket */
+static bool map_ring(
+	int fd, xdp_ring_t *ring, const struct xdp_ring_offset *off, uint32_t size, size_t desc_size, off_t pgoff) {
+	ring->map_len = off->desc + size * desc_size;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return false;
+	}
+
+	ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+	ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+	ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+	ring->desc = (uint8_t *)ring->map + off->desc;
+	ring->mask = size - 1;
+
+	return true;
+}
+
+/** Unmaps a ring of an AF_XDP socket */
+static void unmap_ring(xdp_ring_t *ring) {
+	if (ring->map)
+		munmap(ring->map, ring->map_len);
+}
+
+/** Returns the number of entries that can be consumed from a ring */
+static inline uint32_t ring_available(const xdp_ring_t *ring) {
+	return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer;
+}
+
+/** Marks \e n entries of a ring as consumed */
+static inline void ring_release(xdp_ring_t *ring, uint32_t n) {
+	__atomic_store_n(ring->consumer, *ring->consumer + n, __ATOMIC_RELEASE);
+}
+
+/** Makes \e n entries of a ring that have been written after the current producer index visible to the kernel */
+static inline void ring_submit(xdp_ring_t *ring, uint32_t n) {
+	__atomic_store_n(ring->producer, *ring->producer + n, __ATOMIC_RELEASE);
+}
+
+/** Returns the address of an entry of the fill or completion ring */
+static inline uint64_t *ring_addr(const xdp_ring_t *ring, uint32_t i) {
+	return &((uint64_t *)ring->desc)[i & ring->mask];
+}
+
+/** Returns the address of an entry of the RX or TX ring */
+static inline struct xdp_desc *ring_desc(const xdp_ring_t *ring, uint32_t i) {
+	return &((struct xdp_desc *)ring->desc)[i & ring->mask];
+}
+
+
+/** Frees a queue, closing its AF_XDP socket */
+static void close_queue(xdp_queue_t *queue) {
+	unmap_ring(&queue->rx);
+	unmap_ring(&queue->tx);
+	unmap_ring(&queue->fill);
+	unmap_ring(&queue->comp);
+
+	if (queue->fd.type == POLL_TYPE_XDP) {
+		if (!fastd_poll_fd_close(&queue->fd))
+			pr_error_errno("closing AF_XDP socket: close");
+	} else if (queue->fd.fd >= 0) {
+		if (close(queue->fd.fd))
+			pr_error_errno("closing AF_XDP socket: close");
+	}
+
+	if (queue->umem)
+		munmap(queue->umem, XDP_UMEM_SIZE);
+
+	free(queue);
+}
+
+/**
+   Creates the AF_XDP socket of a receive queue and binds it in zero-copy or copy mode
+
+   A failure to bind in zero-copy mode is only logged at debug level, as the caller falls back to copy mode.
+*/
+static xdp_queue_t *open_queue(fastd_xdp_t *xdp, uint16_t index, bool zerocopy) {
+	xdp_queue_t *queue = fastd_new0(xdp_queue_t);
+	queue->xdp = xdp;
+	queue->index = index;
+	queue->fd = FASTD_POLL_FD(POLL_TYPE_UNSPEC, socket(AF_XDP, SOCK_RAW, 0));
+
+	if (queue->fd.fd < 0) {
+		pr_error_errno("unable to create AF_XDP socket");
+		goto error;
+	}
+
+	queue->umem = mmap(NULL, XDP_UMEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (queue->umem == MAP_FAILED) {
+		queue->umem = NULL;
+		pr_error_errno("unable to allocate UMEM: mmap");
+		goto error;
+	}
+
+	const struct xdp_umem_reg umem = {
+		.addr = (uintptr_t)queue->umem,
+		.len = XDP_UMEM_SIZE,
+		.chunk_size = XDP_FRAME_SIZE,
+	};
+	const uint32_t rx_size = XDP_RX_FRAMES, tx_size = XDP_TX_FRAMES;
+
+	if (setsockopt(queue->fd.fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) ||
+	    setsockopt(queue->fd.fd, SOL_XDP, XDP_UMEM_FILL_RING, &rx_size, sizeof(rx_size)) ||
+	    setsockopt(queue->fd.fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &tx_size, sizeof(tx_size)) ||
+	    setsockopt(queue->fd.fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size)) ||
+	    setsockopt(queue->fd.fd, SOL_XDP, XDP_TX_RING, &tx_size, sizeof(tx_size))) {
+		pr_error_errno("unable to set up AF_XDP socket: setsockopt");
+		goto error;
+	}
+
+	struct xdp_mmap_offsets off;
+	socklen_t off_len = sizeof(off);
+	if (getsockopt(queue->fd.fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len)) {
+		pr_error_errno("unable to set up AF_XDP socket: getsockopt");
+		goto error;
+	}
+
+	if (!map_ring(queue->fd.fd, &queue->rx, &off.rx, rx_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+	    !map_ring(queue->fd.fd, &queue->tx, &off.tx, tx_size, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) ||
+	    !map_ring(queue->fd.fd, &queue->fill, &off.fr, rx_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+	    !map_ring(
+		    queue->fd.fd, &queue->comp, &off.cr, tx_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)) {
+		pr_error_errno("unable to map AF_XDP rings: mmap");
+		goto error;
+	}
+
+	/* The first frames are used for receiving, the rest for sending */
+	uint32_t i;
+	for (i = 0; i < XDP_RX_FRAMES; i++)
+		*ring_addr(&queue->fill, *queue->fill.producer + i) = (uint64_t)i * XDP_FRAME_SIZE;
+	ring_submit(&queue->fill, XDP_RX_FRAMES);
+
+	for (i = 0; i < XDP_TX_FRAMES; i++)
+		queue->free_frames[i] = (uint64_t)(XDP_RX_FRAMES + i) * XDP_FRAME_SIZE;
+	queue->n_free = XDP_TX_FRAMES;
+
+	const struct sockaddr_xdp addr = {
+		.sxdp_family = AF_XDP,
+		.sxdp_flags = (zerocopy ? XDP_ZEROCOPY : XDP_COPY) | XDP_USE_NEED_WAKEUP,
+		.sxdp_ifindex = xdp->ifindex,
+		.sxdp_queue_id = index,
+	};
+
+	if (bind(queue->fd.fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+		if (zerocopy)
+			pr_debug("unable to use AF_XDP zero-copy mode on `%s': %s", xdp->ifname, strerror(errno));
+		else
+			pr_error("unable to bind AF_XDP socket to queue %u of `%s': %s", (unsigned)index, xdp->ifname,
+				 strerror(errno));
+
+		goto error;
+	}
+
+	return queue;
+
+error:
+	close_queue(queue);
+	return NULL;
+}
+
+/** Creates the AF_XDP sockets of all receive queues */
+static bool open_queues(fastd_xdp_t *xdp) {
+	xdp->queues = fastd_new0_array(xdp->n_queues, xdp_queue_t *);
+
+	size_t i;
+	for (i = 0; i < xdp->n_queues; i++) {
+		xdp_queue_t *queue = NULL;
+
+		/* Zero-copy mode is tried on the first queue; the other queues use the same mode */
+		if (i == 0 && xdp->native) {
+			queue = open_queue(xdp, i, true);
+			xdp->zerocopy = (queue != NULL);
+		}
+
+		if (!queue)
+			queue = open_queue(xdp, i, xdp->zerocopy);
+
+		if (!queue)
+			return false;
+
+		xdp->queues[i] = queue;
+
+		uint32_t key = i, value = queue->fd.fd;
+		union bpf_attr attr = {
+			.map_fd = xdp->map_fd,
+			.key = (uintptr_t)&key,
+			.value = (uintptr_t)&value,
+		};
+		if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+			pr_error_errno("unable to add AF_XDP socket to XSKMAP");
+			return false;
+		}
+
+		queue->fd.type = POLL_TYPE_XDP;
+		fastd_poll_fd_register(&queue->fd);
+	}
+
+	return true;
+}
+
+/** Determines the number of receive queues of an interface */
+static size_t get_queues(const char *ifname) {
+	struct ethtool_channels channels = { .cmd = ETHTOOL_GCHANNELS };
+	struct ifreq ifr = {};
+
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	ifr.ifr_data = (void *)&channels;
+
+	if (ioctl(ctx.ioctl_sock, SIOCETHTOOL, &ifr) < 0) {
+		pr_debug_errno("unable to get number of queues: ioctl");
+		return 1;
+	}
+
+	return max_size_t(channels.rx_count + channels.combined_count, 1);
+}
+
+/** Gets the index, MAC address, MTU and number of queues of an interface */
+static bool get_iface(fastd_xdp_t *xdp) {
+	struct ifreq ifr = {};
+	strncpy(ifr.ifr_name, xdp->ifname, IFNAMSIZ - 1);
+
+	xdp->ifindex = if_nametoindex(xdp->ifname);
+	if (!xdp->ifindex) {
+		pr_error("unable to use XDP on `%s': %s", xdp->ifname, strerror(errno));
+		return false;
+	}
+
+	if (ioctl(ctx.ioctl_sock, SIOCGIFHWADDR, &ifr) < 0) {
+		pr_error_errno("unable to get MAC address: ioctl");
+		return false;
+	}
+
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		pr_error("unable to use XDP on `%s': not an Ethernet interface", xdp->ifname);
+		return false;
+	}
+
+	memcpy(xdp->mac.data, ifr.ifr_hwaddr.sa_data, sizeof(xdp->mac.data));
+
+	if (ioctl(ctx.ioctl_sock, SIOCGIFMTU, &ifr) < 0) {
+		pr_error_errno("unable to get MTU: ioctl");
+		return false;
+	}
+
+	xdp->mtu = ifr.ifr_mtu;
+	xdp->n_queues = get_queues(xdp->ifname);
+
+	return true;
+}
+
+/** Sets up AF_XDP on an interface */
+static bool setup_xdp(fastd_xdp_t *xdp) {
+	if (!get_iface(xdp))
+		return false;
+
+	union bpf_attr attr = {
+		.map_type = BPF_MAP_TYPE_XSKMAP,
+		.key_size = sizeof(uint32_t),
+		.value_size = sizeof(uint32_t),
+		.max_entries = xdp->n_queues,
+		.map_name = "fastd_xsks",
+	};
+
+	xdp->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xdp->map_fd < 0) {
+		pr_error_errno("unable to create XSKMAP");
+		return false;
+	}
+
+	xdp->prog_fd = load_prog(xdp);
+	if (xdp->prog_fd < 0) {
+		pr_error_errno("unable to load XDP program");
+		return false;
+	}
+
+	if (attach_prog(xdp, XDP_FLAGS_DRV_MODE)) {
+		xdp->native = true;
+	} else {
+		pr_debug_errno("unable to attach XDP program in native mode");
+
+		if (!attach_prog(xdp, XDP_FLAGS_SKB_MODE)) {
+			pr_error("unable to attach XDP program to `%s': %s", xdp->ifname, strerror(errno));
+			return false;
+		}
+	}
+
+	if (!open_queues(xdp))
+		return false;
+
+	pr_info("using AF_XDP on `%s' (%u queues, %s XDP, %s mode)", xdp->ifname, (unsigned)xdp->n_queues,
+		xdp->native ? "native" : "generic", xdp->zerocopy ? "zero-copy" : "copy");
+
+	return true;
+}
+
+/** Frees the AF_XDP state of an interface, detaching the XDP program */
+static void free_xdp(fastd_xdp_t *xdp) {
+	size_t i;
+
+	if (xdp->link_fd >= 0)
+		close(xdp->link_fd);
+
+	if (xdp->queues) {
+		for (i = 0; i < xdp->n_queues; i++) {
+			if (xdp->queues[i])
+				close_queue(xdp->queues[i]);
+		}
+
+		free(xdp->queues);
+	}
+
+	if (xdp->prog_fd >= 0)
+		close(xdp->prog_fd);
+	if (xdp->map_fd >= 0)
+		close(xdp->map_fd);
+
+	for (i = 0; i < ctx.n_socks; i++) {
+		if (ctx.socks[i].xdp == xdp)
+			ctx.socks[i].xdp = NULL;
+	}
+
+	free(xdp);
+}
+
+/** Sets up AF_XDP for all bind addresses with the \e xdp flag (after the regular sockets have been bound) */
+void fastd_xdp_init(void) {
+	size_t i;
+
+	for (i = 0; i < ctx.n_socks; i++) {
+		fastd_socket_t *sock = &ctx.socks[i];
+		if (!sock->addr || !(sock->addr->flags & FASTD_BIND_XDP))
+			continue;
+
+		fastd_xdp_t *xdp;
+		for (xdp = ctx.xdp; xdp; xdp = xdp->next) {
+			if (strcmp(xdp->ifname, sock->addr->bindtodev) == 0)
+				break;
+		}
+
+		if (!xdp) {
+			xdp = fastd_new0(fastd_xdp_t);
+			xdp->ifname = sock->addr->bindtodev;
+			xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+
+			xdp->next = ctx.xdp;
+			ctx.xdp = xdp;
+		}
+
+		sock->xdp = xdp;
+	}
+
+	fastd_xdp_t **xdpp = &ctx.xdp;
+	while (*xdpp) {
+		fastd_xdp_t *xdp = *xdpp;
+
+		if (setup_xdp(xdp)) {
+			xdpp = &xdp->next;
+			continue;
+		}
+
+		pr_warn("not using AF_XDP on `%s', packets are received through the regular sockets", xdp->ifname);
+
+		*xdpp = xdp->next;
+		free_xdp(xdp);
+	}
+}
+
+/** Frees the AF_XDP state of all interfaces */
+void fastd_xdp_free(void) {
+	while (ctx.xdp) {
+		fastd_xdp_t *next = ctx.xdp->next;
+		free_xdp(ctx.xdp);
+		ctx.xdp = next;
+	}
+}
+
+
+/** Returns the frames of sent packets to the free list */
+static void reap_completions(xdp_queue_t *queue) {
+	uint32_t n = ring_available(&queue->comp), i;
+
+	for (i = 0; i < n; i++)
+		queue->free_frames[queue->n_free++] = *ring_addr(&queue->comp, *queue->comp.consumer + i);
+
+	ring_release(&queue->comp, n);
+}
+
+/** Makes the kernel send the packets on the TX ring of a queue */
+static void kick(xdp_queue_t *queue) {
+	if (!queue->kick)
+		return;
+
+	/* In zero-copy mode, the driver only needs to be woken up when it asks for it */
+	if (queue->xdp->zerocopy && !(__atomic_load_n(queue->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+		queue->kick = false;
+		return;
+	}
+
+	/* In copy mode, the kernel sends a limited number of packets per call, so it is woken up until it has sent
+	   everything or can't make progress */
+	size_t i;
+	for (i = 0; i <= XDP_TX_FRAMES / 16; i++) {
+		if (sendto(queue->fd.fd, NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0)
+			break;
+
+		if (errno != EAGAIN && errno != EBUSY) {
+			pr_debug2_errno("AF_XDP: sendto");
+			break;
+		}
+
+		reap_completions(queue);
+
+		if (*queue->tx.producer == __atomic_load_n(queue->tx.consumer, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	queue->kick = false;
+}
+
+/** Wakes up the kernel for all packets put on the TX rings since the last call */
+void fastd_xdp_flush(void) {
+	fastd_xdp_t *xdp;
+	size_t i;
+
+	for (xdp = ctx.xdp; xdp; xdp = xdp->next) {
+		for (i = 0; i < xdp->n_queues; i++)
+			kick(xdp->queues[i]);
+	}
+}
+
+
+/** Returns the socket bound to the destination address of a packet received through AF_XDP */
+static fastd_socket_t *find_socket(const fastd_xdp_t *xdp, const fastd_peer_address_t *local_addr) {
+	size_t i;
+
+	for (i = 0; i < ctx.n_socks; i++) {
+		fastd_socket_t *sock = &ctx.socks[i];
+		if (sock->xdp == xdp && fastd_peer_address_equal(sock->bound_addr, local_addr))
+			return sock;
+	}
+
+	return NULL;
+}
+
+/**
+   Handles a frame received through AF_XDP
+
+   The XDP program only redirects IPv4 packets without options or fragmentation and IPv6 packets without extension
+   headers, so only the lengths need to be checked. Checksums aren't verified; payload packets are authenticated
+   anyway.
+*/
+static void handle_frame(xdp_queue_t *queue, const uint8_t *frame, size_t len) {
+	int64_t start = fastd_latency_start();
+
+	fastd_eth_header_t eth;
+	fastd_peer_address_t local_addr = {}, remote_addr = {};
+	struct udphdr udp;
+	size_t l3_len;
+
+	if (len < sizeof(eth))
+		return;
+
+	memcpy(&eth, frame, sizeof(eth));
+	frame += sizeof(eth);
+	len -= sizeof(eth);
+
+	if (eth.proto == htons(XDP_ETH_P_IP)) {
+		struct iphdr ip;
+
+		if (len < sizeof(ip) + sizeof(udp))
+			return;
+
+		memcpy(&ip, frame, sizeof(ip));
+		memcpy(&udp, frame + sizeof(ip), sizeof(udp));
+
+		l3_len = ntohs(ip.tot_len);
+		if (l3_len > len || l3_len < sizeof(ip) + ntohs(udp.len))
+			return;
+
+		frame += sizeof(ip);
+
+		local_addr.in.sin_family = remote_addr.in.sin_family = AF_INET;
+		local_addr.in.sin_addr.s_addr = ip.daddr;
+		remote_addr.in.sin_addr.s_addr = ip.saddr;
+		local_addr.in.sin_port = udp.dest;
+		remote_addr.in.sin_port = udp.source;
+	} else if (eth.proto == htons(XDP_ETH_P_IPV6)) {
+		struct ip6_hdr ip6;
+
+		if (len < sizeof(ip6) + sizeof(udp))
+			return;
+
+		memcpy(&ip6, frame, sizeof(ip6));
+		memcpy(&udp, frame + sizeof(ip6), sizeof(udp));
+
+		l3_len = sizeof(ip6) + ntohs(ip6.ip6_plen);
+		if (l3_len > len || l3_len < sizeof(ip6) + ntohs(udp.len))
+			return;
+
+		frame += sizeof(ip6);
+
+		local_addr.in6.sin6_family = remote_addr.in6.sin6_family = AF_INET6;
+		local_addr.in6.sin6_addr = ip6.ip6_dst;
+		remote_addr.in6.sin6_addr = ip6.ip6_src;
+		local_addr.in6.sin6_port = udp.dest;
+		remote_addr.in6.sin6_port = udp.source;
+	} else {
+		return;
+	}
+
+	if (ntohs(udp.len) <= sizeof(udp))
+		return;
+
+	fastd_socket_t *sock = find_socket(queue->xdp, &local_addr);
+	if (!sock)
+		return;
+
+	size_t payload_len = ntohs(udp.len) - sizeof(udp);
+	fastd_buffer_t buffer = fastd_buffer_alloc(payload_len, conf.decrypt_headroom, conf.tailroom);
+	memcpy(buffer.data, frame + sizeof(udp), payload_len);
+
+	fastd_peer_address_simplify(&remote_addr);
+
+	fastd_xdp_dest_t src = {
+		.xdp = queue->xdp,
+		.addr = remote_addr,
+		.mac = eth.source,
+		.queue = queue->index,
+	};
+
+	ctx.xdp_src = &src;
+	fastd_receive_from(sock, &local_addr, &remote_addr, buffer, start);
+	ctx.xdp_src = NULL;
+}
+
+/** Handles the packets received on an AF_XDP socket */
+void fastd_xdp_handle(fastd_poll_fd_t *fd) {
+	xdp_queue_t *queue = container_of(fd, xdp_queue_t, fd);
+	uint32_t n = min_size_t(ring_available(&queue->rx), XDP_BATCH), i;
+
+	for (i = 0; i < n; i++) {
+		const struct xdp_desc *desc = ring_desc(&queue->rx, *queue->rx.consumer + i);
+		handle_frame(queue, queue->umem + desc->addr, desc->len);
+
+		/* The frame can be reused right away, as handle_frame() has copied the packet */
+		*ring_addr(&queue->fill, *queue->fill.producer + i) = desc->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+	}
+
+	ring_release(&queue->rx, n);
+	ring_submit(&queue->fill, n);
+
+	if (__atomic_load_n(queue->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+		recvfrom(queue->fd.fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+
+/** Adds data to an Internet checksum */
+static uint32_t checksum_add(uint32_t sum, const void *data, size_t len) {
+	const uint8_t *p = data;
+
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+
+	if (len)
+		sum += p[0] << 8;
+
+	return sum;
+}
+
+/** Returns the final Internet checksum in network byte order */
+static uint16_t checksum_finish(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons(~sum);
+}
+
+/**
+   Puts a payload packet to a peer on the TX ring, taking ownership of the buffer
+
+   Returns false if the packet must be sent through the socket, because AF_XDP isn't used on the socket's interface,
+   the peer's packets haven't been received through AF_XDP from its current address, the packet doesn't fit into the
+   interface MTU or no frame is available.
+*/
+bool fastd_xdp_send(
+	const fastd_socket_t *sock, const fastd_peer_address_t *remote_addr, fastd_buffer_t buffer, fastd_peer_t *peer,
+	size_t stat_size) {
+	fastd_xdp_t *xdp = sock->xdp;
+
+	if (!xdp || !peer || peer->xdp.xdp != xdp || !fastd_peer_address_equal(&peer->xdp.addr, remote_addr))
+		return false;
+
+	bool v6 = (remote_addr->sa.sa_family == AF_INET6);
+	size_t ip_len = v6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr);
+	size_t udp_len = sizeof(struct udphdr) + buffer.len;
+
+	if (ip_len + udp_len > xdp->mtu || XDP_ETH_HLEN + ip_len + udp_len > XDP_FRAME_SIZE)
+		return false;
+
+	xdp_queue_t *queue = xdp->queues[peer->xdp.queue];
+
+	if (!queue->n_free) {
+		reap_completions(queue);
+
+		if (!queue->n_free) {
+			kick(queue);
+			reap_completions(queue);
+
+			if (!queue->n_free)
+				return false;
+		}
+	}
+
+	uint64_t addr = queue->free_frames[--queue->n_free];
+	uint8_t *frame = queue->umem + addr;
+
+	const fastd_eth_header_t eth = {
+		.dest = peer->xdp.mac,
+		.source = xdp->mac,
+		.proto = htons(v6 ? XDP_ETH_P_IPV6 : XDP_ETH_P_IP),
+	};
+	memcpy(frame, &eth, sizeof(eth));
+
+	struct udphdr udp = {
+		.source = fastd_peer_address_get_port(sock->bound_addr),
+		.dest = fastd_peer_address_get_port(remote_addr),
+		.len = htons(udp_len),
+	};
+
+	if (v6) {
+		struct ip6_hdr ip6 = {
+			.ip6_flow = htonl(6 << 28),
+			.ip6_plen = htons(udp_len),
+			.ip6_nxt = IPPROTO_UDP,
+			.ip6_hlim = XDP_TTL,
+			.ip6_src = sock->bound_addr->in6.sin6_addr,
+			.ip6_dst = remote_addr->in6.sin6_addr,
+		};
+		memcpy(frame + sizeof(eth), &ip6, sizeof(ip6));
+
+		/* The UDP checksum is mandatory for IPv6 */
+		const uint32_t pseudo[2] = { htonl(udp_len), htonl(IPPROTO_UDP) };
+		uint32_t sum = checksum_add(0, &ip6.ip6_src, 2 * sizeof(struct in6_addr));
+		sum = checksum_add(sum, pseudo, sizeof(pseudo));
+		sum = checksum_add(sum, &udp, sizeof(udp));
+		sum = checksum_add(sum, buffer.data, buffer.len);
+
+		udp.check = checksum_finish(sum) ?: 0xffff;
+	} else {
+		/* Like the socket, DF isn't set as PMTU discovery is disabled */
+		struct iphdr ip = {
+			.version = 4,
+			.ihl = sizeof(struct iphdr) / 4,
+			.tot_len = htons(ip_len + udp_len),
+			.id = htons(xdp->ip_id++),
+			.ttl = XDP_TTL,
+			.protocol = IPPROTO_UDP,
+			.saddr = sock->bound_addr->in.sin_addr.s_addr,
+			.daddr = remote_addr->in.sin_addr.s_addr,
+		};
+		ip.check = checksum_finish(checksum_add(0, &ip, sizeof(ip)));
+		memcpy(frame + sizeof(eth), &ip, sizeof(ip));
+
+		/* The UDP checksum is optional for IPv4; payload packets are authenticated anyway */
+	}
+
+	memcpy(frame + sizeof(eth) + ip_len, &udp, sizeof(udp));
+	memcpy(frame + sizeof(eth) + ip_len + sizeof(udp), buffer.data, buffer.len);
+
+	/* There are as many TX frames as entries in the TX ring, so the ring can't be full when a frame was free */
+	struct xdp_desc *desc = ring_desc(&queue->tx, *queue->tx.producer);
+	desc->addr = addr;
+	desc->len = sizeof(eth) + ip_len + udp_len;
+	desc->options = 0;
+	ring_submit(&queue->tx, 1);
+
+	queue->kick = true;
+
+	fastd_trace(send, peer->id, buffer.len, 0);
+	fastd_send_complete(peer, stat_size, 0);
+	fastd_buffer_free(buffer);
+
+	return true;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   AF_XDP packet path for the bind addresses configured with the \e xdp flag
+*/
+
+
+#pragma once
+
+#include "peer.h"
+
+
+#ifdef WITH_XDP
+
+void fastd_xdp_init(void);
+void fastd_xdp_free(void);
+
+void fastd_xdp_handle(fastd_poll_fd_t *fd);
+void fastd_xdp_flush(void);
+
+bool fastd_xdp_send(
+	const fastd_socket_t *sock, const fastd_peer_address_t *remote_addr, fastd_buffer_t buffer, fastd_peer_t *peer,
+	size_t stat_size);
+
+/** Remembers the link-layer source of the packet that is currently being handled as the destination of \e peer */
+static inline void fastd_xdp_learn(fastd_peer_t *peer) {
+	if (ctx.xdp_src)
+		peer->xdp = *ctx.xdp_src;
+}
+
+#else
+
+static inline void fastd_xdp_init(void) {}
+
+static inline void fastd_xdp_free(void) {}
+
+static inline void fastd_xdp_flush(void) {}
+
+static inline bool fastd_xdp_send(
+	UNUSED const fastd_socket_t *sock, UNUSED const fastd_peer_address_t *remote_addr, UNUSED fastd_buffer_t buffer,
+	UNUSED fastd_peer_t *peer, UNUSED size_t stat_size) {
+	return false;
+}
+
+static inline void fastd_xdp_learn(UNUSED fastd_peer_t *peer) {}
+
+#endif
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "crypto.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+
+static int64_t get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (1000*(int64_t)ts.tv_sec) + ts.tv_nsec/1000000;
+}
+
+static void run_benchmark(const fastd_sha256_impl_t *impl, size_t iters, size_t size) {
+	printf("Running %zd HMAC-SHA256 iterations with input size %zd using %s... ", iters, size, impl->name);
+
+	uint32_t key[FASTD_HMACSHA256_KEY_WORDS] = {};
+	uint32_t *in = calloc(alignto(size, 4), 1);
+	fastd_sha256_t out;
+
+	fastd_sha256_set_impl(impl);
+
+	int64_t start = get_time();
+	for (size_t i = 0; i < iters; i++) {
+		fastd_hmacsha256(&out, key, in, size);
+		key[0] ^= out.w[0];
+	}
+
+	int64_t end = get_time();
+
+	printf("done in %"PRId64" ms\n", end - start);
+
+	free(in);
+}
+
+
+int main(void) {
+	const fastd_sha256_impl_t *impls[] = {
+		&fastd_sha256_generic,
+#ifdef WITH_SHA256_SHANI
+		&fastd_sha256_shani,
+#endif
+	};
+
+	for (size_t i = 0; i < array_size(impls); i++) {
+		if (!impls[i]->available())
+			continue;
+
+		run_benchmark(impls[i], 10000000, 32);
+		run_benchmark(impls[i], 10000000, 128);
+		run_benchmark(impls[i], 2000000, 1000);
+	}
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/*
+  Known-answer tests of the Curve25519 implementation selected at build time (the built-in one or libuecc);
+  test-ecc25519.c additionally compares the built-in implementation with libuecc when both are available.
+*/
+
+
+#include "build.h"
+
+#ifdef USE_BUILTIN_ECC
+
+#include "ecc25519.h"
+
+#define ecc_int256_t fastd_ecc_int256_t
+#define ecc_25519_work_t fastd_ecc_25519_work_t
+#define ecc_25519_work_base_legacy fastd_ecc_25519_work_base_legacy
+#define ecc_25519_store_packed_legacy fastd_ecc_25519_store_packed_legacy
+#define ecc_25519_scalarmult_base fastd_ecc_25519_scalarmult_base
+#define ecc_25519_gf_sanitize_secret fastd_ecc_25519_gf_sanitize_secret
+
+#else
+
+#include <libuecc/ecc.h>
+
+#endif
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+
+static void test_base_point(void **state) {
+	const uint8_t expected[32] = {
+		0xd4, 0x6b, 0xfe, 0x7f, 0x39, 0xfa, 0x8c, 0x22, 0xe1, 0x96, 0x23, 0xeb, 0x26, 0xb7, 0x8e, 0x6a,
+		0x34, 0x74, 0x8b, 0x66, 0xd6, 0xa3, 0x26, 0xdd, 0x19, 0x5e, 0x9f, 0x21, 0x50, 0x43, 0x7c, 0x54,
+	};
+	ecc_int256_t packed;
+
+	(void)state;
+
+	ecc_25519_store_packed_legacy(&packed, &ecc_25519_work_base_legacy);
+	assert_memory_equal(expected, packed.p, 32);
+}
+
+static void test_keypair(void **state) {
+	const uint8_t expected_secret[32] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x5f,
+	};
+	const uint8_t expected_public[32] = {
+		0x41, 0xc6, 0xef, 0x88, 0xf1, 0x36, 0xa7, 0x5c, 0xbe, 0xd2, 0x02, 0xec, 0xc6, 0x24, 0x2e, 0x0d,
+		0xbb, 0xc9, 0x16, 0x14, 0x73, 0x06, 0xdd, 0x99, 0x8a, 0x3f, 0x94, 0xe0, 0x1b, 0x39, 0xb0, 0x51,
+	};
+	ecc_int256_t secret, public;
+	ecc_25519_work_t work;
+	size_t i;
+
+	(void)state;
+
+	for (i = 0; i < 32; i++)
+		secret.p[i] = i;
+
+	ecc_25519_gf_sanitize_secret(&secret, &secret);
+	assert_memory_equal(expected_secret, secret.p, 32);
+
+	ecc_25519_scalarmult_base(&work, &secret);
+	ecc_25519_store_packed_legacy(&public, &work);
+	assert_memory_equal(expected_public, public.p, 32);
+}
+
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_base_point),
+		cmocka_unit_test(test_keypair),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "ecc25519.h"
+
+#include <libuecc/ecc.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+
+/** The number of random inputs used by each test */
+#define ROUNDS 64
+
+
+/** xorshift64* state, so the tests are reproducible */
+static uint64_t rand_state = 0x0123456789abcdef;
+
+static void random_int256(fastd_ecc_int256_t *out) {
+	size_t i;
+
+	for (i = 0; i < 32; i++) {
+		rand_state ^= rand_state >> 12;
+		rand_state ^= rand_state << 25;
+		rand_state ^= rand_state >> 27;
+		out->p[i] = (rand_state * UINT64_C(2685821657736338717)) >> 56;
+	}
+}
+
+static void to_uecc(ecc_int256_t *out, const fastd_ecc_int256_t *in) {
+	memcpy(out->p, in->p, 32);
+}
+
+/** Generates a random point, returning it in both representations */
+static void random_point(fastd_ecc_25519_work_t *out, ecc_25519_work_t *out_uecc) {
+	fastd_ecc_int256_t n, packed;
+	ecc_int256_t n_uecc;
+
+	random_int256(&n);
+	to_uecc(&n_uecc, &n);
+
+	fastd_ecc_25519_scalarmult_base(out, &n);
+	ecc_25519_scalarmult_base(out_uecc, &n_uecc);
+
+	fastd_ecc_25519_store_packed_legacy(&packed, out);
+	assert_true(fastd_ecc_25519_load_packed_legacy(out, &packed));
+}
+
+static void assert_points_equal(const fastd_ecc_25519_work_t *p, const ecc_25519_work_t *p_uecc) {
+	fastd_ecc_int256_t packed;
+	ecc_int256_t packed_uecc;
+
+	fastd_ecc_25519_store_packed_legacy(&packed, p);
+	ecc_25519_store_packed_legacy(&packed_uecc, p_uecc);
+
+	assert_memory_equal(packed.p, packed_uecc.p, 32);
+}
+
+
+static void test_load_store(void **state) {
+	fastd_ecc_int256_t in, out;
+	ecc_int256_t in_uecc, out_uecc;
+	fastd_ecc_25519_work_t work;
+	ecc_25519_work_t work_uecc;
+	size_t i;
+
+	(void)state;
+
+	/* Random strings are valid points about half of the time */
+	for (i = 0; i < ROUNDS; i++) {
+		random_int256(&in);
+		to_uecc(&in_uecc, &in);
+
+		int ok = fastd_ecc_25519_load_packed_legacy(&work, &in);
+		assert_int_equal(ok, ecc_25519_load_packed_legacy(&work_uecc, &in_uecc));
+
+		if (!ok)
+			continue;
+
+		assert_int_equal(fastd_ecc_25519_is_identity(&work), ecc_25519_is_identity(&work_uecc));
+
+		fastd_ecc_25519_store_packed_legacy(&out, &work);
+		ecc_25519_store_packed_legacy(&out_uecc, &work_uecc);
+		assert_memory_equal(out.p, out_uecc.p, 32);
+	}
+}
+
+static void test_group_ops(void **state) {
+	fastd_ecc_25519_work_t p, q, r;
+	ecc_25519_work_t p_uecc, q_uecc, r_uecc;
+	size_t i;
+
+	(void)state;
+
+	for (i = 0; i < ROUNDS; i++) {
+		random_point(&p, &p_uecc);
+		random_point(&q, &q_uecc);
+
+		fastd_ecc_25519_add(&r, &p, &q);
+		ecc_25519_add(&r_uecc, &p_uecc, &q_uecc);
+		assert_points_equal(&r, &r_uecc);
+
+		fastd_ecc_25519_double(&r, &p);
+		ecc_25519_double(&r_uecc, &p_uecc);
+		assert_points_equal(&r, &r_uecc);
+
+		fastd_ecc_25519_sub(&r, &p, &q);
+		fastd_ecc_25519_add(&r, &r, &q);
+		assert_points_equal(&r, &p_uecc);
+
+		fastd_ecc_25519_sub(&r, &p, &p);
+		assert_true(fastd_ecc_25519_is_identity(&r));
+		assert_false(fastd_ecc_25519_is_identity(&p));
+	}
+}
+
+static void test_scalarmult(void **state) {
+	fastd_ecc_int256_t n;
+	ecc_int256_t n_uecc;
+	fastd_ecc_25519_work_t p, r;
+	ecc_25519_work_t p_uecc, r_uecc;
+	size_t i;
+
+	(void)state;
+
+	for (i = 0; i < ROUNDS; i++) {
+		random_int256(&n);
+		to_uecc(&n_uecc, &n);
+		random_point(&p, &p_uecc);
+
+		fastd_ecc_25519_scalarmult_base(&r, &n);
+		ecc_25519_scalarmult_base(&r_uecc, &n_uecc);
+		assert_points_equal(&r, &r_uecc);
+
+		fastd_ecc_25519_scalarmult(&r, &n, &p);
+		ecc_25519_scalarmult(&r_uecc, &n_uecc, &p_uecc);
+		assert_points_equal(&r, &r_uecc);
+
+		fastd_ecc_25519_scalarmult_bits(&r, &n, &p, 128);
+		ecc_25519_scalarmult_bits(&r_uecc, &n_uecc, &p_uecc, 128);
+		assert_points_equal(&r, &r_uecc);
+	}
+}
+
+static void test_gf(void **state) {
+	fastd_ecc_int256_t a, b, r, r_reduced;
+	ecc_int256_t a_uecc, b_uecc, r_uecc;
+	size_t i;
+
+	(void)state;
+
+	for (i = 0; i < ROUNDS; i++) {
+		random_int256(&a);
+		random_int256(&b);
+		to_uecc(&a_uecc, &a);
+		to_uecc(&b_uecc, &b);
+
+		/* libuecc doesn't guarantee fully reduced results for all functions, so reduce before comparing */
+		fastd_ecc_25519_gf_add(&r, &a, &b);
+		ecc_25519_gf_add(&r_uecc, &a_uecc, &b_uecc);
+		ecc_25519_gf_reduce(&r_uecc, &r_uecc);
+		fastd_ecc_25519_gf_reduce(&r_reduced, &r);
+		assert_memory_equal(r.p, r_reduced.p, 32);
+		assert_memory_equal(r.p, r_uecc.p, 32);
+
+		fastd_ecc_25519_gf_mult(&r, &a, &b);
+		ecc_25519_gf_mult(&r_uecc, &a_uecc, &b_uecc);
+		ecc_25519_gf_reduce(&r_uecc, &r_uecc);
+		assert_memory_equal(r.p, r_uecc.p, 32);
+
+		fastd_ecc_25519_gf_reduce(&r, &a);
+		ecc_25519_gf_reduce(&r_uecc, &a_uecc);
+		assert_memory_equal(r.p, r_uecc.p, 32);
+
+		fastd_ecc_25519_gf_sanitize_secret(&r, &a);
+		ecc_25519_gf_sanitize_secret(&r_uecc, &a_uecc);
+		assert_memory_equal(r.p, r_uecc.p, 32);
+	}
+}
+
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_load_store),
+		cmocka_unit_test(test_group_ops),
+		cmocka_unit_test(test_scalarmult),
+		cmocka_unit_test(test_gf),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "crypto.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+
+/** Returns the n-th implementation supported by the CPU, or NULL */
+static const fastd_sha256_impl_t *get_impl(size_t n) {
+	const fastd_sha256_impl_t *impls[] = {
+		&fastd_sha256_generic,
+#ifdef WITH_SHA256_SHANI
+		&fastd_sha256_shani,
+#endif
+	};
+	size_t i;
+
+	for (i = 0; i < array_size(impls); i++) {
+		if (!impls[i]->available())
+			continue;
+
+		if (!n--)
+			return impls[i];
+	}
+
+	return NULL;
+}
+
+
+static void test_sha256(const uint8_t expected[32], const char *in, size_t len) {
+	const fastd_sha256_impl_t *impl;
+	size_t i;
+
+	uint32_t *inbuf = calloc(alignto(len, 4) + 4, 1);
+	memcpy(inbuf, in, len);
+
+	for (i = 0; (impl = get_impl(i)) != NULL; i++) {
+		fastd_sha256_t out;
+
+		assert_true(fastd_sha256_set_impl(impl));
+		fastd_sha256(&out, inbuf, len);
+		assert_memory_equal(expected, out.b, 32);
+	}
+
+	free(inbuf);
+}
+
+static void test_hmacsha256(const uint8_t expected[32], const char *key, const char *in, size_t len) {
+	const fastd_sha256_impl_t *impl;
+	uint32_t keybuf[FASTD_HMACSHA256_KEY_WORDS] = {};
+	size_t i;
+
+	memcpy(keybuf, key, strlen(key));
+
+	uint32_t *inbuf = calloc(alignto(len, 4) + 4, 1);
+	memcpy(inbuf, in, len);
+
+	for (i = 0; (impl = get_impl(i)) != NULL; i++) {
+		fastd_sha256_t out;
+
+		assert_true(fastd_sha256_set_impl(impl));
+		fastd_hmacsha256(&out, keybuf, inbuf, len);
+		assert_memory_equal(expected, out.b, 32);
+		assert_true(fastd_hmacsha256_verify(expected, keybuf, inbuf, len));
+	}
+
+	free(inbuf);
+}
+
+
+static void test_sha256_1(UNUSED void **state) {
+	const uint8_t expected[32] = {
+		0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+		0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55,
+	};
+
+	test_sha256(expected, "", 0);
+}
+
+static void test_sha256_2(UNUSED void **state) {
+	const uint8_t expected[32] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+	};
+
+	test_sha256(expected, "abc", 3);
+}
+
+static void test_sha256_3(UNUSED void **state) {
+	const uint8_t expected[32] = {
+		0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+		0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1,
+	};
+	const char *in = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+	test_sha256(expected, in, strlen(in));
+}
+
+static void test_sha256_4(UNUSED void **state) {
+	const uint8_t expected[32] = {
+		0x41, 0xed, 0xec, 0xe4, 0x2d, 0x63, 0xe8, 0xd9, 0xbf, 0x51, 0x5a, 0x9b, 0xa6, 0x93, 0x2e, 0x1c,
+		0x20, 0xcb, 0xc9, 0xf5, 0xa5, 0xd1, 0x34, 0x64, 0x5a, 0xdb, 0x5d, 0xb1, 0xb9, 0x73, 0x7e, 0xa3,
+	};
+	char in[1000];
+	memset(in, 'a', sizeof(in));
+
+	test_sha256(expected, in, sizeof(in));
+}
+
+static void test_hmacsha256_1(UNUSED void **state) {
+	const uint8_t expected[32] = {
+		0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+		0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43,
+	};
+	const char *in = "what do ya want for nothing?";
+
+	test_hmacsha256(expected, "Jefe", in, strlen(in));
+}
+
+/** Compares all implementations with the generic one for all input lengths up to 300 bytes */
+static void test_sha256_impls(UNUSED void **state) {
+	const fastd_sha256_impl_t *impl;
+	uint32_t in[75], key[FASTD_HMACSHA256_KEY_WORDS];
+	size_t i, len;
+
+	for (i = 0; i < array_size(in); i++)
+		in[i] = 0x9e3779b9 * (i + 1);
+	for (i = 0; i < array_size(key); i++)
+		key[i] = 0x7f4a7c15 * (i + 1);
+
+	for (len = 0; len <= sizeof(in); len++) {
+		fastd_sha256_t expected, expected_hmac;
+
+		assert_true(fastd_sha256_set_impl(&fastd_sha256_generic));
+		fastd_sha256(&expected, in, len);
+		fastd_hmacsha256(&expected_hmac, key, in, len);
+
+		for (i = 1; (impl = get_impl(i)) != NULL; i++) {
+			fastd_sha256_t out;
+
+			assert_true(fastd_sha256_set_impl(impl));
+
+			fastd_sha256(&out, in, len);
+			assert_memory_equal(expected.b, out.b, 32);
+
+			fastd_hmacsha256(&out, key, in, len);
+			assert_memory_equal(expected_hmac.b, out.b, 32);
+		}
+	}
+}
+
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_sha256_1),
+		cmocka_unit_test(test_sha256_2),
+		cmocka_unit_test(test_sha256_3),
+		cmocka_unit_test(test_sha256_4),
+		cmocka_unit_test(test_hmacsha256_1),
+		cmocka_unit_test(test_sha256_impls),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}